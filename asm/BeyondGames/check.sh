@@ -3,3 +3,9 @@
 # Look for any obvious errors in the BASIC listings.
 
 cat E*.bas | egrep -v  '^ [0-9][0-9][0-9][0-9] DATA  [0-9][0-9][0-9][02468], [0-9]+, [0-9]+, [0-9]+, [0-9]+, [0-9]+, [0-9]+, [0-9]+, [0-9]+, [0-9][0-9][0-9][0-9]$' | grep -v END | grep -v FOLLOW | grep -v CONTAIN | grep -v CHECKSUMS | grep -v SUITABLE | grep -v BASIC | egrep -v '^$'
+
+# Check the checksum of every DATA line, as the object code loader does.
+for f in E*.bas
+do
+    bintomon -i data $f >/dev/null
+done
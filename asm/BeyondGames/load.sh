@@ -1,6 +1,10 @@
 #!/bin/sh
 #
 # Send files to load
+#
+# Each file is loaded by running the BASIC object code loader. It is
+# much faster to send "make visiblemonitor-data.lod" from the OSI
+# monitor's Load command instead, which loads the same DATA lines.
 
 echo "NEW" >ALL.bas
 cat OBJECTCODELOADER.bas >>ALL.bas
@@ -0,0 +1,272 @@
+#!/bin/sh
+#
+# Regression and benchmark suite for bintomon.
+#
+# usage: bench.sh [-g] [-n <Runs>] [-o <ResultsFile>]
+#
+# First the golden files committed elsewhere in the tree are converted
+# back to binary with montobin and then regenerated with bintomon. The
+# output has to match the golden file exactly, so any drift in the
+# output formats shows up here.
+# Then bintomon is run with option combinations it has to refuse.
+# Then scripts/SEND and sendmon send a file over a pseudo-terminal,
+# which needs python3, checking what arrives and the baud rate used.
+#
+# Then a set of synthetic images is generated (1 KB, 64 KB and 16 MB
+# of random data, plus sparse, dense and fill-heavy 48 KB images) and
+# every output format and option combination is timed, keeping the
+# best of <Runs> runs (defaults to 3). Where montobin can read the
+# output back it is checked against the image as well.
+#
+# The results are written as a tab separated table, one line per
+# conversion, to bench-results.tsv or <ResultsFile>. The columns are:
+#   test image bytes format options seconds mb/s chars status
+# With -g only the golden files are checked and no table is written.
+# The exit status is 1 if anything failed.
+#
+# Run it from this directory after make, or use "make check" for the
+# golden files only and "make bench" for everything.
+#
+
+BINTOMON=./bintomon
+MONTOBIN=./montobin
+TOP=../..
+RUNS=3
+RESULTS=bench-results.tsv
+GOLDEN_ONLY=0
+
+while getopts "gn:o:" opt; do
+    case $opt in
+    g) GOLDEN_ONLY=1 ;;
+    n) RUNS=$OPTARG ;;
+    o) RESULTS=$OPTARG ;;
+    *) echo "usage: $0 [-g] [-n <Runs>] [-o <ResultsFile>]" >&2; exit 1 ;;
+    esac
+done
+
+for tool in $BINTOMON $MONTOBIN; do
+    if [ ! -x $tool ]; then
+        echo "$0: $tool not found, please run make first" >&2
+        exit 1
+    fi
+done
+
+TMP=`mktemp -d` || exit 1
+trap 'rm -rf $TMP' EXIT
+trap 'exit 1' INT TERM
+failed=0
+: >$TMP/golden.tsv
+
+# Golden files and the bintomon options that produced them. The input
+# is the binary image montobin reads back from the golden file.
+while read golden options; do
+    case $golden in
+    ''|\#*) continue ;;
+    esac
+    if ! $MONTOBIN -o $TMP/golden.bin "$TOP/$golden" 2>$TMP/err; then
+        echo "FAIL $golden: `cat $TMP/err`"
+        failed=1
+        continue
+    fi
+    $BINTOMON $options $TMP/golden.bin >$TMP/golden.out 2>$TMP/err
+    if cmp -s $TMP/golden.out "$TOP/$golden"; then
+        status=pass
+    else
+        status=FAIL
+        failed=1
+    fi
+    echo "$status $golden"
+    printf "golden\t%s\t%d\t%s\t%s\t-\t-\t%d\t%s\n" "$golden" \
+        `wc -c <$TMP/golden.bin` "${options%% *}" "${options#* }" \
+        `wc -c <$TMP/golden.out` $status >>$TMP/golden.tsv
+done <<EOF
+c/hello/hello1.mon              -1 -l 0x0280 -r 0x0280
+c/hello/hello2.mon              -1 -l 0x0280 -r 0x0280
+c/hello/nqueens.mon             -1 -l 0x0280 -r 0x0280
+c/hello/sieve.mon               -1 -l 0x0280 -r 0x0280
+c/yum/yum.mon                   -1 -l 0x0280 -r 0x0280
+asm/wozmon/wozmon.mon           -1 -l 0xFF00 -r 0xFF00
+asm/a1basic/a1basic.mon         -1 -l 0xE000 -r 0xE000
+asm/ehbasic/basic.mon           -1 -l 0x5000 -r 0x5000
+asm/ewoz/ewoz.mon               -1 -l 0x7000 -r 0x7000
+asm/tinybasic/TinyBasic.mon     -1 -l 0x7600 -r 0x7600
+asm/wozaci/wozaci.mon           -1 -l 0xC100 -r 0xC100
+asm/wozfp/wozfp.mon             -1 -l 0x1D00 -r 0x2394
+asm/Apple][Monitor/downloads/3xxx.mon -1 -l 0x3500 -r 0x3F65
+asm/BeyondGames/visiblemonitor.lod -o -l 0x1000 -r 0x1207
+asm/2ksa/2ksa-kim-0200.ptp      -k -l 0x0200
+asm/KIM-1/Misc/clock/clock.ptp  -k -l 0x0200
+asm/KIM-1/TheFirstBookOfKIM/Utilities/Hypertape/hypertape.ptp -k -l 0x0100
+EOF
+
+# Option combinations bintomon has to refuse, rather than writing
+# output the other tools can't use, run on a 256 byte image. Each must
+# fail with an error and leave nothing on the standard output.
+head -c 256 /dev/zero >$TMP/refuse.bin
+while read options; do
+    case $options in
+    ''|\#*) continue ;;
+    esac
+    if $BINTOMON $options $TMP/refuse.bin >$TMP/refuse.out 2>$TMP/err ||
+       [ ! -s $TMP/err ] || [ -s $TMP/refuse.out ]; then
+        status=FAIL
+        failed=1
+    else
+        status=pass
+    fi
+    echo "$status refuse $options" | sed "s|$TMP/||g"
+done <<EOF
+# Blocks above \$FFFF, which sendmon can't read back
+-2 -l 0x10000 --blocks $TMP/refuse.blk
+-2 -l 0xFF80 --blocks $TMP/refuse.blk
+EOF
+
+# scripts/SEND and sendmon, sending over a pseudo-terminal set to 4800
+# baud. The file is bigger than the terminal's buffer, so the speed can
+# be read while the sender is still writing. SEND has to leave the
+# speed alone unless given -b, and put it back afterwards either way.
+if command -v python3 >/dev/null; then
+    cat >$TMP/pty.py <<'PYEOF'
+import os, select, subprocess, sys, termios, tty
+master, slave = os.openpty()
+tty.setraw(slave)
+t = termios.tcgetattr(slave)
+t[4] = t[5] = termios.B4800
+termios.tcsetattr(slave, termios.TCSANOW, t)
+name = os.ttyname(slave)
+proc = subprocess.Popen([a.replace('PTY', name) for a in sys.argv[2:]])
+speeds = {termios.B4800: 4800, termios.B9600: 9600, termios.B19200: 19200}
+received = b''
+during = None
+while True:
+    if select.select([master], [], [], 0.2)[0]:
+        if during is None:
+            during = speeds.get(termios.tcgetattr(slave)[5], 0)
+        received += os.read(master, 4096)
+    elif proc.poll() is not None:
+        break
+after = speeds.get(termios.tcgetattr(slave)[5], 0)
+open(sys.argv[1], 'wb').write(received)
+print(proc.returncode, during, after)
+PYEOF
+    awk 'BEGIN { for (i = 0; i < 4096; i++) printf "%04X: 00 01 02 03 04 05 06 07\n", i * 8 }' >$TMP/send.mon
+    tr '\n' '\r' <$TMP/send.mon >$TMP/send.expected
+    while read status during after options; do
+        case $status in
+        ''|\#*) continue ;;
+        esac
+        if [ "`PATH=.:$PATH python3 $TMP/pty.py $TMP/send.out $options`" = "$status $during $after" ] &&
+           cmp -s $TMP/send.out $TMP/send.expected; then
+            status=pass
+        else
+            status=FAIL
+            failed=1
+        fi
+        echo "$status send $options" | sed "s|$TMP/||g"
+    done <<EOF
+# Exit status, speed while sending, speed afterwards and the command
+0 4800 4800 $TOP/scripts/SEND -d PTY $TMP/send.mon
+0 19200 4800 $TOP/scripts/SEND -d PTY -b 19200 $TMP/send.mon
+0 9600 4800 ./sendmon -d PTY $TMP/send.mon
+EOF
+else
+    echo "skip send (python3 not found)"
+fi
+
+if [ $GOLDEN_ONLY = 1 ]; then
+    exit $failed
+fi
+
+# Synthetic images, generated the same way every time so results can be
+# compared between runs. Each is given as name, load address and an awk
+# program that prints the bytes.
+image() {
+    LC_ALL=C awk -v size=$2 "BEGIN { srand(6502); $3 }" >$TMP/$1.bin
+}
+image dense-1k 1024 \
+    'for (i = 0; i < size; i++) printf "%c", int(rand() * 256)'
+image dense-64k 65536 \
+    'for (i = 0; i < size; i++) printf "%c", int(rand() * 256)'
+image dense 49152 \
+    'for (i = 0; i < size; i++) printf "%c", int(rand() * 256)'
+image sparse 49152 \
+    'for (i = 0; i < size; i++) printf "%c", rand() < 0.02 ? int(rand() * 256) : 0'
+image fill 49152 \
+    'for (i = 0; i < size; ) { b = int(rand() * 256); n = int(rand() * rand() * 512) + 1
+     for (; n > 0 && i < size; n--) { printf "%c", b; i++ } }'
+: >$TMP/big-16m.bin
+for i in `seq 256`; do
+    cat $TMP/dense-64k.bin >>$TMP/big-16m.bin
+done
+
+# Time one conversion and add a line to the results table.
+bench() {
+    name=$1 load=$2 format=$3 options=$4
+    file=$TMP/$name.bin
+    bytes=`wc -c <$file`
+    best=
+    run=0
+    while [ $run -lt $RUNS ]; do
+        start=`date +%s.%N`
+        if ! $BINTOMON $format $options -l $load $file >$TMP/out 2>$TMP/err; then
+            best=error
+            break
+        fi
+        end=`date +%s.%N`
+        best=`echo "$start $end ${best:-999999}" |
+            awk '{ t = $2 - $1; print t < $3 ? t : $3 }'`
+        run=$((run + 1))
+    done
+    if [ "$best" = error ]; then
+        status=error
+        failed=1
+        echo "$name $format $options: `cat $TMP/err`" >&2
+        seconds=- rate=- chars=-
+    else
+        status=-
+        case "$format $options" in
+        -[12jko]" "|-[12jko]" -b "*|-[2j]" -x 0")
+            # Check the output loads the same image back in
+            if $MONTOBIN -o $TMP/back.bin $TMP/out 2>/dev/null &&
+               cmp -s $TMP/back.bin $file; then
+                status=ok
+            else
+                status=FAIL
+                failed=1
+            fi
+            ;;
+        esac
+        seconds=`printf "%.6f" $best`
+        rate=`echo $bytes $best | awk '{ if ($2 > 0) printf "%.2f", $1 / $2 / 1048576; else print "-" }'`
+        chars=`wc -c <$TMP/out`
+    fi
+    printf "bench\t%s\t%d\t%s\t%s\t%s\t%s\t%s\t%s\n" $name $bytes \
+        "$format" "${options:--}" $seconds $rate $chars $status >>$RESULTS
+    printf "%-10s %-3s %-8s %10s s %8s MB/s %s\n" $name "$format" \
+        "${options:--}" $seconds $rate $status
+}
+
+printf "test\timage\tbytes\tformat\toptions\tseconds\tmb/s\tchars\tstatus\n" >$RESULTS
+cat $TMP/golden.tsv >>$RESULTS
+for spec in dense-1k:0x0280 dense-64k:0x0000 dense:0x1000 sparse:0x1000 fill:0x1000; do
+    name=${spec%:*} load=${spec#*:}
+    for format in -1 -2 -j -k -o; do
+        for options in "" "-b 32" "-b auto" "-c 0" "-x 0" "-z"; do
+            case "$format $options" in
+            # Only the Apple II and JMON monitors have a fill command
+            -[1ko]" -x 0") continue ;;
+            esac
+            case "$load $options" in
+            # Nowhere to unpack an image that fills memory
+            "0x0000 -z") continue ;;
+            esac
+            bench $name $load $format "$options"
+        done
+    done
+done
+bench dense-64k 0x0000 --wav aci
+bench dense-64k 0x0000 --wav kim-fast
+bench big-16m 0 -2 ""
+bench big-16m 0 -2 "-x 0"
+
+exit $failed
@@ -0,0 +1,1103 @@
+/*
+ * Write a program into an Apple II DOS 3.3 or ProDOS disk image.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * usage: bintodsk [-h] [-v] [-c] [-f] [-l <LoadAddress>] [-n <Name>] [-t <Type>]
+ *                 [-V <Volume>] [-b <Blocks>] <Image> <Filename>
+ *
+ * The program in <Filename> is written to the disk image <Image> as a
+ * binary file, replacing any file of the same name. Sectors or blocks
+ * are allocated from the free space and the catalog and VTOC (DOS 3.3)
+ * or the volume directory and block bitmap (ProDOS) are updated. Only
+ * the sectors that changed are written back to the image, so a FloppyEmu
+ * or emulator disk can be updated in place in a few milliseconds.
+ *
+ * The image can be a 140 KB 5.25" disk in DOS 3.3 sector order (.dsk
+ * or .do) or ProDOS order (.po), holding either file system, or a
+ * larger ProDOS volume in ProDOS order (such as an 800 KB or 32 MB
+ * .po). The file system and sector order are found from the contents.
+ * Files are only written to the ProDOS volume directory, not to
+ * subdirectories.
+ *
+ * The input is normally the output of cc65 for the apple2 or apple2enh
+ * targets, an AppleSingle file, whose ProDOS file type and load
+ * address are used. A flat binary is loaded at -l <LoadAddress>
+ * (defaults to 0x803, where cc65 programs start), or with -f at the
+ * address in its DOS 3.3 header (4 bytes holding the load address and
+ * length). Intel HEX, S-record and hex dump files are also accepted,
+ * as by bintomon. The file is named <Name> on the disk, or by default
+ * the input file name without its directory, in capitals.
+ *
+ * On DOS 3.3 disks the file is a B (binary) file with the load address
+ * and length in its first four bytes, to run with BRUN. On ProDOS
+ * volumes its file type is given by -t <Type> (bin, sys or a number),
+ * or comes from the AppleSingle file, defaulting to BIN ($06). The
+ * auxiliary type is the load address.
+ *
+ * The -c option creates the image as a blank disk if it does not
+ * already exist: a DOS 3.3 data disk, or a ProDOS volume if the name
+ * ends in .po. The ProDOS volume is named <Volume> (defaults to BLANK)
+ * and has <Blocks> 512 byte blocks (defaults to 280, a 5.25" disk).
+ * Neither is bootable; boot the target from another disk and then
+ * load the program from this one.
+ * With the -v option the file written and the space used and left on
+ * the disk are shown.
+ *
+ * Examples:
+ * bintodsk adventure.po adventure
+ * bintodsk -v -c -n HELLO hello.dsk hello
+ * bintodsk -c -V GAMES -b 1600 games.po adventure
+ * bintodsk -f -n WOZFP mydisk.dsk wozfp.bin
+ *
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include "libbintomon.h"
+
+/* print command usage */
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [-h] [-v] [-c] [-f] [-l <LoadAddress>] [-n <Name>] [-t <Type>] [-V <Volume>]\n"
+            "       [-b <Blocks>] <Image> <Filename>\n", name);
+}
+
+/* Show help info */
+void showHelp(char *name)
+{
+    usage(name);
+    fprintf(stderr,
+            "\n-h  Show help info and exit.\n"
+            "-v  Show verbose output.\n"
+            "-c  Create the image as a blank disk if it does not exist (ProDOS if named .po).\n"
+            "-f  Get load address and length from first 4 bytes of file.\n"
+            "-l <LoadAddress>  Load address of a binary file (defaults to 0x803).\n"
+            "-n <Name>  Name of the file on the disk (defaults to the input file name).\n"
+            "-t <Type>  ProDOS file type: bin, sys or a number (defaults to bin).\n"
+            "-V <Volume>  Volume name for a new ProDOS image (defaults to BLANK).\n"
+            "-b <Blocks>  Size of a new ProDOS image in blocks (defaults to 280).\n\n"
+            "The image can be a .dsk, .do or .po file with a DOS 3.3 or ProDOS file\n"
+            "system. The input can be a cc65 AppleSingle file, a binary, Intel HEX,\n"
+            "S-records or a hex dump. Any file of the same name is replaced.\n");
+}
+
+static const char *programName;
+
+/* Disk image file systems */
+enum fileSystem { DOS33_DISK, PRODOS_DISK };
+
+#define SECTOR_SIZE 256
+#define BLOCK_SIZE 512
+#define TRACKS 35
+#define SECTORS 16
+#define DISK_SIZE (TRACKS * SECTORS * SECTOR_SIZE)
+#define DISK_BLOCKS (DISK_SIZE / BLOCK_SIZE)
+
+/*
+ * DOS 3.3. The VTOC (track 17 sector 0) holds a bitmap of the free
+ * sectors and points to the first catalog sector. Each catalog sector
+ * holds 7 file entries and points to the next. A file entry points to
+ * the file's first track/sector list, which lists up to 122 sectors of
+ * the file and points to the next list.
+ */
+#define VTOC_TRACK 17
+#define VTOC_CATALOG 0x01       // Track and sector of the first catalog sector
+#define VTOC_LAST_TRACK 0x30    // Last track allocated
+#define VTOC_DIRECTION 0x31     // Direction of allocation, 1 or -1
+#define VTOC_BITMAP 0x38        // 4 bytes per track, set bits for free sectors
+#define CATALOG_NEXT 0x01
+#define CATALOG_ENTRIES 0x0b
+#define CATALOG_ENTRY_SIZE 35
+#define ENTRIES_PER_SECTOR 7
+#define ENTRY_TYPE 0x02
+#define ENTRY_NAME 0x03
+#define ENTRY_SECTORS 0x21
+#define DOS_NAME_LENGTH 30
+#define DOS_BINARY 0x04
+#define DOS_LOCKED 0x80
+#define DOS_DELETED 0xff
+#define LIST_NEXT 0x01
+#define LIST_OFFSET 0x05        // Sector offset in the file of the first sector listed
+#define LIST_PAIRS 0x0c
+#define PAIRS_PER_LIST 122
+#define DEFAULT_VOLUME_NUMBER 254
+
+/*
+ * ProDOS. The volume directory starts in block 2 with a header giving
+ * the volume name, file count, size and where the bitmap of free
+ * blocks starts. Each directory block holds 13 entries and points to
+ * the next. A file of one block is a seedling, its key block the data.
+ * Up to 256 blocks it is a sapling, with an index block listing the
+ * data blocks (low bytes of the block numbers, then the high bytes).
+ * Larger files are trees, with a master index block of index blocks.
+ */
+#define VOLUME_DIRECTORY 2
+#define VOLUME_DIRECTORY_BLOCKS 4
+#define DIRECTORY_NEXT 0x02
+#define DIRECTORY_ENTRIES 0x04
+#define ENTRY_LENGTH 0x27
+#define ENTRIES_PER_BLOCK 13
+#define HEADER_ACCESS 0x22
+#define HEADER_ENTRY_LENGTH 0x23
+#define HEADER_ENTRIES_PER_BLOCK 0x24
+#define HEADER_FILE_COUNT 0x25
+#define HEADER_BITMAP 0x27
+#define HEADER_TOTAL_BLOCKS 0x29
+#define FILE_TYPE 0x10
+#define FILE_KEY 0x11
+#define FILE_BLOCKS 0x13
+#define FILE_EOF 0x15
+#define FILE_CREATED 0x18
+#define FILE_ACCESS 0x1e
+#define FILE_AUX_TYPE 0x1f
+#define FILE_MODIFIED 0x21
+#define FILE_HEADER 0x25
+#define PRODOS_NAME_LENGTH 15
+#define SEEDLING 1
+#define SAPLING 2
+#define TREE 3
+#define VOLUME_HEADER 0xf
+#define PRODOS_BIN 0x06
+#define PRODOS_SYS 0xff
+#define ACCESS_DEFAULT 0xe3     // Destroy, rename, backup, write and read
+#define ACCESS_DESTROY 0x80
+#define BLOCKS_PER_BITMAP (BLOCK_SIZE * 8)
+#define DEFAULT_VOLUME_NAME "BLANK"
+
+/*
+ * A disk image read into memory. The sectors are kept in the order the
+ * file system numbers them (DOS 3.3 sectors or ProDOS blocks), even if
+ * the image file has the other sector order.
+ */
+struct disk {
+    enum fileSystem fileSystem;
+    bool interleaved;           // The file has the other sector order
+    unsigned char *data;
+    unsigned char *original;    // As read, to find the sectors that changed
+    size_t size;
+    long blocks;                // ProDOS volume size
+};
+
+/*
+ * Where each DOS 3.3 sector is in a ProDOS ordered track, and the
+ * other way round.
+ */
+static const int interleave[SECTORS] = { 0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 15 };
+
+static inline int littleEndian16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline void putLittleEndian16(unsigned char *p, int value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+}
+
+/* Return where a 256 byte sector of the disk is in the image file. */
+long fileOffset(const struct disk *d, long sector)
+{
+    if (!d->interleaved)
+        return sector * SECTOR_SIZE;
+    return ((sector / SECTORS) * SECTORS + interleave[sector % SECTORS]) * SECTOR_SIZE;
+}
+
+/* Return a DOS 3.3 sector. */
+static inline unsigned char *dosSector(struct disk *d, int track, int sector)
+{
+    return d->data + (track * SECTORS + sector) * SECTOR_SIZE;
+}
+
+/* Return a ProDOS block. */
+static inline unsigned char *block(struct disk *d, long n)
+{
+    return d->data + n * BLOCK_SIZE;
+}
+
+/* Return if a 140 KB image in DOS 3.3 order has a DOS 3.3 VTOC. */
+bool isDos33(const unsigned char *data, size_t size)
+{
+    const unsigned char *vtoc = data + VTOC_TRACK * SECTORS * SECTOR_SIZE;
+
+    return size == DISK_SIZE && vtoc[0x27] == PAIRS_PER_LIST && vtoc[0x34] == TRACKS &&
+        vtoc[0x35] == SECTORS && littleEndian16(vtoc + 0x36) == SECTOR_SIZE;
+}
+
+/*
+ * Return how many catalog sectors are chained from the VTOC of an image
+ * in DOS 3.3 order, up to 15.
+ */
+int catalogLength(const unsigned char *data)
+{
+    const unsigned char *vtoc = data + VTOC_TRACK * SECTORS * SECTOR_SIZE;
+    int track = vtoc[VTOC_CATALOG];
+    int sector = vtoc[VTOC_CATALOG + 1];
+    int count = 0;
+
+    while (track != 0 && track < TRACKS && sector < SECTORS && count < SECTORS - 1) {
+        const unsigned char *catalog = data + (track * SECTORS + sector) * SECTOR_SIZE;
+        track = catalog[CATALOG_NEXT];
+        sector = catalog[CATALOG_NEXT + 1];
+        count++;
+    }
+    return count;
+}
+
+/* Return if an image in ProDOS order has a ProDOS volume directory. */
+bool isProdos(const unsigned char *data, size_t size)
+{
+    const unsigned char *key = data + VOLUME_DIRECTORY * BLOCK_SIZE;
+    long blocks;
+
+    if (size < (VOLUME_DIRECTORY + 1) * BLOCK_SIZE)
+        return false;
+    blocks = littleEndian16(key + HEADER_TOTAL_BLOCKS);
+    return littleEndian16(key) == 0 && key[DIRECTORY_ENTRIES] >> 4 == VOLUME_HEADER &&
+        key[HEADER_ENTRY_LENGTH] == ENTRY_LENGTH && key[HEADER_ENTRIES_PER_BLOCK] == ENTRIES_PER_BLOCK &&
+        blocks > VOLUME_DIRECTORY + VOLUME_DIRECTORY_BLOCKS && blocks * BLOCK_SIZE <= (long)size;
+}
+
+/* Copy an image, changing its sector order between DOS 3.3 and ProDOS. */
+void reorder(unsigned char *to, const unsigned char *from, size_t size)
+{
+    for (size_t sector = 0; sector < size / SECTOR_SIZE; sector++) {
+        size_t track = sector / SECTORS;
+        memcpy(to + sector * SECTOR_SIZE, from + (track * SECTORS + interleave[sector % SECTORS]) * SECTOR_SIZE,
+               SECTOR_SIZE);
+    }
+}
+
+/*
+ * Read a disk image and work out its file system and sector order.
+ * Returns false, after reporting an error, if it is not one.
+ */
+bool readDisk(int fd, const char *filename, struct disk *d)
+{
+    struct stat st;
+    size_t done = 0;
+
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: Unable to read '%s'\n", programName, filename);
+        return false;
+    }
+    d->size = st.st_size;
+    d->data = malloc(d->size + 1);
+    d->original = malloc(d->size + 1);
+    if (d->data == NULL || d->original == NULL) {
+        fprintf(stderr, "%s: Out of memory\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    while (done < d->size) {
+        ssize_t n = pread(fd, d->original + done, d->size - done, done);
+        if (n <= 0) {
+            fprintf(stderr, "%s: Unable to read '%s'\n", programName, filename);
+            return false;
+        }
+        done += n;
+    }
+
+    d->interleaved = false;
+    if (isProdos(d->original, d->size)) {
+        d->fileSystem = PRODOS_DISK;
+    } else if (d->size == DISK_SIZE) {
+        reorder(d->data, d->original, d->size);
+        if (isProdos(d->data, d->size)) {
+            d->fileSystem = PRODOS_DISK;
+            d->interleaved = true;
+        } else if (isDos33(d->original, d->size)) {
+            /* Sector 0 is the same in both orders, but only one has a catalog. */
+            d->fileSystem = DOS33_DISK;
+            d->interleaved = catalogLength(d->data) > catalogLength(d->original);
+        } else {
+            fprintf(stderr, "%s: '%s' is not a DOS 3.3 or ProDOS disk image\n", programName, filename);
+            return false;
+        }
+    } else {
+        fprintf(stderr, "%s: '%s' is not a DOS 3.3 or ProDOS disk image\n", programName, filename);
+        return false;
+    }
+
+    if (d->interleaved) {
+        memcpy(d->original, d->data, d->size);
+    } else {
+        memcpy(d->data, d->original, d->size);
+    }
+    if (d->fileSystem == PRODOS_DISK)
+        d->blocks = littleEndian16(block(d, VOLUME_DIRECTORY) + HEADER_TOTAL_BLOCKS);
+    return true;
+}
+
+/*
+ * Write back the sectors that have changed. Returns the number
+ * written, or -1 on error.
+ */
+long writeDisk(int fd, const struct disk *d)
+{
+    long written = 0;
+
+    for (size_t sector = 0; sector < d->size / SECTOR_SIZE; sector++) {
+        const unsigned char *p = d->data + sector * SECTOR_SIZE;
+
+        if (memcmp(p, d->original + sector * SECTOR_SIZE, SECTOR_SIZE) == 0)
+            continue;
+        if (pwrite(fd, p, SECTOR_SIZE, fileOffset(d, sector)) != SECTOR_SIZE)
+            return -1;
+        written++;
+    }
+    return written;
+}
+
+/* Return if a DOS 3.3 sector is free. */
+static inline bool dosSectorFree(struct disk *d, int track, int sector)
+{
+    unsigned char *vtoc = dosSector(d, VTOC_TRACK, 0);
+
+    return vtoc[VTOC_BITMAP + 4 * track + (sector < 8)] & (1 << (sector & 7));
+}
+
+/* Mark a DOS 3.3 sector free or used. */
+void setDosSectorFree(struct disk *d, int track, int sector, bool free)
+{
+    unsigned char *p = dosSector(d, VTOC_TRACK, 0) + VTOC_BITMAP + 4 * track + (sector < 8);
+
+    if (free)
+        *p |= 1 << (sector & 7);
+    else
+        *p &= ~(1 << (sector & 7));
+}
+
+/* Return the number of free DOS 3.3 sectors, not counting track 0 or the catalog track. */
+int dosFreeSectors(struct disk *d)
+{
+    int count = 0;
+
+    for (int track = 1; track < TRACKS; track++) {
+        if (track == VTOC_TRACK)
+            continue;
+        for (int sector = 0; sector < SECTORS; sector++)
+            count += dosSectorFree(d, track, sector);
+    }
+    return count;
+}
+
+/*
+ * Allocate a free DOS 3.3 sector and clear it. Like DOS, tracks are
+ * used moving out from the catalog track, first up to the last track
+ * and then down towards track 1, and the highest sectors first.
+ * Returns false if the disk is full.
+ */
+bool allocateDosSector(struct disk *d, int *track, int *sector)
+{
+    unsigned char *vtoc = dosSector(d, VTOC_TRACK, 0);
+
+    for (int i = 1; i < TRACKS - 1; i++) {
+        int t = i < TRACKS - VTOC_TRACK ? VTOC_TRACK + i : TRACKS - 1 - i;
+
+        for (int s = SECTORS - 1; s >= 0; s--) {
+            if (!dosSectorFree(d, t, s))
+                continue;
+            setDosSectorFree(d, t, s, false);
+            memset(dosSector(d, t, s), 0, SECTOR_SIZE);
+            vtoc[VTOC_LAST_TRACK] = t;
+            vtoc[VTOC_DIRECTION] = t > VTOC_TRACK ? 1 : 0xff;
+            *track = t;
+            *sector = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Free the sectors of a DOS 3.3 file: the data and the track/sector lists. */
+void freeDosFile(struct disk *d, const unsigned char *entry)
+{
+    int track = entry[0];
+    int sector = entry[1];
+
+    /* The count guards against a corrupt list that loops. */
+    for (int count = 0; track != 0 && track < TRACKS && sector < SECTORS && count < TRACKS * SECTORS; count++) {
+        unsigned char *list = dosSector(d, track, sector);
+
+        for (int i = 0; i < PAIRS_PER_LIST; i++) {
+            int t = list[LIST_PAIRS + 2 * i];
+            int s = list[LIST_PAIRS + 2 * i + 1];
+            if (t != 0 && t < TRACKS && s < SECTORS)
+                setDosSectorFree(d, t, s, true);
+        }
+        setDosSectorFree(d, track, sector, true);
+        track = list[LIST_NEXT];
+        sector = list[LIST_NEXT + 1];
+    }
+}
+
+/*
+ * Write a binary file to a DOS 3.3 disk, replacing any file of the same
+ * name. The file starts with its load address and length. Returns the
+ * sectors used, or -1 after reporting an error.
+ */
+int writeDosFile(struct disk *d, const char *name, int address, const unsigned char *data, size_t n, bool *replaced)
+{
+    unsigned char *vtoc = dosSector(d, VTOC_TRACK, 0);
+    unsigned char dosName[DOS_NAME_LENGTH];
+    unsigned char *entry = NULL;
+    unsigned char *freeEntry = NULL;
+    unsigned char *list = NULL;
+    int track = vtoc[VTOC_CATALOG];
+    int sector = vtoc[VTOC_CATALOG + 1];
+    int dataSectors = (n + 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int sectors = dataSectors + (dataSectors + PAIRS_PER_LIST - 1) / PAIRS_PER_LIST;
+    int available;
+    bool end = false;
+
+    /* Names are in high bit set ASCII, padded with spaces. */
+    memset(dosName, ' ' | 0x80, DOS_NAME_LENGTH);
+    for (int i = 0; name[i] != '\0'; i++)
+        dosName[i] = toupper((unsigned char)name[i]) | 0x80;
+
+    /* Look for the file, or the first unused entry, until the end of the catalog. */
+    for (int count = 0; track != 0 && entry == NULL && !end && count < SECTORS; count++) {
+        unsigned char *catalog;
+
+        if (track >= TRACKS || sector >= SECTORS)
+            break;
+        catalog = dosSector(d, track, sector);
+        for (int i = 0; i < ENTRIES_PER_SECTOR; i++) {
+            unsigned char *e = catalog + CATALOG_ENTRIES + CATALOG_ENTRY_SIZE * i;
+
+            if (e[0] == 0 || e[0] == DOS_DELETED) {
+                if (freeEntry == NULL)
+                    freeEntry = e;
+                end = e[0] == 0;
+                if (end)
+                    break;
+            } else if (memcmp(e + ENTRY_NAME, dosName, DOS_NAME_LENGTH) == 0) {
+                entry = e;
+                break;
+            }
+        }
+        track = catalog[CATALOG_NEXT];
+        sector = catalog[CATALOG_NEXT + 1];
+    }
+
+    *replaced = entry != NULL;
+    if (entry != NULL) {
+        if (entry[ENTRY_TYPE] & DOS_LOCKED) {
+            fprintf(stderr, "%s: '%s' is locked on the disk\n", programName, name);
+            return -1;
+        }
+        freeDosFile(d, entry);
+    } else if (freeEntry != NULL) {
+        entry = freeEntry;
+    } else {
+        fprintf(stderr, "%s: The disk catalog is full\n", programName);
+        return -1;
+    }
+
+    available = dosFreeSectors(d);
+    if (sectors > available) {
+        fprintf(stderr, "%s: Not enough room on the disk: %d sectors needed, %d free\n", programName, sectors,
+                available);
+        return -1;
+    }
+
+    /* Copy the data, a list sector before every 122 data sectors. */
+    for (int i = 0; i < dataSectors; i++) {
+        int t, s;
+        unsigned char *p;
+        size_t offset = (size_t)i * SECTOR_SIZE;
+
+        if (i % PAIRS_PER_LIST == 0) {
+            allocateDosSector(d, &t, &s);
+            if (list == NULL) {
+                entry[0] = t;
+                entry[1] = s;
+            } else {
+                list[LIST_NEXT] = t;
+                list[LIST_NEXT + 1] = s;
+            }
+            list = dosSector(d, t, s);
+            putLittleEndian16(list + LIST_OFFSET, i);
+        }
+        allocateDosSector(d, &t, &s);
+        list[LIST_PAIRS + 2 * (i % PAIRS_PER_LIST)] = t;
+        list[LIST_PAIRS + 2 * (i % PAIRS_PER_LIST) + 1] = s;
+
+        /* The file is the 4 byte header then the data. */
+        p = dosSector(d, t, s);
+        for (int j = 0; j < SECTOR_SIZE && offset + j < n + 4; j++) {
+            size_t k = offset + j;
+            if (k < 4)
+                p[j] = ((k < 2 ? address : (int)n) >> (8 * (k & 1))) & 0xff;
+            else
+                p[j] = data[k - 4];
+        }
+    }
+
+    entry[ENTRY_TYPE] = DOS_BINARY;
+    memcpy(entry + ENTRY_NAME, dosName, DOS_NAME_LENGTH);
+    putLittleEndian16(entry + ENTRY_SECTORS, sectors);
+    return sectors;
+}
+
+/* Make an empty DOS 3.3 data disk, with tracks 0-2 kept for DOS as INIT does. */
+void formatDos33(struct disk *d)
+{
+    unsigned char *vtoc = dosSector(d, VTOC_TRACK, 0);
+
+    vtoc[0x00] = 0x04;
+    vtoc[VTOC_CATALOG] = VTOC_TRACK;
+    vtoc[VTOC_CATALOG + 1] = SECTORS - 1;
+    vtoc[0x03] = 3; // DOS release
+    vtoc[0x06] = DEFAULT_VOLUME_NUMBER;
+    vtoc[0x27] = PAIRS_PER_LIST;
+    vtoc[VTOC_LAST_TRACK] = VTOC_TRACK;
+    vtoc[VTOC_DIRECTION] = 1;
+    vtoc[0x34] = TRACKS;
+    vtoc[0x35] = SECTORS;
+    putLittleEndian16(vtoc + 0x36, SECTOR_SIZE);
+    for (int track = 3; track < TRACKS; track++) {
+        if (track == VTOC_TRACK)
+            continue;
+        for (int sector = 0; sector < SECTORS; sector++)
+            setDosSectorFree(d, track, sector, true);
+    }
+    /* The catalog sectors are chained from sector 15 down to 1. */
+    for (int sector = SECTORS - 1; sector > 1; sector--) {
+        dosSector(d, VTOC_TRACK, sector)[CATALOG_NEXT] = VTOC_TRACK;
+        dosSector(d, VTOC_TRACK, sector)[CATALOG_NEXT + 1] = sector - 1;
+    }
+}
+
+/* Return if a ProDOS block is free. */
+static inline bool blockFree(struct disk *d, long n)
+{
+    unsigned char *bitmap = block(d, littleEndian16(block(d, VOLUME_DIRECTORY) + HEADER_BITMAP));
+
+    return bitmap[n / 8] & (0x80 >> (n % 8));
+}
+
+/* Mark a ProDOS block free or used. */
+void setBlockFree(struct disk *d, long n, bool free)
+{
+    unsigned char *bitmap = block(d, littleEndian16(block(d, VOLUME_DIRECTORY) + HEADER_BITMAP));
+
+    if (n >= d->blocks)
+        return;
+    if (free)
+        bitmap[n / 8] |= 0x80 >> (n % 8);
+    else
+        bitmap[n / 8] &= ~(0x80 >> (n % 8));
+}
+
+/* Return the number of free ProDOS blocks. */
+long freeBlocks(struct disk *d)
+{
+    long count = 0;
+
+    for (long n = 0; n < d->blocks; n++)
+        count += blockFree(d, n);
+    return count;
+}
+
+/* Allocate the first free ProDOS block, as ProDOS does, and clear it. */
+long allocateBlock(struct disk *d)
+{
+    for (long n = 0; n < d->blocks; n++) {
+        if (blockFree(d, n)) {
+            setBlockFree(d, n, false);
+            memset(block(d, n), 0, BLOCK_SIZE);
+            return n;
+        }
+    }
+    return -1;
+}
+
+/* Free an index block and the blocks it lists, going down levels of index blocks. */
+void freeIndex(struct disk *d, long n, int levels)
+{
+    if (n == 0 || n >= d->blocks)
+        return;
+    for (int i = 0; i < 256 && levels > 0; i++) {
+        long p = block(d, n)[i] | (block(d, n)[256 + i] << 8);
+        freeIndex(d, p, levels - 1);
+    }
+    setBlockFree(d, n, true);
+}
+
+/* Store the current date and time in ProDOS form. */
+void putProdosTime(unsigned char *p)
+{
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+    int date = ((tm->tm_year % 100) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+
+    putLittleEndian16(p, date);
+    p[2] = tm->tm_min;
+    p[3] = tm->tm_hour;
+}
+
+/*
+ * Write a file to the ProDOS volume directory, replacing any file of
+ * the same name. Returns the blocks used, or -1 after reporting an
+ * error.
+ */
+long writeProdosFile(struct disk *d, const char *name, int type, int aux, const unsigned char *data, size_t n,
+                     bool *replaced)
+{
+    unsigned char *header = block(d, VOLUME_DIRECTORY);
+    unsigned char *entry = NULL;
+    unsigned char *freeEntry = NULL;
+    long current = VOLUME_DIRECTORY;
+    long dataBlocks = n == 0 ? 1 : (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long blocks = dataBlocks + (dataBlocks > 1);
+    long key;
+    long available;
+    int length = strlen(name);
+
+    if (dataBlocks > 256) {
+        fprintf(stderr, "%s: '%s' is more than 128 KB\n", programName, name);
+        return -1;
+    }
+
+    /* Look for the file, or the first unused entry, in each directory block. */
+    for (int count = 0; current != 0 && entry == NULL && count < d->blocks; count++) {
+        unsigned char *p;
+
+        if (current >= d->blocks)
+            break;
+        p = block(d, current);
+        for (int i = current == VOLUME_DIRECTORY; i < ENTRIES_PER_BLOCK; i++) {
+            unsigned char *e = p + DIRECTORY_ENTRIES + ENTRY_LENGTH * i;
+
+            if (e[0] >> 4 == 0) {
+                if (freeEntry == NULL)
+                    freeEntry = e;
+            } else if ((e[0] & 0x0f) == length && strncasecmp((char *)e + 1, name, length) == 0) {
+                entry = e;
+                break;
+            }
+        }
+        current = littleEndian16(p + DIRECTORY_NEXT);
+    }
+
+    *replaced = entry != NULL;
+    if (entry != NULL) {
+        int storage = entry[0] >> 4;
+
+        if (storage != SEEDLING && storage != SAPLING && storage != TREE) {
+            fprintf(stderr, "%s: '%s' on the disk is not a file\n", programName, name);
+            return -1;
+        }
+        if (!(entry[FILE_ACCESS] & ACCESS_DESTROY)) {
+            fprintf(stderr, "%s: '%s' is locked on the disk\n", programName, name);
+            return -1;
+        }
+        freeIndex(d, littleEndian16(entry + FILE_KEY), storage - 1);
+    } else if (freeEntry != NULL) {
+        entry = freeEntry;
+        memset(entry, 0, ENTRY_LENGTH);
+        entry[FILE_ACCESS] = ACCESS_DEFAULT;
+        putProdosTime(entry + FILE_CREATED);
+        putLittleEndian16(header + HEADER_FILE_COUNT, littleEndian16(header + HEADER_FILE_COUNT) + 1);
+    } else {
+        fprintf(stderr, "%s: The volume directory is full\n", programName);
+        return -1;
+    }
+
+    available = freeBlocks(d);
+    if (blocks > available) {
+        fprintf(stderr, "%s: Not enough room on the disk: %ld blocks needed, %ld free\n", programName, blocks,
+                available);
+        return -1;
+    }
+
+    key = allocateBlock(d);
+    for (long i = 0; i < dataBlocks; i++) {
+        long b = dataBlocks > 1 ? allocateBlock(d) : key;
+        size_t offset = i * BLOCK_SIZE;
+
+        if (dataBlocks > 1) {
+            block(d, key)[i] = b & 0xff;
+            block(d, key)[256 + i] = b >> 8;
+        }
+        memcpy(block(d, b), data + offset, n - offset < BLOCK_SIZE ? n - offset : BLOCK_SIZE);
+    }
+
+    entry[0] = ((dataBlocks > 1 ? SAPLING : SEEDLING) << 4) | length;
+    memset(entry + 1, 0, PRODOS_NAME_LENGTH);
+    for (int i = 0; i < length; i++)
+        entry[1 + i] = toupper((unsigned char)name[i]);
+    entry[FILE_TYPE] = type;
+    putLittleEndian16(entry + FILE_KEY, key);
+    putLittleEndian16(entry + FILE_BLOCKS, blocks);
+    entry[FILE_EOF] = n & 0xff;
+    entry[FILE_EOF + 1] = (n >> 8) & 0xff;
+    entry[FILE_EOF + 2] = (n >> 16) & 0xff;
+    putLittleEndian16(entry + FILE_AUX_TYPE, aux);
+    putProdosTime(entry + FILE_MODIFIED);
+    putLittleEndian16(entry + FILE_HEADER, VOLUME_DIRECTORY);
+    return blocks;
+}
+
+/* Make an empty ProDOS volume: the volume directory, then the bitmap. */
+void formatProdos(struct disk *d, const char *volume)
+{
+    int bitmapBlocks = (d->blocks + BLOCKS_PER_BITMAP - 1) / BLOCKS_PER_BITMAP;
+    int bitmap = VOLUME_DIRECTORY + VOLUME_DIRECTORY_BLOCKS;
+    unsigned char *header = block(d, VOLUME_DIRECTORY);
+    int length = strlen(volume);
+
+    for (int i = 0; i < VOLUME_DIRECTORY_BLOCKS; i++) {
+        unsigned char *p = block(d, VOLUME_DIRECTORY + i);
+        putLittleEndian16(p, i == 0 ? 0 : VOLUME_DIRECTORY + i - 1);
+        putLittleEndian16(p + DIRECTORY_NEXT, i == VOLUME_DIRECTORY_BLOCKS - 1 ? 0 : VOLUME_DIRECTORY + i + 1);
+    }
+    header[DIRECTORY_ENTRIES] = (VOLUME_HEADER << 4) | length;
+    for (int i = 0; i < length; i++)
+        header[DIRECTORY_ENTRIES + 1 + i] = toupper((unsigned char)volume[i]);
+    putProdosTime(header + DIRECTORY_ENTRIES + FILE_CREATED);
+    header[HEADER_ACCESS] = 0xc3;
+    header[HEADER_ENTRY_LENGTH] = ENTRY_LENGTH;
+    header[HEADER_ENTRIES_PER_BLOCK] = ENTRIES_PER_BLOCK;
+    putLittleEndian16(header + HEADER_BITMAP, bitmap);
+    putLittleEndian16(header + HEADER_TOTAL_BLOCKS, d->blocks);
+    for (long n = bitmap + bitmapBlocks; n < d->blocks; n++)
+        setBlockFree(d, n, true);
+}
+
+/*
+ * Create a blank disk image file. Returns false, after reporting an
+ * error, if it can't be created.
+ */
+bool createDisk(int fd, const char *filename, enum fileSystem fileSystem, long blocks, const char *volume,
+                struct disk *d)
+{
+    d->fileSystem = fileSystem;
+    d->interleaved = false;
+    d->blocks = fileSystem == PRODOS_DISK ? blocks : DISK_BLOCKS;
+    d->size = d->blocks * BLOCK_SIZE;
+    d->data = calloc(d->size, 1);
+    d->original = calloc(d->size, 1);
+    if (d->data == NULL || d->original == NULL) {
+        fprintf(stderr, "%s: Out of memory\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(fd, d->size) != 0) {
+        fprintf(stderr, "%s: Unable to create '%s': %s\n", programName, filename, strerror(errno));
+        return false;
+    }
+    if (fileSystem == PRODOS_DISK)
+        formatProdos(d, volume);
+    else
+        formatDos33(d);
+    return true;
+}
+
+/* Return if a name is a valid ProDOS file or volume name. */
+bool validProdosName(const char *name)
+{
+    int length = strlen(name);
+
+    if (length < 1 || length > PRODOS_NAME_LENGTH || !isalpha((unsigned char)name[0]))
+        return false;
+    for (int i = 1; i < length; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '.')
+            return false;
+    }
+    return true;
+}
+
+/* Return if a name is a valid DOS 3.3 file name. */
+bool validDosName(const char *name)
+{
+    int length = strlen(name);
+
+    return length >= 1 && length <= DOS_NAME_LENGTH && isalpha((unsigned char)name[0]) && strchr(name, ',') == NULL;
+}
+
+/* Read a whole file into a malloc()ed buffer. Returns NULL on error. */
+unsigned char *readFile(const char *filename, size_t *length)
+{
+    FILE *file = fopen(filename, "rb");
+    unsigned char *data = NULL;
+    size_t capacity = 0;
+
+    if (file == NULL)
+        return NULL;
+    *length = 0;
+    for (;;) {
+        size_t n;
+
+        if (*length == capacity) {
+            capacity = capacity ? 2 * capacity : 65536;
+            data = realloc(data, capacity);
+            if (data == NULL) {
+                fprintf(stderr, "%s: Out of memory\n", programName);
+                exit(EXIT_FAILURE);
+            }
+        }
+        n = fread(data + *length, 1, capacity - *length, file);
+        if (n == 0)
+            break;
+        *length += n;
+    }
+    if (ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+/* Parse a ProDOS file type: bin, sys or a number. Returns -1 if not valid. */
+int parseFileType(const char *s)
+{
+    char *end;
+    long type;
+
+    if (!strcasecmp(s, "bin"))
+        return PRODOS_BIN;
+    if (!strcasecmp(s, "sys"))
+        return PRODOS_SYS;
+    type = strtol(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || type < 0 || type > 0xff)
+        return -1;
+    return type;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool verbose = false;
+    bool create = false;
+    bool fromFile = false;
+    bool replaced = false;
+    int loadAddress = 0x803;
+    int type = -1;
+    int fileType = 0;
+    long blocks = DISK_BLOCKS;
+    const char *name = NULL;
+    const char *volume = DEFAULT_VOLUME_NAME;
+    const char *imageName;
+    const char *inputName;
+    char diskName[DOS_NAME_LENGTH + 1];
+    unsigned char *file;
+    unsigned char *image = NULL;
+    const unsigned char *data;
+    size_t fileLength;
+    size_t length;
+    int address;
+    long used;
+    long written;
+    int fd;
+    struct disk disk;
+
+    programName = argv[0];
+
+    while ((opt = getopt(argc, argv, "hvcfl:n:t:V:b:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'c':
+            create = true;
+            break;
+        case 'f':
+            fromFile = true;
+            break;
+        case 'l':
+            loadAddress = strtol(optarg, 0, 0);
+            if (loadAddress < 0 || loadAddress > 0xffff) {
+                fprintf(stderr, "%s: Invalid load address '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        case 't':
+            type = parseFileType(optarg);
+            if (type == -1) {
+                fprintf(stderr, "%s: Invalid file type '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'V':
+            volume = optarg;
+            if (!validProdosName(volume)) {
+                fprintf(stderr, "%s: Invalid volume name '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            blocks = strtol(optarg, 0, 0);
+            if (blocks < 16 || blocks > 65535) {
+                fprintf(stderr, "%s: Volume size must be 16 to 65535 blocks\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            showHelp(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc != optind + 2) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    imageName = argv[optind];
+    inputName = argv[optind + 1];
+
+    /* The default name on the disk is the input file name without its directory. */
+    if (name == NULL)
+        name = strrchr(inputName, '/') ? strrchr(inputName, '/') + 1 : inputName;
+    if (strlen(name) > DOS_NAME_LENGTH) {
+        fprintf(stderr, "%s: '%s' is too long for a file name on the disk (use -n)\n", argv[0], name);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; name[i] != '\0'; i++)
+        diskName[i] = toupper((unsigned char)name[i]);
+    diskName[strlen(name)] = '\0';
+    name = diskName;
+
+    file = readFile(inputName, &fileLength);
+    if (file == NULL) {
+        fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], inputName);
+        return 1;
+    }
+
+    if (fromFile) {
+        if (fileLength < 4) {
+            fprintf(stderr, "%s: '%s' is too short to have a DOS 3.3 header\n", argv[0], inputName);
+            return 1;
+        }
+        address = file[0] | (file[1] << 8);
+        length = file[2] | (file[3] << 8);
+        if (length > fileLength - 4) {
+            fprintf(stderr, "%s: '%s' is shorter than the length in its header\n", argv[0], inputName);
+            return 1;
+        }
+        data = file + 4;
+    } else {
+        enum bmInputFormat format = bmDetectInputFormat(file, fileLength);
+
+        if (format == BM_BINARY_INPUT) {
+            address = loadAddress;
+            data = file;
+            length = fileLength;
+        } else {
+            struct bmLoader loader = { .runAddress = -1 };
+            struct bmRange *ranges = NULL;
+            int numRanges;
+
+            if (!bmParseInput(format, file, fileLength, loadAddress, &loader, stderr, argv[0]))
+                return 1;
+            if (loader.numSegments == 0) {
+                fprintf(stderr, "%s: No data in '%s'\n", argv[0], inputName);
+                return 1;
+            }
+            if (!bmBuildImage(&loader, &image, &length, &address, &ranges, &numRanges, stderr, argv[0]))
+                return 1;
+            fileType = loader.fileType;
+            data = image;
+            free(ranges);
+            free(loader.bytes);
+        }
+    }
+    if (address + length > 0x10000) {
+        fprintf(stderr, "%s: '%s' goes above $FFFF\n", argv[0], inputName);
+        return 1;
+    }
+
+    fd = open(imageName, O_RDWR | (create ? O_CREAT : 0), 0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Unable to open '%s': %s\n", argv[0], imageName, strerror(errno));
+        return 1;
+    }
+    if (create && lseek(fd, 0, SEEK_END) == 0) {
+        size_t n = strlen(imageName);
+        bool prodos = n > 3 && !strcasecmp(imageName + n - 3, ".po");
+
+        if (!createDisk(fd, imageName, prodos ? PRODOS_DISK : DOS33_DISK, blocks, volume, &disk))
+            return 1;
+    } else if (!readDisk(fd, imageName, &disk)) {
+        return 1;
+    }
+
+    if (disk.fileSystem == DOS33_DISK) {
+        if (type != -1 && type != PRODOS_BIN) {
+            fprintf(stderr, "%s: DOS 3.3 only has binary files, not type $%02X\n", argv[0], type);
+            return 1;
+        }
+        if (!validDosName(name)) {
+            fprintf(stderr, "%s: '%s' is not a valid DOS 3.3 file name (use -n)\n", argv[0], name);
+            return 1;
+        }
+        used = writeDosFile(&disk, name, address, data, length, &replaced);
+    } else {
+        if (type == -1)
+            type = fileType != 0 ? fileType : PRODOS_BIN;
+        if (!validProdosName(name)) {
+            fprintf(stderr, "%s: '%s' is not a valid ProDOS file name (use -n)\n", argv[0], name);
+            return 1;
+        }
+        used = writeProdosFile(&disk, name, type, address, data, length, &replaced);
+    }
+    if (used < 0)
+        return 1;
+
+    written = writeDisk(fd, &disk);
+    if (written < 0 || close(fd) != 0) {
+        fprintf(stderr, "%s: Error writing '%s': %s\n", argv[0], imageName, strerror(errno));
+        return 1;
+    }
+
+    if (verbose) {
+        if (disk.fileSystem == DOS33_DISK) {
+            fprintf(stderr, "Image: DOS 3.3, %s sector order\n", disk.interleaved ? "ProDOS" : "DOS 3.3");
+            fprintf(stderr, "File: %s (B), load address $%04X, %zu bytes\n", name, address, length);
+            fprintf(stderr, "Sectors used: %ld, %d free\n", used, dosFreeSectors(&disk));
+        } else {
+            unsigned char *header = block(&disk, VOLUME_DIRECTORY);
+            fprintf(stderr, "Image: ProDOS volume /%.*s, %ld blocks, %s sector order\n",
+                    header[DIRECTORY_ENTRIES] & 0x0f, header + DIRECTORY_ENTRIES + 1, disk.blocks,
+                    disk.interleaved ? "DOS 3.3" : "ProDOS");
+            fprintf(stderr, "File: %s (type $%02X), load address $%04X, %zu bytes\n", name, type, address, length);
+            fprintf(stderr, "Blocks used: %ld, %ld free\n", used, freeBlocks(&disk));
+        }
+        if (replaced)
+            fprintf(stderr, "Replaced the file already on the disk\n");
+        fprintf(stderr, "Sectors written: %ld\n", written);
+    }
+
+    free(disk.data);
+    free(disk.original);
+    free(image);
+    free(file);
+    return 0;
+}
@@ -1,5 +1,7 @@
 /*
- * Convert binary file to Woz monitor format.
+ * Convert binary file to Woz monitor format, JMON format, MOS
+ * Technology (KIM-1) paper tape format, or Ohio Scientific 65V monitor
+ * load format, or to Apple 1 or KIM-1 cassette audio.
  *
  * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
  *
@@ -15,7 +17,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  *
- * usage: bintomon [-h] [-v] [-f] [-1] [-2] [-b <bytes>] [-l <LoadAddress>] [-r <RunAddress>] [-c <fill>] <filename>
+ * usage: bintomon [-h] [-v] [-f] [-1] [-2] [-j] [-k] [-o] [-z] [-b <bytes>] [-l <LoadAddress>] [-r <RunAddress>] [-c <fill>] [-x <MinRun>] [-a <Start>-<End>] [-m <MapFile>] [-s <Name>] [-p <Profile>] [-i <Format>] [--base <Image>] [--blocks <Manifest> [--block-size <Bytes>]] [--wav <Tape> [--tape-id <ID>] [--sample-rate <Hz>]] <filename>...
+ *        bintomon [-v] [--threads <Count>] --batch <Manifest>
  *
  * The -h option will display the command usage and exit.
  * The -l option and <LoadAddress> argument specifies the starting
@@ -24,37 +27,171 @@
  * the LoadAddress and program length are read from the first 4 bytes
  * of the file. A -1 option specifies to use Apple 1 Woz Monitor
  * format. The -2 option specifies to use the Apple II Monitor format.
- * The -b option specifies how many data bytes per line (defaults to 8).
+ * For a 65816 image that goes above $FFFF, this gives every address
+ * with its bank as "BB/AAAA", as the Apple IIgs monitor accepts, and
+ * starts a new line at each bank boundary. Images of up to 16 MB can
+ * be sent this way. The other formats only have 16-bit addresses.
+ * The -j option specifies to use the commands of the JMON monitor.
+ * The -k option specifies to use the MOS Technology paper tape format
+ * used by the KIM-1, the same as produced by srec_cat's
+ * -MOS_Technologies option. The -o option specifies to use the format
+ * accepted by the Load command of the Ohio Scientific 65V and CEGMON
+ * monitors.
+ * The -b option specifies how many data bytes per line (defaults to 8,
+ * or 24 for paper tape format). With "-b auto" the number of bytes per
+ * line that gives the shortest estimated upload time is used.
+ * The -p option describes the target for the upload time estimate and
+ * for -b auto, as a comma separated list of: baud=<Rate> (the default
+ * is 9600), char=<ms> and line=<ms>, the time the monitor needs to
+ * process each character and each line, and max=<Chars>, the longest
+ * line the monitor accepts. By default this is 127 characters for the
+ * Woz Monitor and 248 for the Apple II monitor. A warning is given if
+ * any line is longer.
  * If no <LoadAddress> is specified, it defaults to
  * 0x280. If no <RunAddess> is specified, it defaults to the
  * <LoadAddress>. Addresses can be specified in decimal or hex
- * (prefixed with "0x"). A monitor run or go command is sent at the end of
- * the file. If <RunAddress> is "-" then the run command is not
- * generated in the output.
+ * (prefixed with "0x"), or as a hex bank and address such as
+ * 01/2000. A monitor run or go command is sent at the end of the
+ * file. If <RunAddress> is "-" then the run command is not generated
+ * in the output.
+ * The -m option reads an ld65 map file (as written by ld65 -m). The
+ * load and run addresses can then also be given as the name of an
+ * exported symbol or a segment from the map file, whose value or
+ * start address is used. The -s <Name> option sets both the load and
+ * run addresses to the same symbol or segment.
  * The -c option causes lines containing only the specified fill
  * character to be skipped. Typically this is used when the input file
- * contains long runs of all zeros or FF.
+ * contains long runs of all zeros or FF. In OSI format there are no
+ * lines, so instead any run of three or more fill characters is
+ * skipped and a new load address sent after it.
+ * The -x option finds runs of at least <MinRun> copies of any byte
+ * and sends a monitor command to fill that memory instead of the
+ * data. This is supported for the JMON format (using its F command)
+ * and the Apple II Monitor format (by storing the first byte and
+ * using an overlapping M move command to copy it through the rest).
+ * A <MinRun> of 0 uses the shortest run for which this sends fewer
+ * characters.
+ * The -a option limits output to the data in the address range from
+ * <Start> up to but not including <End>, like srec_cat's -crop
+ * option. It can be given more than once. Each range starts a new
+ * line or record.
+ * The -z option compresses the program and sends it with a small 6502
+ * decompressor (110 bytes, using zero page $F0-$F7) placed after it.
+ * The run command starts the decompressor, which unpacks the program
+ * in place to the load address and then jumps to the run address. The
+ * compressed data is loaded just far enough above the load address
+ * that unpacking never overwrites data not yet read. With -v the
+ * compressed size and estimated time saved are shown.
+ * The --base option sends only what has changed since an earlier
+ * version of the program was loaded. <Image> is either that version's
+ * binary file or the monitor file that was sent for it (Woz Monitor or
+ * Apple II Monitor format). Only the bytes that differ are sent, each
+ * changed run with its own address, except that short unchanged gaps
+ * are sent too when that is quicker than sending a new address.
+ * The --blocks option splits the output into blocks of up to 256 bytes
+ * (or --block-size <Bytes>), each starting on a new line with its
+ * address, and writes a manifest listing the address, length and
+ * checksum of each block and where its text is in the output. After
+ * an upload, "sendmon -k <Manifest>" reads back the checksums from the
+ * target and sends only the blocks that were garbled again. This is
+ * for the Woz Monitor and Apple II Monitor formats, without -c or -x,
+ * and for images that end by $FFFF.
+ * The --wav option writes a WAV file of a cassette tape to play into
+ * the target instead of monitor text. <Tape> is aci for the Apple 1
+ * Cassette Interface, kim for the standard KIM-1 tape format, or
+ * kim-fast for KIM-1 tapes with the shortest timing (the same as
+ * Hypertape) that the KIM-1 ROM still loads, about six times faster.
+ * The KIM-1 tape has the ID given by --tape-id (1 to 254, defaulting
+ * to 1). The audio is 8-bit mono at 44100 Hz, or --sample-rate <Hz>.
+ * A tape holds the whole image from the load address, without a run
+ * command, so -a, -c, -x, -z, --base and --blocks can't be used. With
+ * -v the tape length and how to load it are shown.
+ * The -i option gives the format of the input file: bin (a flat
+ * binary), dos33 (a binary with the DOS 3.3 header, the same as -f),
+ * ihex (Intel HEX), srec (Motorola S-records), hex (a hex dump with an
+ * address at the start of each line, as in a Woz Monitor or Apple II
+ * Monitor listing, or the Woz Monitor, Apple II Monitor or JMON
+ * commands bintomon writes, including its fill commands), applesingle
+ * (as written by the cc65 apple2 targets) or data (the BASIC DATA
+ * statements read by the object code loader in asm/BeyondGames, each
+ * an address, eight bytes and a checksum, which is checked). The
+ * default, auto, works it out from the contents of the file. Apart
+ * from binaries, these formats give their own load addresses, which
+ * replace <LoadAddress>, and may load separate segments. Each segment
+ * is sent with its own address and nothing is sent for the gaps
+ * between them. An Intel HEX or S-record start address, or the run
+ * command at the end of a monitor file, is used if no <RunAddress> is
+ * given, otherwise the lowest address loaded is.
+ * Several input files can be given to load them together in one
+ * upload, for example the ACI, BASIC and a monitor, as a linker would.
+ * The -f, -i, -l, -m and -s options apply to the input file that
+ * follows them (or to the last one, if they come after it), so each
+ * file has its own load address or map file. The other options apply
+ * to the whole upload. The files are loaded into one image, and
+ * adjacent segments are merged so they are sent as one. If any file
+ * loads data where another file does, each overlap is reported with
+ * the files and addresses involved and nothing is output. There is a
+ * single run command at the end: the -r address (a symbol is looked up
+ * in the map file of the input it was given for), or else the first
+ * file's run address.
  * With the -v option verbose output is sent to standard error listing
  * the load and run address and program size.
+ * The --batch option runs all the conversions listed in a manifest
+ * file ("-" for standard input). Each line of the manifest holds the
+ * options and input file as they would be given on the command line,
+ * then ">" and the output file. Names with spaces can be quoted or
+ * have the spaces escaped with a backslash, as in a shell. Blank lines
+ * and lines starting with # are ignored. The conversions run on a
+ * pool of worker threads, one per CPU unless --threads is given. An
+ * error in one conversion is reported, with the manifest line number,
+ * and the others still run. The output of each is the same as running
+ * bintomon on its own.
+ * The conversion itself is done by libbintomon (see libbintomon.h),
+ * which other programs can link with to convert images directly.
  *
  * Examples:
  * bintomon myprog.bin
  * bintomon -v -f myprog.bin
  * bintomon -l 0x300 myprog.bin
  * bintomon -l 0x280 -r 0x300 myprog.bin
+ * bintomon -k -l 0x200 myprog.bin
+ * bintomon -k -l 0 -a 0-0x4e -a 0x200-0x3fa myprog.bin
+ * bintomon -o -c 0 -l 0x1000 -r 0x1207 myprog.bin
+ * bintomon -v -j -x 0 -l 0x2000 myprog.bin
+ * bintomon -v -m jmon.map -s JMON jmon.bin
+ * bintomon -m 2ksa.map -l ORG -r MAIN 2ksa.bin
+ * bintomon -v -b auto -p baud=2400,line=20 myprog.bin
+ * bintomon -v -z -l 0x5000 basic.bin
+ * bintomon -2 visiblemonitor.hex
+ * bintomon -2 -l 01/0000 -r 01/0000 bank1.bin
+ * bintomon -j -a 0x8000-0x9000 myprog.s19
+ * bintomon --base jmon-old.bin -m jmon.map -s JMON jmon.bin
+ * bintomon --blocks basic.blk -l 0xE000 basic.bin >basic.mon
+ * bintomon --wav aci -l 0xE000 basic.bin >basic.wav
+ * bintomon --wav kim-fast --tape-id 2 -l 0x200 myprog.bin >myprog.wav
+ * bintomon -l 0xC100 wozaci.bin -l 0x5000 basic.bin -m jmon.map -l JMON jmon.bin -r 0x5000
+ * bintomon -o -r 0x1207 E1.bas E2.bas E3.bas ... E12.bas
+ * bintomon --batch images.txt
  *
  */
 
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include <stdbool.h>
+#include <errno.h>
+#include "libbintomon.h"
 
 /* print command usage */
 void usage(char *name) {
-    fprintf(stderr, "usage: %s [-h] [-v] [-f] [-1] [-2] [-b <Bytes>] [-l <LoadAddress>] [-r <RunAddress>] [-c <Fill>] <Filename>\n", name);
+    fprintf(stderr, "usage: %s [-h] [-v] [-f] [-1] [-2] [-j] [-k] [-o] [-z] [-b <Bytes>] [-l <LoadAddress>] [-r <RunAddress>] [-c <Fill>] [-x <MinRun>] [-a <Start>-<End>] [-m <MapFile>] [-s <Name>] [-p <Profile>] [-i <Format>] [--base <Image>] [--blocks <Manifest> [--block-size <Bytes>]] [--wav <Tape> [--tape-id <ID>] [--sample-rate <Hz>]] <Filename>...\n", name);
+    fprintf(stderr, "       %s [-v] [--threads <Count>] --batch <Manifest>\n", name);
 }
 
 /* Show help info */
@@ -67,187 +204,1308 @@ void showHelp(char *name)
             "-f  Get load address and length from first 4 bytes of file.\n"
             "-1  Use Apple 1 Woz Monitor format.\n"
             "-2  Use Apple II Monitor format.\n"
-            "-b <Bytes>  Specify how many data bytes per line (defaults to 8).\n"
+            "-j  Use JMON monitor format.\n"
+            "-k  Use KIM-1 (MOS Technology) paper tape format.\n"
+            "-o  Use OSI 65V monitor load format.\n"
+            "-z  Send compressed, with a decompressor that unpacks and runs it.\n"
+            "-b <Bytes>  Specify how many data bytes per line (defaults to 8, or 24 for -k,\n"
+            "            auto for the fastest upload).\n"
             "-l <LoadAddress>  Specify beginning load address (defaults to 0x280).\n"
             "-r <RunAddress>  Specify program run/start address (defaults to load address).\n"
-            "-c <Fill>  Skip lines containing the specified fill character.\n\n"
-            "Addresses can be specified in decimal or hex (prefixed with 0x). A\n"
+            "-c <Fill>  Skip lines containing the specified fill character.\n"
+            "-x <MinRun>  Use monitor fill commands for runs of MinRun or more bytes (0 = auto).\n"
+            "-a <Start>-<End>  Only output data from Start up to End (may be repeated).\n"
+            "-m <MapFile>  Read symbols and segments from an ld65 map file.\n"
+            "-s <Name>  Use map file symbol or segment as load and run address.\n"
+            "-p <Profile>  Target serial link and monitor, e.g. baud=2400,char=1,line=20,max=127.\n"
+            "-i <Format>  Input format: auto (default), bin, dos33, ihex, srec, hex, applesingle or data.\n"
+            "--base <Image>  Only send bytes that differ from an earlier binary or .mon file.\n"
+            "--blocks <Manifest>  Write a block checksum manifest for sendmon -k.\n"
+            "--block-size <Bytes>  Bytes per checksummed block, 1 to 256 (defaults to 256).\n"
+            "--wav <Tape>  Write cassette audio: aci, kim or kim-fast.\n"
+            "--tape-id <ID>  KIM-1 tape ID, 1 to 254 (defaults to 1).\n"
+            "--sample-rate <Hz>  WAV sample rate (defaults to 44100).\n"
+            "--batch <Manifest>  Run the conversions listed in a manifest file.\n"
+            "--threads <Count>  Number of threads for --batch (defaults to one per CPU).\n\n"
+            "Addresses can be specified in decimal or hex (prefixed with 0x), as a\n"
+            "65816 bank and address (e.g. 01/2000, only for -2 output), or with -m\n"
+            "as the name of a symbol or segment in the map file. A\n"
             "monitor run or go command is sent at the end of the file. If run address\n"
-            "is - then the run command is not generated in the output.\n");
+            "is - then the run command is not generated in the output. Paper tape\n"
+            "format has no run command.\n"
+            "Input formats other than bin and dos33 give their own load addresses.\n"
+            "Several input files can be given, each after its own -f, -i, -l, -m or -s\n"
+            "options. They are merged into one upload and must not overlap.\n"
+            "Each line of a batch manifest has options and an input file, then >\n"
+            "and an output file, e.g.: -m wozmon.map -s RESET wozmon.bin > wozmon.mon\n"
+            "Names with spaces can be quoted or escaped with \\ as in a shell.\n");
 }
 
-/* Return if an array of length n contains all fill characters. */
-bool allFill(unsigned char bytes[], int n, int fill)
+/* Parse an address range of the form <Start>-<End>. */
+bool parseRange(const char *s, struct bmRange *r)
 {
-    for (int i = 0; i < n; i++) {
-        if (bytes[i] != fill)
-            return false;
-    }
+    char *end;
+
+    r->start = strtol(s, &end, 0);
+    if (end == s || *end != '-')
+        return false;
+    s = end + 1;
+    r->end = strtol(s, &end, 0);
+    if (end == s || *end != '\0' || r->end < r->start)
+        return false;
     return true;
 }
 
-int main(int argc, char *argv[])
+/* The contents of an input file. */
+struct inputFile {
+    unsigned char *contents;
+    size_t length;
+    bool mapped;            // mmap()ed rather than malloc()ed
+};
+
+/*
+ * Open an input file and get its contents. A regular file is mapped
+ * into memory rather than copied, so even a 16 MB image is read
+ * straight from the page cache as it is converted. Anything else, such
+ * as a pipe, is read into memory. Returns false, after writing an
+ * error to log, if it can't be opened or read.
+ */
+bool openInput(const char *filename, struct inputFile *in, FILE *log, const char *prefix)
 {
+    struct stat st;
     FILE *file;
-    unsigned char b;
-    int loadAddress = 0x280;
-    int runAddress = -2;
-    int length = -1;
-    int address;
-    int bytesPerLine = 8;
-    unsigned char bytes[255];
+    bool ok;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(log, "%s: Unable to open '%s'\n", prefix, filename);
+        return false;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        in->contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->contents != MAP_FAILED) {
+            madvise(in->contents, st.st_size, MADV_SEQUENTIAL);
+            in->length = st.st_size;
+            in->mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+
+    file = fdopen(fd, "rb");
+    if (file == NULL) {
+        fprintf(log, "%s: Unable to open '%s'\n", prefix, filename);
+        close(fd);
+        return false;
+    }
+    ok = bmReadFile(file, &in->contents, &in->length);
+    in->mapped = false;
+    fclose(file);
+    if (!ok)
+        fprintf(log, "%s: Out of memory reading '%s'\n", prefix, filename);
+    return ok;
+}
+
+/* Release an input file's contents. */
+void closeInput(struct inputFile *in)
+{
+    if (in->mapped)
+        munmap(in->contents, in->length);
+    else
+        free(in->contents);
+    in->contents = NULL;
+    in->length = 0;
+    in->mapped = false;
+}
+
+/* Replace an input file's contents with a malloc()ed image built from it. */
+void replaceInput(struct inputFile *in, unsigned char *image, size_t length)
+{
+    closeInput(in);
+    in->contents = image;
+    in->length = length;
+}
+
+static const char *inputFormatNames[] = {
+    "auto", "bin", "ihex", "srec", "hex", "applesingle", "data"
+};
+
+static const char *tapeFormatNames[] = { "none", "aci", "kim", "kim-fast" };
+
+/* An input file and the options that apply to it. */
+struct jobInput {
+    const char *name;
+    const char *mapName;
+    const char *loadName;
+    bool fromFile;
+    enum bmInputFormat format;
+};
+
+/*
+ * One conversion to run: the settings and file names from the command
+ * line or from one line of a batch manifest.
+ */
+struct job {
+    struct bmSettings settings;
+    const char *prefix;     // For messages: program name, or manifest and line number
+    struct jobInput *inputs;
+    int numInputs;
+    const char *outputName; // NULL for standard output
+    const char *runName;
+    int runInput;           // Input whose map file the run address is looked up in
+    const char *baseName;   // --base image for a delta upload
+    const char *blocksName; // --blocks manifest to write
+    int blockSize;          // --block-size
+    enum bmTapeFormat tapeFormat; // --wav cassette audio, or BM_NO_TAPE
+    int tapeId;             // --tape-id
+    int sampleRate;         // --sample-rate
+    int minRun;             // From -x, or -1 if not given
+    struct bmProfile profile; // Target for upload time estimate and -b auto
+    bool autoWidth;         // Choose bytes per line for the fastest upload
+    bool compress;          // Send compressed with a decompressor
+    bool verbose;
+    const char *batchName;  // Command line only: --batch manifest
+    int threads;            // Command line only: --threads, or 0 for one per CPU
+    char **args;            // Manifest line words, which the names point into
+    int status;             // 0 if converted, 1 on error
+};
+
+/* Long options. --batch and --threads are only used on the command line. */
+static const struct option longOptions[] = {
+    { "base", required_argument, NULL, 'D' },
+    { "blocks", required_argument, NULL, 'K' },
+    { "block-size", required_argument, NULL, 'S' },
+    { "wav", required_argument, NULL, 'W' },
+    { "tape-id", required_argument, NULL, 'I' },
+    { "sample-rate", required_argument, NULL, 'R' },
+    { "batch", required_argument, NULL, 'B' },
+    { "threads", required_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Parse the options for a job. Errors are reported using argv[0] as
+ * the prefix. Returns false if the options are not valid.
+ */
+bool parseOptions(struct job *job, int argc, char *argv[], bool commandLine)
+{
+    struct bmSettings *settings = &job->settings;
+    struct jobInput next = { .format = BM_AUTO_INPUT }; // Options for the next input file
+    bool nextOptions = false;
     int opt;
-    size_t size;
-    int fromFile = 0;
-    int verbose = 0;
-    int version = 1; // Use Apple 1 or Apple 2 format
-    bool skipFill = false;
-    unsigned char fillChar = 0;
-
-    while ((opt = getopt(argc, argv, "hv12fl:r:b:c:")) != -1) {
+
+    *job = (struct job) {
+        .settings = {
+            .format = BM_APPLE1_FORMAT,
+            .loadAddress = 0x280,
+            .runAddress = -2,
+            .bytesPerLine = -1,
+            .skipFill = false,
+            .fillChar = 0,
+            .minRun = 0,
+            .ranges = NULL,
+            .numRanges = 0
+        },
+        .prefix = argv[0],
+        .minRun = -1,
+        .blockSize = BM_DEFAULT_BLOCK_SIZE,
+        .tapeId = BM_DEFAULT_TAPE_ID,
+        .sampleRate = BM_DEFAULT_SAMPLE_RATE,
+        .profile = {
+            .baud = 9600,
+            .charDelay = 0,
+            .lineDelay = 0,
+            .maxLine = -1
+        }
+    };
+
+    /* Start a fresh scan, as getopt() is called again for each manifest line. */
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optreset = 1;
+    optind = 1;
+#endif
+
+    /* The leading "-" returns input file names in order, as option 1. */
+    while ((opt = getopt_long(argc, argv, "-hv12jkozfi:l:r:b:c:x:a:m:s:p:", longOptions, NULL)) != -1) {
         switch (opt) {
+        case 1:
+            if (job->numInputs % 8 == 0) {
+                struct jobInput *inputs = realloc(job->inputs, (job->numInputs + 8) * sizeof(struct jobInput));
+                if (inputs == NULL) {
+                    fprintf(stderr, "%s: Out of memory\n", argv[0]);
+                    return false;
+                }
+                job->inputs = inputs;
+            }
+            next.name = optarg;
+            job->inputs[job->numInputs++] = next;
+            next = (struct jobInput) { .format = BM_AUTO_INPUT };
+            nextOptions = false;
+            break;
         case 'f':
-            fromFile = 1;
+            next.fromFile = true;
+            nextOptions = true;
             break;
         case 'v':
-            verbose = 1;
+            job->verbose = true;
             break;
         case '1':
-            version = 1;
+            settings->format = BM_APPLE1_FORMAT;
             break;
         case '2':
-            version = 2;
+            settings->format = BM_APPLE2_FORMAT;
+            break;
+        case 'j':
+            settings->format = BM_JMON_FORMAT;
+            break;
+        case 'k':
+            settings->format = BM_KIM1_FORMAT;
+            break;
+        case 'o':
+            settings->format = BM_OSI_FORMAT;
+            break;
+        case 'z':
+            job->compress = true;
+            break;
+        case 'i':
+            nextOptions = true;
+            if (!strcmp(optarg, "dos33")) {
+                next.format = BM_BINARY_INPUT;
+                next.fromFile = true;
+                break;
+            }
+            for (next.format = BM_AUTO_INPUT; next.format <= BM_BASIC_DATA_INPUT; next.format++) {
+                if (!strcmp(optarg, inputFormatNames[next.format]))
+                    break;
+            }
+            if (next.format > BM_BASIC_DATA_INPUT) {
+                fprintf(stderr, "%s: Unknown input format '%s'\n", argv[0], optarg);
+                return false;
+            }
             break;
         case 'l':
-            loadAddress = strtol(optarg, 0, 0);
+            next.loadName = optarg;
+            nextOptions = true;
             break;
         case 'r':
             if (!strcmp(optarg, "-")) {
-                runAddress = -1;
+                settings->runAddress = -1;
+                job->runName = NULL;
             } else {
-                runAddress = strtol(optarg, 0, 0);
+                job->runName = optarg;
+                job->runInput = job->numInputs;
             }
             break;
+        case 'm':
+            next.mapName = optarg;
+            nextOptions = true;
+            break;
+        case 's':
+            next.loadName = optarg;
+            nextOptions = true;
+            job->runName = optarg;
+            job->runInput = job->numInputs;
+            break;
         case 'b':
-            bytesPerLine = strtol(optarg, 0, 0);
+            job->autoWidth = !strcmp(optarg, "auto");
+            settings->bytesPerLine = job->autoWidth ? -1 : strtol(optarg, 0, 0);
+            break;
+        case 'p':
+            if (!bmParseProfile(optarg, &job->profile)) {
+                fprintf(stderr, "%s: Invalid target profile '%s'\n", argv[0], optarg);
+                return false;
+            }
             break;
         case 'c':
-            fillChar = strtol(optarg, 0, 0);
-            skipFill = true;
+            settings->fillChar = strtol(optarg, 0, 0);
+            settings->skipFill = true;
+            break;
+        case 'x':
+            job->minRun = strtol(optarg, 0, 0);
+            break;
+        case 'a':
+            if (settings->numRanges % 8 == 0) {
+                struct bmRange *ranges = realloc(settings->ranges, (settings->numRanges + 8) * sizeof(struct bmRange));
+                if (ranges == NULL) {
+                    fprintf(stderr, "%s: Out of memory\n", argv[0]);
+                    return false;
+                }
+                settings->ranges = ranges;
+            }
+            if (!parseRange(optarg, &settings->ranges[settings->numRanges])) {
+                fprintf(stderr, "%s: Invalid address range '%s'\n", argv[0], optarg);
+                return false;
+            }
+            settings->numRanges++;
+            break;
+        case 'D':
+            job->baseName = optarg;
+            break;
+        case 'K':
+            job->blocksName = optarg;
+            break;
+        case 'S':
+            job->blockSize = strtol(optarg, 0, 0);
+            if (job->blockSize < 1 || job->blockSize > 256) {
+                fprintf(stderr, "%s: Block size must be 1 to 256 bytes\n", argv[0]);
+                return false;
+            }
+            break;
+        case 'W':
+            for (job->tapeFormat = BM_ACI_TAPE; job->tapeFormat <= BM_KIM_FAST_TAPE; job->tapeFormat++) {
+                if (!strcmp(optarg, tapeFormatNames[job->tapeFormat]))
+                    break;
+            }
+            if (job->tapeFormat > BM_KIM_FAST_TAPE) {
+                fprintf(stderr, "%s: Unknown tape format '%s'\n", argv[0], optarg);
+                return false;
+            }
+            break;
+        case 'I':
+            job->tapeId = strtol(optarg, 0, 0);
+            if (job->tapeId < 1 || job->tapeId > 0xfe) {
+                fprintf(stderr, "%s: Tape ID must be 1 to 254\n", argv[0]);
+                return false;
+            }
+            break;
+        case 'R':
+            job->sampleRate = strtol(optarg, 0, 0);
+            if (job->sampleRate < 22050 || job->sampleRate > 192000) {
+                fprintf(stderr, "%s: Sample rate must be 22050 to 192000 Hz\n", argv[0]);
+                return false;
+            }
+            break;
+        case 'B':
+        case 'T':
+            if (!commandLine) {
+                fprintf(stderr, "%s: --batch and --threads can't be used in a manifest\n", argv[0]);
+                return false;
+            }
+            if (opt == 'B')
+                job->batchName = optarg;
+            else
+                job->threads = strtol(optarg, 0, 0);
             break;
         case 'h':
-            showHelp(argv[0]);
-            exit(EXIT_SUCCESS);
+            if (commandLine) {
+                showHelp(argv[0]);
+                exit(EXIT_SUCCESS);
+            }
+            fprintf(stderr, "%s: The -h option can't be used in a manifest\n", argv[0]);
+            return false;
         default:
+            if (commandLine)
+                usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (job->batchName != NULL) {
+        if (job->numInputs != 0) {
             usage(argv[0]);
-            exit(EXIT_FAILURE);
+            return false;
         }
+        return true;
     }
 
-    if (argc != optind + 1) {
-        usage(argv[0]);
-        exit(EXIT_FAILURE);
+    if (job->numInputs == 0) {
+        if (commandLine)
+            usage(argv[0]);
+        else
+            fprintf(stderr, "%s: Expected options and an input file\n", argv[0]);
+        return false;
     }
 
-    file = fopen(argv[optind], "rb");
-    if (file == NULL) {
-        fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], argv[optind]);
-        return 1;
+    /* Input options after the last file name apply to that file. */
+    if (nextOptions) {
+        struct jobInput *last = &job->inputs[job->numInputs - 1];
+        if (next.mapName != NULL)
+            last->mapName = next.mapName;
+        if (next.loadName != NULL)
+            last->loadName = next.loadName;
+        if (next.format != BM_AUTO_INPUT)
+            last->format = next.format;
+        last->fromFile |= next.fromFile;
     }
+    if (job->runInput == job->numInputs)
+        job->runInput--;
 
-    if (fromFile) {
-        /* read load address from file */
-        size = fread(&b, 1, 1, file);
-        assert(size == 1);
-        loadAddress = b;
-        size = fread(&b, 1, 1, file);
-        assert(size == 1);
-        loadAddress += b << 8;
+    /* Default line length depends on the format. */
+    if (settings->bytesPerLine == -1)
+        settings->bytesPerLine = bmEncoderFor(settings->format)->bytesPerLine;
 
-        /* read length from file */
-        size = fread(&b, 1, 1, file);
-        assert(size == 1);
-        length = b;
-        size = fread(&b, 1, 1, file);
-        assert(size == 1);
-        length += b << 8;
+    if (job->blocksName != NULL) {
+        if (settings->format != BM_APPLE1_FORMAT && settings->format != BM_APPLE2_FORMAT) {
+            fprintf(stderr, "%s: The --blocks option needs Woz Monitor or Apple II Monitor format\n", argv[0]);
+            return false;
+        }
+        if (settings->skipFill || job->minRun != -1) {
+            fprintf(stderr, "%s: The --blocks option can't be used with -c or -x\n", argv[0]);
+            return false;
+        }
     }
 
-    /* If not set, run address is load address */
-    if (runAddress == -2)
-        runAddress = loadAddress;
-
-    /* Set current address to load address. */
-    address = loadAddress;
-
-    /* Set flag when we need to print the address for data. */
-    bool printAddress = true;
-
-    int printed = 0;
-
-    // Repeat until end of file:
-    //   Read a line's worth of bytes
-    //   If the entire line is fill chars
-    //     Skip it and advance address.
-    //     Set flag that we need to print address.
-    //   Else
-    //     Print address if needed.
-    //     Clear print address flag.
-    //     Print the line (or less) of data.
-
-    int n;
-    while ((n = fread(&bytes, 1, bytesPerLine, file)) != 0) {
-        if (skipFill && allFill(bytes, n, fillChar)) {
-            address += n;
-            printAddress = true;
-        } else {
-            if (printAddress) {
-                printf("%04X:", address);
-            }
-            printAddress = false;
-            for (int i = 0; i < n; i++) {
-                printf(" %02X", bytes[i]);
-                address++;
-                printed++;
-                if ((printed % bytesPerLine) == 0) {
-                    printf("\n:");
-                    printed = 0;
-                }
+    if (job->tapeFormat != BM_NO_TAPE && (settings->skipFill || job->minRun != -1 || settings->numRanges != 0 ||
+                                       job->compress || job->baseName != NULL || job->blocksName != NULL)) {
+        fprintf(stderr, "%s: The --wav option can't be used with -a, -c, -x, -z, --base or --blocks\n", argv[0]);
+        return false;
+    }
+
+    if (job->compress && (settings->numRanges != 0 || job->baseName != NULL)) {
+        fprintf(stderr, "%s: The -z option can't be used with -a or --base\n", argv[0]);
+        return false;
+    }
+
+    /* A DOS 3.3 header only makes sense on a flat binary. */
+    for (int i = 0; i < job->numInputs; i++) {
+        struct jobInput *in = &job->inputs[i];
+        if (in->fromFile) {
+            if (in->format != BM_AUTO_INPUT && in->format != BM_BINARY_INPUT) {
+                fprintf(stderr, "%s: The -f option can only be used with binary input\n", argv[0]);
+                return false;
             }
+            in->format = BM_BINARY_INPUT;
         }
     }
-    printf("\n");
-    fclose(file);
 
-    // Add run address
-    if (runAddress != -1) {
-        if (version == 1) {
-            printf("%04XR\n", runAddress);
+    if (job->profile.maxLine == -1)
+        job->profile.maxLine = bmDefaultMaxLine(settings->format);
+
+    if (settings->format == BM_KIM1_FORMAT && (settings->bytesPerLine < 1 || settings->bytesPerLine > 255)) {
+        fprintf(stderr, "%s: Paper tape records must have 1 to 255 bytes\n", argv[0]);
+        return false;
+    }
+
+    if (job->minRun != -1) {
+        if (settings->format != BM_JMON_FORMAT && settings->format != BM_APPLE2_FORMAT) {
+            fprintf(stderr, "%s: The -x option needs a monitor with a fill command (-j or -2)\n", argv[0]);
+            return false;
+        }
+        /* Automatic: shortest run that costs more to send than a fill command. */
+        if (job->minRun == 0)
+            job->minRun = bmFillCommandCost(settings->format) / 3 + 1;
+        settings->minRun = job->minRun;
+    }
+
+    return true;
+}
+
+/*
+ * Read an input's map file, if it has one, and look up its load
+ * address and, if the run address option was given for this input,
+ * the run address. Returns false after reporting an error.
+ */
+bool resolveAddresses(struct job *job, int index, int *loadAddress, FILE *log)
+{
+    const struct jobInput *in = &job->inputs[index];
+    struct bmSymbolTable symbols = { NULL, 0 };
+    bool ok = true;
+
+    if (in->mapName != NULL && !bmReadMapFile(&symbols, in->mapName, log, job->prefix))
+        return false;
+    if ((in->loadName != NULL && !bmLookupAddress(&symbols, in->loadName, loadAddress, log, job->prefix)) ||
+        (job->runName != NULL && job->runInput == index &&
+         !bmLookupAddress(&symbols, job->runName, &job->settings.runAddress, log, job->prefix)))
+        ok = false;
+    bmFreeSymbols(&symbols);
+    return ok;
+}
+
+/*
+ * Open an input file and find the data in it. With -f the load address
+ * and length are read from the DOS 3.3 header, which is skipped. The
+ * input format is worked out from the contents if it was not given.
+ * Returns false after reporting an error.
+ */
+bool openInputFile(struct job *job, struct jobInput *in, struct inputFile *input, int *loadAddress,
+                   const unsigned char **data, size_t *dataLength, int *length, FILE *log)
+{
+    if (!openInput(in->name, input, log, job->prefix))
+        return false;
+    *data = input->contents;
+    *dataLength = input->length;
+
+    if (in->fromFile) {
+        /* read load address and length from file */
+        if (*dataLength < 4) {
+            fprintf(log, "%s: '%s' is too short to have a load address and length\n", job->prefix, in->name);
+            closeInput(input);
+            return false;
+        }
+        *loadAddress = (*data)[0] + ((*data)[1] << 8);
+        *length = (*data)[2] + ((*data)[3] << 8);
+        *data += 4;
+        *dataLength -= 4;
+    }
+
+    if (in->format == BM_AUTO_INPUT)
+        in->format = bmDetectInputFormat(*data, *dataLength);
+    return true;
+}
+
+/*
+ * Load several input files as one image, the way a linker places
+ * object files. Each file is loaded at its own address and its
+ * segments are added to the loader. Data from one file may not
+ * overlap data from another, as one would overwrite the other on the
+ * target; every overlap is reported. The default run address is the
+ * first file's. Returns false after reporting any errors.
+ */
+bool loadInputs(struct job *job, struct bmLoader *merged, FILE *log)
+{
+    struct inputSpan {
+        struct bmRange range;
+        int input;
+    } *spans = NULL;
+    int numSpans = 0;
+    int overlaps = 0;
+    int farthest = 0;
+
+    for (int i = 0; i < job->numInputs; i++) {
+        struct jobInput *in = &job->inputs[i];
+        struct bmLoader l = { .runAddress = -1 };
+        struct inputFile input = { NULL, 0, false };
+        int loadAddress = job->settings.loadAddress;
+        const unsigned char *data;
+        size_t dataLength, offset = 0;
+        int length = -1;
+        int first = numSpans;
+        bool ok;
+
+        ok = resolveAddresses(job, i, &loadAddress, log) &&
+            openInputFile(job, in, &input, &loadAddress, &data, &dataLength, &length, log);
+        if (ok) {
+            ok = bmParseInput(in->format, data, dataLength, loadAddress, &l, log, job->prefix);
+            closeInput(&input);
+        }
+        if (ok && l.numSegments == 0) {
+            fprintf(log, "%s: No data in '%s'\n", job->prefix, in->name);
+            ok = false;
+        }
+        if (ok) {
+            struct inputSpan *more = realloc(spans, (numSpans + l.numSegments) * sizeof(struct inputSpan));
+            if (more != NULL) {
+                spans = more;
+            } else {
+                fprintf(log, "%s: Out of memory\n", job->prefix);
+                ok = false;
+            }
+        }
+        if (!ok) {
+            free(l.segments);
+            free(l.bytes);
+            free(spans);
+            return false;
+        }
+
+        /* Add the data, and keep a sorted and merged copy of where it goes. */
+        for (int j = 0; j < l.numSegments; j++) {
+            size_t size = l.segments[j].end - l.segments[j].start;
+            if (!bmAddSegmentBytes(merged, l.segments[j].start, l.bytes + offset, size)) {
+                fprintf(log, "%s: Out of memory\n", job->prefix);
+                free(l.segments);
+                free(l.bytes);
+                free(spans);
+                return false;
+            }
+            offset += size;
+        }
+        qsort(l.segments, l.numSegments, sizeof(struct bmRange), bmCompareRanges);
+        for (int j = 0; j < l.numSegments; j++) {
+            if (numSpans > first && l.segments[j].start <= spans[numSpans - 1].range.end) {
+                if (l.segments[j].end > spans[numSpans - 1].range.end)
+                    spans[numSpans - 1].range.end = l.segments[j].end;
+            } else {
+                spans[numSpans].range = l.segments[j];
+                spans[numSpans].input = i;
+                numSpans++;
+            }
+        }
+        if (i == 0)
+            merged->runAddress = l.runAddress != -1 ? l.runAddress : spans[0].range.start;
+        if (job->verbose) {
+            fprintf(log, "Input '%s' (%s): ", in->name, inputFormatNames[in->format]);
+            for (int j = first; j < numSpans; j++)
+                fprintf(log, "%s$%04X-$%04X", j == first ? "" : ", ", spans[j].range.start, spans[j].range.end - 1);
+            fprintf(log, " (%zu bytes)\n", l.numBytes);
+        }
+        free(l.segments);
+        free(l.bytes);
+    }
+
+    /*
+     * Sort the spans from all the files. Those from one file don't
+     * overlap each other, so any span that starts before the end of the
+     * one that reaches farthest so far overlaps another file's data.
+     */
+    qsort(spans, numSpans, sizeof(struct inputSpan), bmCompareRanges);
+    for (int i = 1; i < numSpans; i++) {
+        const struct inputSpan *a = &spans[farthest], *b = &spans[i];
+        if (b->range.start < a->range.end) {
+            int end = b->range.end < a->range.end ? b->range.end : a->range.end;
+            fprintf(log, "%s: '%s' $%04X-$%04X overlaps '%s' $%04X-$%04X at $%04X-$%04X\n", job->prefix,
+                    job->inputs[b->input].name, b->range.start, b->range.end - 1,
+                    job->inputs[a->input].name, a->range.start, a->range.end - 1, b->range.start, end - 1);
+            overlaps++;
+        }
+        if (b->range.end > a->range.end)
+            farthest = i;
+    }
+    free(spans);
+    return overlaps == 0;
+}
+
+/*
+ * Run a conversion, writing any messages to log. Returns 0 on success
+ * or 1 if there was an error.
+ */
+int runJob(struct job *job, FILE *log)
+{
+    struct bmSettings *settings = &job->settings;
+    struct jobInput *in = &job->inputs[0];
+    struct bmOutput out;
+    struct inputFile input = { NULL, 0, false };
+    int length = -1;
+    int address;
+    const unsigned char *data;
+    size_t dataLength;
+    int fd = STDOUT_FILENO;
+    long changed = 0;
+    struct bmCompression compression;
+    double uncompressedTime = 0;
+    int segments = 0;
+    long segmentBytes = 0;
+    long highest;
+    long *blockOffsets = NULL;
+    long samples = 0;
+    int status = 0;
+    struct bmLoader loader = { .runAddress = -1 };
+
+    if (job->numInputs > 1) {
+        /* Several files: load them all as segments of one image. */
+        if (!loadInputs(job, &loader, log)) {
+            free(loader.segments);
+            free(loader.bytes);
+            return 1;
+        }
+        data = NULL;
+        dataLength = 0;
+    } else {
+        if (!resolveAddresses(job, 0, &settings->loadAddress, log))
+            return 1;
+        if (!openInputFile(job, in, &input, &settings->loadAddress, &data, &dataLength, &length, log))
+            return 1;
+        if (in->format != BM_BINARY_INPUT &&
+            !bmParseInput(in->format, data, dataLength, settings->loadAddress, &loader, log, job->prefix)) {
+            free(loader.segments);
+            free(loader.bytes);
+            closeInput(&input);
+            return 1;
+        }
+    }
+
+    if (job->numInputs > 1 || in->format != BM_BINARY_INPUT) {
+        /* The files give the addresses: load the segments into an image. */
+        unsigned char *image = NULL;
+        struct bmRange *ranges;
+        int numRanges;
+        bool ok = true;
+
+        if (loader.numSegments == 0) {
+            fprintf(log, "%s: No data in '%s'\n", job->prefix, in->name);
+            ok = false;
+        }
+        if (ok)
+            ok = bmBuildImage(&loader, &image, &dataLength, &settings->loadAddress, &ranges, &numRanges, log,
+                              job->prefix);
+        free(loader.segments);
+        free(loader.bytes);
+        replaceInput(&input, image, dataLength);
+        data = image;
+        if (!ok) {
+            closeInput(&input);
+            return 1;
+        }
+
+        /* Only output what the files load, restricted to any -a ranges. */
+        if (settings->numRanges != 0) {
+            struct bmRange *wanted;
+            qsort(settings->ranges, settings->numRanges, sizeof(struct bmRange), bmCompareRanges);
+            ok = bmIntersectRanges(ranges, numRanges, settings->ranges, settings->numRanges, &wanted,
+                                   &settings->numRanges);
+            free(ranges);
+            if (!ok) {
+                fprintf(log, "%s: Out of memory\n", job->prefix);
+                closeInput(&input);
+                return 1;
+            }
+            free(settings->ranges);
+            settings->ranges = wanted;
+            if (settings->numRanges == 0) {
+                if (job->numInputs > 1)
+                    fprintf(log, "%s: The input files load nothing in the -a address ranges\n", job->prefix);
+                else
+                    fprintf(log, "%s: '%s' loads nothing in the -a address ranges\n", job->prefix, in->name);
+                closeInput(&input);
+                return 1;
+            }
+        } else {
+            settings->ranges = ranges;
+            settings->numRanges = numRanges;
+        }
+        segments = settings->numRanges;
+        for (int i = 0; i < segments; i++)
+            segmentBytes += settings->ranges[i].end - settings->ranges[i].start;
+
+        if (settings->runAddress == -2 && loader.runAddress != -1)
+            settings->runAddress = loader.runAddress;
+
+        if (job->compress && numRanges != 1) {
+            if (job->numInputs > 1)
+                fprintf(log, "%s: The -z option needs a single segment, the input files have %d\n", job->prefix,
+                        numRanges);
+            else
+                fprintf(log, "%s: The -z option needs a single segment, '%s' has %d\n", job->prefix, in->name,
+                        numRanges);
+            closeInput(&input);
+            return 1;
+        }
+    }
+
+
+    /* If not set, run address is load address */
+    if (settings->runAddress == -2)
+        settings->runAddress = settings->loadAddress;
+
+    /* Without -a options, output everything that was read. */
+    if (settings->numRanges == 0) {
+        settings->ranges = malloc(sizeof(struct bmRange));
+        if (settings->ranges == NULL) {
+            fprintf(log, "%s: Out of memory\n", job->prefix);
+            closeInput(&input);
+            return 1;
+        }
+        settings->ranges[0].start = settings->loadAddress;
+        settings->ranges[0].end = settings->loadAddress + dataLength;
+        settings->numRanges = 1;
+    }
+    qsort(settings->ranges, settings->numRanges, sizeof(struct bmRange), bmCompareRanges);
+
+    if (!bmCheckAddresses(settings, dataLength, &highest, log, job->prefix)) {
+        closeInput(&input);
+        return 1;
+    }
+    settings->bankAddresses = highest > 0xffff;
+    if (job->tapeFormat != BM_NO_TAPE && highest > 0xffff) {
+        fprintf(log, "%s: Address $%lX is above $FFFF, which tapes can't load\n", job->prefix, highest);
+        closeInput(&input);
+        return 1;
+    }
+    if (job->blocksName != NULL && highest > 0xffff) {
+        fprintf(log, "%s: Address $%lX is above $FFFF, which --blocks can't check\n", job->prefix, highest);
+        closeInput(&input);
+        return 1;
+    }
+
+    if (job->compress) {
+        struct bmSettings uncompressed = *settings;
+        unsigned char *image;
+        long chars, lines;
+        int longestLine;
+
+        /* Time to send it uncompressed, for comparison. */
+        if (job->autoWidth && settings->format != BM_OSI_FORMAT)
+            uncompressed.bytesPerLine = bmOptimizeLineWidth(settings, &job->profile, data, dataLength);
+        if (uncompressed.bytesPerLine < 0 ||
+            (uncompressed.bytesPerLine > 0 &&
+             !bmCountOutput(&uncompressed, data, dataLength, &chars, &lines, &longestLine))) {
+            fprintf(log, "%s: Out of memory\n", job->prefix);
+            closeInput(&input);
+            return 1;
+        }
+        if (uncompressed.bytesPerLine > 0)
+            uncompressedTime = bmUploadTime(&job->profile, chars, lines);
+        length = -1; // The header length no longer applies
+        if (!bmCompressImage(settings, data, dataLength, &image, &dataLength, &compression, log, job->prefix)) {
+            closeInput(&input);
+            return 1;
+        }
+        replaceInput(&input, image, dataLength);
+        data = image;
+    }
+
+    if (job->baseName != NULL) {
+        struct bmBaseImage base;
+        bool ok;
+
+        if (!bmReadBaseImage(job->baseName, settings->loadAddress, job->numInputs == 1 && in->fromFile, &base, log,
+                             job->prefix)) {
+            closeInput(&input);
+            return 1;
         }
-        if (version == 2) {
-            printf("%04XG\n", runAddress);
+        ok = bmDeltaRanges(settings, data, dataLength, &base, bmMaxDeltaGap(settings->format, &job->profile),
+                           &changed);
+        bmFreeBaseImage(&base);
+        if (!ok) {
+            fprintf(log, "%s: Out of memory\n", job->prefix);
+            closeInput(&input);
+            return 1;
         }
     }
 
-    if (verbose) {
-        fprintf(stderr, "Load address: $%04X\n", loadAddress);
-        if (runAddress != -1)
-            fprintf(stderr, "Run address: $%04X\n", runAddress);
+    if (job->blocksName != NULL && !bmSplitBlocks(settings, dataLength, job->blockSize)) {
+        fprintf(log, "%s: Out of memory\n", job->prefix);
+        closeInput(&input);
+        return 1;
+    }
+
+    if (job->autoWidth && settings->format != BM_OSI_FORMAT) {
+        settings->bytesPerLine = bmOptimizeLineWidth(settings, &job->profile, data, dataLength);
+        if (settings->bytesPerLine < 0) {
+            fprintf(log, "%s: Out of memory\n", job->prefix);
+            closeInput(&input);
+            return 1;
+        }
+        if (settings->bytesPerLine == 0) {
+            fprintf(log, "%s: No line width fits in %d characters\n", job->prefix, job->profile.maxLine);
+            closeInput(&input);
+            return 1;
+        }
+    }
+
+    if (job->outputName != NULL) {
+        fd = open(job->outputName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            fprintf(log, "%s: Unable to create '%s'\n", job->prefix, job->outputName);
+            closeInput(&input);
+            return 1;
+        }
+    }
+    if (job->blocksName != NULL)
+        blockOffsets = malloc((settings->numRanges + 1) * sizeof(long));
+    if (!bmOpenOutput(&out, fd) || (job->blocksName != NULL && blockOffsets == NULL)) {
+        fprintf(log, "%s: Out of memory\n", job->prefix);
+        bmFreeOutput(&out);
+        free(blockOffsets);
+        closeInput(&input);
+        if (job->outputName != NULL) {
+            close(fd);
+            unlink(job->outputName);
+        }
+        return 1;
+    }
+
+    out.countLines = job->tapeFormat == BM_NO_TAPE;
+    out.lineEnd = bmEncoderFor(settings->format)->lineEnd;
+    if (job->blocksName != NULL) {
+        for (int i = 0; i <= settings->numRanges; i++)
+            blockOffsets[i] = -1;
+        out.rangeOffsets = blockOffsets;
+    }
+
+    if (job->tapeFormat != BM_NO_TAPE) {
+        samples = bmWriteTape(&out, job->tapeFormat, job->tapeId, job->sampleRate, settings->loadAddress, data,
+                              dataLength);
+        /* Out of memory: reported, and the partial file removed, as a write error. */
+        if (samples < 0)
+            out.error = ENOMEM;
+        address = settings->loadAddress + dataLength;
+    } else {
+        address = bmConvert(&out, settings, data, dataLength);
+    }
+    out.rangeOffsets = NULL;
+    if (job->blocksName != NULL &&
+        !bmWriteBlockManifest(job->blocksName, settings, data, blockOffsets, log, job->prefix))
+        status = 1;
+    free(blockOffsets);
+    if (out.lineLength > out.longestLine)
+        out.longestLine = out.lineLength;
+
+    if (job->profile.maxLine > 0 && out.longestLine > job->profile.maxLine) {
+        fprintf(log, "%s: Warning: Lines of up to %d characters are longer than the monitor accepts (%d)\n",
+                job->prefix, out.longestLine, job->profile.maxLine);
+    }
+
+    if (job->verbose) {
+        long sent = out.total;
+
+        fprintf(log, "Load address: $%04X\n", settings->loadAddress);
+        if (settings->runAddress != -1)
+            fprintf(log, "Run address: $%04X\n", settings->runAddress);
         else
-            fprintf(stderr, "Run address: none \n");
-        fprintf(stderr, "Last address: $%04X\n", address -1 );
-        if (skipFill) {
-            fprintf(stderr, "Skipping fill character: $%02X\n", fillChar);
+            fprintf(log, "Run address: none \n");
+        fprintf(log, "Last address: $%04X\n", address -1 );
+        if (settings->skipFill) {
+            fprintf(log, "Skipping fill character: $%02X\n", settings->fillChar);
         }
         if (length != -1)
-            fprintf(stderr, "Length (from file): $%04X (%d bytes)\n", length, length);
-        fprintf(stderr, "Length (calculated): $%04X (%d bytes)\n", address - loadAddress, address - loadAddress);
+            fprintf(log, "Length (from file): $%04X (%d bytes)\n", length, length);
+        fprintf(log, "Length (calculated): $%04X (%d bytes)\n", address - settings->loadAddress,
+                address - settings->loadAddress);
+        if (job->numInputs > 1)
+            fprintf(log, "Input files: %d, merged into %d segment%s (%ld bytes)\n", job->numInputs,
+                    segments, segments == 1 ? "" : "s", segmentBytes);
+        else if (segments != 0)
+            fprintf(log, "Input format: %s, %d segment%s (%ld bytes)\n", inputFormatNames[in->format],
+                    segments, segments == 1 ? "" : "s", segmentBytes);
+        if (job->baseName != NULL)
+            fprintf(log, "Changed since base image: %ld bytes in %d ranges\n", changed, settings->numRanges);
+        if (job->autoWidth && settings->format != BM_OSI_FORMAT)
+            fprintf(log, "Bytes per line (fastest upload): %d\n", settings->bytesPerLine);
+        if (job->blocksName != NULL)
+            fprintf(log, "Checksummed blocks: %d of up to %d bytes\n", settings->numRanges, job->blockSize);
+        if (job->tapeFormat == BM_ACI_TAPE) {
+            fprintf(log, "Tape length: %.1f seconds (%ld samples at %d Hz)\n",
+                    (double)samples / job->sampleRate, samples, job->sampleRate);
+            fprintf(log, "To load with the ACI: C100R, then %04X.%04XR\n", settings->loadAddress, address - 1);
+        } else if (job->tapeFormat != BM_NO_TAPE) {
+            fprintf(log, "Tape length: %.1f seconds (%ld samples at %d Hz, %s timing)\n",
+                    (double)samples / job->sampleRate, samples, job->sampleRate,
+                    job->tapeFormat == BM_KIM_FAST_TAPE ? "fast" : "standard");
+            fprintf(log, "To load on the KIM-1: store %02X (or 00) at 17F9, then go to 1873\n", job->tapeId);
+        } else {
+            fprintf(log, "Estimated upload time: %.1f seconds (%ld characters, %ld lines at %ld baud)\n",
+                    bmUploadTime(&job->profile, out.total, out.lines), out.total, out.lines, job->profile.baud);
+        }
+        if (job->compress) {
+            double decompressTime = compression.cycles / 1e6;
+
+            fprintf(log, "Compressed data: $%04X-$%04X (%zu bytes)\n", compression.dataAddress,
+                    compression.dataAddress + (int)compression.packedLength - 1, compression.packedLength);
+            fprintf(log, "Decompressor: $%04X, unpacks to $%04X then runs $%04X\n", compression.stubAddress,
+                    compression.destAddress, compression.runAddress);
+            fprintf(log, "Decompression time: about %.1f seconds at 1 MHz\n", decompressTime);
+            fprintf(log, "Estimated time saved: %.1f seconds\n",
+                    uncompressedTime - bmUploadTime(&job->profile, out.total, out.lines) - decompressTime);
+        }
+        if (settings->minRun > 0) {
+            /* Convert again without fill commands, just counting the output. */
+            struct bmSettings unfilled = *settings;
+
+            out.discard = true;
+            unfilled.minRun = 0;
+            bmConvert(&out, &unfilled, data, dataLength);
+            long unfilledSent = out.total - sent;
+            fprintf(log, "Fill commands used for runs of: %d or more bytes\n", settings->minRun);
+            fprintf(log, "Characters sent: %ld (%ld saved by fill commands)\n", sent, unfilledSent - sent);
+        }
+    }
+
+    if (length != -1 && job->baseName == NULL && address != settings->loadAddress + length) {
+        fprintf(log, "%s: Note: Last address does not match load address + length: $%04X\n", job->prefix,
+                settings->loadAddress + length);
+    }
+
+    bmFreeOutput(&out);
+    closeInput(&input);
+
+    if (out.error != 0) {
+        fprintf(log, "%s: Error writing '%s': %s\n", job->prefix,
+                job->outputName ? job->outputName : "standard output", strerror(out.error));
+    }
+    if (job->outputName != NULL) {
+        if (close(fd) != 0 && out.error == 0) {
+            fprintf(log, "%s: Error writing '%s': %s\n", job->prefix, job->outputName, strerror(errno));
+            out.error = errno;
+        }
+        /* Don't leave a partial file behind to be mistaken for a good one. */
+        if (out.error != 0)
+            unlink(job->outputName);
+    }
+    return out.error != 0 || status != 0;
+}
+
+/* Free what was allocated for a job. */
+void freeJob(struct job *job)
+{
+    free(job->settings.ranges);
+    free(job->inputs);
+    if (job->args != NULL) {
+        for (int i = 0; job->args[i] != NULL; i++)
+            free(job->args[i]);
+        free(job->args);
+    }
+}
+
+/*
+ * Split the next word off a manifest line, as a shell would. Blanks
+ * separate words, except inside single or double quotes, and a
+ * backslash outside single quotes takes the next character as it is.
+ * The word is unquoted in place. *plain is set if its first character
+ * was not quoted, so that ">" and "#" are only special when typed as
+ * they are. Returns NULL at the end of the line, or with *error set if
+ * a quote is not closed.
+ */
+char *nextWord(char **line, bool *plain, bool *error)
+{
+    char *in = *line;
+    char *out, *word;
+    char quote = 0;
+
+    while (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n')
+        in++;
+    if (*in == '\0')
+        return NULL;
+    word = out = in;
+    *plain = *in != '"' && *in != '\'' && *in != '\\';
+    for (; *in != '\0'; in++) {
+        if (quote == 0 && (*in == ' ' || *in == '\t' || *in == '\r' || *in == '\n')) {
+            in++;
+            break;
+        } else if (quote == 0 && (*in == '"' || *in == '\'')) {
+            quote = *in;
+        } else if (*in == quote) {
+            quote = 0;
+        } else if (*in == '\\' && quote != '\'' && in[1] != '\0' && in[1] != '\n') {
+            *out++ = *++in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    *line = in;
+    *error = quote != 0;
+    return word;
+}
+
+/*
+ * Read the jobs from a batch manifest. Each line holds the options and
+ * input file name as they would be given on the command line, then
+ * ">" and the output file name, e.g.
+ *   -v -m wozmon.map -s RESET wozmon.bin > wozmon.mon
+ * Names with spaces can be quoted or have the spaces escaped with a
+ * backslash, as in a shell, e.g.
+ *   -k -l 0x200 "Lunar Lander/lunar.bin" > Lunar\ Lander.ptp
+ * Blank lines and lines starting with # are ignored. Lines with errors
+ * are reported and given a failed status. Returns false, after
+ * reporting an error with prefix, if the manifest could not be read.
+ */
+bool readManifest(const char *filename, struct job **jobs, int *numJobs, const char *prefix)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t size = 0;
+    int lineNumber = 0;
+    bool ok = true;
+
+    if (!strcmp(filename, "-"))
+        file = stdin;
+    else
+        file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: Unable to open manifest '%s'\n", prefix, filename);
+        return false;
+    }
+
+    *jobs = NULL;
+    *numJobs = 0;
+
+    while (ok && getline(&line, &size, file) != -1) {
+        char **args;
+        int argc = 1;
+        char *word;
+        char *rest = line;
+        bool plain, unclosed = false;
+        int redirect = -1;      // Word holding an unquoted ">"
+        const char *outputName = NULL;
+        struct job *job;
+
+        lineNumber++;
+
+        /* Split into words, leaving room for the prefix and a NULL. */
+        args = calloc(strlen(line) / 2 + 3, sizeof(char *));
+        if (args == NULL) {
+            ok = false;
+            break;
+        }
+        while (!unclosed && (word = nextWord(&rest, &plain, &unclosed)) != NULL) {
+            if (argc == 1 && plain && word[0] == '#')
+                break;
+            if (plain && word[0] == '>')
+                redirect = argc;
+            args[argc] = strdup(word);
+            if (args[argc++] == NULL)
+                ok = false;
+        }
+        args[argc] = NULL;
+        if (argc == 1) {
+            free(args);
+            continue;
+        }
+
+        args[0] = malloc(strlen(filename) + 16);
+        if (*numJobs % 64 == 0 && ok) {
+            struct job *more = realloc(*jobs, (*numJobs + 64) * sizeof(struct job));
+            if (more != NULL)
+                *jobs = more;
+            else
+                ok = false;
+        }
+        if (args[0] == NULL || !ok) {
+            for (int i = 0; i < argc; i++)
+                free(args[i]);
+            free(args);
+            ok = false;
+            break;
+        }
+        sprintf(args[0], "%s:%d", filename, lineNumber);
+
+        /* Take the output file from the end: "> file" or ">file". */
+        if (argc >= 3 && redirect == argc - 2 && !strcmp(args[argc - 2], ">")) {
+            outputName = args[argc - 1];
+            argc -= 2;
+        } else if (redirect == argc - 1 && args[argc - 1][1] != '\0') {
+            outputName = args[argc - 1] + 1;
+            argc -= 1;
+        }
+
+        job = &(*jobs)[(*numJobs)++];
+
+        /* getopt() may reorder the words, so parse a copy of the list. */
+        char *argv[argc + 1];
+        memcpy(argv, args, argc * sizeof(char *));
+        argv[argc] = NULL;
 
+        if (!parseOptions(job, argc, argv, false)) {
+            job->status = 1;
+        } else if (unclosed) {
+            fprintf(stderr, "%s: Missing closing quote\n", args[0]);
+            job->status = 1;
+        } else if (outputName == NULL) {
+            fprintf(stderr, "%s: No output file given (use > <OutputFile>)\n", args[0]);
+            job->status = 1;
+        }
+        job->outputName = outputName;
+        job->args = args;
     }
 
-    if (length != -1 && address != loadAddress + length) {
-        fprintf(stderr, "Note: Last address does not match load address + length: $%04X\n", loadAddress + length);
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    if (!ok) {
+        fprintf(stderr, "%s: Out of memory reading manifest '%s'\n", prefix, filename);
+        for (int i = 0; i < *numJobs; i++)
+            freeJob(&(*jobs)[i]);
+        free(*jobs);
+        *jobs = NULL;
+        *numJobs = 0;
     }
+    return ok;
+}
+
+/* Batch mode: the jobs read from the manifest, shared by the worker threads. */
+struct batch {
+    struct job *jobs;
+    int numJobs;
+    int next;               // Next job for a worker to take
+    pthread_mutex_t lock;   // Protects next, and stderr
+};
+
+/*
+ * Worker thread. Takes jobs from the batch until there are none left.
+ * The messages for each job are collected and written out together so
+ * they don't get mixed up with those from other threads.
+ */
+void *worker(void *arg)
+{
+    struct batch *batch = arg;
+
+    for (;;) {
+        struct job *job;
+        char *messages = NULL;
+        size_t size = 0;
+        FILE *log;
+
+        pthread_mutex_lock(&batch->lock);
+        job = batch->next < batch->numJobs ? &batch->jobs[batch->next++] : NULL;
+        pthread_mutex_unlock(&batch->lock);
+        if (job == NULL)
+            break;
+        if (job->status != 0)
+            continue; // Already reported when reading the manifest
+
+        log = open_memstream(&messages, &size);
+        if (log == NULL)
+            log = stderr;
+        if (job->verbose)
+            fprintf(log, "%s: %s -> %s\n", job->prefix, job->inputs[0].name, job->outputName);
+        job->status = runJob(job, log);
+        if (log != stderr) {
+            fclose(log);
+            pthread_mutex_lock(&batch->lock);
+            fputs(messages, stderr);
+            pthread_mutex_unlock(&batch->lock);
+            free(messages);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run all the conversions in a batch manifest on a pool of worker
+ * threads. Returns 0 if they all succeeded, otherwise 1.
+ */
+int runBatch(const struct job *options)
+{
+    struct batch batch;
+    int threads = options->threads;
+    int failed = 0;
+
+    if (!readManifest(options->batchName, &batch.jobs, &batch.numJobs, options->prefix))
+        return 1;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > batch.numJobs)
+        threads = batch.numJobs;
+    if (threads < 1)
+        threads = 1;
+
+    pthread_t tids[threads];
+    int started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, worker, &batch) == 0)
+        started++;
+    /* If no threads could be started, do the work in this one. */
+    if (started == 0)
+        worker(&batch);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&batch.lock);
+
+    for (int i = 0; i < batch.numJobs; i++) {
+        if (batch.jobs[i].status != 0)
+            failed++;
+        freeJob(&batch.jobs[i]);
+    }
+    free(batch.jobs);
+
+    if (options->verbose)
+        fprintf(stderr, "Converted %d of %d files (threads: %d)\n", batch.numJobs - failed, batch.numJobs,
+                started ? started : 1);
+    if (failed != 0)
+        fprintf(stderr, "%s: %d of %d conversions failed\n", options->prefix, failed, batch.numJobs);
+    return failed != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct job job;
+    int status;
+
+    if (!parseOptions(&job, argc, argv, true))
+        exit(EXIT_FAILURE);
+
+    if (job.batchName != NULL)
+        status = runBatch(&job);
+    else
+        status = runJob(&job, stderr);
 
-    return 0;
+    freeJob(&job);
+    return status;
 }
@@ -0,0 +1,2798 @@
+/*
+ * libbintomon: convert memory images to monitor load formats, paper
+ * tape or cassette audio. See libbintomon.h for the interface.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "libbintomon.h"
+
+/* JMON ends its memory write command when Escape is pressed. */
+#define ESC "\x1b"
+
+/* Paper tape records are split at multiples of this address, like srec_cat. */
+#define PTP_CHUNK_SIZE 0x700
+
+/*
+ * Sending a new OSI load address (".AAAA/") costs 6 characters and
+ * each byte skipped saves 3, so skip runs of fill at least this long.
+ */
+#define OSI_MIN_SKIP 3
+
+/* Return if an array of length n contains all fill characters. */
+static bool allFill(const unsigned char bytes[], int n, int fill)
+{
+    for (int i = 0; i < n; i++) {
+        if (bytes[i] != fill)
+            return false;
+    }
+    return true;
+}
+
+/* One row of the hex table: the byte values with high digit d. */
+#define HEX_ROW(d) \
+    { d, '0' }, { d, '1' }, { d, '2' }, { d, '3' }, { d, '4' }, { d, '5' }, { d, '6' }, { d, '7' }, \
+    { d, '8' }, { d, '9' }, { d, 'A' }, { d, 'B' }, { d, 'C' }, { d, 'D' }, { d, 'E' }, { d, 'F' }
+
+/* Two ASCII hex digits for each possible byte value. */
+static const char hexTable[256][2] = {
+    HEX_ROW('0'), HEX_ROW('1'), HEX_ROW('2'), HEX_ROW('3'), HEX_ROW('4'), HEX_ROW('5'), HEX_ROW('6'), HEX_ROW('7'),
+    HEX_ROW('8'), HEX_ROW('9'), HEX_ROW('A'), HEX_ROW('B'), HEX_ROW('C'), HEX_ROW('D'), HEX_ROW('E'), HEX_ROW('F')
+};
+
+/* Set up an output writing to a file descriptor. Returns false if out of memory. */
+bool bmOpenOutput(struct bmOutput *out, int fd)
+{
+    out->buffer = malloc(BM_OUTPUT_BUFFER_SIZE);
+    out->length = 0;
+    out->total = 0;
+    out->discard = false;
+    out->sink = NULL;
+    out->context = NULL;
+    out->fd = fd;
+    out->error = 0;
+    out->countLines = false;
+    out->lineEnd = '\n';
+    out->lines = 0;
+    out->lineLength = 0;
+    out->longestLine = 0;
+    out->bankAddresses = false;
+    out->rangeOffsets = NULL;
+    return out->buffer != NULL;
+}
+
+/*
+ * Set up an output passing each buffer full to a sink function.
+ * Returns false if out of memory.
+ */
+bool bmOpenSinkOutput(struct bmOutput *out, bmOutputSink sink, void *context)
+{
+    bool ok = bmOpenOutput(out, -1);
+
+    out->sink = sink;
+    out->context = context;
+    return ok;
+}
+
+/* Free an output's buffer. Any output not yet flushed is lost. */
+void bmFreeOutput(struct bmOutput *out)
+{
+    free(out->buffer);
+    out->buffer = NULL;
+}
+
+/* A sink that appends the output to a struct bmOutputBuffer. */
+int bmBufferSink(void *context, const char *text, size_t length)
+{
+    struct bmOutputBuffer *b = context;
+
+    if (b->length + length > b->capacity) {
+        size_t capacity = b->capacity ? 2 * b->capacity + length : BM_OUTPUT_BUFFER_SIZE + length;
+        char *data = realloc(b->data, capacity);
+        if (data == NULL)
+            return ENOMEM;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->length, text, length);
+    b->length += length;
+    return 0;
+}
+
+/* Count the lines in the buffered output and find the longest. */
+static void countLines(struct bmOutput *out)
+{
+    const char *p = out->buffer;
+    const char *end = out->buffer + out->length;
+    const char *next;
+
+    while ((next = memchr(p, out->lineEnd, end - p)) != NULL) {
+        int length = out->lineLength + (next - p);
+        if (length > out->longestLine)
+            out->longestLine = length;
+        out->lineLength = 0;
+        out->lines++;
+        p = next + 1;
+    }
+    out->lineLength += end - p;
+}
+
+/*
+ * Write any buffered output, or pass it to the sink. After an error
+ * the rest of the output is discarded and the error is kept to be
+ * reported at the end.
+ */
+void bmFlushOutput(struct bmOutput *out)
+{
+    size_t done = 0;
+
+    out->total += out->length;
+    if (out->countLines)
+        countLines(out);
+    if (out->discard || out->error)
+        done = out->length;
+    if (out->sink != NULL && done < out->length) {
+        out->error = out->sink(out->context, out->buffer, out->length);
+        done = out->length;
+    }
+    while (done < out->length) {
+        ssize_t n = write(out->fd, out->buffer + done, out->length - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            out->error = errno;
+            break;
+        }
+        done += n;
+    }
+    out->length = 0;
+}
+
+/* Return a pointer to room for at least n more bytes of output. */
+static inline char *reserveOutput(struct bmOutput *out, size_t n)
+{
+    if (out->length + n > BM_OUTPUT_BUFFER_SIZE)
+        bmFlushOutput(out);
+    return out->buffer + out->length;
+}
+
+/* Output a string. */
+static void putString(struct bmOutput *out, const char *s)
+{
+    size_t n = strlen(s);
+    char *p = reserveOutput(out, n);
+
+    memcpy(p, s, n);
+    out->length += n;
+}
+
+/*
+ * Output an address as four hex digits, or as a 65816 bank and address
+ * "BB/AAAA", as used by the Apple IIgs monitor. Once any address is
+ * above $FFFF all of them have a bank, so none depends on the bank
+ * the monitor was left in.
+ */
+static void putAddress(struct bmOutput *out, int address)
+{
+    char *p = reserveOutput(out, 7);
+
+    if (out->bankAddresses || address > 0xffff) {
+        p[0] = hexTable[(address >> 16) & 0xff][0];
+        p[1] = hexTable[(address >> 16) & 0xff][1];
+        p[2] = '/';
+        p += 3;
+        out->length += 3;
+    }
+    p[0] = hexTable[(address >> 8) & 0xff][0];
+    p[1] = hexTable[(address >> 8) & 0xff][1];
+    p[2] = hexTable[address & 0xff][0];
+    p[3] = hexTable[address & 0xff][1];
+    out->length += 4;
+}
+
+/* Output a byte as two hex digits. */
+static void putHexByte(struct bmOutput *out, unsigned char b)
+{
+    char *p = reserveOutput(out, 2);
+
+    p[0] = hexTable[b][0];
+    p[1] = hexTable[b][1];
+    out->length += 2;
+}
+
+/* Output n bytes of data, each as a space followed by two hex digits. */
+static void putDataBytes(struct bmOutput *out, const unsigned char bytes[], int n)
+{
+    while (n > 0) {
+        /* Limit each chunk so it always fits in an empty buffer. */
+        int count = n < BM_OUTPUT_BUFFER_SIZE / 3 ? n : BM_OUTPUT_BUFFER_SIZE / 3;
+        char *p = reserveOutput(out, 3 * count);
+
+        for (int i = 0; i < count; i++) {
+            p[0] = ' ';
+            p[1] = hexTable[bytes[i]][0];
+            p[2] = hexTable[bytes[i]][1];
+            p += 3;
+        }
+        out->length += 3 * count;
+        bytes += count;
+        n -= count;
+    }
+}
+
+/*
+ * Output one MOS Technology paper tape data record:
+ * ";" length (1 byte), address (2 bytes), data, then a 16-bit checksum
+ * that is the sum of the length, address and data bytes, all in hex.
+ */
+static void putPtpRecord(struct bmOutput *out, int address, const unsigned char bytes[], int n)
+{
+    unsigned int checksum = n + ((address >> 8) & 0xff) + (address & 0xff);
+    char *p = reserveOutput(out, 2 * n + 12);
+
+    *p++ = ';';
+    p[0] = hexTable[n][0];
+    p[1] = hexTable[n][1];
+    p[2] = hexTable[(address >> 8) & 0xff][0];
+    p[3] = hexTable[(address >> 8) & 0xff][1];
+    p[4] = hexTable[address & 0xff][0];
+    p[5] = hexTable[address & 0xff][1];
+    p += 6;
+    for (int i = 0; i < n; i++) {
+        p[0] = hexTable[bytes[i]][0];
+        p[1] = hexTable[bytes[i]][1];
+        p += 2;
+        checksum += bytes[i];
+    }
+    p[0] = hexTable[(checksum >> 8) & 0xff][0];
+    p[1] = hexTable[(checksum >> 8) & 0xff][1];
+    p[2] = hexTable[checksum & 0xff][0];
+    p[3] = hexTable[checksum & 0xff][1];
+    p[4] = '\n';
+    out->length += 2 * n + 12;
+}
+
+/*
+ * Output the final paper tape record, which has a length of zero and
+ * holds the number of data records in place of the address.
+ */
+static void putPtpEnd(struct bmOutput *out, int records)
+{
+    putString(out, ";00");
+    putAddress(out, records & 0xffff);
+    putAddress(out, ((records >> 8) & 0xff) + (records & 0xff));
+    putString(out, "\n");
+}
+
+/* Output an OSI 65V monitor command to set the load address. */
+static void putOsiAddress(struct bmOutput *out, int address)
+{
+    putString(out, ".");
+    putAddress(out, address);
+    putString(out, "/");
+}
+
+/* Output n bytes of data for the OSI 65V monitor, each as two hex digits and a return. */
+static void putOsiBytes(struct bmOutput *out, const unsigned char bytes[], int n)
+{
+    while (n > 0) {
+        int count = n < BM_OUTPUT_BUFFER_SIZE / 3 ? n : BM_OUTPUT_BUFFER_SIZE / 3;
+        char *p = reserveOutput(out, 3 * count);
+
+        for (int i = 0; i < count; i++) {
+            p[0] = hexTable[bytes[i]][0];
+            p[1] = hexTable[bytes[i]][1];
+            p[2] = '\r';
+            p += 3;
+        }
+        out->length += 3 * count;
+        bytes += count;
+        n -= count;
+    }
+}
+
+/* Return the number of fill characters at the start of an array of length n. */
+static int fillRunLength(const unsigned char bytes[], int n, int fill)
+{
+    int i = 0;
+
+    while (i < n && bytes[i] == fill)
+        i++;
+    return i;
+}
+
+/*
+ * Return the number of bytes at the start of an array of length n
+ * that come before the first run of at least minRun fill characters.
+ */
+static int dataRunLength(const unsigned char bytes[], int n, int fill, int minRun)
+{
+    int run = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (bytes[i] == fill) {
+            if (++run == minRun)
+                return i + 1 - minRun;
+        } else {
+            run = 0;
+        }
+    }
+    return n;
+}
+
+/*
+ * Look for a run of at least minRun copies of the same byte that
+ * starts within the first n bytes of an array. The run may continue
+ * up to limit bytes. Returns true and the offset and length of the
+ * first such run if one is found.
+ */
+static bool findRun(const unsigned char bytes[], int n, int limit, int minRun, int *start, int *length)
+{
+    int i = 0;
+
+    while (i < n) {
+        int j = i + 1;
+        while (j < limit && bytes[j] == bytes[i])
+            j++;
+        if (j - i >= minRun) {
+            *start = i;
+            *length = j - i;
+            return true;
+        }
+        i = j;
+    }
+    return false;
+}
+
+/*
+ * Return the number of characters a monitor fill command costs,
+ * including ending the data before it and re-addressing after it.
+ */
+int bmFillCommandCost(enum bmFormat format)
+{
+    switch (format) {
+    case BM_APPLE2_FORMAT:
+        return 1 + 8 + 16 + 5;  // "\n" "AAAA:XX\n" "BBBB<AAAA.CCCCM\n" "DDDD:"
+    case BM_JMON_FORMAT:
+        return 1 + 15 + 5;      // ESC "F AAAA BBBB XX\n" ":DDDD"
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Output a monitor command to fill length bytes starting at address
+ * with the byte b.
+ */
+static void putFillCommand(struct bmOutput *out, enum bmFormat format, int address, int length, unsigned char b)
+{
+    if (format == BM_JMON_FORMAT) {
+        putString(out, "F ");
+        putAddress(out, address);
+        putString(out, " ");
+        putAddress(out, address + length - 1);
+        putString(out, " ");
+        putHexByte(out, b);
+        putString(out, "\n");
+    } else {
+        /* Store the first byte, then an overlapping move copies it along. */
+        putAddress(out, address);
+        putString(out, ":");
+        putHexByte(out, b);
+        putString(out, "\n");
+        if (length > 1) {
+            putAddress(out, address + 1);
+            putString(out, "<");
+            putAddress(out, address);
+            putString(out, ".");
+            putAddress(out, address + length - 2);
+            putString(out, "M\n");
+        }
+    }
+}
+
+/* Compare ranges by start address for qsort(). */
+int bmCompareRanges(const void *a, const void *b)
+{
+    return ((const struct bmRange *)a)->start - ((const struct bmRange *)b)->start;
+}
+
+/*
+ * Output lines of data for the Woz Monitor, Apple II Monitor or JMON,
+ * from the encoder's address up to end, with data holding the bytes.
+ *
+ * For each line's worth of bytes:
+ *   If the entire line is fill chars
+ *     Skip it and advance address.
+ *     Set flag that we need to print address.
+ *   Else
+ *     If a long run of one byte starts in the line
+ *       Shorten the line to end before it, or if it is at
+ *       the start, output a fill command for it instead.
+ *     Print address if needed.
+ *     Clear print address flag.
+ *     Print the line (or less) of data.
+ */
+static void putLines(struct bmEncoder *e, const unsigned char *data, int end)
+{
+    struct bmOutput *out = e->out;
+    const struct bmSettings *s = e->s;
+    int bytesPerLine = s->bytesPerLine;
+    int start = e->address;
+    int address = e->address;
+
+    while (bytesPerLine > 0 && address < end) {
+        int n = end - address < bytesPerLine ? end - address : bytesPerLine;
+        int bankEnd = (address | 0xffff) + 1;
+        int limit = (end < bankEnd ? end : bankEnd) - address;
+        const unsigned char *bytes = data + (address - start);
+
+        /*
+         * Above $FFFF, start a new line with its bank and address at
+         * each bank boundary rather than relying on the monitor to
+         * carry into the next bank.
+         */
+        if (n > limit)
+            n = limit;
+        if (address > 0xffff && (address & 0xffff) == 0)
+            e->printAddress = true;
+
+        if (s->skipFill && allFill(bytes, n, s->fillChar)) {
+            address += n;
+            e->printAddress = true;
+            continue;
+        }
+
+        if (s->minRun > 0) {
+            int runStart, runLength;
+
+            if (findRun(bytes, n, limit, s->minRun, &runStart, &runLength)) {
+                if (runStart > 0) {
+                    n = runStart;
+                } else {
+                    if (e->inWrite)
+                        putString(out, ESC);
+                    else if (e->lineOpen)
+                        putString(out, "\n");
+                    e->inWrite = false;
+                    e->lineOpen = false;
+                    e->continuing = false;
+                    putFillCommand(out, s->format, address, runLength, bytes[0]);
+                    address += runLength;
+                    e->printAddress = true;
+                    continue;
+                }
+            }
+        }
+
+        if (s->format == BM_JMON_FORMAT) {
+            if (e->printAddress) {
+                if (e->inWrite)
+                    putString(out, ESC);
+                putString(out, ":");
+                putAddress(out, address);
+                e->inWrite = true;
+            }
+            e->printAddress = false;
+            putDataBytes(out, bytes, n);
+            address += n;
+            if (n == bytesPerLine)
+                putString(out, "\n");
+            continue;
+        }
+
+        /*
+         * The ":" that continues a full line is only written once more
+         * data follows on, so that none is left on a line of its own
+         * when the next data needs its own address.
+         */
+        if (e->printAddress) {
+            if (e->lineOpen)
+                putString(out, "\n");
+            putAddress(out, address);
+            putString(out, ":");
+        } else if (e->continuing) {
+            putString(out, ":");
+        }
+        e->printAddress = false;
+        e->continuing = false;
+        putDataBytes(out, bytes, n);
+        address += n;
+        e->lineOpen = true;
+        if (n == bytesPerLine) {
+            putString(out, "\n");
+            e->lineOpen = false;
+            e->continuing = true;
+        }
+    }
+    e->address = address;
+}
+
+/* End Woz Monitor or Apple II Monitor output with the run command. */
+static void putMonitorEnd(struct bmEncoder *e)
+{
+    struct bmOutput *out = e->out;
+    const struct bmSettings *s = e->s;
+
+    /*
+     * Data ending with a full line still ends with an empty ":" line,
+     * as it always has, unless fill was skipped after it.
+     */
+    if (!e->continuing)
+        putString(out, "\n");
+    else if (!e->printAddress)
+        putString(out, ":\n");
+    if (out->rangeOffsets != NULL)
+        out->rangeOffsets[s->numRanges] = out->total + out->length;
+
+    // Add run address
+    if (s->runAddress != -1) {
+        putAddress(out, s->runAddress);
+        if (s->format == BM_APPLE1_FORMAT) {
+            putString(out, "R\n");
+        }
+        if (s->format == BM_APPLE2_FORMAT) {
+            putString(out, "G\n");
+        }
+    }
+}
+
+/* End JMON output: leave the memory write command and go. */
+static void putJmonEnd(struct bmEncoder *e)
+{
+    if (e->inWrite)
+        putString(e->out, ESC);
+
+    // Add go command
+    if (e->s->runAddress != -1) {
+        putString(e->out, "G");
+        putAddress(e->out, e->s->runAddress);
+    }
+}
+
+/* Output paper tape records, skipping any that are all fill. */
+static void putPtpRecords(struct bmEncoder *e, const unsigned char *data, int end)
+{
+    const struct bmSettings *s = e->s;
+    int start = e->address;
+    int address = e->address;
+
+    while (s->bytesPerLine > 0 && address < end) {
+        int n = end - address < s->bytesPerLine ? end - address : s->bytesPerLine;
+        const unsigned char *bytes = data + (address - start);
+
+        /*
+         * srec_cat never lets a paper tape record cross a multiple
+         * of $700 bytes (the size of its internal memory chunks), so
+         * do the same in order to produce identical output.
+         */
+        int chunkEnd = (address / PTP_CHUNK_SIZE + 1) * PTP_CHUNK_SIZE;
+        if (address + n > chunkEnd)
+            n = chunkEnd - address;
+
+        if (s->skipFill && allFill(bytes, n, s->fillChar)) {
+            address += n;
+            e->printAddress = true;
+            continue;
+        }
+
+        putPtpRecord(e->out, address, bytes, n);
+        e->records++;
+        address += n;
+    }
+    e->address = address;
+}
+
+static void putPtpEndRecord(struct bmEncoder *e)
+{
+    putPtpEnd(e->out, e->records);
+}
+
+/*
+ * Output data for the OSI 65V monitor. There are no lines, so with -c
+ * any run of fill long enough is skipped by sending a new address.
+ */
+static void putOsiData(struct bmEncoder *e, const unsigned char *data, int end)
+{
+    const struct bmSettings *s = e->s;
+    int start = e->address;
+    int address = e->address;
+
+    while (address < end) {
+        const unsigned char *bytes = data + (address - start);
+        int n = end - address;
+
+        if (s->skipFill) {
+            int run = fillRunLength(bytes, n, s->fillChar);
+            if (run >= OSI_MIN_SKIP) {
+                address += run;
+                e->printAddress = true;
+                continue;
+            }
+            n = dataRunLength(bytes, n, s->fillChar, OSI_MIN_SKIP);
+        }
+        if (e->printAddress) {
+            putOsiAddress(e->out, address);
+            e->printAddress = false;
+        }
+        putOsiBytes(e->out, bytes, n);
+        address += n;
+    }
+    e->address = address;
+}
+
+/* End OSI output with the go command. */
+static void putOsiEnd(struct bmEncoder *e)
+{
+    if (e->s->runAddress != -1) {
+        putString(e->out, ".");
+        putAddress(e->out, e->s->runAddress);
+        putString(e->out, "G\r");
+    }
+}
+
+static const struct bmEncoderType encoderTypes[] = {
+    [BM_APPLE1_FORMAT] = { "apple1", '\n', 8, putLines, putMonitorEnd },
+    [BM_APPLE2_FORMAT] = { "apple2", '\n', 8, putLines, putMonitorEnd },
+    [BM_JMON_FORMAT] = { "jmon", '\n', 8, putLines, putJmonEnd },
+    [BM_KIM1_FORMAT] = { "ptp", '\n', 24, putPtpRecords, putPtpEndRecord },
+    [BM_OSI_FORMAT] = { "osi", '\r', 8, putOsiData, putOsiEnd }
+};
+
+/* Return the encoder type for an output format. */
+const struct bmEncoderType *bmEncoderFor(enum bmFormat format)
+{
+    return &encoderTypes[format];
+}
+
+/* Start a conversion to out with the given settings. */
+void bmBeginEncoder(struct bmEncoder *e, struct bmOutput *out, const struct bmSettings *s)
+{
+    e->type = bmEncoderFor(s->format);
+    e->out = out;
+    e->s = s;
+    e->address = s->loadAddress;
+    e->printAddress = true;
+    e->lineOpen = false;
+    e->continuing = false;
+    e->inWrite = false;
+    e->records = 0;
+    out->bankAddresses = s->bankAddresses;
+}
+
+/*
+ * Make the next data start a new line with its address, even if it
+ * follows on from the last.
+ */
+static void breakLine(struct bmEncoder *e)
+{
+    if (e->lineOpen)
+        putString(e->out, "\n");
+    e->lineOpen = false;
+    e->continuing = false;
+    e->printAddress = true;
+}
+
+/* Output n bytes of data loaded at address. */
+void bmEncodeSegment(struct bmEncoder *e, int address, const unsigned char *data, size_t n)
+{
+    int end = address + n;
+
+    if (address < e->address) {
+        data += e->address - address; // Overlaps the previous data
+        address = e->address;
+    }
+    if (address >= end)
+        return;
+    if (address != e->address) {
+        e->address = address;
+        e->printAddress = true;
+    }
+    e->type->putData(e, data, end);
+}
+
+/*
+ * Finish a conversion with the run command, if any, and flush the
+ * output. Returns the address following the last byte converted.
+ */
+int bmEndEncoder(struct bmEncoder *e)
+{
+    e->type->putEnd(e);
+    bmFlushOutput(e->out);
+    return e->address;
+}
+
+/*
+ * Convert data loaded at the load address to the output format, only
+ * sending the data in the settings' address ranges. Returns the
+ * address following the last byte converted.
+ */
+int bmConvert(struct bmOutput *out, const struct bmSettings *s, const unsigned char *data, size_t dataLength)
+{
+    struct bmEncoder e;
+
+    bmBeginEncoder(&e, out, s);
+
+    // For each address range:
+    //   Clip it to the data that was read.
+    //   Encode that part of the data.
+
+    for (int r = 0; r < s->numRanges; r++) {
+        int start = s->ranges[r].start;
+        int end = s->ranges[r].end;
+
+        if (start < s->loadAddress)
+            start = s->loadAddress;
+        if (end > s->loadAddress + (int)dataLength)
+            end = s->loadAddress + dataLength;
+        if (start < e.address)
+            start = e.address; // Overlaps the previous range
+        if (start >= end)
+            continue;
+
+        /* For a block manifest, each range starts its own line. */
+        if (out->rangeOffsets != NULL) {
+            breakLine(&e);
+            out->rangeOffsets[r] = out->total + out->length;
+        }
+        bmEncodeSegment(&e, start, data + (start - s->loadAddress), end - start);
+    }
+
+    return bmEndEncoder(&e);
+}
+
+/*
+ * Convert a list of segments, each with its own address and data, in
+ * ascending address order. The load address and ranges in the
+ * settings are not used. Returns the address following the last byte
+ * converted.
+ */
+int bmConvertSegments(struct bmOutput *out, const struct bmSettings *s, const struct bmSegment *segments,
+                      int numSegments)
+{
+    struct bmSettings t = *s;
+    struct bmEncoder e;
+
+    t.loadAddress = numSegments > 0 ? segments[0].address : 0;
+    t.ranges = NULL;
+    t.numRanges = 0;
+    bmBeginEncoder(&e, out, &t);
+    for (int i = 0; i < numSegments; i++)
+        bmEncodeSegment(&e, segments[i].address, segments[i].data, segments[i].length);
+    return bmEndEncoder(&e);
+}
+
+/*
+ * Convert without writing any output, just counting the characters and
+ * lines that would be sent and finding the longest line. Returns false
+ * if out of memory.
+ */
+bool bmCountOutput(const struct bmSettings *s, const unsigned char *data, size_t dataLength, long *chars, long *lines,
+                   int *longestLine)
+{
+    struct bmOutput out;
+
+    if (!bmOpenOutput(&out, -1))
+        return false;
+    out.discard = true;
+    out.countLines = true;
+    out.lineEnd = bmEncoderFor(s->format)->lineEnd;
+    bmConvert(&out, s, data, dataLength);
+    *chars = out.total;
+    *lines = out.lines;
+    *longestLine = out.lineLength > out.longestLine ? out.lineLength : out.longestLine;
+    bmFreeOutput(&out);
+    return true;
+}
+
+/*
+ * Return the checksum of a block for bintomon --blocks and sendmon -k:
+ * a Fletcher-style pair of 8-bit sums, the sum of the bytes in the low
+ * byte and the sum of those running sums in the high byte. Unlike a
+ * plain sum it changes when bytes are dropped or moved, and the 6502
+ * routine in sendmon that checks it on the target is only 38 bytes
+ * (36 for the Apple II).
+ */
+unsigned int bmBlockChecksum(const unsigned char *bytes, int n)
+{
+    unsigned int s1 = 0, s2 = 0;
+
+    for (int i = 0; i < n; i++) {
+        s1 = (s1 + bytes[i]) & 0xff;
+        s2 = (s2 + s1) & 0xff;
+    }
+    return (s2 << 8) | s1;
+}
+
+/*
+ * Compressed uploads (-z). The image is compressed on the host and
+ * sent together with a small 6502 decompressor, which is run instead
+ * of the program. It unpacks the data to the load address and jumps
+ * to the real run address.
+ *
+ * The compressed data is a series of tokens, each starting with a
+ * byte t:
+ *   t = $00         end of data
+ *   t = $01-$7F     t literal bytes follow
+ *   t = $80-$BF     copy (t & $3F) + 3 bytes from up to 256 bytes back,
+ *                   given by one byte holding the distance - 1
+ *   t = $C0-$FF     copy (t & $3F) + 4 bytes from up to 65535 bytes
+ *                   back, given by a 16-bit distance (low byte first)
+ * A copy may overlap the bytes it produces, so a run of one byte costs
+ * two bytes. Everything is byte aligned, which keeps the decompressor
+ * short and fast on a 6502 (roughly 56 cycles per literal byte and 44
+ * per copied byte).
+ */
+
+#define LZ_SHORT_MIN 3
+#define LZ_SHORT_MAX (0x3f + LZ_SHORT_MIN)
+#define LZ_SHORT_DISTANCE 256
+#define LZ_LONG_MIN 4
+#define LZ_LONG_MAX (0x3f + LZ_LONG_MIN)
+#define LZ_MAX_LITERALS 0x7f
+#define LZ_HASH_SIZE 65536
+#define LZ_MAX_CHAIN 256
+
+/*
+ * The decompressor. It uses zero page $F0-$F7 for the source,
+ * destination, copy source and distance. It is assembled for address 0
+ * and the absolute addresses are relocated when it is placed in memory.
+ */
+static const unsigned char lzStub[] = {
+    0xA9, 0x00,         // 00        LDA #<DATA
+    0x85, 0xF0,         // 02        STA SRC
+    0xA9, 0x00,         // 04        LDA #>DATA
+    0x85, 0xF1,         // 06        STA SRC+1
+    0xA9, 0x00,         // 08        LDA #<DEST
+    0x85, 0xF2,         // 0A        STA DST
+    0xA9, 0x00,         // 0C        LDA #>DEST
+    0x85, 0xF3,         // 0E        STA DST+1
+    0xA0, 0x00,         // 10        LDY #0
+    0x20, 0x59, 0x00,   // 12 TOKEN  JSR GETSRC
+    0xAA,               // 15        TAX
+    0xF0, 0x53,         // 16        BEQ DONE
+    0x30, 0x0B,         // 18        BMI MATCH
+    0x20, 0x59, 0x00,   // 1A LIT    JSR GETSRC
+    0x20, 0x62, 0x00,   // 1D        JSR PUTDST
+    0xCA,               // 20        DEX
+    0xD0, 0xF7,         // 21        BNE LIT
+    0xF0, 0xED,         // 23        BEQ TOKEN
+    0x8A,               // 25 MATCH  TXA
+    0xC9, 0xC0,         // 26        CMP #$C0      ; C set for a long distance
+    0x08,               // 28        PHP
+    0x29, 0x3F,         // 29        AND #$3F
+    0x69, 0x03,         // 2B        ADC #3        ; + 1 more if long
+    0xAA,               // 2D        TAX
+    0x20, 0x59, 0x00,   // 2E        JSR GETSRC
+    0x85, 0xF6,         // 31        STA DIST
+    0xA9, 0x00,         // 33        LDA #0
+    0x28,               // 35        PLP
+    0x90, 0x03,         // 36        BCC SHORT
+    0x20, 0x59, 0x00,   // 38        JSR GETSRC
+    0x85, 0xF7,         // 3B SHORT  STA DIST+1
+    0xA5, 0xF2,         // 3D        LDA DST       ; C clear subtracts 1 more if short
+    0xE5, 0xF6,         // 3F        SBC DIST
+    0x85, 0xF4,         // 41        STA COPY
+    0xA5, 0xF3,         // 43        LDA DST+1
+    0xE5, 0xF7,         // 45        SBC DIST+1
+    0x85, 0xF5,         // 47        STA COPY+1
+    0xB1, 0xF4,         // 49 LOOP   LDA (COPY),Y
+    0x20, 0x62, 0x00,   // 4B        JSR PUTDST
+    0xE6, 0xF4,         // 4E        INC COPY
+    0xD0, 0x02,         // 50        BNE *+4
+    0xE6, 0xF5,         // 52        INC COPY+1
+    0xCA,               // 54        DEX
+    0xD0, 0xF2,         // 55        BNE LOOP
+    0xF0, 0xB9,         // 57        BEQ TOKEN
+    0xB1, 0xF0,         // 59 GETSRC LDA (SRC),Y
+    0xE6, 0xF0,         // 5B        INC SRC
+    0xD0, 0x02,         // 5D        BNE *+4
+    0xE6, 0xF1,         // 5F        INC SRC+1
+    0x60,               // 61        RTS
+    0x91, 0xF2,         // 62 PUTDST STA (DST),Y
+    0xE6, 0xF2,         // 64        INC DST
+    0xD0, 0x02,         // 66        BNE *+4
+    0xE6, 0xF3,         // 68        INC DST+1
+    0x60,               // 6A        RTS
+    0x4C, 0x00, 0x00    // 6B DONE   JMP RUN
+};
+
+/* Offsets of the absolute addresses (JSR operands) in the decompressor. */
+static const int lzStubRelocations[] = { 0x13, 0x1B, 0x1E, 0x2F, 0x39, 0x4C };
+
+/* Offsets of the data, destination and run address in the decompressor. */
+#define LZ_STUB_DATA 0x01
+#define LZ_STUB_DEST 0x09
+#define LZ_STUB_RUN 0x6C
+
+/* Return a hash of the LZ_SHORT_MIN bytes at p. */
+static inline unsigned int lzHash(const unsigned char *p)
+{
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (LZ_HASH_SIZE - 1);
+}
+
+/*
+ * Compress data. Matches are found with hash chains, keeping the
+ * longest within reach of a short copy as well as the longest overall.
+ * Then the cheapest way to code the whole image is found working back
+ * from the end: at each position a literal run, or a short or long
+ * copy of any usable length. Returns a malloc()ed buffer and sets
+ * *packedLength, or NULL if out of memory.
+ */
+static unsigned char *lzCompress(const unsigned char *data, size_t n, size_t *packedLength)
+{
+    int *head = malloc(LZ_HASH_SIZE * sizeof(int));
+    int *prev = malloc((n + 1) * sizeof(int));
+    int *shortLength = malloc((n + 1) * sizeof(int));
+    int *shortDistance = malloc((n + 1) * sizeof(int));
+    int *longLength = malloc((n + 1) * sizeof(int));
+    int *longDistance = malloc((n + 1) * sizeof(int));
+    long *cost = malloc((n + 1) * sizeof(long));
+    int *step = malloc((n + 1) * sizeof(int));  // Literal count (< 0), or copy length
+    bool *isShort = malloc((n + 1) * sizeof(bool));
+    unsigned char *packed = malloc(n + n / LZ_MAX_LITERALS + 2);
+    size_t out = 0;
+
+    if (head == NULL || prev == NULL || shortLength == NULL || shortDistance == NULL || longLength == NULL ||
+        longDistance == NULL || cost == NULL || step == NULL || isShort == NULL || packed == NULL) {
+        free(packed);
+        packed = NULL;
+        goto done;
+    }
+
+    /* Find the longest earlier matches at each position. */
+    for (int i = 0; i < LZ_HASH_SIZE; i++)
+        head[i] = -1;
+    for (size_t i = 0; i < n; i++) {
+        shortLength[i] = longLength[i] = 0;
+        shortDistance[i] = longDistance[i] = 0;
+        if (i + LZ_SHORT_MIN > n) {
+            prev[i] = -1;
+            continue;
+        }
+        unsigned int h = lzHash(data + i);
+        int limit = n - i < LZ_LONG_MAX ? n - i : LZ_LONG_MAX;
+        int chain = 0;
+        for (int j = head[h]; j >= 0 && chain < LZ_MAX_CHAIN && (int)i - j <= 0xffff; j = prev[j], chain++) {
+            int length = 0;
+            while (length < limit && data[j + length] == data[i + length])
+                length++;
+            if (i - j <= LZ_SHORT_DISTANCE && length > shortLength[i]) {
+                shortLength[i] = length < LZ_SHORT_MAX ? length : LZ_SHORT_MAX;
+                shortDistance[i] = i - j;
+            }
+            if (length > longLength[i]) {
+                longLength[i] = length;
+                longDistance[i] = i - j;
+                if (length == limit)
+                    break;
+            }
+        }
+        prev[i] = head[h];
+        head[h] = i;
+    }
+
+    /* Cheapest coding from each position to the end, including the end marker. */
+    cost[n] = 1;
+    for (long i = n - 1; i >= 0; i--) {
+        cost[i] = -1;
+        for (int k = 1; k <= LZ_MAX_LITERALS && i + k <= (long)n; k++) {
+            long c = 1 + k + cost[i + k];
+            if (cost[i] < 0 || c < cost[i]) {
+                cost[i] = c;
+                step[i] = -k;
+            }
+        }
+        for (int length = LZ_SHORT_MIN; length <= shortLength[i]; length++) {
+            long c = 2 + cost[i + length];
+            if (c < cost[i]) {
+                cost[i] = c;
+                step[i] = length;
+                isShort[i] = true;
+            }
+        }
+        for (int length = LZ_LONG_MIN; length <= longLength[i]; length++) {
+            long c = 3 + cost[i + length];
+            if (c < cost[i]) {
+                cost[i] = c;
+                step[i] = length;
+                isShort[i] = false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; ) {
+        if (step[i] < 0) {
+            packed[out++] = -step[i];
+            memcpy(packed + out, data + i, -step[i]);
+            out += -step[i];
+            i += -step[i];
+        } else if (isShort[i]) {
+            packed[out++] = 0x80 | (step[i] - LZ_SHORT_MIN);
+            packed[out++] = shortDistance[i] - 1;
+            i += step[i];
+        } else {
+            packed[out++] = 0xc0 | (step[i] - LZ_LONG_MIN);
+            packed[out++] = longDistance[i] & 0xff;
+            packed[out++] = longDistance[i] >> 8;
+            i += step[i];
+        }
+    }
+    packed[out++] = 0x00;
+    *packedLength = out;
+
+done:
+    free(head);
+    free(prev);
+    free(shortLength);
+    free(shortDistance);
+    free(longLength);
+    free(longDistance);
+    free(cost);
+    free(step);
+    free(isShort);
+    return packed;
+}
+
+/*
+ * Return how far past the destination the compressed data has to
+ * start so that decompressing in place never writes over compressed
+ * bytes that have not been read yet. Also counts the approximate
+ * cycles the decompressor takes.
+ */
+static int lzInPlaceMargin(const unsigned char *packed, long *cycles)
+{
+    long read = 0;
+    long written = 0;
+    long margin = 0;
+
+    *cycles = 30;
+    for (;;) {
+        int t = packed[read++];
+
+        if (t == 0)
+            break;
+        if (t < 0x80) {
+            read += t;
+            written += t;
+            *cycles += 34 + 56 * t;
+        } else if (t < 0xc0) {
+            read += 1;
+            written += (t & 0x3f) + LZ_SHORT_MIN;
+            *cycles += 105 + 44 * ((t & 0x3f) + LZ_SHORT_MIN);
+        } else {
+            read += 2;
+            written += (t & 0x3f) + LZ_LONG_MIN;
+            *cycles += 130 + 44 * ((t & 0x3f) + LZ_LONG_MIN);
+        }
+        if (written - read > margin)
+            margin = written - read;
+    }
+    /* The end marker must not be overwritten either. */
+    if (written - read + 1 > margin)
+        margin = written - read + 1;
+    return margin;
+}
+
+/*
+ * Make a new malloc()ed image of the compressed data followed by the
+ * decompressor, and set the load and run addresses to match. Returns
+ * false, after writing an error to log, if it can't be done.
+ */
+bool bmCompressImage(struct bmSettings *s, const unsigned char *data, size_t dataLength, unsigned char **compressed,
+                     size_t *compressedLength, struct bmCompression *c, FILE *log, const char *prefix)
+{
+    int dest = s->loadAddress;
+    int end = s->loadAddress + dataLength;
+    unsigned char *packed;
+    unsigned char *image;
+    unsigned char *stub;
+
+    if (s->runAddress == -1) {
+        fprintf(log, "%s: The -z option needs a run address to start the program after unpacking it\n", prefix);
+        return false;
+    }
+    if (dest < 0x200) {
+        fprintf(log, "%s: The -z option can't unpack into zero page or the stack\n", prefix);
+        return false;
+    }
+
+    c->destAddress = dest;
+    c->runAddress = s->runAddress;
+    packed = lzCompress(data, dataLength, &c->packedLength);
+    if (packed == NULL) {
+        fprintf(log, "%s: Out of memory\n", prefix);
+        return false;
+    }
+    c->dataAddress = dest + lzInPlaceMargin(packed, &c->cycles);
+    c->stubAddress = c->dataAddress + c->packedLength;
+    if (c->stubAddress < end)
+        c->stubAddress = end;
+    if (c->stubAddress + (int)sizeof(lzStub) > 0x10000) {
+        fprintf(log, "%s: No room for the compressed data and decompressor below $10000\n", prefix);
+        free(packed);
+        return false;
+    }
+
+    image = malloc(c->stubAddress - c->dataAddress + sizeof(lzStub));
+    if (image == NULL) {
+        fprintf(log, "%s: Out of memory\n", prefix);
+        free(packed);
+        return false;
+    }
+    memcpy(image, packed, c->packedLength);
+    memset(image + c->packedLength, 0, c->stubAddress - c->dataAddress - c->packedLength);
+    stub = image + (c->stubAddress - c->dataAddress);
+    memcpy(stub, lzStub, sizeof(lzStub));
+    for (size_t i = 0; i < sizeof(lzStubRelocations) / sizeof(lzStubRelocations[0]); i++) {
+        int address = c->stubAddress + stub[lzStubRelocations[i]] + (stub[lzStubRelocations[i] + 1] << 8);
+        stub[lzStubRelocations[i]] = address & 0xff;
+        stub[lzStubRelocations[i] + 1] = address >> 8;
+    }
+    stub[LZ_STUB_DATA] = c->dataAddress & 0xff;
+    stub[LZ_STUB_DATA + 4] = c->dataAddress >> 8;
+    stub[LZ_STUB_DEST] = dest & 0xff;
+    stub[LZ_STUB_DEST + 4] = dest >> 8;
+    stub[LZ_STUB_RUN] = s->runAddress & 0xff;
+    stub[LZ_STUB_RUN + 1] = s->runAddress >> 8;
+
+    free(packed);
+    *compressed = image;
+    *compressedLength = c->stubAddress - c->dataAddress + sizeof(lzStub);
+    s->loadAddress = c->dataAddress;
+    s->runAddress = c->stubAddress;
+    s->ranges[0].start = s->loadAddress;
+    s->ranges[0].end = s->loadAddress + *compressedLength;
+    return true;
+}
+
+/*
+ * Add bytes loaded at an address, extending the last segment if they
+ * follow on from it. Returns false, with nothing added, if out of
+ * memory.
+ */
+bool bmAddSegmentBytes(struct bmLoader *l, long address, const unsigned char *bytes, int n)
+{
+    if (n <= 0)
+        return true;
+    if (l->numSegments == 0 || l->segments[l->numSegments - 1].end != address) {
+        if (l->numSegments % 64 == 0) {
+            struct bmRange *segments = realloc(l->segments, (l->numSegments + 64) * sizeof(struct bmRange));
+
+            if (segments == NULL)
+                return false;
+            l->segments = segments;
+        }
+        l->segments[l->numSegments].start = address;
+        l->segments[l->numSegments].end = address;
+        l->numSegments++;
+    }
+    if (l->numBytes + n > l->capacity) {
+        size_t capacity = l->capacity ? 2 * l->capacity + n : 65536 + n;
+        unsigned char *bytes = realloc(l->bytes, capacity);
+
+        if (bytes == NULL)
+            return false;
+        l->bytes = bytes;
+        l->capacity = capacity;
+    }
+    memcpy(l->bytes + l->numBytes, bytes, n);
+    l->numBytes += n;
+    l->segments[l->numSegments - 1].end += n;
+    return true;
+}
+
+/* Report running out of memory while loading an input file, returning false. */
+static bool outOfMemory(FILE *log, const char *prefix)
+{
+    fprintf(log, "%s: Out of memory\n", prefix);
+    return false;
+}
+
+/* Return the value of a hex digit, or -1 if it is not one. */
+int bmHexDigit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Parse n pairs of hex digits. Returns false if they are not all hex digits. */
+static bool parseHexBytes(const unsigned char *text, int n, unsigned char *bytes)
+{
+    for (int i = 0; i < n; i++) {
+        int hi = bmHexDigit(text[2 * i]);
+        int lo = bmHexDigit(text[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        bytes[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+/* Return the length of a line of text, not counting its end. */
+static size_t lineLength(const unsigned char *text, size_t length)
+{
+    size_t n = 0;
+
+    while (n < length && text[n] != '\n' && text[n] != '\r')
+        n++;
+    return n;
+}
+
+/*
+ * Parse Intel HEX records, ":LLAAAATT<data>CC". Data (type 00) is
+ * placed using the extended segment (02) or linear (04) address, and a
+ * start address (03 or 05) becomes the run address.
+ */
+static bool parseIntelHex(const unsigned char *text, size_t length, struct bmLoader *l, FILE *log, const char *prefix)
+{
+    unsigned char record[5 + 255];
+    long base = 0;
+    int lineNumber = 0;
+
+    for (size_t i = 0; i < length; ) {
+        size_t n = lineLength(text + i, length - i);
+        const unsigned char *line = text + i;
+        int sum = 0;
+
+        i += n + 1;
+        lineNumber++;
+        if (n == 0)
+            continue;
+        if (line[0] != ':' || n < 11 || (n - 1) % 2 != 0 || !parseHexBytes(line + 1, (n - 1) / 2, record) ||
+            (int)(n - 1) / 2 != record[0] + 5) {
+            fprintf(log, "%s: Invalid Intel HEX record on line %d\n", prefix, lineNumber);
+            return false;
+        }
+        for (int k = 0; k < record[0] + 5; k++)
+            sum += record[k];
+        if ((sum & 0xff) != 0) {
+            fprintf(log, "%s: Intel HEX checksum error on line %d\n", prefix, lineNumber);
+            return false;
+        }
+        if (((record[3] == 0x02 || record[3] == 0x04) && record[0] != 2) ||
+            ((record[3] == 0x03 || record[3] == 0x05) && record[0] != 4)) {
+            fprintf(log, "%s: Invalid Intel HEX address record on line %d\n", prefix, lineNumber);
+            return false;
+        }
+
+        switch (record[3]) {
+        case 0x00:
+            if (!bmAddSegmentBytes(l, base + ((record[1] << 8) | record[2]), record + 4, record[0]))
+                return outOfMemory(log, prefix);
+            break;
+        case 0x01:
+            return true;
+        case 0x02:
+            base = ((record[4] << 8) | record[5]) << 4;
+            break;
+        case 0x03:
+            l->runAddress = (((record[4] << 8) | record[5]) << 4) + ((record[6] << 8) | record[7]);
+            break;
+        case 0x04:
+            base = (long)((record[4] << 8) | record[5]) << 16;
+            break;
+        case 0x05:
+            l->runAddress = ((long)record[4] << 24) | (record[5] << 16) | (record[6] << 8) | record[7];
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Parse Motorola S-records, "S<Type><Count><Address><Data><Checksum>".
+ * S1, S2 and S3 records hold data with 16, 24 and 32-bit addresses,
+ * and S9, S8 and S7 records give the start address.
+ */
+static bool parseSRecords(const unsigned char *text, size_t length, struct bmLoader *l, FILE *log, const char *prefix)
+{
+    unsigned char record[1 + 255];
+    int lineNumber = 0;
+
+    for (size_t i = 0; i < length; ) {
+        size_t n = lineLength(text + i, length - i);
+        const unsigned char *line = text + i;
+        int type;
+        int addressSize;
+        long address = 0;
+        int sum = 0;
+
+        i += n + 1;
+        lineNumber++;
+        if (n == 0)
+            continue;
+        type = n > 1 ? line[1] - '0' : -1;
+        if (line[0] != 'S' || type < 0 || type > 9 || n < 10 || n % 2 != 0 ||
+            !parseHexBytes(line + 2, (n - 2) / 2, record) || (int)(n - 2) / 2 != record[0] + 1) {
+            fprintf(log, "%s: Invalid S-record on line %d\n", prefix, lineNumber);
+            return false;
+        }
+        for (int k = 0; k <= record[0]; k++)
+            sum += record[k];
+        if ((sum & 0xff) != 0xff) {
+            fprintf(log, "%s: S-record checksum error on line %d\n", prefix, lineNumber);
+            return false;
+        }
+
+        switch (type) {
+        case 1: case 9:
+            addressSize = 2;
+            break;
+        case 2: case 8:
+            addressSize = 3;
+            break;
+        case 3: case 7:
+            addressSize = 4;
+            break;
+        default:
+            continue; // Header and record counts
+        }
+        if (record[0] < addressSize + 1) {
+            fprintf(log, "%s: Invalid S-record on line %d\n", prefix, lineNumber);
+            return false;
+        }
+        for (int k = 0; k < addressSize; k++)
+            address = (address << 8) | record[1 + k];
+        if (type > 3)
+            l->runAddress = address;
+        else if (!bmAddSegmentBytes(l, address, record + 1 + addressSize, record[0] - addressSize - 1))
+            return outOfMemory(log, prefix);
+    }
+    return true;
+}
+
+/*
+ * Find the byte loaded last at an address, which is what a monitor
+ * move command would copy from there. Returns false if nothing has
+ * been loaded there.
+ */
+static bool loadedByte(const struct bmLoader *l, long address, unsigned char *b)
+{
+    size_t end = l->numBytes;
+
+    for (int i = l->numSegments - 1; i >= 0; i--) {
+        const struct bmRange *r = &l->segments[i];
+        size_t start = end - (r->end - r->start);
+
+        if (address >= r->start && address < r->end) {
+            *b = l->bytes[start + (address - r->start)];
+            return true;
+        }
+        end = start;
+    }
+    return false;
+}
+
+/*
+ * Read an address: up to 8 hex digits, or a 65816 bank and address
+ * "BB/AAAA". The bank is remembered and applies to later addresses of
+ * up to four digits that don't give their own, as in the Apple IIgs
+ * monitor. Returns false, leaving p alone, if there is no address.
+ */
+static bool parseMonitorAddress(const unsigned char **p, const unsigned char *end, int *bank, long *address)
+{
+    const unsigned char *q = *p;
+    long value = 0;
+    int digits = 0;
+
+    while (q < end && bmHexDigit(*q) >= 0 && digits < 8) {
+        value = (value << 4) | bmHexDigit(*q++);
+        digits++;
+    }
+    if (digits == 0)
+        return false;
+    if (q + 1 < end && *q == '/' && digits <= 2 && bmHexDigit(q[1]) >= 0) {
+        *bank = value;
+        value = 0;
+        digits = 0;
+        q++;
+        while (q < end && bmHexDigit(*q) >= 0 && digits < 4) {
+            value = (value << 4) | bmHexDigit(*q++);
+            digits++;
+        }
+    }
+    *address = digits <= 4 ? ((long)*bank << 16) | value : value;
+    *p = q;
+    return true;
+}
+
+/*
+ * Read data bytes, each two hex digits, separated by blanks, storing
+ * them from *address on. Anything else ends the data. Returns where
+ * the data ends, or NULL if out of memory.
+ */
+static const unsigned char *parseMonitorBytes(const unsigned char *p, const unsigned char *end, long *address,
+                                              struct bmLoader *l)
+{
+    unsigned char bytes[256];
+    int count = 0;
+
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p + 1 >= end || bmHexDigit(p[0]) < 0 || bmHexDigit(p[1]) < 0 ||
+            (p + 2 < end && p[2] != ' ' && p[2] != '\t')) {
+            break;
+        }
+        bytes[count++] = (bmHexDigit(p[0]) << 4) | bmHexDigit(p[1]);
+        p += 2;
+        if (count == sizeof(bytes)) {
+            if (!bmAddSegmentBytes(l, *address, bytes, count))
+                return NULL;
+            *address += count;
+            count = 0;
+        }
+    }
+    if (!bmAddSegmentBytes(l, *address, bytes, count))
+        return NULL;
+    *address += count;
+    return p;
+}
+
+/* Skip blanks, returning if there is anything after them. */
+static bool skipBlanks(const unsigned char **p, const unsigned char *end)
+{
+    while (*p < end && (**p == ' ' || **p == '\t'))
+        (*p)++;
+    return *p < end;
+}
+
+/*
+ * Parse monitor text: a hex dump with an address at the start of each
+ * line, e.g.
+ *   1000 65 D0 20 18 18 D3 20 10
+ * or what bintomon sends to a monitor. The address may be followed by
+ * a colon, as in Woz Monitor files, and a line starting with a colon
+ * continues from the previous line. An address can have a 65816 bank,
+ * as in "01/2000:". A Woz Monitor or Apple II Monitor run command,
+ * such as "0280R" or "0280G", gives the run address, and an Apple II
+ * Monitor move, "<Dest><<Start>.<End>M", copies what was loaded
+ * before, one byte at a time as the monitor does, so that an
+ * overlapping move fills. JMON commands are read too: ":<Address>"
+ * followed by data bytes over any number of lines up to an Escape,
+ * "F <Start> <End> <Byte>" to fill and "G<Address>" to run. Other
+ * lines, such as other monitor commands, are ignored.
+ *
+ * The text can be given a piece at a time, as long as each piece but
+ * the last ends at the end of a line, so that a large file can be read
+ * in chunks. The state carried from one piece to the next is in m,
+ * which bmBeginMonitorText() starts off.
+ */
+void bmBeginMonitorText(struct bmMonitorText *m)
+{
+    m->address = 0;
+    m->haveAddress = false;
+    m->inWrite = false;
+    m->bank = 0;
+    m->line = 0;
+}
+
+bool bmParseMonitorText(struct bmMonitorText *m, const unsigned char *text, size_t length, struct bmLoader *l,
+                        FILE *log, const char *prefix)
+{
+    long address = m->address;
+    bool haveAddress = m->haveAddress;
+    bool inWrite = m->inWrite;
+    int bank = m->bank;
+    long line = m->line;
+
+    for (size_t i = 0; i < length; ) {
+        size_t n = lineLength(text + i, length - i);
+        const unsigned char *p = text + i;
+        const unsigned char *lineEnd = text + i + n;
+
+        i += n + 1;
+        line++;
+        while (p < lineEnd) {
+            const unsigned char *end = memchr(p, 0x1b, lineEnd - p);
+            long value;
+
+            if (end == NULL)
+                end = lineEnd;
+            if (!skipBlanks(&p, end)) {
+                /* Nothing more before the end of the line or an Escape */
+            } else if (inWrite) {
+                p = parseMonitorBytes(p, end, &address, l);
+                if (p == NULL)
+                    return outOfMemory(log, prefix);
+            } else if (*p == ':') {
+                p++;
+                if (parseMonitorAddress(&p, end, &bank, &value)) {
+                    address = value;
+                    haveAddress = true;
+                    inWrite = true;
+                } else if (!haveAddress) {
+                    p = end;
+                }
+                if (p < end)
+                    p = parseMonitorBytes(p, end, &address, l);
+                if (p == NULL)
+                    return outOfMemory(log, prefix);
+            } else if ((*p == 'F' || *p == 'f') && p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+                long fillStart, fillEnd, fill;
+                unsigned char bytes[256];
+
+                p++;
+                if (!skipBlanks(&p, end) || !parseMonitorAddress(&p, end, &bank, &fillStart) ||
+                    !skipBlanks(&p, end) || !parseMonitorAddress(&p, end, &bank, &fillEnd) ||
+                    !skipBlanks(&p, end) || !parseMonitorAddress(&p, end, &bank, &fill) ||
+                    fillEnd < fillStart || fill > 0xff) {
+                    fprintf(log, "%s: Line %ld: Invalid fill command\n", prefix, line);
+                    return false;
+                }
+                memset(bytes, fill, sizeof(bytes));
+                while (fillStart <= fillEnd) {
+                    int count = fillEnd - fillStart + 1 < (long)sizeof(bytes) ? fillEnd - fillStart + 1 : sizeof(bytes);
+
+                    if (!bmAddSegmentBytes(l, fillStart, bytes, count))
+                        return outOfMemory(log, prefix);
+                    fillStart += count;
+                }
+            } else if ((*p == 'G' || *p == 'g') && p + 1 < end && bmHexDigit(p[1]) >= 0) {
+                p++;
+                if (parseMonitorAddress(&p, end, &bank, &value))
+                    l->runAddress = value;
+            } else if (parseMonitorAddress(&p, end, &bank, &value)) {
+                if (p < end && (*p == 'R' || *p == 'r' || *p == 'G' || *p == 'g')) {
+                    l->runAddress = value;
+                } else if (p < end && *p == '<') {
+                    long source, sourceEnd;
+
+                    p++;
+                    if (!parseMonitorAddress(&p, end, &bank, &source) || p == end || *p++ != '.' ||
+                        !parseMonitorAddress(&p, end, &bank, &sourceEnd) || p == end ||
+                        (*p != 'M' && *p != 'm') || sourceEnd < source) {
+                        fprintf(log, "%s: Line %ld: Invalid move command\n", prefix, line);
+                        return false;
+                    }
+                    for (long a = source; a <= sourceEnd; a++) {
+                        unsigned char b;
+
+                        if (!loadedByte(l, a, &b)) {
+                            fprintf(log, "%s: Line %ld: Move from $%04lX, which was not loaded\n",
+                                    prefix, line, a);
+                            return false;
+                        }
+                        if (!bmAddSegmentBytes(l, value + (a - source), &b, 1))
+                            return outOfMemory(log, prefix);
+                    }
+                } else if (p == end || *p == ' ' || *p == '\t' || *p == ':') {
+                    if (p < end && *p == ':')
+                        p++;
+                    address = value;
+                    haveAddress = true;
+                    p = parseMonitorBytes(p, end, &address, l);
+                    if (p == NULL)
+                        return outOfMemory(log, prefix);
+                }
+            }
+            /* Anything else up to the end of the line or an Escape is ignored. */
+            p = end;
+            if (end < lineEnd) {
+                inWrite = false;
+                p++;
+            }
+        }
+    }
+    m->address = address;
+    m->haveAddress = haveAddress;
+    m->inWrite = inWrite;
+    m->bank = bank;
+    m->line = line;
+    return true;
+}
+
+/* Parse a whole file of monitor text or a hex dump. */
+static bool parseHexDump(const unsigned char *text, size_t length, struct bmLoader *l, FILE *log, const char *prefix)
+{
+    struct bmMonitorText m;
+
+    bmBeginMonitorText(&m);
+    if (!bmParseMonitorText(&m, text, length, l, log, prefix))
+        return false;
+    if (l->numSegments == 0) {
+        fprintf(log, "%s: No data found in hex dump\n", prefix);
+        return false;
+    }
+    return true;
+}
+
+/* Values in a DATA statement for the object code loader: address, 8 bytes and checksum. */
+#define DATA_VALUES 10
+
+/*
+ * Read a BASIC DATA statement of decimal numbers, "<Line> DATA <Value>,
+ * <Value>...", putting up to max of the values in values[]. Returns the
+ * number of values, 0 if they are not all numbers, or -1 if the line is
+ * not a DATA statement.
+ */
+static int parseDataLine(const unsigned char *p, const unsigned char *end, long *lineNumber, long values[], int max)
+{
+    int n = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    *lineNumber = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        *lineNumber = *lineNumber * 10 + (*p++ - '0');
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p < 4 || memcmp(p, "DATA", 4) != 0)
+        return -1;
+    p += 4;
+
+    for (;;) {
+        const unsigned char *start;
+        long value = 0;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        start = p;
+        while (p < end && *p >= '0' && *p <= '9' && p - start < 9)
+            value = value * 10 + (*p++ - '0');
+        if (p == start)
+            return 0;
+        if (n < max)
+            values[n] = value;
+        n++;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p == end)
+            return n;
+        if (*p++ != ',')
+            return 0;
+    }
+}
+
+/*
+ * Parse the DATA statements of a BASIC program for Ken Skier's object
+ * code loader (see asm/BeyondGames/OBJECTCODELOADER.bas), e.g.
+ *   1000 DATA  4352, 32, 196, 17, 32, 43, 17, 174, 3, 4866
+ * Each gives an address, eight bytes to load there, and a checksum
+ * which is the sum of the address and the bytes. The checksums are
+ * checked as the loader would. Lines that are not DATA statements,
+ * such as the title and END, are ignored.
+ */
+static bool parseBasicData(const unsigned char *text, size_t length, struct bmLoader *l, FILE *log, const char *prefix)
+{
+    for (size_t i = 0; i < length; ) {
+        size_t n = lineLength(text + i, length - i);
+        long values[DATA_VALUES];
+        unsigned char bytes[DATA_VALUES - 2];
+        long basicLine;
+        long sum = 0;
+        int count = parseDataLine(text + i, text + i + n, &basicLine, values, DATA_VALUES);
+
+        i += n + 1;
+        if (count < 0)
+            continue;
+        if (count != DATA_VALUES) {
+            fprintf(log, "%s: DATA line %ld does not hold an address, 8 bytes and a checksum\n", prefix, basicLine);
+            return false;
+        }
+        if (values[0] > 0xffff) {
+            fprintf(log, "%s: Invalid address %ld in DATA line %ld\n", prefix, values[0], basicLine);
+            return false;
+        }
+        for (int k = 0; k < DATA_VALUES - 1; k++) {
+            sum += values[k];
+            if (k == 0)
+                continue;
+            if (values[k] > 0xff) {
+                fprintf(log, "%s: Invalid byte %ld in DATA line %ld\n", prefix, values[k], basicLine);
+                return false;
+            }
+            bytes[k - 1] = values[k];
+        }
+        if (sum != values[DATA_VALUES - 1]) {
+            fprintf(log, "%s: Checksum error in DATA line %ld (address %ld): sum is %ld, not %ld\n",
+                    prefix, basicLine, values[0], sum, values[DATA_VALUES - 1]);
+            return false;
+        }
+        if (!bmAddSegmentBytes(l, values[0], bytes, sizeof(bytes)))
+            return outOfMemory(log, prefix);
+    }
+    if (l->numSegments == 0) {
+        fprintf(log, "%s: No DATA statements found\n", prefix);
+        return false;
+    }
+    return true;
+}
+
+/* Return a big-endian 32-bit number. */
+static inline unsigned long bigEndian32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Parse an AppleSingle file, as written by the cc65 apple2 targets. The
+ * data fork (entry 1) is the program and the auxiliary type in the
+ * ProDOS file info (entry 11) is its load address. Its file type is
+ * kept too. Without that entry the load address from the command line
+ * is used.
+ */
+static bool parseAppleSingle(const unsigned char *file, size_t length, int loadAddress, struct bmLoader *l,
+                             FILE *log, const char *prefix)
+{
+    const unsigned char *dataFork = NULL;
+    unsigned long dataLength = 0;
+    int entries;
+
+    if (length < 26) {
+        fprintf(log, "%s: AppleSingle header is too short\n", prefix);
+        return false;
+    }
+    entries = (file[24] << 8) | file[25];
+    if (26 + 12 * (size_t)entries > length) {
+        fprintf(log, "%s: AppleSingle header is too short\n", prefix);
+        return false;
+    }
+    for (int i = 0; i < entries; i++) {
+        const unsigned char *entry = file + 26 + 12 * i;
+        unsigned long id = bigEndian32(entry);
+        unsigned long offset = bigEndian32(entry + 4);
+        unsigned long size = bigEndian32(entry + 8);
+
+        if (offset > length || size > length - offset) {
+            fprintf(log, "%s: AppleSingle entry %lu is outside the file\n", prefix, id);
+            return false;
+        }
+        if (id == 1) {
+            dataFork = file + offset;
+            dataLength = size;
+        } else if (id == 11 && size >= 8) {
+            l->fileType = file[offset + 3];
+            loadAddress = bigEndian32(file + offset + 4) & 0xffff;
+        }
+    }
+    if (dataFork == NULL) {
+        fprintf(log, "%s: AppleSingle file has no data fork\n", prefix);
+        return false;
+    }
+    if (!bmAddSegmentBytes(l, loadAddress, dataFork, dataLength))
+        return outOfMemory(log, prefix);
+    return true;
+}
+
+/* Return if a whole file is printable text, allowing the Escapes that end JMON writes. */
+static bool isText(const unsigned char *text, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if ((text[i] < ' ' || text[i] > '~') && text[i] != '\n' && text[i] != '\r' && text[i] != '\t' &&
+            text[i] != 0x1b) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return if a line starts with an address, which may have a 65816 bank
+ * as in 01/2000, and at least one data byte, as in a hex dump.
+ */
+static bool isDumpLine(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *start;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    start = p;
+    while (p < end && bmHexDigit(*p) >= 0)
+        p++;
+    if (p < end && *p == '/' && p > start && p - start <= 2) {
+        start = ++p;
+        while (p < end && bmHexDigit(*p) >= 0)
+            p++;
+        if (p - start > 4)
+            return false;
+    }
+    if (p == start || p - start > 8)
+        return false;
+    if (p < end && *p == ':')
+        p++;
+    else if (p == end || (*p != ' ' && *p != '\t'))
+        return false;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p + 1 < end && bmHexDigit(p[0]) >= 0 && bmHexDigit(p[1]) >= 0 &&
+           (p + 2 == end || p[2] == ' ' || p[2] == '\t');
+}
+
+/*
+ * Return if the first DATA statement in a text file looks like a line
+ * for the object code loader. Its checksum is checked when it is parsed.
+ */
+static bool isBasicData(const unsigned char *text, size_t length)
+{
+    for (size_t i = 0; i < length; ) {
+        size_t n = lineLength(text + i, length - i);
+        long values[DATA_VALUES];
+        long basicLine;
+        int count = parseDataLine(text + i, text + i + n, &basicLine, values, DATA_VALUES);
+
+        i += n + 1;
+        if (count >= 0)
+            return count == DATA_VALUES;
+    }
+    return false;
+}
+
+/*
+ * Work out the format of an input file from its contents. Text is only
+ * taken to be a hex dump, or monitor commands, if one of its first few
+ * lines looks like one, or as BASIC DATA statements if the first of
+ * them has the right number of values, so that other text files are
+ * still sent as they are.
+ */
+enum bmInputFormat bmDetectInputFormat(const unsigned char *file, size_t length)
+{
+    size_t i = 0;
+
+    if (length >= 4 && bigEndian32(file) == 0x00051600)
+        return BM_APPLESINGLE_INPUT;
+    if (!isText(file, length))
+        return BM_BINARY_INPUT;
+    while (i < length && (file[i] == ' ' || file[i] == '\t' || file[i] == '\r' || file[i] == '\n'))
+        i++;
+    if (i < length && file[i] == ':') {
+        size_t j = i + 1;
+
+        /* A JMON write, ":0280 A9 00", has a blank after the address. */
+        while (j < length && bmHexDigit(file[j]) >= 0)
+            j++;
+        if (j - i <= 9 && j < length && (file[j] == ' ' || file[j] == '\t'))
+            return BM_DUMP_INPUT;
+        return BM_IHEX_INPUT;
+    }
+    if (i + 1 < length && file[i] == 'S' && file[i + 1] >= '0' && file[i + 1] <= '9')
+        return BM_SREC_INPUT;
+    for (int lines = 0; lines < 8 && i < length; lines++) {
+        size_t n = lineLength(file + i, length - i);
+        if (isDumpLine(file + i, file + i + n))
+            return BM_DUMP_INPUT;
+        i += n + 1;
+    }
+    if (isBasicData(file, length))
+        return BM_BASIC_DATA_INPUT;
+    return BM_BINARY_INPUT;
+}
+
+/*
+ * Load the segments from the contents of an input file in the given
+ * format. A binary is a single segment at the load address. Returns
+ * false after reporting an error.
+ */
+bool bmParseInput(enum bmInputFormat format, const unsigned char *data, size_t length, int loadAddress,
+                  struct bmLoader *l, FILE *log, const char *prefix)
+{
+    switch (format) {
+    case BM_BINARY_INPUT:
+        if (length > BM_MAX_IMAGE_SPAN) {
+            fprintf(log, "%s: Input is more than 16 MB\n", prefix);
+            return false;
+        }
+        if (!bmAddSegmentBytes(l, loadAddress, data, length))
+            return outOfMemory(log, prefix);
+        return true;
+    case BM_IHEX_INPUT:
+        return parseIntelHex(data, length, l, log, prefix);
+    case BM_SREC_INPUT:
+        return parseSRecords(data, length, l, log, prefix);
+    case BM_DUMP_INPUT:
+        return parseHexDump(data, length, l, log, prefix);
+    case BM_BASIC_DATA_INPUT:
+        return parseBasicData(data, length, l, log, prefix);
+    default:
+        return parseAppleSingle(data, length, loadAddress, l, log, prefix);
+    }
+}
+
+/*
+ * Build the memory image from the segments loaded: a flat buffer from
+ * the lowest address to the highest, with the segments as the ranges
+ * to output (sorted, with overlapping and adjacent ones merged). Where
+ * segments overlap, the one later in the file wins.
+ */
+bool bmBuildImage(struct bmLoader *l, unsigned char **data, size_t *dataLength, int *loadAddress,
+                  struct bmRange **ranges, int *numRanges, FILE *log, const char *prefix)
+{
+    long low = l->segments[0].start;
+    long high = l->segments[0].end;
+    size_t offset = 0;
+    int n = 0;
+
+    for (int i = 1; i < l->numSegments; i++) {
+        if (l->segments[i].start < low)
+            low = l->segments[i].start;
+        if (l->segments[i].end > high)
+            high = l->segments[i].end;
+    }
+    if (high - low > BM_MAX_IMAGE_SPAN || low < 0) {
+        fprintf(log, "%s: Input covers $%lX-$%lX, more than 16 MB\n", prefix, low, high - 1);
+        return false;
+    }
+
+    *data = calloc(high - low, 1);
+    if (*data == NULL && high > low) {
+        fprintf(log, "%s: Out of memory\n", prefix);
+        return false;
+    }
+    for (int i = 0; i < l->numSegments; i++) {
+        size_t size = l->segments[i].end - l->segments[i].start;
+        memcpy(*data + (l->segments[i].start - low), l->bytes + offset, size);
+        offset += size;
+    }
+
+    qsort(l->segments, l->numSegments, sizeof(struct bmRange), bmCompareRanges);
+    for (int i = 0; i < l->numSegments; i++) {
+        if (n > 0 && l->segments[i].start <= l->segments[n - 1].end) {
+            if (l->segments[i].end > l->segments[n - 1].end)
+                l->segments[n - 1].end = l->segments[i].end;
+        } else {
+            l->segments[n++] = l->segments[i];
+        }
+    }
+
+    *dataLength = high - low;
+    *loadAddress = low;
+    *ranges = l->segments;
+    *numRanges = n;
+    l->segments = NULL;
+    return true;
+}
+
+/*
+ * Symbols and segments from an ld65 map file, so that load and run
+ * addresses can be given by name.
+ */
+
+/* Add a symbol or segment to the table. Returns false if out of memory. */
+static bool addMapEntry(struct bmSymbolTable *table, const char *name, int value)
+{
+    char *copy;
+
+    if (table->count % 64 == 0) {
+        struct bmMapEntry *entries = realloc(table->entries, (table->count + 64) * sizeof(struct bmMapEntry));
+        if (entries == NULL)
+            return false;
+        table->entries = entries;
+    }
+    copy = strdup(name);
+    if (copy == NULL)
+        return false;
+    table->entries[table->count].name = copy;
+    table->entries[table->count].value = value;
+    table->count++;
+    return true;
+}
+
+/* Free the symbols read from a map file. */
+void bmFreeSymbols(struct bmSymbolTable *table)
+{
+    for (int i = 0; i < table->count; i++)
+        free(table->entries[i].name);
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+}
+
+/*
+ * Read the segment list and exports list from an ld65 map file into a
+ * table, which should start out empty. The segment list has a name,
+ * start, end, size and alignment on each line. The exports list has
+ * one or two entries per line, each a name, a value and some flags,
+ * e.g.
+ *   RESET                     00FF00 RLA    WOZMON                    00FF00 RLA
+ * Returns false, after writing an error to log, if the file could not
+ * be read.
+ */
+bool bmReadMapFile(struct bmSymbolTable *table, const char *filename, FILE *log, const char *prefix)
+{
+    enum { OTHER, SEGMENTS, EXPORTS } section = OTHER;
+    char line[1024];
+    FILE *file;
+    bool ok = true;
+
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(log, "%s: Unable to open map file '%s'\n", prefix, filename);
+        return false;
+    }
+
+    while (ok && fgets(line, sizeof(line), file) != NULL) {
+        char name[256];
+        char flags[16];
+        unsigned int value;
+        int used;
+
+        if (!strncmp(line, "Segment list:", 13)) {
+            section = SEGMENTS;
+            continue;
+        }
+        if (!strncmp(line, "Exports list by name:", 21)) {
+            section = EXPORTS;
+            continue;
+        }
+        if (line[0] != ' ' && strchr(line, ':') != NULL) {
+            section = OTHER; // Start of some other list
+            continue;
+        }
+        if (section == SEGMENTS) {
+            /* Skip the heading, which has no hex start address. */
+            if (sscanf(line, "%255s %x", name, &value) == 2 && strcmp(name, "Name") != 0)
+                ok = addMapEntry(table, name, value);
+        } else if (section == EXPORTS) {
+            const char *p = line;
+            while (ok && sscanf(p, "%255s %x %15s%n", name, &value, flags, &used) == 3) {
+                ok = addMapEntry(table, name, value);
+                p += used;
+            }
+        }
+    }
+
+    fclose(file);
+    if (!ok) {
+        bmFreeSymbols(table);
+        return outOfMemory(log, prefix);
+    }
+    return true;
+}
+
+/*
+ * Parse a decimal or hex (0x prefixed) number, or a hex 65816 bank and
+ * address such as 01/2000, returning false if it is not one.
+ */
+bool bmParseNumber(const char *s, int *value)
+{
+    char *end;
+
+    *value = strtol(s, &end, 0);
+    if (end != s && *end == '/') {
+        const char *address = end + 1;
+        long bank = strtol(s, &end, 16);
+        *value = (bank << 16) | strtol(address, &end, 16);
+        return bank <= 0xff && end - address == 4 && *end == '\0';
+    }
+    return end != s && *end == '\0';
+}
+
+/*
+ * Look up the address for a load or run address argument, which can
+ * be a number or a symbol or segment name from the map file. Returns
+ * false, after writing an error message to log, if it is neither.
+ */
+bool bmLookupAddress(const struct bmSymbolTable *table, const char *name, int *address, FILE *log, const char *prefix)
+{
+    if (bmParseNumber(name, address))
+        return true;
+
+    /* Exports come after segments, so search backwards to prefer symbols. */
+    for (int i = table->count - 1; i >= 0; i--) {
+        if (!strcmp(table->entries[i].name, name)) {
+            *address = table->entries[i].value;
+            return true;
+        }
+    }
+
+    if (table->count == 0)
+        fprintf(log, "%s: '%s' is not a number (use -m to read symbols from a map file)\n", prefix, name);
+    else
+        fprintf(log, "%s: Symbol or segment '%s' not found in map file\n", prefix, name);
+    return false;
+}
+
+/*
+ * Return the longest line a monitor accepts. The Woz Monitor cancels a
+ * line of more than 127 characters and the Apple II Monitor rings the
+ * bell (which is slow) from character 249. JMON and the OSI 65V act on
+ * each character as it arrives and paper tape records have their own
+ * 255 byte limit.
+ */
+int bmDefaultMaxLine(enum bmFormat format)
+{
+    switch (format) {
+    case BM_APPLE1_FORMAT:
+        return 127;
+    case BM_APPLE2_FORMAT:
+        return 248;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Parse a target profile: a comma separated list of baud=<Rate>,
+ * char=<Milliseconds>, line=<Milliseconds> and max=<Characters>. A
+ * bare number is taken as the baud rate. Returns false if it is not
+ * valid, or if out of memory.
+ */
+bool bmParseProfile(const char *s, struct bmProfile *p)
+{
+    char *list = strdup(s);
+    char *item;
+    char *save;
+    bool ok = list != NULL;
+
+    for (item = strtok_r(list, ",", &save); ok && item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        char *end;
+        double number;
+
+        if (value != NULL)
+            *value++ = '\0';
+        else
+            value = item;
+        number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) {
+            ok = false;
+        } else if (value == item || !strcmp(item, "baud")) {
+            p->baud = number;
+        } else if (!strcmp(item, "char")) {
+            p->charDelay = number;
+        } else if (!strcmp(item, "line")) {
+            p->lineDelay = number;
+        } else if (!strcmp(item, "max")) {
+            p->maxLine = number;
+        } else {
+            ok = false;
+        }
+    }
+    free(list);
+    return ok && p->baud > 0;
+}
+
+/* Return the estimated time in seconds to upload some characters and lines. */
+double bmUploadTime(const struct bmProfile *p, long chars, long lines)
+{
+    return chars * (10.0 / p->baud + p->charDelay / 1000.0) + lines * p->lineDelay / 1000.0;
+}
+
+/*
+ * Find the number of bytes per line that gives the shortest estimated
+ * upload time. Each width whose lines fit the monitor's limit is tried
+ * by converting without output and counting the characters and lines.
+ * The per-line overhead favours long lines, but fill lines skipped with
+ * -c and fill commands from -x depend on where lines start, so the
+ * data matters too. Returns 0 if no width fits, or -1 if out of memory.
+ */
+int bmOptimizeLineWidth(const struct bmSettings *s, const struct bmProfile *p, const unsigned char *data,
+                        size_t dataLength)
+{
+    struct bmSettings trial = *s;
+    int limit = 255;
+    int best = 0;
+    double bestTime = 0;
+
+    if (s->format != BM_KIM1_FORMAT && p->maxLine > 0 && p->maxLine / 3 < limit)
+        limit = p->maxLine / 3;
+
+    for (int n = 1; n <= limit; n++) {
+        long chars, lines;
+        int longestLine;
+        double time;
+
+        trial.bytesPerLine = n;
+        if (!bmCountOutput(&trial, data, dataLength, &chars, &lines, &longestLine))
+            return -1;
+        if (p->maxLine > 0 && longestLine > p->maxLine)
+            continue;
+        time = bmUploadTime(p, chars, lines);
+        if (best == 0 || time < bestTime) {
+            best = n;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Find the parts of one sorted list of ranges that are also in another
+ * and set *result to them, as a new malloc()ed list. Returns false if
+ * out of memory.
+ */
+bool bmIntersectRanges(const struct bmRange *a, int na, const struct bmRange *b, int nb, struct bmRange **result,
+                       int *n)
+{
+    int i = 0, j = 0;
+
+    *result = malloc((na + nb + 1) * sizeof(struct bmRange));
+    if (*result == NULL)
+        return false;
+    *n = 0;
+    while (i < na && j < nb) {
+        int start = a[i].start > b[j].start ? a[i].start : b[j].start;
+        int end = a[i].end < b[j].end ? a[i].end : b[j].end;
+        if (start < end) {
+            (*result)[*n].start = start;
+            (*result)[*n].end = end;
+            (*n)++;
+        }
+        if (a[i].end < b[j].end)
+            i++;
+        else
+            j++;
+    }
+    return true;
+}
+
+/*
+ * Find the highest address that will be sent, and check that it can be
+ * given in the output format. Only the Apple II format has 65816 bank
+ * addresses (as the Apple IIgs monitor accepts), which reach up to
+ * $FFFFFF. The other monitors and paper tape only have 16-bit
+ * addresses. Returns false, after writing an error to log, if it is
+ * too high.
+ */
+bool bmCheckAddresses(const struct bmSettings *s, size_t dataLength, long *highestAddress, FILE *log,
+                      const char *prefix)
+{
+    long highest = s->runAddress;
+    long limit = s->format == BM_APPLE2_FORMAT ? 0xffffff : 0xffff;
+
+    for (int i = 0; i < s->numRanges; i++) {
+        long start = s->ranges[i].start > s->loadAddress ? s->ranges[i].start : s->loadAddress;
+        long end = s->loadAddress + (long)dataLength;
+        if (s->ranges[i].end < end)
+            end = s->ranges[i].end;
+        if (start < end && end - 1 > highest)
+            highest = end - 1;
+    }
+    if (highest > limit) {
+        if (limit == 0xffff)
+            fprintf(log, "%s: Address $%lX is above $FFFF (use -2 for 65816 bank addresses)\n", prefix, highest);
+        else
+            fprintf(log, "%s: Address $%lX is above $FFFFFF\n", prefix, highest);
+        return false;
+    }
+    *highestAddress = highest;
+    return true;
+}
+
+/*
+ * Read the rest of a file into memory. Sets *data to a malloc()ed
+ * buffer (which may be NULL for an empty file) and *length. Returns
+ * false if out of memory.
+ */
+bool bmReadFile(FILE *file, unsigned char **data, size_t *length)
+{
+    unsigned char *buffer = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t n;
+
+    do {
+        if (size == capacity) {
+            unsigned char *bigger;
+            capacity = capacity ? 2 * capacity : 65536;
+            bigger = realloc(buffer, capacity);
+            if (bigger == NULL) {
+                free(buffer);
+                return false;
+            }
+            buffer = bigger;
+        }
+        n = fread(buffer + size, 1, capacity - size, file);
+        size += n;
+    } while (n != 0);
+
+    *data = buffer;
+    *length = size;
+    return true;
+}
+
+/*
+ * Delta uploads (--base). Only the bytes that differ from an earlier
+ * image of the target's memory are sent.
+ *
+ * Read the base image. This is either a binary file loaded at the same
+ * address as the new one (with its own header if hasHeader is set), or
+ * monitor text, such as an earlier output of bintomon, which is read
+ * the same way as a monitor text input file. Only the bytes it stores
+ * are known. Returns false, after writing an error to log, on error.
+ */
+bool bmReadBaseImage(const char *filename, int loadAddress, bool hasHeader, struct bmBaseImage *base, FILE *log,
+                     const char *prefix)
+{
+    FILE *file;
+    unsigned char *contents;
+    size_t length;
+    bool ok;
+
+    *base = (struct bmBaseImage) { 0, 0, NULL, NULL };
+    file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(log, "%s: Unable to open base image '%s'\n", prefix, filename);
+        return false;
+    }
+    ok = bmReadFile(file, &contents, &length);
+    fclose(file);
+    if (!ok)
+        return outOfMemory(log, prefix);
+
+    if (bmDetectInputFormat(contents, length) == BM_DUMP_INPUT) {
+        struct bmLoader l = { .runAddress = -1 };
+        struct bmRange *ranges = NULL;
+        int numRanges = 0;
+        size_t size = 0;
+
+        ok = bmParseInput(BM_DUMP_INPUT, contents, length, 0, &l, log, prefix);
+        free(contents);
+        /* With nothing stored, every byte is unknown and is sent. */
+        if (ok && l.numSegments != 0)
+            ok = bmBuildImage(&l, &base->data, &size, &base->start, &ranges, &numRanges, log, prefix);
+        free(l.segments);
+        free(l.bytes);
+        if (!ok)
+            return false;
+        base->length = size;
+        base->known = calloc(size + 1, sizeof(bool));
+        if (base->known == NULL) {
+            free(base->data);
+            free(ranges);
+            base->data = NULL;
+            return outOfMemory(log, prefix);
+        }
+        for (int i = 0; i < numRanges; i++) {
+            for (int a = ranges[i].start; a < ranges[i].end; a++)
+                base->known[a - base->start] = true;
+        }
+        free(ranges);
+        return true;
+    }
+
+    base->start = loadAddress;
+    if (hasHeader) {
+        if (length < 4) {
+            fprintf(log, "%s: '%s' is too short to have a load address and length\n", prefix, filename);
+            free(contents);
+            return false;
+        }
+        base->start = contents[0] + (contents[1] << 8);
+        length -= 4;
+        memmove(contents, contents + 4, length);
+    }
+    base->data = contents;
+    base->length = length;
+    return true;
+}
+
+/* Free a base image. */
+void bmFreeBaseImage(struct bmBaseImage *base)
+{
+    free(base->data);
+    free(base->known);
+    base->data = NULL;
+    base->known = NULL;
+}
+
+/* Return if the byte at an address is the same in the base image. */
+static inline bool unchanged(const struct bmBaseImage *base, int address, unsigned char b)
+{
+    int i = address - base->start;
+
+    return i >= 0 && i < base->length && (base->known == NULL || base->known[i]) && base->data[i] == b;
+}
+
+/*
+ * Return the longest run of unchanged bytes that is cheaper to send
+ * than to skip. Skipping means ending the line or record and sending
+ * a new address after the gap.
+ */
+int bmMaxDeltaGap(enum bmFormat format, const struct bmProfile *p)
+{
+    double skipTime;
+    double byteTime;
+
+    switch (format) {
+    case BM_KIM1_FORMAT:
+        skipTime = bmUploadTime(p, 12, 1);  // ";LLAAAA" "CCCC\n" for a new record
+        byteTime = bmUploadTime(p, 2, 0);
+        break;
+    case BM_OSI_FORMAT:
+        skipTime = bmUploadTime(p, 6, 0);   // ".AAAA/"
+        byteTime = bmUploadTime(p, 3, 1);   // "DD\r"
+        break;
+    case BM_JMON_FORMAT:
+        skipTime = bmUploadTime(p, 6, 0);   // ESC ":AAAA"
+        byteTime = bmUploadTime(p, 3, 0);
+        break;
+    default:
+        skipTime = bmUploadTime(p, 6, 1);   // "\n" "AAAA:"
+        byteTime = bmUploadTime(p, 3, 0);
+        break;
+    }
+    return skipTime / byteTime;
+}
+
+/*
+ * Replace the ranges to output with the parts of them that differ
+ * from the base image, sending short unchanged gaps anyway when that
+ * is cheaper, and set *changed to the number of changed bytes. Returns
+ * false, leaving the ranges as they were, if out of memory.
+ */
+bool bmDeltaRanges(struct bmSettings *s, const unsigned char *data, size_t dataLength, const struct bmBaseImage *base,
+                   int maxGap, long *changed)
+{
+    struct bmRange *ranges = NULL;
+    int numRanges = 0;
+
+    *changed = 0;
+    for (int r = 0; r < s->numRanges; r++) {
+        int start = s->ranges[r].start;
+        int end = s->ranges[r].end;
+
+        if (start < s->loadAddress)
+            start = s->loadAddress;
+        if (end > s->loadAddress + (int)dataLength)
+            end = s->loadAddress + dataLength;
+        if (r > 0 && start < s->ranges[r - 1].end)
+            start = s->ranges[r - 1].end; // Overlaps the previous range
+
+        for (int address = start; address < end; address++) {
+            if (unchanged(base, address, data[address - s->loadAddress]))
+                continue;
+            (*changed)++;
+            /* Extend the last range over a short gap, or start a new one. */
+            if (numRanges > 0 && ranges[numRanges - 1].end >= start &&
+                address - ranges[numRanges - 1].end <= maxGap) {
+                ranges[numRanges - 1].end = address + 1;
+                continue;
+            }
+            if (numRanges % 64 == 0) {
+                struct bmRange *more = realloc(ranges, (numRanges + 64) * sizeof(struct bmRange));
+                if (more == NULL) {
+                    free(ranges);
+                    return false;
+                }
+                ranges = more;
+            }
+            ranges[numRanges].start = address;
+            ranges[numRanges].end = address + 1;
+            numRanges++;
+        }
+    }
+
+    free(s->ranges);
+    s->ranges = ranges;
+    s->numRanges = numRanges;
+    return true;
+}
+
+/*
+ * Block checksums (--blocks). The image is sent in blocks of up to 256
+ * bytes, each starting on its own line, and a manifest lists every
+ * block's address, length and checksum (from bmBlockChecksum()) and
+ * where its text is in the output. After an upload, sendmon -k reads
+ * back the checksum of each block from the target and sends again only
+ * the text for blocks that differ. Blocks must be below $10000, where
+ * sendmon can read them back. The manifest is a line
+ * "bintomon-blocks <Format>" and then one line per block:
+ *   <Address (hex)> <Length> <Checksum (hex)> <Offset> <TextLength>
+ *
+ * Replace the ranges to output with blocks: the ranges merged, clipped
+ * to the data and split at multiples of the block size. Returns false,
+ * leaving the ranges as they were, if out of memory.
+ */
+bool bmSplitBlocks(struct bmSettings *s, size_t dataLength, int blockSize)
+{
+    struct bmRange *blocks = NULL;
+    int numBlocks = 0;
+    int end = -1;
+
+    for (int i = 0; i < s->numRanges; i++) {
+        int start = s->ranges[i].start > s->loadAddress ? s->ranges[i].start : s->loadAddress;
+        int stop = s->loadAddress + (int)dataLength;
+
+        if (s->ranges[i].end < stop)
+            stop = s->ranges[i].end;
+        if (start < end)
+            start = end; // Overlaps the previous range
+        while (start < stop) {
+            int blockEnd = (start / blockSize + 1) * blockSize;
+            if (blockEnd > stop)
+                blockEnd = stop;
+            if (numBlocks % 256 == 0) {
+                struct bmRange *more = realloc(blocks, (numBlocks + 256) * sizeof(struct bmRange));
+                if (more == NULL) {
+                    free(blocks);
+                    return false;
+                }
+                blocks = more;
+            }
+            blocks[numBlocks].start = start;
+            blocks[numBlocks].end = blockEnd;
+            numBlocks++;
+            start = blockEnd;
+        }
+        if (stop > end)
+            end = stop;
+    }
+    free(s->ranges);
+    s->ranges = blocks;
+    s->numRanges = numBlocks;
+    return true;
+}
+
+/*
+ * Write the block manifest, given where the text of each block starts
+ * in the output (from bmOutput.rangeOffsets). Returns false, after
+ * writing an error to log, if it can't be written.
+ */
+bool bmWriteBlockManifest(const char *filename, const struct bmSettings *s, const unsigned char *data,
+                          const long *offsets, FILE *log, const char *prefix)
+{
+    FILE *file = fopen(filename, "w");
+
+    if (file == NULL) {
+        fprintf(log, "%s: Unable to write block manifest '%s'\n", prefix, filename);
+        return false;
+    }
+    fprintf(file, "bintomon-blocks %s\n", s->format == BM_APPLE1_FORMAT ? "apple1" : "apple2");
+    for (int i = 0; i < s->numRanges; i++) {
+        int start = s->ranges[i].start;
+        int n = s->ranges[i].end - start;
+        if (offsets[i] == -1)
+            continue;
+        fprintf(file, "%04X %d %04X %ld %ld\n", start, n, bmBlockChecksum(data + (start - s->loadAddress), n),
+                offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    if (fclose(file) != 0) {
+        fprintf(log, "%s: Unable to write block manifest '%s'\n", prefix, filename);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Cassette audio (--wav). Instead of monitor text, the image is written
+ * as a WAV file to play into the Apple 1 Cassette Interface (ACI) or
+ * the KIM-1 tape input. Both send each bit as a few cycles of a square
+ * wave, so the samples for a 0 bit and a 1 bit are worked out once
+ * into tables, starting from either level, and the tape is then just
+ * those tables copied into the output buffer one bit at a time.
+ *
+ * ACI (wozaci.s): a header of 1 kHz tone, a start bit, then the data
+ * with each byte sent high bit first. A 0 bit is one cycle of 2 kHz and
+ * a 1 bit one cycle of 1 kHz. The tape holds no addresses; they are
+ * typed into the ACI, e.g. "C100R" and then "0280.0FFFR".
+ *
+ * KIM-1 (DUMPT in kim.s): 100 SYNC characters, "*", the ID, the start
+ * address, the data as pairs of hex digits, "/", the checksum (the
+ * 16-bit sum of the address and data bytes) and two EOT characters.
+ * Characters are sent low bit first, and each bit is some 3700 Hz
+ * followed by some 2400 Hz tone. The ROM sends 9 cycles and 6 cycles
+ * of these (2.48 ms of each) as one unit, a 1 bit as one unit of
+ * 3700 Hz and two of 2400 Hz and a 0 bit the other way round. LOADT
+ * only compares the time spent in each tone, using its 64 us timer,
+ * so the units can be much shorter. What limits them is that after
+ * the last bit of a character LOADT takes about 300 us to store the
+ * byte before it looks for the next bit, all during the 3700 Hz part.
+ * The kim-fast timing uses units of 3 half cycles of 3700 Hz and 2 of
+ * 2400 Hz (414 us), as Jim Butterfield's Hypertape does, which is the
+ * shortest that leaves LOADT some margin, and loads 6 times faster.
+ */
+/* 8-bit unsigned sample values for the two levels of the square wave. */
+#define TAPE_LOW 0x20
+#define TAPE_HIGH 0xe0
+
+/* ACI header and trailer lengths in 1 bits. The ROM writes 8192. */
+#define ACI_HEADER_BITS 8192
+#define ACI_TRAILER_BITS 16
+
+#define KIM_SYNC_CHARS 100
+#define KIM_SYNC 0x16
+#define KIM_EOT 0x04
+
+/* A run of half cycles of one tone. */
+struct tone {
+    int halfCycles;
+    int microseconds;   // Length of each half cycle
+};
+
+/* The tones for a 0 bit and a 1 bit in each tape format. */
+static const struct tone tapeTones[][2][2] = {
+    [BM_ACI_TAPE] = { { { 2, 250 } }, { { 2, 500 } } },
+    [BM_KIM_TAPE] = { { { 36, 138 }, { 12, 207 } }, { { 18, 138 }, { 24, 207 } } },
+    [BM_KIM_FAST_TAPE] = { { { 6, 138 }, { 2, 207 } }, { { 3, 138 }, { 4, 207 } } }
+};
+
+/* Writes the samples for a tape, or with no output just counts them. */
+struct tapeWriter {
+    struct bmOutput *out;         // NULL to only count samples
+    unsigned char *bits[2][2];  // Samples for each bit value, starting low or high
+    int bitLength[2];           // Samples in each bit
+    bool flips[2];              // An odd number of half cycles ends at the other level
+    int level;                  // Current level, 0 low or 1 high
+    long samples;               // Samples so far
+};
+
+/*
+ * Work out the samples for each bit. Half cycle edges are rounded to
+ * the nearest sample from the start of the bit so the errors don't add
+ * up. Returns false if out of memory.
+ */
+static bool initTapeWriter(struct tapeWriter *t, enum bmTapeFormat format, int sampleRate)
+{
+    *t = (struct tapeWriter) { .out = NULL };
+
+    for (int b = 0; b < 2; b++) {
+        const struct tone *tones = tapeTones[format][b];
+        long microseconds = 0;
+        int halfCycles = 0;
+        int start = 0;
+
+        for (int i = 0; i < 2; i++)
+            microseconds += (long)tones[i].halfCycles * tones[i].microseconds;
+        t->bitLength[b] = (microseconds * sampleRate + 500000) / 1000000;
+        t->bits[b][0] = malloc(t->bitLength[b]);
+        t->bits[b][1] = malloc(t->bitLength[b]);
+        if (t->bits[b][0] == NULL || t->bits[b][1] == NULL)
+            return false;
+
+        microseconds = 0;
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < tones[i].halfCycles; j++) {
+                int end;
+                microseconds += tones[i].microseconds;
+                end = (microseconds * sampleRate + 500000) / 1000000;
+                memset(t->bits[b][0] + start, halfCycles % 2 ? TAPE_HIGH : TAPE_LOW, end - start);
+                memset(t->bits[b][1] + start, halfCycles % 2 ? TAPE_LOW : TAPE_HIGH, end - start);
+                halfCycles++;
+                start = end;
+            }
+        }
+        t->flips[b] = halfCycles % 2;
+    }
+    return true;
+}
+
+static void freeTapeWriter(struct tapeWriter *t)
+{
+    for (int b = 0; b < 2; b++) {
+        free(t->bits[b][0]);
+        free(t->bits[b][1]);
+    }
+}
+
+/* Output the samples for one bit. */
+static inline void putTapeBit(struct tapeWriter *t, int b)
+{
+    int n = t->bitLength[b];
+
+    if (t->out != NULL) {
+        memcpy(reserveOutput(t->out, n), t->bits[b][t->level], n);
+        t->out->length += n;
+    }
+    t->samples += n;
+    t->level ^= t->flips[b];
+}
+
+/* Output a KIM-1 tape character, low bit first. */
+static void putKimChar(struct tapeWriter *t, unsigned char c)
+{
+    for (int i = 0; i < 8; i++)
+        putTapeBit(t, (c >> i) & 1);
+}
+
+/* Output a byte as two KIM-1 tape characters, hex digits. */
+static void putKimByte(struct tapeWriter *t, unsigned char b)
+{
+    putKimChar(t, hexTable[b][0]);
+    putKimChar(t, hexTable[b][1]);
+}
+
+/* Output a whole tape of n bytes loaded at address. */
+static void putTape(struct tapeWriter *t, enum bmTapeFormat format, int id, int address, const unsigned char *data,
+                    size_t n)
+{
+    if (format == BM_ACI_TAPE) {
+        for (int i = 0; i < ACI_HEADER_BITS; i++)
+            putTapeBit(t, 1);
+        putTapeBit(t, 0); // Start bit
+        for (size_t i = 0; i < n; i++) {
+            for (int j = 7; j >= 0; j--)
+                putTapeBit(t, (data[i] >> j) & 1);
+        }
+        /* Something after the last bit, so its last edge is on the tape. */
+        for (int i = 0; i < ACI_TRAILER_BITS; i++)
+            putTapeBit(t, 1);
+    } else {
+        unsigned int checksum = (address & 0xff) + ((address >> 8) & 0xff);
+
+        for (int i = 0; i < KIM_SYNC_CHARS; i++)
+            putKimChar(t, KIM_SYNC);
+        putKimChar(t, '*');
+        putKimByte(t, id);
+        putKimByte(t, address & 0xff);
+        putKimByte(t, (address >> 8) & 0xff);
+        for (size_t i = 0; i < n; i++) {
+            putKimByte(t, data[i]);
+            checksum += data[i];
+        }
+        putKimChar(t, '/');
+        putKimByte(t, checksum & 0xff);
+        putKimByte(t, (checksum >> 8) & 0xff);
+        putKimChar(t, KIM_EOT);
+        putKimChar(t, KIM_EOT);
+    }
+}
+
+/* Output a little endian number of the given number of bytes. */
+static void putLittleEndian(struct bmOutput *out, unsigned long value, int bytes)
+{
+    char *p = reserveOutput(out, bytes);
+
+    for (int i = 0; i < bytes; i++)
+        p[i] = (value >> (8 * i)) & 0xff;
+    out->length += bytes;
+}
+
+/* Output the header of a WAV file of 8-bit mono samples. */
+static void putWavHeader(struct bmOutput *out, int sampleRate, long samples)
+{
+    putString(out, "RIFF");
+    putLittleEndian(out, 36 + samples, 4);
+    putString(out, "WAVEfmt ");
+    putLittleEndian(out, 16, 4);        // Format chunk length
+    putLittleEndian(out, 1, 2);         // PCM
+    putLittleEndian(out, 1, 2);         // Channels
+    putLittleEndian(out, sampleRate, 4);
+    putLittleEndian(out, sampleRate, 4); // Bytes per second
+    putLittleEndian(out, 1, 2);         // Bytes per sample
+    putLittleEndian(out, 8, 2);         // Bits per sample
+    putString(out, "data");
+    putLittleEndian(out, samples, 4);
+}
+
+/*
+ * Write an image as a WAV file of a cassette tape. The tape is
+ * generated twice, first only to count the samples for the header.
+ * Returns the number of samples, or -1 if out of memory.
+ */
+long bmWriteTape(struct bmOutput *out, enum bmTapeFormat format, int id, int sampleRate, int address,
+                 const unsigned char *data, size_t n)
+{
+    struct tapeWriter t;
+    long samples = -1;
+
+    if (initTapeWriter(&t, format, sampleRate)) {
+        putTape(&t, format, id, address, data, n);
+        samples = t.samples;
+        putWavHeader(out, sampleRate, samples);
+        t.out = out;
+        t.samples = 0;
+        t.level = 0;
+        putTape(&t, format, id, address, data, n);
+        bmFlushOutput(out);
+    }
+    freeTapeWriter(&t);
+    return samples;
+}
@@ -0,0 +1,317 @@
+/*
+ * libbintomon: convert memory images to monitor load formats.
+ *
+ * This is the conversion engine used by bintomon, as a library that
+ * other host programs can call directly instead of running bintomon
+ * and reading its output. An image is given as one flat buffer with a
+ * list of address ranges (bmConvert), or as a list of segments each in
+ * its own buffer (bmConvertSegments). The data is read where it is and
+ * never copied. The text goes into a large buffer which, when full or
+ * at the end, is handed to a sink: a file descriptor, or a function
+ * called with each buffer full (bmBufferSink collects everything in
+ * memory). For more control, an encoder can be fed the image a piece
+ * at a time. Around that are the steps bintomon takes to decide what
+ * to send: reading input files and ld65 map files, choosing the line
+ * width with the upload cost model, comparing with a base image for a
+ * delta upload, and splitting the image into checksummed blocks.
+ *
+ * Everything the library defines starts with bm or BM_, so that it
+ * can be linked into programs with names of their own. It never
+ * exits: errors, including running out of memory, are returned to the
+ * caller, with any message written to the log given.
+ *
+ * Example, converting a program at $0280 to Woz Monitor format in
+ * memory:
+ *
+ *   struct bmSettings s = { .format = BM_APPLE1_FORMAT, .runAddress = 0x280, .bytesPerLine = 8 };
+ *   struct bmSegment program = { 0x280, data, length };
+ *   struct bmOutputBuffer text = { NULL, 0, 0 };
+ *   struct bmOutput out;
+ *
+ *   bmOpenSinkOutput(&out, bmBufferSink, &text);
+ *   bmConvertSegments(&out, &s, &program, 1);
+ *   bmFreeOutput(&out);
+ *   ... use text.data and text.length, then free(text.data) ...
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBBINTOMON_H
+#define LIBBINTOMON_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Output formats */
+enum bmFormat { BM_APPLE1_FORMAT, BM_APPLE2_FORMAT, BM_JMON_FORMAT, BM_KIM1_FORMAT, BM_OSI_FORMAT };
+
+/* An address range to output, from start up to but not including end. */
+struct bmRange {
+    int start;
+    int end;
+};
+
+/* Conversion settings, from the command line options. */
+struct bmSettings {
+    enum bmFormat format;
+    int loadAddress;
+    int runAddress;         // -1 for no run command
+    int bytesPerLine;
+    bool skipFill;
+    unsigned char fillChar;
+    int minRun;             // Use fill commands for runs this long, 0 for never
+    struct bmRange *ranges;
+    int numRanges;
+    bool bankAddresses;     // Give every address a 65816 bank
+};
+
+/* A block of memory to load: its address, and length bytes of data. */
+struct bmSegment {
+    int address;
+    const unsigned char *data;
+    size_t length;
+};
+
+/*
+ * Output engine. Rather than calling printf() for every byte, lines
+ * are formatted into a large buffer using a precomputed byte to hex
+ * lookup table and the buffer is passed on to the sink only when it
+ * fills up or at the end of the conversion. Each conversion has its
+ * own output so that several can run at once in batch mode.
+ */
+
+#define BM_OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/*
+ * A sink is called with each buffer full of output. It returns 0, or
+ * an errno value to discard the rest of the output.
+ */
+typedef int (*bmOutputSink)(void *context, const char *text, size_t length);
+
+struct bmOutput {
+    char *buffer;           // BM_OUTPUT_BUFFER_SIZE bytes
+    size_t length;          // Bytes waiting in buffer
+    long total;             // Total characters flushed
+    bool discard;           // Just count the characters, don't write them
+    bmOutputSink sink;      // Function to pass the output to, or NULL to write() it to fd
+    void *context;          // Passed to sink
+    int fd;                 // File descriptor to write to
+    int error;              // errno from a failed write, or 0
+    bool countLines;        // Keep the line counts below
+    char lineEnd;           // Character that ends a line, newline or return
+    long lines;             // Lines flushed
+    int lineLength;         // Characters so far in the current line
+    int longestLine;        // Most characters in a line, not counting its end
+    bool bankAddresses;     // Give every address a 65816 bank
+    long *rangeOffsets;     // If not NULL, where each range's text starts (-1 if not sent), then where the data ends
+};
+
+/* Output collected in memory by bmBufferSink. Start with all fields zero. */
+struct bmOutputBuffer {
+    char *data;             // malloc()ed, NULL until there is output
+    size_t length;
+    size_t capacity;
+};
+
+bool bmOpenOutput(struct bmOutput *out, int fd);
+bool bmOpenSinkOutput(struct bmOutput *out, bmOutputSink sink, void *context);
+void bmFlushOutput(struct bmOutput *out);
+void bmFreeOutput(struct bmOutput *out);
+int bmBufferSink(void *context, const char *text, size_t length);
+
+/*
+ * Encoders. Each output format has an encoder type, giving its line
+ * end, default bytes per line and the functions that write its text.
+ * An encoder holds the state of one conversion in that format, so the
+ * data can be given to it in pieces as long as their addresses
+ * ascend. Anything before the end of the previous piece is skipped.
+ */
+struct bmEncoder;
+
+struct bmEncoderType {
+    const char *name;
+    char lineEnd;
+    int bytesPerLine;
+    void (*putData)(struct bmEncoder *e, const unsigned char *data, int end);
+    void (*putEnd)(struct bmEncoder *e);
+};
+
+struct bmEncoder {
+    const struct bmEncoderType *type;
+    struct bmOutput *out;
+    const struct bmSettings *s;
+    int address;            // Address after the last byte given
+    bool printAddress;      // The next data needs its address
+    bool lineOpen;          // The output needs a newline before a new address
+    bool continuing;        // A full line ended, so more data at the next address starts with ":"
+    bool inWrite;           // Inside a JMON memory write command
+    int records;            // Paper tape records written
+};
+
+const struct bmEncoderType *bmEncoderFor(enum bmFormat format);
+void bmBeginEncoder(struct bmEncoder *e, struct bmOutput *out, const struct bmSettings *s);
+void bmEncodeSegment(struct bmEncoder *e, int address, const unsigned char *data, size_t n);
+int bmEndEncoder(struct bmEncoder *e);
+
+int bmConvert(struct bmOutput *out, const struct bmSettings *s, const unsigned char *data, size_t dataLength);
+int bmConvertSegments(struct bmOutput *out, const struct bmSettings *s, const struct bmSegment *segments,
+                      int numSegments);
+bool bmCountOutput(const struct bmSettings *s, const unsigned char *data, size_t dataLength, long *chars, long *lines,
+                   int *longestLine);
+int bmFillCommandCost(enum bmFormat format);
+int bmCompareRanges(const void *a, const void *b);
+unsigned int bmBlockChecksum(const unsigned char *bytes, int n);
+
+/* Results of compressing an image. */
+struct bmCompression {
+    int destAddress;        // Where the data is unpacked to (the original load address)
+    int runAddress;         // Original run address
+    int dataAddress;        // Where the compressed data is loaded
+    int stubAddress;        // Where the decompressor is loaded and run
+    size_t packedLength;    // Compressed data length
+    long cycles;            // Approximate 6502 cycles to decompress
+};
+
+bool bmCompressImage(struct bmSettings *s, const unsigned char *data, size_t dataLength, unsigned char **compressed,
+                     size_t *compressedLength, struct bmCompression *c, FILE *log, const char *prefix);
+
+/*
+ * Input formats. A flat binary is loaded at the load address (with the
+ * DOS 3.3 header giving the address if -f is used). The other formats
+ * carry their own addresses and can have several separate segments,
+ * which are output with their own addresses and no padding between.
+ */
+enum bmInputFormat {
+    BM_AUTO_INPUT, BM_BINARY_INPUT, BM_IHEX_INPUT, BM_SREC_INPUT, BM_DUMP_INPUT, BM_APPLESINGLE_INPUT,
+    BM_BASIC_DATA_INPUT
+};
+
+/* Largest span of addresses an input file can cover. */
+#define BM_MAX_IMAGE_SPAN 0x1000000
+
+/* Segments being collected from an input file. */
+struct bmLoader {
+    struct bmRange *segments;
+    int numSegments;
+    unsigned char *bytes;   // Data for each segment in turn
+    size_t numBytes;
+    size_t capacity;
+    long runAddress;        // Start address from the file, or -1
+    int fileType;           // ProDOS file type from an AppleSingle file, or 0
+};
+
+int bmHexDigit(int c);
+bool bmAddSegmentBytes(struct bmLoader *l, long address, const unsigned char *bytes, int n);
+enum bmInputFormat bmDetectInputFormat(const unsigned char *file, size_t length);
+bool bmParseInput(enum bmInputFormat format, const unsigned char *data, size_t length, int loadAddress,
+                  struct bmLoader *l, FILE *log, const char *prefix);
+bool bmBuildImage(struct bmLoader *l, unsigned char **data, size_t *dataLength, int *loadAddress,
+                  struct bmRange **ranges, int *numRanges, FILE *log, const char *prefix);
+
+/*
+ * Monitor text being parsed a piece at a time, each piece ending at
+ * the end of a line.
+ */
+struct bmMonitorText {
+    long address;           // Where the next data byte goes
+    bool haveAddress;
+    bool inWrite;           // In a JMON memory write, which an Escape ends
+    int bank;               // 65816 bank for addresses given without one
+    long line;              // Lines read so far, for error messages
+};
+
+void bmBeginMonitorText(struct bmMonitorText *m);
+bool bmParseMonitorText(struct bmMonitorText *m, const unsigned char *text, size_t length, struct bmLoader *l,
+                        FILE *log, const char *prefix);
+
+/* A symbol or segment from an ld65 map file. */
+struct bmMapEntry {
+    char *name;
+    int value;
+};
+
+/* Symbols and segments read from a map file. Start with all fields zero. */
+struct bmSymbolTable {
+    struct bmMapEntry *entries;
+    int count;
+};
+
+bool bmReadMapFile(struct bmSymbolTable *table, const char *filename, FILE *log, const char *prefix);
+void bmFreeSymbols(struct bmSymbolTable *table);
+bool bmParseNumber(const char *s, int *value);
+bool bmLookupAddress(const struct bmSymbolTable *table, const char *name, int *address, FILE *log, const char *prefix);
+
+/*
+ * Serial transfer cost model. Uploading takes the time to send each
+ * character at the baud rate (with 8N1 framing, 10 bits), plus any
+ * time the monitor needs to process each character and each line
+ * before it is ready for more. A monitor that reads a line into a
+ * buffer before acting on it also has a limit on the line length.
+ */
+struct bmProfile {
+    long baud;
+    double charDelay;       // Milliseconds per character
+    double lineDelay;       // Milliseconds per line
+    int maxLine;            // Most characters in a line before its return, 0 for no limit, -1 for format default
+};
+
+int bmDefaultMaxLine(enum bmFormat format);
+bool bmParseProfile(const char *s, struct bmProfile *p);
+double bmUploadTime(const struct bmProfile *p, long chars, long lines);
+int bmOptimizeLineWidth(const struct bmSettings *s, const struct bmProfile *p, const unsigned char *data,
+                        size_t dataLength);
+
+bool bmIntersectRanges(const struct bmRange *a, int na, const struct bmRange *b, int nb, struct bmRange **result,
+                       int *n);
+bool bmCheckAddresses(const struct bmSettings *s, size_t dataLength, long *highestAddress, FILE *log,
+                      const char *prefix);
+bool bmReadFile(FILE *file, unsigned char **data, size_t *length);
+
+/*
+ * An earlier image of memory to compare against for a delta upload.
+ * Bytes that the base file did not set are unknown and are always sent.
+ */
+struct bmBaseImage {
+    int start;              // Address of data[0]
+    int length;
+    unsigned char *data;
+    bool *known;            // NULL if every byte is known
+};
+
+bool bmReadBaseImage(const char *filename, int loadAddress, bool hasHeader, struct bmBaseImage *base, FILE *log,
+                     const char *prefix);
+void bmFreeBaseImage(struct bmBaseImage *base);
+int bmMaxDeltaGap(enum bmFormat format, const struct bmProfile *p);
+bool bmDeltaRanges(struct bmSettings *s, const unsigned char *data, size_t dataLength, const struct bmBaseImage *base,
+                   int maxGap, long *changed);
+
+/* Block checksums for sendmon to check an upload against. */
+#define BM_DEFAULT_BLOCK_SIZE 256
+
+bool bmSplitBlocks(struct bmSettings *s, size_t dataLength, int blockSize);
+bool bmWriteBlockManifest(const char *filename, const struct bmSettings *s, const unsigned char *data,
+                          const long *offsets, FILE *log, const char *prefix);
+
+/* Cassette tape formats for WAV output. */
+enum bmTapeFormat { BM_NO_TAPE, BM_ACI_TAPE, BM_KIM_TAPE, BM_KIM_FAST_TAPE };
+
+#define BM_DEFAULT_SAMPLE_RATE 44100
+#define BM_DEFAULT_TAPE_ID 1
+
+long bmWriteTape(struct bmOutput *out, enum bmTapeFormat format, int id, int sampleRate, int address,
+                 const unsigned char *data, size_t n);
+
+#endif /* LIBBINTOMON_H */
@@ -0,0 +1,660 @@
+/*
+ * Convert Woz monitor, paper tape, or OSI load files back to binary.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * usage: montobin [-h] [-v] [-s] [-p <Pad>] [-o <OutputFile>] <Filename>
+ *
+ * This is the reverse of bintomon. It reads a file in one of the
+ * formats below and writes the memory image it would load.
+ *
+ * Apple 1 Woz Monitor or Apple II Monitor format (.mon), e.g.
+ *   0280: A2 FF 9A 20 8C 02 20 83
+ *   : 09 4C 00 FF
+ *   0290:00
+ *   0291<0290.02A0M
+ *   0280R
+ *   01/2000: 18 FB
+ * JMON format (.mon), e.g.
+ *   :0280 A2 FF 9A 20 8C 02 20 83<Esc>F 0290 02A0 00
+ *   G0280
+ * Hex dump format with an address at the start of each line (.hex), e.g.
+ *   1000 65 D0 20 18 18 D3 20 10
+ * MOS Technology (KIM-1) paper tape format (.ptp), e.g.
+ *   ;180200A9008D0117...09AB
+ *   ;0000010001
+ * OSI 65V monitor load format (.lod), e.g.
+ *   .1000/65<CR>D0<CR>....1000G<CR>
+ *
+ * The format is detected from the start of the file. Monitor files are
+ * interpreted the way the monitor itself would, so for example a
+ * "RUN" command for BASIC after the data is ignored, while the fill
+ * commands bintomon -x writes are carried out. They and hex dumps are
+ * read by libbintomon, as for bintomon -i hex, so that both read the
+ * same text the same way. Paper tape record checksums and the final
+ * record count are checked.
+ *
+ * The data is collected into a list of segments (address and bytes),
+ * with overlapping or adjacent segments merged. By default a flat
+ * binary image is written from the lowest to the highest address
+ * loaded, with any gaps filled with the -p <Pad> byte (defaults to 0).
+ * With the -s option each segment is instead written with a four byte
+ * header holding its load address and length (low byte first), the
+ * same header read by the bintomon -f option.
+ * Output goes to standard output unless -o <OutputFile> is given. A
+ * filename of - reads from standard input.
+ * With the -v option the segments and run address are listed on
+ * standard error.
+ *
+ * Examples:
+ * montobin basic.mon >basic.bin
+ * montobin -v -s -o microchess.seg microchess.ptp
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "libbintomon.h"
+
+/* Input formats */
+enum format { MONITOR_FORMAT, PTP_FORMAT, OSI_FORMAT };
+
+static const char *formatNames[] = {
+    "Woz/Apple II monitor, JMON or hex dump", "MOS Technology paper tape", "OSI 65V monitor load"
+};
+
+/* A contiguous block of memory loaded from the file. */
+struct segment {
+    int address;
+    size_t length;
+    size_t capacity;
+    unsigned char *data;
+    int order; // Position in the file, so later data can win on overlap
+};
+
+static struct segment *segments = NULL;
+static int numSegments = 0;
+static int maxSegments = 0;
+
+/* Segment currently being appended to. */
+static struct segment *current = NULL;
+
+/* Value of each character as a hex digit, or -1. */
+static signed char hexValue[256];
+
+/* Name of program, for error messages. */
+static const char *programName;
+
+/* Current line of input, for error messages. */
+static int lineNumber = 1;
+
+/* Set if any errors (e.g. bad checksums) were found. */
+static bool errors = false;
+
+/* print command usage */
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-h] [-v] [-s] [-p <Pad>] [-o <OutputFile>] <Filename>\n", name);
+}
+
+/* Show help info */
+void showHelp(const char *name)
+{
+    usage(name);
+    fprintf(stderr,
+            "\n-h  Show help info and exit.\n"
+            "-v  Show verbose output.\n"
+            "-s  Write each segment with a 4 byte address/length header.\n"
+            "-p <Pad>  Byte used to fill gaps in flat binary output (defaults to 0).\n"
+            "-o <OutputFile>  Write to file rather than standard output.\n\n"
+            "Reads Woz/Apple II monitor or JMON (.mon), hex dump (.hex), KIM-1 paper tape\n"
+            "(.ptp) and OSI monitor load (.lod) files. The format is detected automatically.\n"
+            "A filename of - reads from standard input.\n");
+}
+
+/* Fill in the hex digit lookup table. */
+void initHexValue(void)
+{
+    for (int i = 0; i < 256; i++)
+        hexValue[i] = -1;
+    for (int i = 0; i < 10; i++)
+        hexValue['0' + i] = i;
+    for (int i = 0; i < 6; i++) {
+        hexValue['A' + i] = 10 + i;
+        hexValue['a' + i] = 10 + i;
+    }
+}
+
+/* Exit with an out of memory error. */
+void outOfMemory(void)
+{
+    fprintf(stderr, "%s: Out of memory\n", programName);
+    exit(EXIT_FAILURE);
+}
+
+/* Start a new segment at the given address. */
+void newSegment(int address)
+{
+    if (numSegments == maxSegments) {
+        maxSegments = maxSegments ? 2 * maxSegments : 16;
+        segments = realloc(segments, maxSegments * sizeof(struct segment));
+        if (segments == NULL)
+            outOfMemory();
+    }
+    current = &segments[numSegments];
+    current->address = address;
+    current->length = 0;
+    current->capacity = 0;
+    current->data = NULL;
+    current->order = numSegments;
+    numSegments++;
+}
+
+/* Store a byte at an address, starting a new segment if it is not contiguous. */
+static inline void storeByte(int address, unsigned char b)
+{
+    if (current == NULL || address != current->address + (int)current->length)
+        newSegment(address);
+    if (current->length == current->capacity) {
+        current->capacity = current->capacity ? 2 * current->capacity : 256;
+        current->data = realloc(current->data, current->capacity);
+        if (current->data == NULL)
+            outOfMemory();
+    }
+    current->data[current->length++] = b;
+}
+
+/* Compare segments by address, then by position in file, for qsort(). */
+int compareSegments(const void *a, const void *b)
+{
+    const struct segment *s1 = a;
+    const struct segment *s2 = b;
+
+    if (s1->address != s2->address)
+        return s1->address < s2->address ? -1 : 1;
+    return s1->order - s2->order;
+}
+
+/* Compare segments by position in file, for qsort(). */
+int compareOrder(const void *a, const void *b)
+{
+    return ((const struct segment *)a)->order - ((const struct segment *)b)->order;
+}
+
+/*
+ * Sort the segments by address and merge any that overlap or are
+ * adjacent. Where data overlaps, whatever came later in the file wins,
+ * as it would when loaded into memory.
+ */
+void mergeSegments(void)
+{
+    int out = 0;
+
+    /* Drop empty segments. */
+    for (int i = 0; i < numSegments; i++) {
+        if (segments[i].length != 0)
+            segments[out++] = segments[i];
+        else
+            free(segments[i].data);
+    }
+    numSegments = out;
+
+    qsort(segments, numSegments, sizeof(struct segment), compareSegments);
+
+    out = 0;
+    for (int i = 0; i < numSegments; ) {
+        int start = segments[i].address;
+        int end = start + segments[i].length;
+        int j = i + 1;
+
+        while (j < numSegments && segments[j].address <= end) {
+            if (segments[j].address + (int)segments[j].length > end)
+                end = segments[j].address + segments[j].length;
+            j++;
+        }
+
+        if (j == i + 1) {
+            segments[out++] = segments[i];
+        } else {
+            struct segment merged;
+
+            merged.address = start;
+            merged.length = end - start;
+            merged.capacity = merged.length;
+            merged.data = malloc(merged.length);
+            if (merged.data == NULL)
+                outOfMemory();
+
+            /* Copy in file order so later data overwrites earlier. */
+            qsort(&segments[i], j - i, sizeof(struct segment), compareOrder);
+            merged.order = segments[i].order;
+            for (int k = i; k < j; k++) {
+                memcpy(merged.data + (segments[k].address - start), segments[k].data, segments[k].length);
+                free(segments[k].data);
+            }
+            segments[out++] = merged;
+        }
+        i = j;
+    }
+    numSegments = out;
+    current = NULL;
+}
+
+/*
+ * Parser state. Paper tape and OSI files are processed one character
+ * at a time. Monitor text is parsed by libbintomon a line at a time.
+ */
+struct parser {
+    enum format format;
+    struct bmMonitorText monitor;
+    struct bmLoader loader;
+    int value;          // Hex number being accumulated
+    int digits;         // Number of hex digits in value
+    bool store;         // OSI: data mode
+    bool address;       // OSI: address mode
+    int storeAddress;   // Address for next byte stored
+    int runAddress;     // -1 if none
+
+    /* Paper tape record being read. */
+    bool inRecord;
+    int recordBytes;
+    int dataRecords;
+    bool sawEnd;
+    unsigned char record[1 + 2 + 255 + 2];
+};
+
+/* Check and store a complete paper tape record. */
+void endPtpRecord(struct parser *p)
+{
+    unsigned char *r = p->record;
+    unsigned int sum = 0;
+    int n;
+
+    p->inRecord = false;
+    if (p->digits) {
+        fprintf(stderr, "%s: Line %d: Odd number of hex digits in record\n", programName, lineNumber);
+        errors = true;
+        return;
+    }
+    if (p->recordBytes < 5 || p->recordBytes != r[0] + 5) {
+        fprintf(stderr, "%s: Line %d: Record length does not match data\n", programName, lineNumber);
+        errors = true;
+        return;
+    }
+    n = r[0];
+    for (int i = 0; i < n + 3; i++)
+        sum += r[i];
+    if ((sum & 0xffff) != ((r[n + 3] << 8) | r[n + 4])) {
+        fprintf(stderr, "%s: Line %d: Bad checksum $%04X, expected $%04X\n",
+                programName, lineNumber, (r[n + 3] << 8) | r[n + 4], sum & 0xffff);
+        errors = true;
+        return;
+    }
+    if (n == 0) {
+        /* Last record holds the number of data records. */
+        int count = (r[1] << 8) | r[2];
+        if (count != p->dataRecords) {
+            fprintf(stderr, "%s: Line %d: Record count is %d but read %d records\n",
+                    programName, lineNumber, count, p->dataRecords);
+            errors = true;
+        }
+        p->sawEnd = true;
+        return;
+    }
+    int address = (r[1] << 8) | r[2];
+    for (int i = 0; i < n; i++)
+        storeByte(address + i, r[3 + i]);
+    p->dataRecords++;
+}
+
+/*
+ * MOS Technology paper tape: ";" then length, address, data and a
+ * 16-bit checksum in hex. Anything outside a record is ignored.
+ */
+static inline void parsePtp(struct parser *p, int c)
+{
+    int d = hexValue[c];
+
+    if (c == ';') {
+        if (p->inRecord)
+            endPtpRecord(p);
+        p->inRecord = true;
+        p->recordBytes = 0;
+        p->value = 0;
+        p->digits = 0;
+        return;
+    }
+    if (!p->inRecord)
+        return;
+    if (d >= 0) {
+        p->value = (p->value << 4) | d;
+        if (++p->digits == 2) {
+            if (p->recordBytes < (int)sizeof(p->record))
+                p->record[p->recordBytes] = p->value;
+            p->recordBytes++;
+            p->value = 0;
+            p->digits = 0;
+        }
+    } else if (c == '\n' || c == '\r') {
+        endPtpRecord(p);
+    } else if (c != ' ' && c != '\0') {
+        fprintf(stderr, "%s: Line %d: Invalid character in record\n", programName, lineNumber);
+        errors = true;
+        p->inRecord = false;
+    }
+}
+
+/*
+ * OSI 65V monitor: "." enters address mode and "/" data mode. In
+ * address mode the last four hex digits typed are the address and G
+ * runs it. In data mode the last two digits are stored by a return.
+ */
+static inline void parseOsi(struct parser *p, int c)
+{
+    int d = hexValue[c];
+
+    if (d >= 0) {
+        p->value = ((p->value << 4) | d) & 0xffff;
+        p->digits++;
+        return;
+    }
+    switch (c) {
+    case '.':
+        p->address = true;
+        p->store = false;
+        break;
+    case '/':
+        if (p->address && p->digits)
+            p->storeAddress = p->value;
+        p->address = false;
+        p->store = true;
+        break;
+    case '\r':
+    case '\n':
+        if (p->store && p->digits)
+            storeByte(p->storeAddress++, p->value & 0xff);
+        break;
+    case 'G':
+    case 'g':
+        if (p->address && p->digits)
+            p->runAddress = p->value;
+        break;
+    }
+    p->value = 0;
+    p->digits = 0;
+}
+
+/* Work out the format from the start of the file. */
+enum format detectFormat(const unsigned char *buf, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\r' || buf[i] == '\n' || buf[i] == '\0'))
+        i++;
+    if (i < n && buf[i] == ';')
+        return PTP_FORMAT;
+    if (i < n && buf[i] == '.')
+        return OSI_FORMAT;
+    return MONITOR_FORMAT;
+}
+
+/*
+ * At the end of monitor text or a hex dump, store the segments
+ * libbintomon loaded, in the order they were loaded so that later data
+ * still wins.
+ */
+void endMonitor(struct parser *p)
+{
+    struct bmLoader *l = &p->loader;
+    size_t offset = 0;
+
+    for (int i = 0; i < l->numSegments; i++) {
+        for (long address = l->segments[i].start; address < l->segments[i].end; address++)
+            storeByte(address, l->bytes[offset++]);
+    }
+    p->runAddress = l->runAddress;
+    free(l->segments);
+    free(l->bytes);
+}
+
+/*
+ * Parse some input, returning false after an error that stops it being
+ * loaded. Monitor text must be given whole lines.
+ */
+bool parseBuffer(struct parser *p, const unsigned char *buf, size_t n)
+{
+    switch (p->format) {
+    case MONITOR_FORMAT:
+        return bmParseMonitorText(&p->monitor, buf, n, &p->loader, stderr, programName);
+    case PTP_FORMAT:
+        for (size_t i = 0; i < n; i++) {
+            parsePtp(p, buf[i]);
+            lineNumber += (buf[i] == '\n');
+        }
+        break;
+    case OSI_FORMAT:
+        for (size_t i = 0; i < n; i++) {
+            parseOsi(p, buf[i]);
+            lineNumber += (buf[i] == '\n');
+        }
+        break;
+    }
+    return true;
+}
+
+/* Write data to the output file, exiting on error. */
+void writeData(FILE *file, const void *data, size_t n)
+{
+    if (fwrite(data, 1, n, file) != n) {
+        perror(programName);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    FILE *output = stdout;
+    static unsigned char buffer[256 * 1024];
+    unsigned char *input = buffer;
+    size_t capacity = sizeof(buffer);
+    size_t length = 0, kept = 0;
+    size_t n;
+    bool detected = false;
+    int opt;
+    bool verbose = false;
+    bool writeSegments = false;
+    unsigned char pad = 0;
+    const char *outputName = NULL;
+    struct parser parser;
+
+    programName = argv[0];
+
+    while ((opt = getopt(argc, argv, "hvsp:o:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 's':
+            writeSegments = true;
+            break;
+        case 'p':
+            pad = strtol(optarg, 0, 0);
+            break;
+        case 'o':
+            outputName = optarg;
+            break;
+        case 'h':
+            showHelp(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc != optind + 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!strcmp(argv[optind], "-")) {
+        file = stdin;
+    } else {
+        file = fopen(argv[optind], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], argv[optind]);
+            return 1;
+        }
+    }
+
+    initHexValue();
+    memset(&parser, 0, sizeof(parser));
+    parser.runAddress = -1;
+    parser.loader.runAddress = -1;
+    bmBeginMonitorText(&parser.monitor);
+
+    /*
+     * Read the file in chunks, parsing each as it comes. Monitor text is
+     * parsed a line at a time, so a line split between chunks is kept
+     * back and parsed with the next one. Only a line longer than the
+     * buffer makes it grow.
+     */
+    do {
+        size_t end;
+
+        n = fread(input + kept, 1, capacity - kept, file);
+        length = kept + n;
+        if (!detected && length != 0) {
+            parser.format = detectFormat(input, length);
+            detected = true;
+        }
+        end = length;
+        if (parser.format == MONITOR_FORMAT && n != 0) {
+            while (end > 0 && input[end - 1] != '\n' && input[end - 1] != '\r')
+                end--;
+        }
+        if (end == 0 && length == capacity) {
+            unsigned char *bigger = malloc(2 * capacity);
+            if (bigger == NULL)
+                outOfMemory();
+            memcpy(bigger, input, length);
+            if (input != buffer)
+                free(input);
+            input = bigger;
+            capacity *= 2;
+        } else if (!parseBuffer(&parser, input, end)) {
+            return 1;
+        } else {
+            memmove(input, input + end, length - end);
+            length -= end;
+        }
+        kept = length;
+    } while (n != 0);
+    if (ferror(file)) {
+        fprintf(stderr, "%s: Error reading '%s'\n", argv[0], argv[optind]);
+        return 1;
+    }
+    if (file != stdin)
+        fclose(file);
+    if (input != buffer)
+        free(input);
+
+    /* Finish off anything not ended by a newline. */
+    switch (parser.format) {
+    case MONITOR_FORMAT:
+        endMonitor(&parser);
+        break;
+    case PTP_FORMAT:
+        if (parser.inRecord)
+            endPtpRecord(&parser);
+        if (!parser.sawEnd) {
+            fprintf(stderr, "%s: Missing final paper tape record\n", argv[0]);
+            errors = true;
+        }
+        break;
+    case OSI_FORMAT:
+        parseOsi(&parser, ' ');
+        break;
+    }
+
+    mergeSegments();
+
+    if (verbose) {
+        fprintf(stderr, "Format: %s\n", formatNames[parser.format]);
+        for (int i = 0; i < numSegments; i++) {
+            fprintf(stderr, "Segment: $%04X-$%04X (%zu bytes)\n", segments[i].address,
+                    segments[i].address + (int)segments[i].length - 1, segments[i].length);
+        }
+        if (parser.runAddress != -1)
+            fprintf(stderr, "Run address: $%04X\n", parser.runAddress);
+        else
+            fprintf(stderr, "Run address: none\n");
+    }
+
+    if (numSegments == 0) {
+        fprintf(stderr, "%s: No data found in '%s'\n", argv[0], argv[optind]);
+        return 1;
+    }
+
+    if (outputName != NULL) {
+        output = fopen(outputName, "wb");
+        if (output == NULL) {
+            fprintf(stderr, "%s: Unable to create '%s'\n", argv[0], outputName);
+            return 1;
+        }
+    }
+
+    if (writeSegments) {
+        for (int i = 0; i < numSegments; i++) {
+            unsigned char header[4];
+
+            if (segments[i].address > 0xffff || segments[i].length > 0xffff) {
+                fprintf(stderr, "%s: Segment at $%04X does not fit in a 4 byte header\n", argv[0], segments[i].address);
+                return 1;
+            }
+            header[0] = segments[i].address & 0xff;
+            header[1] = segments[i].address >> 8;
+            header[2] = segments[i].length & 0xff;
+            header[3] = segments[i].length >> 8;
+            writeData(output, header, sizeof(header));
+            writeData(output, segments[i].data, segments[i].length);
+        }
+    } else {
+        int address = segments[0].address;
+        memset(buffer, pad, sizeof(buffer));
+        for (int i = 0; i < numSegments; i++) {
+            /* Fill any gap before this segment. */
+            while (address < segments[i].address) {
+                size_t gap = segments[i].address - address;
+                if (gap > sizeof(buffer))
+                    gap = sizeof(buffer);
+                writeData(output, buffer, gap);
+                address += gap;
+            }
+            writeData(output, segments[i].data, segments[i].length);
+            address += segments[i].length;
+        }
+    }
+
+    if (fclose(output) != 0) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,893 @@
+/*
+ * Send a monitor load file to a 6502 system over a serial port, with
+ * pacing so that the monitor can keep up.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * usage: sendmon [-h] [-v] [-r] [-n] [-d <Device>] [-b <Baud>] [-c <CharDelay>] [-l <LineDelay>] [-e] [-p <Prompt>] [-t <Timeout>] [-k <Blocks> [-s] [-m <Method>] [-w <Address>] [-a <Attempts>]] [<Filename>]
+ *
+ * This replaces the old scripts/SEND (stty, tr and ascii-xfr through
+ * a temporary file). The file, or standard input if no file or - is
+ * given, is streamed straight to the serial device, so the output of
+ * bintomon can be piped into it. Newlines are translated to returns
+ * as they are sent (a newline following a return is dropped) unless
+ * -n is given.
+ *
+ * The -d option gives the serial device (defaults to /dev/ttyUSB0) and
+ * -b its baud rate (defaults to 9600, or -b 0 to keep the speed the
+ * device is already set to). The device is put in raw mode for the
+ * transfer and restored afterwards. Anything that is not a
+ * terminal, such as a pipe or file, is written as is.
+ *
+ * Pacing:
+ * -c <CharDelay> waits this many milliseconds after each character.
+ * -l <LineDelay> waits this many milliseconds after each return.
+ * -e waits for each character to be echoed back before sending the
+ *    next, which paces the transfer to the speed the monitor reads
+ *    and echoes at (e.g. the Apple 1 display).
+ * -p <Prompt> waits after each return until the prompt character is
+ *    received, meaning the monitor has processed the line, e.g. -p '*'
+ *    for the Apple II monitor. It can be given as a character or a
+ *    number such as 0x0d.
+ * -t <Timeout> is how many milliseconds to wait for an echo or prompt
+ *    (defaults to 1000). On a timeout sending carries on, and the
+ *    number of timeouts is reported.
+ * Delays can have a fractional part, e.g. -c 0.5.
+ *
+ * Checking and repairing an upload:
+ * -k <Blocks> reads a block manifest written by bintomon --blocks for
+ *    the file. After sending, the checksum of each block is read back
+ *    from the target and only the text for blocks that differ is sent
+ *    again, until all match. The run command at the end of the file
+ *    is only sent once they do. This needs the Woz Monitor or Apple II
+ *    Monitor and a file rather than standard input.
+ * -s skips sending the whole file first, to check and repair an
+ *    upload that was already done.
+ * -m <Method> is how checksums are read back: "routine" (the default)
+ *    loads a 38 byte checksum routine and runs it for each block,
+ *    which returns just 5 characters per block. It uses zero page $06
+ *    to $09. "dump" has the monitor display each block instead, which
+ *    needs no memory on the target but is as slow as sending it.
+ * -w <Address> is where to load the checksum routine. By default it
+ *    goes in the first free space from $0300 up that no block uses.
+ * -a <Attempts> is how many times bad blocks are sent again before
+ *    giving up (defaults to 3). The exit status is 1 if any block
+ *    still differs.
+ *
+ * With -r anything received from the device is copied to standard
+ * output. With -v the characters sent, time taken, effective bytes
+ * per second and any timeouts are reported on standard error.
+ *
+ * Any pseudo-terminal can stand in for the real machine for testing,
+ * e.g. one end of "socat -d -d pty,raw,echo=0 pty,raw,echo=0" with a
+ * program echoing on the other.
+ *
+ * Examples:
+ * sendmon jmon.mon
+ * bintomon -m wozmon.map -s RESET wozmon.bin | sendmon -e -v
+ * sendmon -d /dev/ttyUSB1 -b 19200 -p '*' appleiimonitor.mon
+ * sendmon -n -c 2 jmon.lod
+ * bintomon --blocks basic.blk -l 0xE000 basic.bin >basic.mon
+ * sendmon -e -v -k basic.blk basic.mon
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include "libbintomon.h"
+
+/* print command usage */
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [-h] [-v] [-r] [-n] [-d <Device>] [-b <Baud>] [-c <CharDelay>] [-l <LineDelay>] [-e] [-p <Prompt>] [-t <Timeout>] [-k <Blocks> [-s] [-m <Method>] [-w <Address>] [-a <Attempts>]] [<Filename>]\n", name);
+}
+
+/* Show help info */
+void showHelp(char *name)
+{
+    usage(name);
+    fprintf(stderr,
+            "\n-h  Show help info and exit.\n"
+            "-v  Report characters sent, time taken and bytes per second.\n"
+            "-r  Copy characters received from the device to standard output.\n"
+            "-n  Don't translate newlines to returns.\n"
+            "-d <Device>  Serial device (defaults to /dev/ttyUSB0).\n"
+            "-b <Baud>  Baud rate (defaults to 9600, 0 keeps the device's speed).\n"
+            "-c <CharDelay>  Milliseconds to wait after each character.\n"
+            "-l <LineDelay>  Milliseconds to wait after each line.\n"
+            "-e  Wait for each character to be echoed.\n"
+            "-p <Prompt>  Wait for the monitor's prompt character after each line.\n"
+            "-t <Timeout>  Milliseconds to wait for an echo or prompt (defaults to 1000).\n"
+            "-k <Blocks>  Check blocks from a bintomon --blocks manifest and resend bad ones.\n"
+            "-s  With -k, don't send the whole file first, just check and repair.\n"
+            "-m <Method>  Read back checksums with a routine on the target or a dump.\n"
+            "-w <Address>  Where to load the checksum routine (defaults to free space).\n"
+            "-a <Attempts>  Times to resend bad blocks before giving up (defaults to 3).\n\n"
+            "Reads standard input if no file or - is given.\n");
+}
+
+/* Settings from the command line options. */
+struct settings {
+    const char *device;
+    long baud;
+    double charDelay;   // Milliseconds
+    double lineDelay;   // Milliseconds
+    bool waitEcho;
+    int prompt;         // Character to wait for after each line, or -1
+    int timeout;        // Milliseconds
+    bool translate;     // Newlines to returns
+    bool showReceived;
+    bool verbose;
+    bool paced;         // Send a character at a time
+    const char *blocksName; // Block manifest to check against
+    bool skipSend;
+    bool useDump;       // Read back blocks with a dump rather than the routine
+    int routineAddress; // -1 to find free space
+    int attempts;
+};
+
+/* Transfer statistics. */
+struct stats {
+    long sent;
+    long lines;
+    long timeouts;
+};
+
+/* A block from a bintomon --blocks manifest. */
+struct block {
+    int address;
+    int length;
+    unsigned int checksum;
+    long offset;        // Where its text is in the file
+    long textLength;
+    bool bad;
+};
+
+static const char *programName;
+
+/* The serial device, and its settings before we changed them. */
+static int device = -1;
+static struct termios savedTermios;
+static bool restoreTermios = false;
+
+/* Baud rates and their termios speeds. */
+static const struct {
+    long baud;
+    speed_t speed;
+} speeds[] = {
+    { 300, B300 }, { 600, B600 }, { 1200, B1200 }, { 2400, B2400 },
+    { 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+    { 57600, B57600 }, { 115200, B115200 }, { 230400, B230400 }
+};
+
+/* Return the current time in seconds. */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Wait for a number of milliseconds. */
+void delay(double ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms - ts.tv_sec * 1000.0) * 1e6;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * Put the serial device in raw mode at the baud rate, or its current
+ * speed if the baud rate is 0. Returns false on error.
+ */
+bool setupDevice(const struct settings *s)
+{
+    struct termios t;
+    speed_t speed = 0;
+
+    /* Pipes and files (e.g. for testing) are used as they are. */
+    if (!isatty(device))
+        return true;
+
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (speeds[i].baud == s->baud)
+            speed = speeds[i].speed;
+    }
+    if (speed == 0 && s->baud != 0) {
+        fprintf(stderr, "%s: Unsupported baud rate %ld\n", programName, s->baud);
+        return false;
+    }
+
+    if (tcgetattr(device, &savedTermios) != 0) {
+        perror("sendmon: tcgetattr");
+        return false;
+    }
+    t = savedTermios;
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cflag &= ~HUPCL;
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    if (s->baud != 0) {
+        cfsetispeed(&t, speed);
+        cfsetospeed(&t, speed);
+    }
+    if (tcsetattr(device, TCSANOW, &t) != 0) {
+        perror("sendmon: tcsetattr");
+        return false;
+    }
+    restoreTermios = true;
+    return true;
+}
+
+/* Put the serial device back the way it was. */
+void restoreDevice(void)
+{
+    if (restoreTermios) {
+        tcdrain(device);
+        tcsetattr(device, TCSANOW, &savedTermios);
+        restoreTermios = false;
+    }
+}
+
+/* Write bytes to the device. Exits on error. */
+void writeDevice(const unsigned char *bytes, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = write(device, bytes, n);
+        if (written < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("sendmon: write");
+            restoreDevice();
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        n -= written;
+    }
+}
+
+/*
+ * Read from the device until the character c is received, or until
+ * timeout milliseconds pass. Bit 7 is ignored, as many 6502 systems
+ * set it. With c of -1 just read whatever is waiting. Returns false
+ * on a timeout.
+ */
+bool waitFor(const struct settings *s, int c, int timeout)
+{
+    double deadline = now() + timeout / 1000.0;
+
+    for (;;) {
+        struct pollfd pfd = { device, POLLIN, 0 };
+        int ms = c == -1 ? 0 : (int)((deadline - now()) * 1000 + 0.5);
+        unsigned char ch;
+
+        if (ms < 0)
+            ms = 0;
+        if (poll(&pfd, 1, ms) <= 0 || !(pfd.revents & POLLIN))
+            return c == -1;
+        if (read(device, &ch, 1) != 1)
+            return c == -1;
+        if (s->showReceived) {
+            putchar(ch & 0x7f);
+            fflush(stdout);
+        }
+        if (c != -1 && (ch & 0x7f) == (c & 0x7f))
+            return true;
+    }
+}
+
+/* Return if a character ends a line: a return, or a newline when they are sent as is. */
+bool isLineEnd(const struct settings *s, unsigned char c)
+{
+    return c == '\r' || (c == '\n' && !s->translate);
+}
+
+/* Send one character with the requested pacing. */
+void sendPaced(const struct settings *s, struct stats *stats, unsigned char c)
+{
+    writeDevice(&c, 1);
+    stats->sent++;
+
+    if (s->waitEcho) {
+        if (!waitFor(s, c, s->timeout))
+            stats->timeouts++;
+    } else if (s->showReceived) {
+        waitFor(s, -1, 0);
+    }
+    delay(s->charDelay);
+
+    if (isLineEnd(s, c)) {
+        stats->lines++;
+        if (s->prompt != -1 && !waitFor(s, s->prompt, s->timeout))
+            stats->timeouts++;
+        delay(s->lineDelay);
+    }
+}
+
+/* Parse a prompt character given as a single character or a number. */
+bool parsePrompt(const char *arg, int *prompt)
+{
+    char *end;
+
+    if (arg[0] != '\0' && arg[1] == '\0') {
+        *prompt = (unsigned char)arg[0];
+        return true;
+    }
+    *prompt = strtol(arg, &end, 0);
+    return end != arg && *end == '\0' && *prompt >= 0 && *prompt <= 255;
+}
+
+/*
+ * Send text, translating newlines to returns unless -n was given, with
+ * the requested pacing. *lastCR says if the last character sent was a
+ * return, so that a newline after it can be dropped.
+ */
+void sendText(const struct settings *s, struct stats *stats, const unsigned char *text, size_t n, bool *lastCR)
+{
+    static unsigned char outBuffer[64 * 1024];
+    size_t length = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = text[i];
+        bool afterCR = *lastCR;
+
+        *lastCR = c == '\r';
+        if (s->translate && c == '\n') {
+            if (afterCR)
+                continue;
+            c = '\r';
+        }
+        if (s->paced) {
+            sendPaced(s, stats, c);
+        } else {
+            outBuffer[length++] = c;
+            if (isLineEnd(s, c))
+                stats->lines++;
+            if (length == sizeof(outBuffer)) {
+                writeDevice(outBuffer, length);
+                stats->sent += length;
+                length = 0;
+            }
+        }
+    }
+    if (length > 0) {
+        writeDevice(outBuffer, length);
+        stats->sent += length;
+    }
+}
+
+/*
+ * Read a character from the device, waiting up to timeout
+ * milliseconds. Returns it with bit 7 cleared, or -1 on a timeout.
+ */
+int readDevice(const struct settings *s, int timeout)
+{
+    struct pollfd pfd = { device, POLLIN, 0 };
+    unsigned char ch;
+
+    if (poll(&pfd, 1, timeout) <= 0 || !(pfd.revents & POLLIN))
+        return -1;
+    if (read(device, &ch, 1) != 1)
+        return -1;
+    if (s->showReceived) {
+        putchar(ch & 0x7f);
+        fflush(stdout);
+    }
+    return ch & 0x7f;
+}
+
+/* Read and drop anything received until the device has been quiet for a while. */
+void drainInput(const struct settings *s)
+{
+    while (readDevice(s, 200) != -1)
+        ;
+}
+
+/*
+ * Read a block manifest written by bintomon --blocks. Returns false,
+ * after reporting the error, if it can't be read.
+ */
+bool readBlockManifest(const char *filename, long fileLength, struct block **blocks, int *numBlocks, bool *apple1)
+{
+    FILE *file = fopen(filename, "r");
+    char line[256];
+    char format[16];
+    int lineNumber = 1;
+
+    if (file == NULL) {
+        fprintf(stderr, "%s: Unable to open block manifest '%s'\n", programName, filename);
+        return false;
+    }
+    if (fgets(line, sizeof(line), file) == NULL || sscanf(line, "bintomon-blocks %15s", format) != 1 ||
+        (strcmp(format, "apple1") != 0 && strcmp(format, "apple2") != 0)) {
+        fprintf(stderr, "%s: '%s' is not a Woz Monitor or Apple II Monitor block manifest\n", programName, filename);
+        fclose(file);
+        return false;
+    }
+    *apple1 = !strcmp(format, "apple1");
+
+    *blocks = NULL;
+    *numBlocks = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct block b = { .bad = false };
+
+        lineNumber++;
+        if (sscanf(line, "%x %d %x %ld %ld", &b.address, &b.length, &b.checksum, &b.offset, &b.textLength) != 5 ||
+            b.length < 1 || b.length > 256 || b.address + b.length > 0x10000 ||
+            b.offset < 0 || b.textLength < 0 || b.offset + b.textLength > fileLength) {
+            fprintf(stderr, "%s: %s:%d: Invalid block (or not for this file)\n", programName, filename, lineNumber);
+            free(*blocks);
+            fclose(file);
+            return false;
+        }
+        if (*numBlocks % 256 == 0) {
+            *blocks = realloc(*blocks, (*numBlocks + 256) * sizeof(struct block));
+            if (*blocks == NULL) {
+                fprintf(stderr, "%s: Out of memory\n", programName);
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*blocks)[(*numBlocks)++] = b;
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ * 6502 routine that prints the checksum of a block as "=" and four hex
+ * digits. The block address is at $06-$07 and its length (0 for 256)
+ * at $08, and $09 holds the running sum of sums:
+ *
+ *         LDX #$00        ; X = sum of bytes
+ *         STX $09
+ *         LDY #$00
+ * LOOP    TXA
+ *         CLC
+ *         ADC ($06),Y
+ *         TAX
+ *         CLC
+ *         ADC $09
+ *         STA $09
+ *         INY
+ *         CPY $08
+ *         BNE LOOP
+ *         LDA #'=' + $80
+ *         JSR ECHO
+ *         LDA $09
+ *         JSR PRBYTE
+ *         TXA
+ *         JSR PRBYTE
+ *         JMP GETLINE     ; RTS for the Apple II monitor's G command
+ *
+ * It is position independent. The Woz Monitor's ECHO, PRBYTE and
+ * GETLINE are patched to COUT, PRBYTE and RTS for the Apple II.
+ */
+static const unsigned char checksumRoutine[] = {
+    0xA2, 0x00, 0x86, 0x09, 0xA0, 0x00, 0x8A, 0x18,
+    0x71, 0x06, 0xAA, 0x18, 0x65, 0x09, 0x85, 0x09,
+    0xC8, 0xC4, 0x08, 0xD0, 0xF1, 0xA9, 0xBD, 0x20,
+    0xEF, 0xFF, 0xA5, 0x09, 0x20, 0xDC, 0xFF, 0x8A,
+    0x20, 0xDC, 0xFF, 0x4C, 0x1F, 0xFF
+};
+#define ROUTINE_ECHO 0x18
+#define ROUTINE_PRBYTE1 0x1D
+#define ROUTINE_PRBYTE2 0x21
+#define ROUTINE_EXIT 0x23
+#define ROUTINE_ZERO_PAGE 0x06   // Uses $06-$09
+
+/* Make the checksum routine for the monitor. Returns its length. */
+int buildRoutine(bool apple1, unsigned char *code)
+{
+    memcpy(code, checksumRoutine, sizeof(checksumRoutine));
+    if (apple1)
+        return sizeof(checksumRoutine);
+    code[ROUTINE_ECHO] = 0xED;      // COUT $FDED
+    code[ROUTINE_ECHO + 1] = 0xFD;
+    code[ROUTINE_PRBYTE1] = 0xDA;   // PRBYTE $FDDA
+    code[ROUTINE_PRBYTE1 + 1] = 0xFD;
+    code[ROUTINE_PRBYTE2] = 0xDA;
+    code[ROUTINE_PRBYTE2 + 1] = 0xFD;
+    code[ROUTINE_EXIT] = 0x60;      // RTS
+    return ROUTINE_EXIT + 1;
+}
+
+/* Return if an address range overlaps any block. */
+bool overlapsBlocks(int start, int end, const struct block *blocks, int numBlocks)
+{
+    for (int i = 0; i < numBlocks; i++) {
+        if (start < blocks[i].address + blocks[i].length && blocks[i].address < end)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Read back the bytes of a block with the monitor's examine command,
+ * "AAAA.BBBB", whose output has lines like "AAAA: XX XX" (Woz Monitor)
+ * or "AAAA- XX XX" (Apple II). Returns the checksum of the bytes, or -1
+ * if they don't all arrive in time.
+ */
+long dumpChecksum(const struct settings *s, struct stats *stats, int address, int length, bool *lastCR)
+{
+    unsigned char bytes[256];
+    char command[32];
+    int received = 0;
+    int value = 0, digits = 0;
+    int next = -1;      // Address of the next byte on the current line, or -1 outside data
+
+    snprintf(command, sizeof(command), "%04X.%04X\n", address, address + length - 1);
+    sendText(s, stats, (const unsigned char *)command, strlen(command), lastCR);
+
+    while (received < length) {
+        int c = readDevice(s, s->timeout);
+
+        if (c == -1)
+            return -1;
+        if (bmHexDigit(c) >= 0) {
+            value = (value << 4) | bmHexDigit(c);
+            digits++;
+            continue;
+        }
+        if ((c == ':' || c == '-') && digits == 4) {
+            next = value;
+        } else if (next != -1 && digits == 2) {
+            if (next == address + received)
+                bytes[received++] = value;
+            next++;
+        }
+        if (c == '\r' || c == '\n')
+            next = -1;
+        value = 0;
+        digits = 0;
+    }
+    return bmBlockChecksum(bytes, length);
+}
+
+/*
+ * Run the checksum routine for a block: store the block address and
+ * length in zero page, then run it. Returns the checksum it prints, or
+ * -1 if there is no answer in time.
+ */
+long routineChecksum(const struct settings *s, struct stats *stats, bool apple1, int address, int length, bool *lastCR)
+{
+    char command[64];
+    long checksum = 0;
+    int c;
+
+    snprintf(command, sizeof(command), "%X: %02X %02X %02X\n%04X%s\n", ROUTINE_ZERO_PAGE, address & 0xff, address >> 8,
+             length & 0xff, s->routineAddress, apple1 ? "R" : "G");
+    sendText(s, stats, (const unsigned char *)command, strlen(command), lastCR);
+
+    /* The answer is "=" and four hex digits. Nothing else sent has an "=". */
+    do {
+        c = readDevice(s, s->timeout);
+        if (c == -1)
+            return -1;
+    } while (c != '=');
+    for (int i = 0; i < 4; i++) {
+        c = readDevice(s, s->timeout);
+        if (c == -1 || bmHexDigit(c) < 0)
+            return -1;
+        checksum = (checksum << 4) | bmHexDigit(c);
+    }
+    return checksum;
+}
+
+/*
+ * Load the checksum routine, checking it with a dump and loading it
+ * again if it was garbled. Returns false if it can't be loaded.
+ */
+bool loadRoutine(const struct settings *s, struct stats *stats, bool apple1, bool *lastCR)
+{
+    unsigned char code[sizeof(checksumRoutine)];
+    int length = buildRoutine(apple1, code);
+    char text[256];
+    int n = 0;
+
+    for (int i = 0; i < length; i++) {
+        if (i % 8 == 0)
+            n += sprintf(text + n, "%s%04X:", i ? "\n" : "", s->routineAddress + i);
+        n += sprintf(text + n, " %02X", code[i]);
+    }
+    n += sprintf(text + n, "\n");
+
+    for (int attempt = 0; attempt <= s->attempts; attempt++) {
+        sendText(s, stats, (const unsigned char *)text, n, lastCR);
+        drainInput(s);
+        if (dumpChecksum(s, stats, s->routineAddress, length, lastCR) == bmBlockChecksum(code, length))
+            return true;
+        drainInput(s);
+    }
+    fprintf(stderr, "%s: Unable to load the checksum routine at $%04X\n", programName, s->routineAddress);
+    return false;
+}
+
+/*
+ * Check the blocks of an upload against the manifest, sending the
+ * text of any bad ones again. Returns the number still bad.
+ */
+int repairBlocks(struct settings *s, struct stats *stats, const unsigned char *text, struct block *blocks,
+                 int numBlocks, bool apple1, bool *lastCR)
+{
+    int bad = numBlocks;
+    long resent = 0;
+
+    for (int i = 0; i < numBlocks; i++)
+        blocks[i].bad = true;
+
+    if (!s->useDump) {
+        int length = apple1 ? (int)sizeof(checksumRoutine) : ROUTINE_EXIT + 1;
+
+        if (overlapsBlocks(ROUTINE_ZERO_PAGE, ROUTINE_ZERO_PAGE + 4, blocks, numBlocks)) {
+            fprintf(stderr, "%s: The upload uses $06-$09, which the checksum routine needs (use -m dump)\n", programName);
+            return bad;
+        }
+        if (s->routineAddress == -1) {
+            for (int a = 0x300; a + length <= 0x10000 && s->routineAddress == -1; a += 16) {
+                if (!overlapsBlocks(a, a + length, blocks, numBlocks))
+                    s->routineAddress = a;
+            }
+        }
+        if (s->routineAddress == -1 || overlapsBlocks(s->routineAddress, s->routineAddress + length, blocks, numBlocks)) {
+            fprintf(stderr, "%s: No free space for the checksum routine (use -w or -m dump)\n", programName);
+            return bad;
+        }
+    }
+
+    drainInput(s);
+    if (!s->useDump && !loadRoutine(s, stats, apple1, lastCR))
+        return bad;
+
+    for (int attempt = 0; ; attempt++) {
+        int checked = 0;
+
+        for (int i = 0; i < numBlocks; i++) {
+            long checksum;
+
+            if (!blocks[i].bad)
+                continue;
+            if (s->useDump)
+                checksum = dumpChecksum(s, stats, blocks[i].address, blocks[i].length, lastCR);
+            else
+                checksum = routineChecksum(s, stats, apple1, blocks[i].address, blocks[i].length, lastCR);
+            if (checksum == -1)
+                stats->timeouts++;
+            if (checksum == blocks[i].checksum) {
+                blocks[i].bad = false;
+                bad--;
+            }
+            checked++;
+        }
+        if (s->verbose)
+            fprintf(stderr, "Checked %d blocks: %d bad\n", checked, bad);
+        if (bad == 0 || attempt == s->attempts)
+            break;
+
+        /* Send the bad blocks again, then let the monitor's echo finish. */
+        for (int i = 0; i < numBlocks; i++) {
+            if (blocks[i].bad) {
+                sendText(s, stats, text + blocks[i].offset, blocks[i].textLength, lastCR);
+                resent += blocks[i].textLength;
+            }
+        }
+        drainInput(s);
+    }
+
+    if (s->verbose)
+        fprintf(stderr, "Characters sent again for bad blocks: %ld\n", resent);
+    if (bad != 0)
+        fprintf(stderr, "%s: %d of %d blocks still differ\n", programName, bad, numBlocks);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *file = stdin;
+    static unsigned char buffer[64 * 1024];
+    unsigned char *text = NULL;
+    size_t textLength = 0;
+    struct block *blocks = NULL;
+    int numBlocks = 0;
+    bool apple1 = true;
+    int bad = 0;
+    size_t n;
+    int opt;
+    bool lastCR = false;
+    double start;
+    double elapsed;
+    struct stats stats = { 0, 0, 0 };
+    struct settings s = {
+        .device = "/dev/ttyUSB0",
+        .baud = 9600,
+        .charDelay = 0,
+        .lineDelay = 0,
+        .waitEcho = false,
+        .prompt = -1,
+        .timeout = 1000,
+        .translate = true,
+        .showReceived = false,
+        .verbose = false,
+        .blocksName = NULL,
+        .skipSend = false,
+        .useDump = false,
+        .routineAddress = -1,
+        .attempts = 3
+    };
+
+    programName = argv[0];
+
+    while ((opt = getopt(argc, argv, "hvrnd:b:c:l:ep:t:k:sm:w:a:")) != -1) {
+        switch (opt) {
+        case 'v':
+            s.verbose = true;
+            break;
+        case 'r':
+            s.showReceived = true;
+            break;
+        case 'n':
+            s.translate = false;
+            break;
+        case 'd':
+            s.device = optarg;
+            break;
+        case 'b':
+            s.baud = strtol(optarg, 0, 0);
+            break;
+        case 'c':
+            s.charDelay = strtod(optarg, 0);
+            break;
+        case 'l':
+            s.lineDelay = strtod(optarg, 0);
+            break;
+        case 'e':
+            s.waitEcho = true;
+            break;
+        case 'p':
+            if (!parsePrompt(optarg, &s.prompt)) {
+                fprintf(stderr, "%s: Invalid prompt character '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            s.timeout = strtol(optarg, 0, 0);
+            break;
+        case 'k':
+            s.blocksName = optarg;
+            break;
+        case 's':
+            s.skipSend = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "routine") != 0 && strcmp(optarg, "dump") != 0) {
+                fprintf(stderr, "%s: Method must be routine or dump\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            s.useDump = !strcmp(optarg, "dump");
+            break;
+        case 'w':
+            s.routineAddress = strtol(optarg, 0, 0);
+            break;
+        case 'a':
+            s.attempts = strtol(optarg, 0, 0);
+            break;
+        case 'h':
+            showHelp(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc > optind + 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc == optind + 1 && strcmp(argv[optind], "-") != 0) {
+        file = fopen(argv[optind], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "%s: File not found: %s\n", argv[0], argv[optind]);
+            return 1;
+        }
+    }
+
+    /* Blocks are sent again from the file, so read it all in. */
+    if (s.blocksName != NULL) {
+        if (file == stdin) {
+            fprintf(stderr, "%s: The -k option needs a file, not standard input\n", argv[0]);
+            return 1;
+        }
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            text = realloc(text, textLength + n);
+            if (text == NULL) {
+                fprintf(stderr, "%s: Out of memory\n", argv[0]);
+                return 1;
+            }
+            memcpy(text + textLength, buffer, n);
+            textLength += n;
+        }
+        if (!readBlockManifest(s.blocksName, textLength, &blocks, &numBlocks, &apple1))
+            return 1;
+    }
+
+    device = open(s.device, O_RDWR | O_NOCTTY);
+    if (device < 0) {
+        fprintf(stderr, "%s: Unable to open '%s': %s\n", argv[0], s.device, strerror(errno));
+        return 1;
+    }
+    if (!setupDevice(&s))
+        return 1;
+
+    /* Without pacing, send in large blocks. */
+    s.paced = s.waitEcho || s.prompt != -1 || s.charDelay > 0 || s.lineDelay > 0 || s.showReceived;
+
+    start = now();
+    if (text != NULL) {
+        /* Hold back the run command until every block is right. */
+        size_t dataEnd = 0;
+
+        for (int i = 0; i < numBlocks; i++) {
+            if ((size_t)(blocks[i].offset + blocks[i].textLength) > dataEnd)
+                dataEnd = blocks[i].offset + blocks[i].textLength;
+        }
+        if (!s.skipSend)
+            sendText(&s, &stats, text, dataEnd, &lastCR);
+        bad = repairBlocks(&s, &stats, text, blocks, numBlocks, apple1, &lastCR);
+        if (bad == 0)
+            sendText(&s, &stats, text + dataEnd, textLength - dataEnd, &lastCR);
+    } else if (s.blocksName == NULL || !s.skipSend) {
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            sendText(&s, &stats, buffer, n, &lastCR);
+    }
+
+    /* Wait for the last characters to go out before timing. */
+    if (restoreTermios)
+        tcdrain(device);
+    elapsed = now() - start;
+    if (s.showReceived)
+        waitFor(&s, -1, 0);
+    restoreDevice();
+    close(device);
+    if (file != stdin)
+        fclose(file);
+
+    if (s.verbose) {
+        fprintf(stderr, "Characters sent: %ld (%ld lines)\n", stats.sent, stats.lines);
+        fprintf(stderr, "Time: %.2f seconds\n", elapsed);
+        if (elapsed > 0)
+            fprintf(stderr, "Effective rate: %.0f bytes per second\n", stats.sent / elapsed);
+        if (s.waitEcho || s.prompt != -1 || s.blocksName != NULL)
+            fprintf(stderr, "Timeouts: %ld\n", stats.timeouts);
+    }
+
+    free(text);
+    free(blocks);
+    return bad != 0;
+}
@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# Regression checks for run6502.
+#
+# usage: check.sh
+#
+# Each program below is run with the options given and has to return
+# to the monitor, display what it should and take exactly the number of
+# cycles it should. The small programs in tests/ were assembled by hand
+# and their cycle counts worked out from the instruction timings, so a
+# wrong timing shows up as well as a wrong result:
+#
+#   selfmod.mon  Each pass round a loop increments the operand of the
+#                LDA at its top, so an engine that keeps running the
+#                instruction as first decoded prints AAAAA, not ABCDE.
+#   65c02.mon    A decimal mode ADC ($19 + $28 = $47, "G"), which takes
+#                an extra cycle on the 65C02, a BRA, and JMP ($02FF),
+#                whose high byte the 65C02 reads from $0300, not $0200.
+#   bank1.mon    A 65816 program loaded and run in bank 1, which ends
+#                with a JML back to the monitor in bank 0. It is also
+#                run as a binary loaded with -l.
+#
+# The C programs in c/hello are run with each engine too, with the
+# output not checked but the cycle count checked. With -k each engine
+# is also checked against the interpreter as it runs.
+#
+# Run it from this directory after make, or use "make check". The exit
+# status is 1 if anything failed.
+#
+
+RUN6502=./run6502
+TOP=../..
+
+if [ ! -x $RUN6502 ]; then
+    echo "$0: $RUN6502 not found, please run make first" >&2
+    exit 1
+fi
+
+TMP=`mktemp -d` || exit 1
+trap 'rm -rf $TMP' EXIT
+trap 'exit 1' INT TERM
+failed=0
+
+# bank1.mon as a binary: LDA #$C1, STA $D012, JML $00FF00
+printf '\251\301\215\022\320\134\000\377\000' >$TMP/bank1.bin
+
+# Program, expected cycles, expected output (- for not checked) and the
+# run6502 options.
+while read program cycles display options; do
+    case $program in
+    ''|\#*) continue ;;
+    esac
+    file=`echo $program | sed "s|^TMP/|$TMP/|; s|^TOP/|$TOP/|"`
+    if $RUN6502 $options $file </dev/null >$TMP/out 2>$TMP/err &&
+       grep -q "^Cycles: $cycles " $TMP/err &&
+       { [ "$display" = - ] || [ "`cat $TMP/out`" = "$display" ]; }; then
+        status=pass
+    else
+        status=FAIL
+        failed=1
+    fi
+    echo "$status $program $options"
+    if [ $status = FAIL ]; then
+        sed 's/^/    /' $TMP/err
+    fi
+done <<EOF
+tests/selfmod.mon       99 ABCDE -e interpreter
+tests/selfmod.mon       99 ABCDE -e threaded -k
+tests/selfmod.mon       99 ABCDE -e blocks -k
+tests/selfmod.mon       99 ABCDE -p 65c02 -e interpreter
+tests/selfmod.mon       99 ABCDE -p 65c02 -e threaded -k
+tests/selfmod.mon       99 ABCDE -p 65c02 -e blocks -k
+tests/selfmod.mon       99 ABCDE -p 65816
+tests/65c02.mon         33 G! -p 65c02 -e interpreter
+tests/65c02.mon         33 G! -p 65c02 -e threaded -k
+tests/65c02.mon         33 G! -p 65c02 -e blocks -k
+tests/bank1.mon         10 A -p 65816
+TMP/bank1.bin           10 A -p 65816 -l 01/2000
+TOP/c/hello/hello1.mon  4282 - -e interpreter
+TOP/c/hello/hello1.mon  4282 - -e threaded -k
+TOP/c/hello/hello1.mon  4282 - -e blocks -k
+TOP/c/hello/hello1.mon  4282 - -p 65816
+TOP/c/hello/sieve.mon   67542106 - -e threaded -k
+TOP/c/hello/sieve.mon   67542106 - -e blocks -k
+TOP/c/hello/sieve.mon   67542106 - -p 65816
+EOF
+
+exit $failed
@@ -0,0 +1,220 @@
+/*
+ * The NMOS 6502 instructions, for lib6502.c.
+ *
+ * Each INSTRUCTION(opcode, ...) gives the statements that carry out an
+ * opcode once it has been fetched and its base cycles counted. This
+ * file is included once for each engine, with INSTRUCTION and the
+ * operand and memory macros that the statements use defined to suit
+ * it, so that the engines share one definition of every instruction.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Loads and stores */
+INSTRUCTION(0xa9, a = FETCH(); SET_NZ(a))
+INSTRUCTION(0xa5, ZP(); a = mem[address]; SET_NZ(a))
+INSTRUCTION(0xb5, ZPX(); a = mem[address]; SET_NZ(a))
+INSTRUCTION(0xad, ABS(); a = READ(); SET_NZ(a))
+INSTRUCTION(0xbd, ABSX_R(); a = READ(); SET_NZ(a))
+INSTRUCTION(0xb9, ABSY_R(); a = READ(); SET_NZ(a))
+INSTRUCTION(0xa1, INDX(); a = READ(); SET_NZ(a))
+INSTRUCTION(0xb1, INDY_R(); a = READ(); SET_NZ(a))
+INSTRUCTION(0xa2, x = FETCH(); SET_NZ(x))
+INSTRUCTION(0xa6, ZP(); x = mem[address]; SET_NZ(x))
+INSTRUCTION(0xb6, ZPY(); x = mem[address]; SET_NZ(x))
+INSTRUCTION(0xae, ABS(); x = READ(); SET_NZ(x))
+INSTRUCTION(0xbe, ABSY_R(); x = READ(); SET_NZ(x))
+INSTRUCTION(0xa0, y = FETCH(); SET_NZ(y))
+INSTRUCTION(0xa4, ZP(); y = mem[address]; SET_NZ(y))
+INSTRUCTION(0xb4, ZPX(); y = mem[address]; SET_NZ(y))
+INSTRUCTION(0xac, ABS(); y = READ(); SET_NZ(y))
+INSTRUCTION(0xbc, ABSX_R(); y = READ(); SET_NZ(y))
+INSTRUCTION(0x85, ZP(); STORE(a))
+INSTRUCTION(0x95, ZPX(); STORE(a))
+INSTRUCTION(0x8d, ABS(); WRITE(a))
+INSTRUCTION(0x9d, ABSX(); WRITE(a))
+INSTRUCTION(0x99, ABSY(); WRITE(a))
+INSTRUCTION(0x81, INDX(); WRITE(a))
+INSTRUCTION(0x91, INDY(); WRITE(a))
+INSTRUCTION(0x86, ZP(); STORE(x))
+INSTRUCTION(0x96, ZPY(); STORE(x))
+INSTRUCTION(0x8e, ABS(); WRITE(x))
+INSTRUCTION(0x84, ZP(); STORE(y))
+INSTRUCTION(0x94, ZPX(); STORE(y))
+INSTRUCTION(0x8c, ABS(); WRITE(y))
+
+/* Register transfers */
+INSTRUCTION(0xaa, x = a; SET_NZ(x))
+INSTRUCTION(0xa8, y = a; SET_NZ(y))
+INSTRUCTION(0x8a, a = x; SET_NZ(a))
+INSTRUCTION(0x98, a = y; SET_NZ(a))
+INSTRUCTION(0xba, x = s; SET_NZ(x))
+INSTRUCTION(0x9a, s = x)
+
+/* Stack */
+INSTRUCTION(0x48, PUSH(a))
+INSTRUCTION(0x08, PUSH(p | FLAG_B | FLAG_U))
+INSTRUCTION(0x68, a = PULL(); SET_NZ(a))
+INSTRUCTION(0x28, p = (PULL() & ~FLAG_B) | FLAG_U)
+
+/* Logical */
+INSTRUCTION(0x29, a &= FETCH(); SET_NZ(a))
+INSTRUCTION(0x25, ZP(); a &= mem[address]; SET_NZ(a))
+INSTRUCTION(0x35, ZPX(); a &= mem[address]; SET_NZ(a))
+INSTRUCTION(0x2d, ABS(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x3d, ABSX_R(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x39, ABSY_R(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x21, INDX(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x31, INDY_R(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x49, a ^= FETCH(); SET_NZ(a))
+INSTRUCTION(0x45, ZP(); a ^= mem[address]; SET_NZ(a))
+INSTRUCTION(0x55, ZPX(); a ^= mem[address]; SET_NZ(a))
+INSTRUCTION(0x4d, ABS(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x5d, ABSX_R(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x59, ABSY_R(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x41, INDX(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x51, INDY_R(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x09, a |= FETCH(); SET_NZ(a))
+INSTRUCTION(0x05, ZP(); a |= mem[address]; SET_NZ(a))
+INSTRUCTION(0x15, ZPX(); a |= mem[address]; SET_NZ(a))
+INSTRUCTION(0x0d, ABS(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x1d, ABSX_R(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x19, ABSY_R(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x01, INDX(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x11, INDY_R(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x24, ZP(); BIT(mem[address]))
+INSTRUCTION(0x2c, ABS(); BIT(READ()))
+
+/* Arithmetic */
+INSTRUCTION(0x69, ADC(FETCH()))
+INSTRUCTION(0x65, ZP(); ADC(mem[address]))
+INSTRUCTION(0x75, ZPX(); ADC(mem[address]))
+INSTRUCTION(0x6d, ABS(); ADC(READ()))
+INSTRUCTION(0x7d, ABSX_R(); ADC(READ()))
+INSTRUCTION(0x79, ABSY_R(); ADC(READ()))
+INSTRUCTION(0x61, INDX(); ADC(READ()))
+INSTRUCTION(0x71, INDY_R(); ADC(READ()))
+INSTRUCTION(0xe9, SBC(FETCH()))
+INSTRUCTION(0xe5, ZP(); SBC(mem[address]))
+INSTRUCTION(0xf5, ZPX(); SBC(mem[address]))
+INSTRUCTION(0xed, ABS(); SBC(READ()))
+INSTRUCTION(0xfd, ABSX_R(); SBC(READ()))
+INSTRUCTION(0xf9, ABSY_R(); SBC(READ()))
+INSTRUCTION(0xe1, INDX(); SBC(READ()))
+INSTRUCTION(0xf1, INDY_R(); SBC(READ()))
+INSTRUCTION(0xc9, COMPARE(a, FETCH()))
+INSTRUCTION(0xc5, ZP(); COMPARE(a, mem[address]))
+INSTRUCTION(0xd5, ZPX(); COMPARE(a, mem[address]))
+INSTRUCTION(0xcd, ABS(); COMPARE(a, READ()))
+INSTRUCTION(0xdd, ABSX_R(); COMPARE(a, READ()))
+INSTRUCTION(0xd9, ABSY_R(); COMPARE(a, READ()))
+INSTRUCTION(0xc1, INDX(); COMPARE(a, READ()))
+INSTRUCTION(0xd1, INDY_R(); COMPARE(a, READ()))
+INSTRUCTION(0xe0, COMPARE(x, FETCH()))
+INSTRUCTION(0xe4, ZP(); COMPARE(x, mem[address]))
+INSTRUCTION(0xec, ABS(); COMPARE(x, READ()))
+INSTRUCTION(0xc0, COMPARE(y, FETCH()))
+INSTRUCTION(0xc4, ZP(); COMPARE(y, mem[address]))
+INSTRUCTION(0xcc, ABS(); COMPARE(y, READ()))
+
+/* Increments and decrements */
+INSTRUCTION(0xe6, ZP(); MODIFY_ZP(INC))
+INSTRUCTION(0xf6, ZPX(); MODIFY_ZP(INC))
+INSTRUCTION(0xee, ABS(); MODIFY(INC))
+INSTRUCTION(0xfe, ABSX(); MODIFY(INC))
+INSTRUCTION(0xe8, INC(x))
+INSTRUCTION(0xc8, INC(y))
+INSTRUCTION(0xc6, ZP(); MODIFY_ZP(DEC))
+INSTRUCTION(0xd6, ZPX(); MODIFY_ZP(DEC))
+INSTRUCTION(0xce, ABS(); MODIFY(DEC))
+INSTRUCTION(0xde, ABSX(); MODIFY(DEC))
+INSTRUCTION(0xca, DEC(x))
+INSTRUCTION(0x88, DEC(y))
+
+/* Shifts */
+INSTRUCTION(0x0a, ASL(a))
+INSTRUCTION(0x06, ZP(); MODIFY_ZP(ASL))
+INSTRUCTION(0x16, ZPX(); MODIFY_ZP(ASL))
+INSTRUCTION(0x0e, ABS(); MODIFY(ASL))
+INSTRUCTION(0x1e, ABSX(); MODIFY(ASL))
+INSTRUCTION(0x4a, LSR(a))
+INSTRUCTION(0x46, ZP(); MODIFY_ZP(LSR))
+INSTRUCTION(0x56, ZPX(); MODIFY_ZP(LSR))
+INSTRUCTION(0x4e, ABS(); MODIFY(LSR))
+INSTRUCTION(0x5e, ABSX(); MODIFY(LSR))
+INSTRUCTION(0x2a, ROL(a))
+INSTRUCTION(0x26, ZP(); MODIFY_ZP(ROL))
+INSTRUCTION(0x36, ZPX(); MODIFY_ZP(ROL))
+INSTRUCTION(0x2e, ABS(); MODIFY(ROL))
+INSTRUCTION(0x3e, ABSX(); MODIFY(ROL))
+INSTRUCTION(0x6a, ROR(a))
+INSTRUCTION(0x66, ZP(); MODIFY_ZP(ROR))
+INSTRUCTION(0x76, ZPX(); MODIFY_ZP(ROR))
+INSTRUCTION(0x6e, ABS(); MODIFY(ROR))
+INSTRUCTION(0x7e, ABSX(); MODIFY(ROR))
+
+/* Jumps and calls */
+INSTRUCTION(0x4c, pc = FETCH16())
+INSTRUCTION(0x6c,
+    base = FETCH16();
+    // The high byte of the address comes from the same page
+    pc = mem[base] | (mem[(base & 0xff00) | ((base + 1) & 0xff)] << 8)
+)
+INSTRUCTION(0x20,
+    address = FETCH16();
+    pc--;
+    PUSH(pc >> 8);
+    PUSH(pc & 0xff);
+    pc = address
+)
+INSTRUCTION(0x60,
+    pc = PULL();
+    pc |= PULL() << 8;
+    pc++
+)
+INSTRUCTION(0x40,
+    p = (PULL() & ~FLAG_B) | FLAG_U;
+    pc = PULL();
+    pc |= PULL() << 8
+)
+INSTRUCTION(0x00,
+    pc++;
+    PUSH(pc >> 8);
+    PUSH(pc & 0xff);
+    PUSH(p | FLAG_B | FLAG_U);
+    p |= FLAG_I;
+    pc = mem[0xfffe] | (mem[0xffff] << 8)
+)
+
+/* Branches */
+INSTRUCTION(0x10, BRANCH(!(p & FLAG_N)))
+INSTRUCTION(0x30, BRANCH(p & FLAG_N))
+INSTRUCTION(0x50, BRANCH(!(p & FLAG_V)))
+INSTRUCTION(0x70, BRANCH(p & FLAG_V))
+INSTRUCTION(0x90, BRANCH(!(p & FLAG_C)))
+INSTRUCTION(0xb0, BRANCH(p & FLAG_C))
+INSTRUCTION(0xd0, BRANCH(!(p & FLAG_Z)))
+INSTRUCTION(0xf0, BRANCH(p & FLAG_Z))
+
+/* Flags */
+INSTRUCTION(0x18, p &= ~FLAG_C)
+INSTRUCTION(0x38, p |= FLAG_C)
+INSTRUCTION(0x58, p &= ~FLAG_I)
+INSTRUCTION(0x78, p |= FLAG_I)
+INSTRUCTION(0xd8, p &= ~FLAG_D)
+INSTRUCTION(0xf8, p |= FLAG_D)
+INSTRUCTION(0xb8, p &= ~FLAG_V)
+
+INSTRUCTION(0xea, )
@@ -0,0 +1,186 @@
+/*
+ * The 65C02 instructions, for lib6502.c.
+ *
+ * These are the instructions of the WDC 65C02, with the Rockwell RMB,
+ * SMB, BBR and BBS, that the NMOS 6502 does not have or that work or
+ * take a different number of cycles on it. The instruction for opcode n
+ * is numbered 0x100 + n, so that they can be told apart from the NMOS
+ * ones in instructions.h, which the 65C02 runs for its other opcodes.
+ * Their cycles come from the opcode table shared with the disassembler.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Zero page indirect addressing */
+INSTRUCTION(0x1b2, INDZ(); a = READ(); SET_NZ(a))
+INSTRUCTION(0x192, INDZ(); WRITE(a))
+INSTRUCTION(0x132, INDZ(); a &= READ(); SET_NZ(a))
+INSTRUCTION(0x152, INDZ(); a ^= READ(); SET_NZ(a))
+INSTRUCTION(0x112, INDZ(); a |= READ(); SET_NZ(a))
+INSTRUCTION(0x1d2, INDZ(); COMPARE(a, READ()))
+
+/* Stores of zero */
+INSTRUCTION(0x164, ZP(); STORE(0))
+INSTRUCTION(0x174, ZPX(); STORE(0))
+INSTRUCTION(0x19c, ABS(); WRITE(0))
+INSTRUCTION(0x19e, ABSX(); WRITE(0))
+
+/* Stack */
+INSTRUCTION(0x1da, PUSH(x))
+INSTRUCTION(0x15a, PUSH(y))
+INSTRUCTION(0x1fa, x = PULL(); SET_NZ(x))
+INSTRUCTION(0x17a, y = PULL(); SET_NZ(y))
+
+/* Bit tests and bit setting. BIT immediate only sets Z. */
+INSTRUCTION(0x189, p = (p & ~FLAG_Z) | ((a & FETCH()) ? 0 : FLAG_Z))
+INSTRUCTION(0x134, ZPX(); BIT(mem[address]))
+INSTRUCTION(0x13c, ABSX_R(); BIT(READ()))
+INSTRUCTION(0x104, ZP(); MODIFY_ZP(TSB))
+INSTRUCTION(0x10c, ABS(); MODIFY(TSB))
+INSTRUCTION(0x114, ZP(); MODIFY_ZP(TRB))
+INSTRUCTION(0x11c, ABS(); MODIFY(TRB))
+
+/* Arithmetic, with valid flags and an extra cycle in decimal mode */
+INSTRUCTION(0x169, ADC_CMOS(FETCH()))
+INSTRUCTION(0x165, ZP(); ADC_CMOS(mem[address]))
+INSTRUCTION(0x175, ZPX(); ADC_CMOS(mem[address]))
+INSTRUCTION(0x16d, ABS(); ADC_CMOS(READ()))
+INSTRUCTION(0x17d, ABSX_R(); ADC_CMOS(READ()))
+INSTRUCTION(0x179, ABSY_R(); ADC_CMOS(READ()))
+INSTRUCTION(0x161, INDX(); ADC_CMOS(READ()))
+INSTRUCTION(0x171, INDY_R(); ADC_CMOS(READ()))
+INSTRUCTION(0x172, INDZ(); ADC_CMOS(READ()))
+INSTRUCTION(0x1e9, SBC_CMOS(FETCH()))
+INSTRUCTION(0x1e5, ZP(); SBC_CMOS(mem[address]))
+INSTRUCTION(0x1f5, ZPX(); SBC_CMOS(mem[address]))
+INSTRUCTION(0x1ed, ABS(); SBC_CMOS(READ()))
+INSTRUCTION(0x1fd, ABSX_R(); SBC_CMOS(READ()))
+INSTRUCTION(0x1f9, ABSY_R(); SBC_CMOS(READ()))
+INSTRUCTION(0x1e1, INDX(); SBC_CMOS(READ()))
+INSTRUCTION(0x1f1, INDY_R(); SBC_CMOS(READ()))
+INSTRUCTION(0x1f2, INDZ(); SBC_CMOS(READ()))
+
+/* Increments and decrements of the accumulator */
+INSTRUCTION(0x11a, INC(a))
+INSTRUCTION(0x13a, DEC(a))
+
+/* Shifts with indexing take a cycle less unless they cross a page */
+INSTRUCTION(0x11e, ABSX_R(); MODIFY(ASL))
+INSTRUCTION(0x15e, ABSX_R(); MODIFY(LSR))
+INSTRUCTION(0x13e, ABSX_R(); MODIFY(ROL))
+INSTRUCTION(0x17e, ABSX_R(); MODIFY(ROR))
+
+/* Jumps and branches */
+INSTRUCTION(0x180, BRANCH(true))
+INSTRUCTION(0x16c,
+    base = FETCH16();
+    // No longer wraps around within the page
+    pc = mem[base] | (mem[(uint16_t)(base + 1)] << 8)
+)
+INSTRUCTION(0x17c, ABSX(); pc = mem[address] | (mem[(uint16_t)(address + 1)] << 8))
+
+/* BRK also clears decimal mode */
+INSTRUCTION(0x100,
+    pc++;
+    PUSH(pc >> 8);
+    PUSH(pc & 0xff);
+    PUSH(p | FLAG_B | FLAG_U);
+    p = (p | FLAG_I) & ~FLAG_D;
+    pc = mem[0xfffe] | (mem[0xffff] << 8)
+)
+
+/* Rockwell bit instructions on zero page: reset, set, and branch if reset or set */
+INSTRUCTION(0x107, ZP(); STORE(mem[address] & ~0x01))
+INSTRUCTION(0x117, ZP(); STORE(mem[address] & ~0x02))
+INSTRUCTION(0x127, ZP(); STORE(mem[address] & ~0x04))
+INSTRUCTION(0x137, ZP(); STORE(mem[address] & ~0x08))
+INSTRUCTION(0x147, ZP(); STORE(mem[address] & ~0x10))
+INSTRUCTION(0x157, ZP(); STORE(mem[address] & ~0x20))
+INSTRUCTION(0x167, ZP(); STORE(mem[address] & ~0x40))
+INSTRUCTION(0x177, ZP(); STORE(mem[address] & ~0x80))
+INSTRUCTION(0x187, ZP(); STORE(mem[address] | 0x01))
+INSTRUCTION(0x197, ZP(); STORE(mem[address] | 0x02))
+INSTRUCTION(0x1a7, ZP(); STORE(mem[address] | 0x04))
+INSTRUCTION(0x1b7, ZP(); STORE(mem[address] | 0x08))
+INSTRUCTION(0x1c7, ZP(); STORE(mem[address] | 0x10))
+INSTRUCTION(0x1d7, ZP(); STORE(mem[address] | 0x20))
+INSTRUCTION(0x1e7, ZP(); STORE(mem[address] | 0x40))
+INSTRUCTION(0x1f7, ZP(); STORE(mem[address] | 0x80))
+INSTRUCTION(0x10f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x01)))
+INSTRUCTION(0x11f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x02)))
+INSTRUCTION(0x12f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x04)))
+INSTRUCTION(0x13f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x08)))
+INSTRUCTION(0x14f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x10)))
+INSTRUCTION(0x15f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x20)))
+INSTRUCTION(0x16f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x40)))
+INSTRUCTION(0x17f, ZP(); BRANCH_BY(FETCH2(), !(mem[address] & 0x80)))
+INSTRUCTION(0x18f, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x01))
+INSTRUCTION(0x19f, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x02))
+INSTRUCTION(0x1af, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x04))
+INSTRUCTION(0x1bf, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x08))
+INSTRUCTION(0x1cf, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x10))
+INSTRUCTION(0x1df, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x20))
+INSTRUCTION(0x1ef, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x40))
+INSTRUCTION(0x1ff, ZP(); BRANCH_BY(FETCH2(), mem[address] & 0x80))
+
+/* WDC wait for interrupt and stop, which end the run as there are no interrupts */
+INSTRUCTION(0x1cb, HALT())
+INSTRUCTION(0x1db, HALT())
+
+/* The opcodes that are not defined are NOPs, skipping their operands */
+INSTRUCTION(0x102, (void)FETCH())
+INSTRUCTION(0x122, (void)FETCH())
+INSTRUCTION(0x142, (void)FETCH())
+INSTRUCTION(0x162, (void)FETCH())
+INSTRUCTION(0x182, (void)FETCH())
+INSTRUCTION(0x1c2, (void)FETCH())
+INSTRUCTION(0x1e2, (void)FETCH())
+INSTRUCTION(0x144, (void)FETCH())
+INSTRUCTION(0x154, (void)FETCH())
+INSTRUCTION(0x1d4, (void)FETCH())
+INSTRUCTION(0x1f4, (void)FETCH())
+INSTRUCTION(0x15c, (void)FETCH16())
+INSTRUCTION(0x1dc, (void)FETCH16())
+INSTRUCTION(0x1fc, (void)FETCH16())
+INSTRUCTION(0x103, )
+INSTRUCTION(0x113, )
+INSTRUCTION(0x123, )
+INSTRUCTION(0x133, )
+INSTRUCTION(0x143, )
+INSTRUCTION(0x153, )
+INSTRUCTION(0x163, )
+INSTRUCTION(0x173, )
+INSTRUCTION(0x183, )
+INSTRUCTION(0x193, )
+INSTRUCTION(0x1a3, )
+INSTRUCTION(0x1b3, )
+INSTRUCTION(0x1c3, )
+INSTRUCTION(0x1d3, )
+INSTRUCTION(0x1e3, )
+INSTRUCTION(0x1f3, )
+INSTRUCTION(0x10b, )
+INSTRUCTION(0x11b, )
+INSTRUCTION(0x12b, )
+INSTRUCTION(0x13b, )
+INSTRUCTION(0x14b, )
+INSTRUCTION(0x15b, )
+INSTRUCTION(0x16b, )
+INSTRUCTION(0x17b, )
+INSTRUCTION(0x18b, )
+INSTRUCTION(0x19b, )
+INSTRUCTION(0x1ab, )
+INSTRUCTION(0x1bb, )
+INSTRUCTION(0x1eb, )
+INSTRUCTION(0x1fb, )
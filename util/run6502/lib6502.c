@@ -0,0 +1,1081 @@
+/*
+ * lib6502: run 6502 programs on the host. See lib6502.h.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib6502.h"
+
+/* The Woz Monitor, as assembled from asm/wozmon/wozmon.s. */
+static const uint8_t wozMonitor[256] = {
+    0xD8, 0x58, 0xA0, 0x7F, 0x8C, 0x12, 0xD0, 0xA9, 0xA7, 0x8D, 0x11, 0xD0, 0x8D, 0x13, 0xD0, 0xC9,
+    0xDF, 0xF0, 0x13, 0xC9, 0x9B, 0xF0, 0x03, 0xC8, 0x10, 0x0F, 0xA9, 0xDC, 0x20, 0xEF, 0xFF, 0xA9,
+    0x8D, 0x20, 0xEF, 0xFF, 0xA0, 0x01, 0x88, 0x30, 0xF6, 0xAD, 0x11, 0xD0, 0x10, 0xFB, 0xAD, 0x10,
+    0xD0, 0x99, 0x00, 0x02, 0x20, 0xEF, 0xFF, 0xC9, 0x8D, 0xD0, 0xD4, 0xA0, 0xFF, 0xA9, 0x00, 0xAA,
+    0x0A, 0x85, 0x2B, 0xC8, 0xB9, 0x00, 0x02, 0xC9, 0x8D, 0xF0, 0xD4, 0xC9, 0xAE, 0x90, 0xF4, 0xF0,
+    0xF0, 0xC9, 0xBA, 0xF0, 0xEB, 0xC9, 0xD2, 0xF0, 0x3B, 0x86, 0x28, 0x86, 0x29, 0x84, 0x2A, 0xB9,
+    0x00, 0x02, 0x49, 0xB0, 0xC9, 0x0A, 0x90, 0x06, 0x69, 0x88, 0xC9, 0xFA, 0x90, 0x11, 0x0A, 0x0A,
+    0x0A, 0x0A, 0xA2, 0x04, 0x0A, 0x26, 0x28, 0x26, 0x29, 0xCA, 0xD0, 0xF8, 0xC8, 0xD0, 0xE0, 0xC4,
+    0x2A, 0xF0, 0x97, 0x24, 0x2B, 0x50, 0x10, 0xA5, 0x28, 0x81, 0x26, 0xE6, 0x26, 0xD0, 0xB5, 0xE6,
+    0x27, 0x4C, 0x44, 0xFF, 0x6C, 0x24, 0x00, 0x30, 0x2B, 0xA2, 0x02, 0xB5, 0x27, 0x95, 0x25, 0x95,
+    0x23, 0xCA, 0xD0, 0xF7, 0xD0, 0x14, 0xA9, 0x8D, 0x20, 0xEF, 0xFF, 0xA5, 0x25, 0x20, 0xDC, 0xFF,
+    0xA5, 0x24, 0x20, 0xDC, 0xFF, 0xA9, 0xBA, 0x20, 0xEF, 0xFF, 0xA9, 0xA0, 0x20, 0xEF, 0xFF, 0xA1,
+    0x24, 0x20, 0xDC, 0xFF, 0x86, 0x2B, 0xA5, 0x24, 0xC5, 0x28, 0xA5, 0x25, 0xE5, 0x29, 0xB0, 0xC1,
+    0xE6, 0x24, 0xD0, 0x02, 0xE6, 0x25, 0xA5, 0x24, 0x29, 0x07, 0x10, 0xC8, 0x48, 0x4A, 0x4A, 0x4A,
+    0x4A, 0x20, 0xE5, 0xFF, 0x68, 0x29, 0x0F, 0x09, 0xB0, 0xC9, 0xBA, 0x90, 0x02, 0x69, 0x06, 0x2C,
+    0x12, 0xD0, 0x30, 0xFB, 0x8D, 0x12, 0xD0, 0x60, 0x00, 0x00, 0x00, 0x0F, 0x00, 0xFF, 0x00, 0x00
+};
+
+/*
+ * The instructions are numbered by their opcodes on the NMOS 6502, and
+ * from 0x100 by their opcodes on the 65C02 for those that differ. The
+ * 65C02 ones come from the opcode table that disasm65c02.py also reads.
+ */
+#define CMOS 0x100
+#define NUM_INSTRUCTIONS 0x200
+
+/* Bytes in each addressing mode of the 65C02 opcode table */
+#define LENGTH_implicit 1
+#define LENGTH_accumulator 1
+#define LENGTH_immediate 2
+#define LENGTH_relative 2
+#define LENGTH_zeroPage 2
+#define LENGTH_zeroPageX 2
+#define LENGTH_zeroPageY 2
+#define LENGTH_indirectX 2
+#define LENGTH_indirectY 2
+#define LENGTH_indirectZeroPage 2
+#define LENGTH_absolute 3
+#define LENGTH_absoluteX 3
+#define LENGTH_absoluteY 3
+#define LENGTH_indirect 3
+#define LENGTH_absoluteIndexedIndirect 3
+#define LENGTH_zeroPageRelative 3
+
+/*
+ * Clock cycles for each instruction, not counting the extra cycle when
+ * an indexed read crosses a page, for a branch taken or for decimal
+ * mode on the 65C02. Zero marks the opcodes that are not defined for
+ * the NMOS 6502; on the 65C02 they are all defined.
+ */
+static const uint8_t cycleTable[NUM_INSTRUCTIONS] = {
+/*       0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+/* 0 */  7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0,
+/* 1 */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+/* 2 */  6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0,
+/* 3 */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+/* 4 */  6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0,
+/* 5 */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+/* 6 */  6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0,
+/* 7 */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+/* 8 */  0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0,
+/* 9 */  2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0,
+/* A */  2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0,
+/* B */  2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0,
+/* C */  2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+/* D */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+/* E */  2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+/* F */  2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+#define OPCODE(opcode, mnemonic, mode, cycles) [CMOS + (opcode)] = (cycles),
+#include "opcodes65c02.def"
+#undef OPCODE
+};
+
+/* Bytes in each instruction, or zero for the undefined opcodes. */
+static const uint8_t lengthTable[NUM_INSTRUCTIONS] = {
+/*       0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+/* 0 */  1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 0, 3, 3, 0,
+/* 1 */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+/* 2 */  3, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* 3 */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+/* 4 */  1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* 5 */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+/* 6 */  1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* 7 */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+/* 8 */  0, 2, 0, 0, 2, 2, 2, 0, 1, 0, 1, 0, 3, 3, 3, 0,
+/* 9 */  2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 0, 3, 0, 0,
+/* A */  2, 2, 2, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* B */  2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 3, 3, 3, 0,
+/* C */  2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* D */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+/* E */  2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0,
+/* F */  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0,
+#define OPCODE(opcode, mnemonic, mode, cycles) [CMOS + (opcode)] = LENGTH_##mode,
+#include "opcodes65c02.def"
+#undef OPCODE
+};
+
+/*
+ * The 65C02 instruction for each opcode that has one of its own, or
+ * zero where it runs the NMOS one.
+ */
+static const uint16_t cmosInstructions[256] = {
+#define INSTRUCTION(opcode, ...) [(opcode) - CMOS] = (opcode),
+#include "instructions65c02.h"
+#undef INSTRUCTION
+};
+
+/* Return the instruction that the CPU runs for an opcode. */
+static inline unsigned instructionFor(enum cpu cpu, uint8_t opcode)
+{
+    if (cpu == CPU_65C02 && cmosInstructions[opcode] != 0)
+        return cmosInstructions[opcode];
+    return opcode;
+}
+
+/*
+ * An instruction decoded by the threaded or block engine. The length
+ * and cycles are the same for every instruction with an opcode, so
+ * they are part of the code for it rather than stored here. All zeros
+ * is an instruction not decoded yet.
+ */
+struct decodedInstruction {
+    uint16_t handler;       // Code to run: one of the handlers below
+    uint16_t operand;       // The bytes after the opcode, low byte first
+};
+
+/* Handlers that are not instructions. The code for instruction n is HANDLER_OPCODE + n. */
+enum { HANDLER_DECODE, HANDLER_STOP, HANDLER_ILLEGAL, HANDLER_END, HANDLER_OPCODE };
+
+/* The most instructions in a block translated by the block engine, and pages they are in. */
+#define MAX_BLOCK_INSTRUCTIONS 32
+#define MAX_BLOCK_PAGES 4
+
+/*
+ * A block translated by the block engine: the instructions that run in
+ * turn from its address, following absolute jumps and calls and going
+ * on past branches, up to a return, an indirect jump, a BRK or a BRA,
+ * ended by a HANDLER_END. A block also ends before a stop address, an
+ * illegal opcode or an instruction that would put it in more than
+ * MAX_BLOCK_PAGES pages, and one that starts at a stop address or an
+ * illegal opcode holds only a HANDLER_STOP or HANDLER_ILLEGAL. It is
+ * used until code in the pages it is in is written, which changes their
+ * generations.
+ */
+struct block {
+    uint16_t count;                             // Instructions, not counting the end
+    uint16_t numPages;
+    uint8_t pages[MAX_BLOCK_PAGES];             // Pages the instructions are in
+    uint32_t generation[MAX_BLOCK_PAGES];       // Their generations when translated
+    unsigned long long checked;                 // m->codeWrites when last up to date
+    struct decodedInstruction code[MAX_BLOCK_INSTRUCTIONS + 1];
+};
+
+/*
+ * Note that the byte at address, part of a decoded instruction, has
+ * been written. The threaded engine's decoded instructions that may
+ * include it are forgotten, and the block engine's blocks in its page
+ * will be translated again.
+ */
+static void invalidate(struct machine *m, uint16_t address)
+{
+    m->codeMap[address] = 0;
+    m->pageGeneration[address >> 8]++;
+    m->codeWrites++;
+    if (m->decoded != NULL) {
+        for (int i = 0; i < 3; i++)
+            m->decoded[(uint16_t)(address - i)] = (struct decodedInstruction) { 0 };
+    }
+}
+
+/* Set up a machine with the Woz Monitor in ROM. Returns NULL if out of memory. */
+struct machine *newMachine(void)
+{
+    struct machine *m = calloc(1, sizeof(struct machine));
+
+    if (m == NULL)
+        return NULL;
+    memcpy(m->memory + MONITOR_RESET, wozMonitor, sizeof(wozMonitor));
+    m->pageFlags[MONITOR_RESET >> 8] = PAGE_ROM;
+    m->pageFlags[KBD >> 8] = PAGE_IO;
+    addStop(m, MONITOR_RESET);
+    addStop(m, MONITOR_GETLINE);
+
+    /* The state the monitor leaves things in when it runs a program. */
+    m->s = 0xff;
+    m->p = FLAG_U;
+    m->e = true;
+    m->kbdcr = 0xa7;
+    m->dspcr = 0xa7;
+    m->dspDirection = 0x7f;
+    return m;
+}
+
+void freeMachine(struct machine *m)
+{
+    for (int i = 1; i < 256; i++) {
+        if (m->banks[i] != NULL) {
+            for (int j = 0; j < 256; j++)
+                free(m->banks[i][j]);
+            free(m->banks[i]);
+        }
+    }
+    if (m->blocks != NULL) {
+        for (int i = 0; i < 0x10000; i++)
+            free(m->blocks[i]);
+        free(m->blocks);
+    }
+    free(m->decoded);
+    free(m->codeMap);
+    free(m);
+}
+
+/* Copy n bytes into memory at address, wrapping around at $FFFF. ROM is written too. */
+void loadMemory(struct machine *m, uint16_t address, const uint8_t *data, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint16_t a = address + i;
+
+        m->memory[a] = data[i];
+        if (m->codeMap != NULL && m->codeMap[a])
+            invalidate(m, a);
+    }
+}
+
+/*
+ * Stop running when the program reaches address, which for the 65816
+ * can be in any bank. The page flag is set for that page in bank 0 as
+ * well, as a quick test before the stops are searched. Returns false
+ * if there are too many.
+ */
+bool addStop(struct machine *m, uint32_t address)
+{
+    uint16_t a = address;
+
+    if (m->numStops == MAX_STOPS)
+        return false;
+    m->stops[m->numStops++] = address;
+    m->pageFlags[a >> 8] |= PAGE_STOP;
+    if (m->codeMap != NULL && m->codeMap[a])
+        invalidate(m, a);
+    return true;
+}
+
+const char *stopReasonName(enum stopReason reason)
+{
+    static const char *names[] = {
+        "Running", "Returned to the monitor", "Reached the cycle limit", "Waiting for input", "Illegal opcode",
+        "Halted by STP or WAI"
+    };
+
+    return names[reason];
+}
+
+const char *cpuName(enum cpu cpu)
+{
+    static const char *names[] = { "6502", "65c02", "65816" };
+
+    return names[cpu];
+}
+
+const char *engineName(enum engine engine)
+{
+    static const char *names[] = { "interpreter", "threaded", "blocks" };
+
+    return names[engine];
+}
+
+/* Return if a key is waiting, reading the next one if needed. */
+static bool pollKeyboard(struct machine *m)
+{
+    if (!m->keyWaiting && !m->inputEnded) {
+        int c = m->keyboard != NULL ? m->keyboard(m->context) : -1;
+        if (c < 0) {
+            m->inputEnded = true;
+        } else {
+            m->kbd = (c == '\n' ? '\r' : c) | 0x80;
+            m->keyWaiting = true;
+        }
+    }
+    if (!m->keyWaiting && m->inputEnded && ++m->idlePolls >= IDLE_POLL_LIMIT)
+        m->stop = STOP_INPUT;
+    return m->keyWaiting;
+}
+
+/*
+ * Read a PIA register. Reading the keyboard data clears the flag that
+ * a key is waiting. The display is always ready for another character.
+ */
+static uint8_t readIo(struct machine *m, uint16_t address)
+{
+    switch (address) {
+    case KBD:
+        m->keyWaiting = false;
+        return m->kbd;
+    case KBDCR:
+        return pollKeyboard(m) ? m->kbdcr | 0x80 : m->kbdcr & 0x7f;
+    case DSP:
+        return 0;
+    case DSPCR:
+        return m->dspcr;
+    default:
+        return m->memory[address];
+    }
+}
+
+/* Write a PIA register. Writing the display data shows a character. */
+static void writeIo(struct machine *m, uint16_t address, uint8_t value)
+{
+    switch (address) {
+    case KBDCR:
+        m->kbdcr = value;
+        break;
+    case DSP:
+        if (!(m->dspcr & 0x04)) {
+            m->dspDirection = value; // Data direction register selected
+        } else if (m->display != NULL) {
+            int c = value & 0x7f;
+            m->display(m->context, c == '\r' ? '\n' : c);
+        }
+        break;
+    case DSPCR:
+        m->dspcr = value;
+        break;
+    case KBD:
+        break;
+    default:
+        m->memory[address] = value;
+        break;
+    }
+}
+
+static inline uint8_t readByte(struct machine *m, uint16_t address)
+{
+    if (m->pageFlags[address >> 8] & PAGE_IO)
+        return readIo(m, address);
+    return m->memory[address];
+}
+
+static inline void writeByte(struct machine *m, uint16_t address, uint8_t value)
+{
+    if (m->pageFlags[address >> 8] & (PAGE_IO | PAGE_ROM)) {
+        if (m->pageFlags[address >> 8] & PAGE_IO)
+            writeIo(m, address, value);
+        return;
+    }
+    m->memory[address] = value;
+}
+
+/* Return if the program has reached a stop address, given with its bank for the 65816. */
+bool atStop(const struct machine *m, uint32_t pc)
+{
+    for (int i = 0; i < m->numStops; i++) {
+        if (m->stops[i] == pc)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * The engines keep the registers in local variables, and these macros
+ * work on them. The operand bytes are read from memory directly, since
+ * code never runs from the PIA. FETCH, FETCH16, FETCH2, PUSH, STORE,
+ * WRITE and HALT are defined differently for the threaded engine.
+ */
+
+#define FETCH() (mem[pc++])
+#define FETCH16() (pc += 2, mem[(uint16_t)(pc - 2)] | (mem[(uint16_t)(pc - 1)] << 8))
+#define FETCH2() (mem[pc++])    // The second operand byte, after FETCH()
+
+#define SET_NZ(v) (p = (p & ~(FLAG_N | FLAG_Z)) | ((v) & FLAG_N) | ((v) ? 0 : FLAG_Z))
+
+#define PUSH(v) (mem[0x100 | s--] = (v))
+#define PULL() (mem[0x100 | ++s])
+
+/* Effective addresses. The _R forms add a cycle if indexing crosses a page. */
+#define ZP() (address = FETCH())
+#define ZPX() (address = (uint8_t)(FETCH() + x))
+#define ZPY() (address = (uint8_t)(FETCH() + y))
+#define ABS() (address = FETCH16())
+#define ABSX() (base = FETCH16(), address = (uint16_t)(base + x))
+#define ABSY() (base = FETCH16(), address = (uint16_t)(base + y))
+#define ABSX_R() (ABSX(), cycles += (base ^ address) >> 8 != 0)
+#define ABSY_R() (ABSY(), cycles += (base ^ address) >> 8 != 0)
+#define INDX() (zp = (uint8_t)(FETCH() + x), address = mem[zp] | (mem[(uint8_t)(zp + 1)] << 8))
+#define INDY() (zp = FETCH(), base = mem[zp] | (mem[(uint8_t)(zp + 1)] << 8), address = (uint16_t)(base + y))
+#define INDY_R() (INDY(), cycles += (base ^ address) >> 8 != 0)
+#define INDZ() (zp = FETCH(), address = mem[zp] | (mem[(uint8_t)(zp + 1)] << 8))
+
+/* Memory at address. Zero page is always RAM, so STORE writes it directly. */
+#define READ() readByte(m, address)
+#define WRITE(v) writeByte(m, address, (v))
+#define STORE(v) (mem[address] = (v))
+
+/* Stop the processor, for the 65C02's STP and WAI. */
+#define HALT() (m->stop = STOP_HALT)
+
+/*
+ * Add with carry. In decimal mode the NMOS 6502 sets Z from the binary
+ * sum, and N and V from the sum after adjusting only the low digit.
+ */
+#define ADC(v) do { \
+    unsigned value = (v); \
+    unsigned carry = p & FLAG_C; \
+    unsigned sum = a + value + carry; \
+    p &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C); \
+    if (p & FLAG_D) { \
+        unsigned low = (a & 0x0f) + (value & 0x0f) + carry; \
+        if (low > 0x09) \
+            low = ((low + 0x06) & 0x0f) + 0x10; \
+        p |= (sum & 0xff) ? 0 : FLAG_Z; \
+        sum = (a & 0xf0) + (value & 0xf0) + low; \
+        p |= (sum & FLAG_N) | ((~(a ^ value) & (a ^ sum) & 0x80) ? FLAG_V : 0); \
+        if (sum >= 0xa0) \
+            sum += 0x60; \
+        p |= sum > 0xff ? FLAG_C : 0; \
+        a = sum; \
+    } else { \
+        p |= ((~(a ^ value) & (a ^ sum) & 0x80) ? FLAG_V : 0) | (sum > 0xff ? FLAG_C : 0); \
+        a = sum; \
+        SET_NZ(a); \
+    } \
+} while (0)
+
+/* Subtract with borrow. In decimal mode the flags are those of the binary result. */
+#define SBC(v) do { \
+    unsigned value = (v); \
+    unsigned borrow = ~p & FLAG_C; \
+    unsigned difference = a - value - borrow; \
+    p &= ~(FLAG_N | FLAG_V | FLAG_Z | FLAG_C); \
+    p |= (((a ^ value) & (a ^ difference) & 0x80) ? FLAG_V : 0) | (difference < 0x100 ? FLAG_C : 0); \
+    SET_NZ((uint8_t)difference); \
+    if (p & FLAG_D) { \
+        int low = (a & 0x0f) - (int)(value & 0x0f) - (int)borrow; \
+        int result; \
+        if (low < 0) \
+            low = ((low - 0x06) & 0x0f) - 0x10; \
+        result = (a & 0xf0) - (int)(value & 0xf0) + low; \
+        if (result < 0) \
+            result -= 0x60; \
+        a = result; \
+    } else { \
+        a = difference; \
+    } \
+} while (0)
+
+/*
+ * Add and subtract on the 65C02, which sets N and Z from the result in
+ * decimal mode, and takes a cycle more for it.
+ */
+#define ADC_CMOS(v) do { \
+    if (p & FLAG_D) { \
+        unsigned value = (v); \
+        unsigned low = (a & 0x0f) + (value & 0x0f) + (p & FLAG_C); \
+        unsigned sum; \
+        if (low > 0x09) \
+            low = ((low + 0x06) & 0x0f) + 0x10; \
+        sum = (a & 0xf0) + (value & 0xf0) + low; \
+        p &= ~(FLAG_V | FLAG_C); \
+        p |= (~(a ^ value) & (a ^ sum) & 0x80) ? FLAG_V : 0; \
+        if (sum >= 0xa0) \
+            sum += 0x60; \
+        p |= sum > 0xff ? FLAG_C : 0; \
+        a = sum; \
+        SET_NZ(a); \
+        cycles++; \
+    } else { \
+        ADC(v); \
+    } \
+} while (0)
+
+#define SBC_CMOS(v) do { \
+    if (p & FLAG_D) { \
+        unsigned value = (v); \
+        int borrow = ~p & FLAG_C; \
+        int low = (a & 0x0f) - (int)(value & 0x0f) - borrow; \
+        int result = a - (int)value - borrow; \
+        p &= ~(FLAG_V | FLAG_C); \
+        p |= (((a ^ value) & (a ^ result) & 0x80) ? FLAG_V : 0) | (result >= 0 ? FLAG_C : 0); \
+        if (result < 0) \
+            result -= 0x60; \
+        if (low < 0) \
+            result -= 0x06; \
+        a = result; \
+        SET_NZ(a); \
+        cycles++; \
+    } else { \
+        SBC(v); \
+    } \
+} while (0)
+
+#define COMPARE(r, v) do { \
+    unsigned difference = (r) - (v); \
+    p = (p & ~FLAG_C) | (difference < 0x100 ? FLAG_C : 0); \
+    SET_NZ((uint8_t)difference); \
+} while (0)
+
+#define BIT(v) do { \
+    uint8_t value = (v); \
+    p = (p & ~(FLAG_N | FLAG_V | FLAG_Z)) | (value & (FLAG_N | FLAG_V)) | ((a & value) ? 0 : FLAG_Z); \
+} while (0)
+
+#define ASL(v) (p = (p & ~FLAG_C) | ((v) >> 7), (v) <<= 1, SET_NZ(v))
+#define LSR(v) (p = (p & ~FLAG_C) | ((v) & FLAG_C), (v) >>= 1, SET_NZ(v))
+#define ROL(v) do { uint8_t c = p & FLAG_C; p = (p & ~FLAG_C) | ((v) >> 7); (v) = ((v) << 1) | c; SET_NZ(v); } while (0)
+#define ROR(v) do { uint8_t c = p & FLAG_C; p = (p & ~FLAG_C) | ((v) & FLAG_C); (v) = ((v) >> 1) | (c << 7); SET_NZ(v); } while (0)
+
+/* Read-modify-write an operand in memory. */
+#define MODIFY(op) do { uint8_t value = READ(); op(value); WRITE(value); } while (0)
+#define MODIFY_ZP(op) do { uint8_t value = mem[address]; op(value); STORE(value); } while (0)
+#define TSB(v) (p = (p & ~FLAG_Z) | ((a & (v)) ? 0 : FLAG_Z), (v) |= a)
+#define TRB(v) (p = (p & ~FLAG_Z) | ((a & (v)) ? 0 : FLAG_Z), (v) &= ~a)
+#define INC(v) ((v)++, SET_NZ(v))
+#define DEC(v) ((v)--, SET_NZ(v))
+
+/* Nothing more to do for a branch taken, except in the block engine. */
+#define BRANCH_TAKEN()
+
+/*
+ * A branch takes a cycle more if taken, and another if it goes to a
+ * different page. BBR and BBS have their offset after a zero page
+ * address.
+ */
+#define BRANCH(condition) BRANCH_BY(FETCH(), condition)
+#define BRANCH_BY(fetch, condition) do { \
+    int8_t offset = (fetch); \
+    if (condition) { \
+        uint16_t target = pc + offset; \
+        cycles += 1 + ((pc ^ target) >> 8 != 0); \
+        pc = target; \
+        BRANCH_TAKEN(); \
+    } \
+} while (0)
+
+/*
+ * The reference engine: fetch, decode and execute each instruction in
+ * turn. Runs until the program reaches a stop address, executes an
+ * illegal opcode, waits for input after the end of the input, or has
+ * run for at least cycleLimit cycles in all.
+ */
+static enum stopReason interpret(struct machine *m, unsigned long long cycleLimit)
+{
+    uint8_t *mem = m->memory;
+    uint16_t pc = m->pc;
+    uint8_t a = m->a;
+    uint8_t x = m->x;
+    uint8_t y = m->y;
+    uint8_t s = m->s;
+    uint8_t p = m->p;
+    unsigned long long cycles = m->cycles;
+    unsigned long long instructions = m->instructions;
+    enum cpu cpu = m->cpu;
+
+    m->stop = STOP_NONE;
+    while (m->stop == STOP_NONE) {
+        uint16_t address, base;
+        uint8_t zp;
+        unsigned instruction;
+
+        if ((m->pageFlags[pc >> 8] & PAGE_STOP) && atStop(m, pc)) {
+            m->stop = STOP_MONITOR;
+            break;
+        }
+        if (cycles >= cycleLimit) {
+            m->stop = STOP_CYCLES;
+            break;
+        }
+        instruction = instructionFor(cpu, mem[pc]);
+        if (cycleTable[instruction] == 0) {
+            m->stop = STOP_ILLEGAL;
+            break;
+        }
+        pc++;
+        cycles += cycleTable[instruction];
+        instructions++;
+
+        switch (instruction) {
+#define INSTRUCTION(opcode, ...) case opcode: __VA_ARGS__; break;
+#include "instructions.h"
+#include "instructions65c02.h"
+#undef INSTRUCTION
+        }
+    }
+
+    m->pc = pc;
+    m->a = a;
+    m->x = x;
+    m->y = y;
+    m->s = s;
+    m->p = p;
+    m->cycles = cycles;
+    m->instructions = instructions;
+    return m->stop;
+}
+
+#ifdef __GNUC__
+
+/*
+ * The threaded engine. Each instruction is decoded once, the first time
+ * it runs, into a record of the code for its opcode and its operand.
+ * The code for each opcode ends by jumping straight to the code for the
+ * next instruction through its record (using GCC's labels as values),
+ * so there is no fetch and decode, and the host can predict each jump
+ * on its own. A stop address decodes to a record that stops, so it
+ * costs nothing to check.
+ *
+ * Any write to a byte of a decoded instruction makes it decoded again,
+ * so self-modifying code and programs loaded by other programs work.
+ * The operand is taken from the record, and pc has already been
+ * advanced past the instruction when its code runs.
+ */
+
+static uint8_t readStopping(struct machine *m, uint16_t address, unsigned long long *limit)
+{
+    uint8_t value = readIo(m, address);
+
+    if (m->stop != STOP_NONE)
+        *limit = 0;
+    return value;
+}
+
+#undef FETCH
+#undef FETCH16
+#undef FETCH2
+#undef PUSH
+#undef STORE
+#undef WRITE
+#define FETCH() ((uint8_t)d->operand)
+#define FETCH16() (d->operand)
+#define FETCH2() ((uint8_t)(d->operand >> 8))
+#define CHECK_CODE(address) do { if (codeMap[address]) invalidate(m, (address)); } while (0)
+#define PUSH(v) do { uint16_t top = 0x100 | s--; mem[top] = (v); CHECK_CODE(top); } while (0)
+#define STORE(v) do { mem[address] = (v); CHECK_CODE(address); } while (0)
+#define WRITE(v) do { writeByte(m, address, (v)); CHECK_CODE(address); } while (0)
+
+/* Reading the PIA can stop the program, which ends the run by lowering the limit. */
+#undef READ
+#define READ() ((m->pageFlags[address >> 8] & PAGE_IO) ? readStopping(m, address, &limit) : mem[address])
+#undef HALT
+#define HALT() (m->stop = STOP_HALT, limit = 0)
+
+/* Go to the next instruction, unless the program has stopped. */
+#define DISPATCH() do { \
+    if (cycles >= limit) \
+        goto leave; \
+    d = &decoded[pc]; \
+    instructions++; \
+    goto *handlers[d->handler]; \
+} while (0)
+
+static enum stopReason runThreaded(struct machine *m, unsigned long long cycleLimit)
+{
+    static const void *const handlers[HANDLER_OPCODE + NUM_INSTRUCTIONS] = {
+        [HANDLER_DECODE] = &&decode,
+        [HANDLER_STOP] = &&stopped,
+        [HANDLER_ILLEGAL] = &&illegal,
+#define INSTRUCTION(opcode, ...) [HANDLER_OPCODE + opcode] = &&op_##opcode,
+#include "instructions.h"
+#include "instructions65c02.h"
+#undef INSTRUCTION
+    };
+    uint8_t *mem = m->memory;
+    uint16_t pc = m->pc;
+    uint8_t a = m->a;
+    uint8_t x = m->x;
+    uint8_t y = m->y;
+    uint8_t s = m->s;
+    uint8_t p = m->p;
+    unsigned long long cycles = m->cycles;
+    unsigned long long instructions = m->instructions;
+    unsigned long long limit = cycleLimit;
+    struct decodedInstruction *decoded;
+    struct decodedInstruction *d;
+    uint8_t *codeMap;
+    uint16_t address, base;
+    uint8_t zp;
+
+    if (m->codeMap == NULL)
+        m->codeMap = calloc(0x10000, 1);
+    if (m->decoded == NULL)
+        m->decoded = calloc(0x10000, sizeof(struct decodedInstruction));
+    if (m->decoded == NULL || m->codeMap == NULL)
+        return interpret(m, cycleLimit);
+    decoded = m->decoded;
+    codeMap = m->codeMap;
+
+    m->stop = STOP_NONE;
+    DISPATCH();
+
+#define INSTRUCTION(opcode, ...) \
+    op_##opcode: pc += lengthTable[opcode]; cycles += cycleTable[opcode]; __VA_ARGS__; DISPATCH();
+#include "instructions.h"
+#include "instructions65c02.h"
+#undef INSTRUCTION
+
+decode:
+    /* Not decoded yet, or written to since: decode it and go again. */
+    instructions--;
+    if ((m->pageFlags[pc >> 8] & PAGE_STOP) && atStop(m, pc)) {
+        *d = (struct decodedInstruction) { HANDLER_STOP, 0 };
+    } else if (cycleTable[instructionFor(m->cpu, mem[pc])] == 0) {
+        *d = (struct decodedInstruction) { HANDLER_ILLEGAL, 0 };
+    } else {
+        unsigned instruction = instructionFor(m->cpu, mem[pc]);
+
+        d->handler = HANDLER_OPCODE + instruction;
+        d->operand = mem[(uint16_t)(pc + 1)] | (mem[(uint16_t)(pc + 2)] << 8);
+        for (int i = 1; i < lengthTable[instruction]; i++)
+            codeMap[(uint16_t)(pc + i)] = 1;
+    }
+    codeMap[pc] = 1;
+    DISPATCH();
+
+stopped:
+    instructions--;
+    m->stop = STOP_MONITOR;
+    goto leave;
+
+illegal:
+    instructions--;
+    m->stop = STOP_ILLEGAL;
+    goto leave;
+
+leave:
+    /* A stop address is reported in preference to the cycle limit. */
+    if (m->stop == STOP_NONE)
+        m->stop = atStop(m, pc) ? STOP_MONITOR : STOP_CYCLES;
+    m->pc = pc;
+    m->a = a;
+    m->x = x;
+    m->y = y;
+    m->s = s;
+    m->p = p;
+    m->cycles = cycles;
+    m->instructions = instructions;
+    return m->stop;
+}
+
+/*
+ * The block engine. The instructions that run in turn from each address
+ * that a branch, jump, call or return goes to are translated into a
+ * block of decoded instructions, kept for that address. Absolute jumps
+ * and calls are followed, and a branch only leaves the block if it is
+ * taken, so a block runs through the calls and the tests that are not
+ * taken as a single superinstruction: the block is found, the stop
+ * addresses checked and the instructions counted once for the whole
+ * block, and its instructions follow one another with only the cycle
+ * limit checked between them.
+ *
+ * Every page of memory has a generation, counted up when a byte of a
+ * translated instruction in it is written, and each block keeps the
+ * generations of its pages from when it was translated. A block whose
+ * pages have changed since is translated again before it runs, so code
+ * that patches itself, such as the routine that Microsoft BASIC and
+ * EhBASIC copy to page zero to get the next character of a line, runs
+ * as it would on the 6502. Until any code at all is written the pages
+ * need not be looked at. A write to code also ends the block that makes
+ * it, in case the code written is later in the same block.
+ */
+
+/* Add the page of address to the block's pages. Returns false if it has too many. */
+static bool addPage(struct machine *m, struct block *b, uint16_t address)
+{
+    uint8_t page = address >> 8;
+
+    for (int i = 0; i < b->numPages; i++) {
+        if (b->pages[i] == page)
+            return true;
+    }
+    if (b->numPages == MAX_BLOCK_PAGES)
+        return false;
+    b->pages[b->numPages] = page;
+    b->generation[b->numPages++] = m->pageGeneration[page];
+    return true;
+}
+
+/* Translate the block at address. Returns NULL if out of memory. */
+static struct block *translate(struct machine *m, uint16_t address)
+{
+    struct block *b = m->blocks[address];
+    const uint8_t *mem = m->memory;
+    int n = 0;
+
+    if (b == NULL) {
+        b = malloc(sizeof(struct block));
+        if (b == NULL)
+            return NULL;
+        m->blocks[address] = b;
+    }
+    b->numPages = 0;
+    addPage(m, b, address);
+    m->codeMap[address] = 1;
+    while (n < MAX_BLOCK_INSTRUCTIONS) {
+        uint8_t opcode = mem[address];
+        unsigned instruction = instructionFor(m->cpu, opcode);
+        uint16_t operand = mem[(uint16_t)(address + 1)] | (mem[(uint16_t)(address + 2)] << 8);
+
+        if ((m->pageFlags[address >> 8] & PAGE_STOP) && atStop(m, address)) {
+            if (n == 0)
+                b->code[n++] = (struct decodedInstruction) { HANDLER_STOP, 0 };
+            break;
+        }
+        if (cycleTable[instruction] == 0) {
+            if (n == 0)
+                b->code[n++] = (struct decodedInstruction) { HANDLER_ILLEGAL, 0 };
+            break;
+        }
+        if (!addPage(m, b, address) || !addPage(m, b, address + lengthTable[instruction] - 1))
+            break;
+        b->code[n++] = (struct decodedInstruction) { HANDLER_OPCODE + instruction, operand };
+        for (int i = 0; i < lengthTable[instruction]; i++)
+            m->codeMap[(uint16_t)(address + i)] = 1;
+
+        if (opcode == 0x20 || opcode == 0x4c) // JSR and JMP absolute
+            address = operand;
+        else if (opcode == 0x00 || opcode == 0x40 || opcode == 0x60 || opcode == 0x6c) // BRK, RTI, RTS and JMP indirect
+            break;
+        else if (opcode == 0x7c || opcode == 0x80) // 65C02 JMP indexed indirect and BRA
+            break;
+        else
+            address += lengthTable[instruction];
+    }
+    if (b->code[0].handler >= HANDLER_OPCODE) {
+        b->code[n] = (struct decodedInstruction) { HANDLER_END, 0 };
+        b->count = n;
+    } else {
+        b->count = 0;
+    }
+    b->checked = m->codeWrites;
+    return b;
+}
+
+/* Return if no code in the block's pages has been written since it was translated. */
+static bool upToDate(struct machine *m, struct block *b)
+{
+    for (int i = 0; i < b->numPages; i++) {
+        if (b->generation[i] != m->pageGeneration[b->pages[i]])
+            return false;
+    }
+    b->checked = m->codeWrites;
+    return true;
+}
+
+/* A write to code ends the block, by lowering the limit. */
+#undef CHECK_CODE
+#define CHECK_CODE(address) do { if (codeMap[address]) { invalidate(m, (address)); limit = 0; } } while (0)
+
+/* A branch taken leaves the block. */
+#undef BRANCH_TAKEN
+#define BRANCH_TAKEN() goto branchTaken
+
+/* Go on to the next instruction in the block, unless the block is to end here. */
+#define NEXT() do { \
+    if (cycles >= limit) \
+        goto blockExit; \
+    d++; \
+    goto *handlers[d->handler]; \
+} while (0)
+
+static enum stopReason runBlocks(struct machine *m, unsigned long long cycleLimit)
+{
+    static const void *const handlers[HANDLER_OPCODE + NUM_INSTRUCTIONS] = {
+        [HANDLER_STOP] = &&stopped,
+        [HANDLER_ILLEGAL] = &&illegal,
+        [HANDLER_END] = &&endOfBlock,
+#define INSTRUCTION(opcode, ...) [HANDLER_OPCODE + opcode] = &&op_##opcode,
+#include "instructions.h"
+#include "instructions65c02.h"
+#undef INSTRUCTION
+    };
+    uint8_t *mem = m->memory;
+    uint16_t pc = m->pc;
+    uint8_t a = m->a;
+    uint8_t x = m->x;
+    uint8_t y = m->y;
+    uint8_t s = m->s;
+    uint8_t p = m->p;
+    unsigned long long cycles = m->cycles;
+    unsigned long long instructions = m->instructions;
+    unsigned long long limit = cycleLimit;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    struct block **blocks;
+    struct block *b;
+    const struct decodedInstruction *d;
+    uint8_t *codeMap;
+    uint16_t address, base;
+    uint8_t zp;
+
+    if (m->codeMap == NULL)
+        m->codeMap = calloc(0x10000, 1);
+    if (m->blocks == NULL)
+        m->blocks = calloc(0x10000, sizeof(struct block *));
+    if (m->codeMap == NULL || m->blocks == NULL)
+        return interpret(m, cycleLimit);
+    blocks = m->blocks;
+    codeMap = m->codeMap;
+
+    m->stop = STOP_NONE;
+
+nextBlock:
+    if (cycles >= limit)
+        goto leave;
+    b = blocks[pc];
+    if (b != NULL && (b->checked == m->codeWrites || upToDate(m, b))) {
+        hits++;
+    } else {
+        misses++;
+        b = translate(m, pc);
+        if (b == NULL)
+            goto outOfMemory;
+    }
+    d = b->code;
+    goto *handlers[d->handler];
+
+#define INSTRUCTION(opcode, ...) \
+    op_##opcode: pc += lengthTable[opcode]; cycles += cycleTable[opcode]; __VA_ARGS__; NEXT();
+#include "instructions.h"
+#include "instructions65c02.h"
+#undef INSTRUCTION
+
+endOfBlock:
+    instructions += b->count;
+    goto nextBlock;
+
+branchTaken:
+    instructions += d - b->code + 1;
+    goto nextBlock;
+
+blockExit:
+    /*
+     * Left the block after the instruction d, at the cycle limit, when
+     * the program stopped or after a write to code.
+     */
+    instructions += d - b->code + 1;
+    if (m->stop != STOP_NONE || cycles >= cycleLimit)
+        goto leave;
+    limit = cycleLimit;
+    goto nextBlock;
+
+stopped:
+    m->stop = STOP_MONITOR;
+    goto leave;
+
+illegal:
+    m->stop = STOP_ILLEGAL;
+    goto leave;
+
+leave:
+    /* A stop address is reported in preference to the cycle limit. */
+    if (m->stop == STOP_NONE)
+        m->stop = atStop(m, pc) ? STOP_MONITOR : STOP_CYCLES;
+outOfMemory:
+    m->pc = pc;
+    m->a = a;
+    m->x = x;
+    m->y = y;
+    m->s = s;
+    m->p = p;
+    m->cycles = cycles;
+    m->instructions = instructions;
+    m->blockHits += hits;
+    m->blockMisses += misses;
+    if (m->stop == STOP_NONE)
+        return interpret(m, cycleLimit); // Out of memory for blocks
+    return m->stop;
+}
+
+#else
+
+/* Without GCC's labels as values, the other engines are the reference one. */
+static enum stopReason runThreaded(struct machine *m, unsigned long long cycleLimit)
+{
+    return interpret(m, cycleLimit);
+}
+
+static enum stopReason runBlocks(struct machine *m, unsigned long long cycleLimit)
+{
+    return interpret(m, cycleLimit);
+}
+
+#endif
+
+/*
+ * The page of a bank above bank 0 that holds address, or NULL if it
+ * has not been written. With create set it is allocated, zeroed, if
+ * need be, and NULL is only returned when out of memory.
+ */
+static uint8_t *highPage(struct machine *m, uint32_t address, bool create)
+{
+    uint8_t **bank = m->banks[(address >> 16) & 0xff];
+    uint8_t page = address >> 8;
+
+    if (bank == NULL) {
+        if (!create)
+            return NULL;
+        bank = m->banks[(address >> 16) & 0xff] = calloc(256, sizeof(uint8_t *));
+        if (bank == NULL)
+            return NULL;
+    }
+    if (bank[page] == NULL && create) {
+        bank[page] = calloc(256, 1);
+        if (bank[page] != NULL)
+            m->highPages++;
+    }
+    return bank[page];
+}
+
+/*
+ * Read the byte at a 24-bit address. Bank 0 is the Apple 1, with the
+ * PIA, and the rest of memory reads as zero until it is written.
+ */
+uint8_t readMemory(struct machine *m, uint32_t address)
+{
+    const uint8_t *page;
+
+    if (address < 0x10000)
+        return readByte(m, address);
+    page = highPage(m, address, false);
+    return page != NULL ? page[address & 0xff] : 0;
+}
+
+/* Write the byte at a 24-bit address. A write that host memory cannot be found for is lost. */
+void writeMemory(struct machine *m, uint32_t address, uint8_t value)
+{
+    uint8_t *page;
+
+    if (address < 0x10000) {
+        writeByte(m, address, value);
+        if (m->codeMap != NULL && m->codeMap[address])
+            invalidate(m, address);
+        return;
+    }
+    page = highPage(m, address, true);
+    if (page != NULL)
+        page[address & 0xff] = value;
+}
+
+/*
+ * Run with the engine chosen in m->engine until the program reaches a
+ * stop address, executes an illegal opcode, waits for input after the
+ * end of the input, or has run for at least cycleLimit cycles in all.
+ * Returns why it stopped.
+ */
+enum stopReason run6502(struct machine *m, unsigned long long cycleLimit)
+{
+    if (m->cpu == CPU_65816)
+        return run65816(m, cycleLimit);
+    switch (m->engine) {
+    case ENGINE_THREADED:
+        return runThreaded(m, cycleLimit);
+    case ENGINE_BLOCKS:
+        return runBlocks(m, cycleLimit);
+    default:
+        return interpret(m, cycleLimit);
+    }
+}
@@ -0,0 +1,204 @@
+/*
+ * lib6502: run 6502 programs on the host.
+ *
+ * This emulates an NMOS 6502, a 65C02 or a 65816 with exact cycle
+ * counts, in an Apple 1 or Replica 1 with the Woz Monitor in ROM at $FF00
+ * and the PIA for the keyboard and display at $D010-$D013. It has no
+ * screen of its own: characters written to the display go to a
+ * callback, and keys are read from another. The rest of memory is RAM,
+ * up to the 16 MB that the 65816 can address, of which only the 256
+ * byte pages above the first 64K that are written take up host memory.
+ *
+ * A program runs until it returns to the monitor, at its reset entry
+ * $FF00 or GETLINE at $FF1F, or at any other stop address added. The
+ * cycles and instructions executed are counted, so programs can be
+ * timed as they would run on the real hardware. Memory should only be
+ * changed between runs with loadMemory() or writeMemory(), which keep
+ * the threaded engine's decoded instructions up to date.
+ *
+ * Example, running a program loaded at $0280:
+ *
+ *   struct machine *m = newMachine();
+ *
+ *   loadMemory(m, 0x280, program, length);
+ *   m->pc = 0x280;
+ *   m->engine = ENGINE_THREADED;
+ *   if (run6502(m, NO_CYCLE_LIMIT) == STOP_MONITOR)
+ *       printf("%llu cycles\n", m->cycles);
+ *   freeMachine(m);
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIB6502_H
+#define LIB6502_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Processor status flags */
+#define FLAG_C 0x01
+#define FLAG_Z 0x02
+#define FLAG_I 0x04
+#define FLAG_D 0x08
+#define FLAG_B 0x10
+#define FLAG_U 0x20
+#define FLAG_V 0x40
+#define FLAG_N 0x80
+#define FLAG_X 0x10         // 65816 native mode: 8-bit index registers, in place of B
+#define FLAG_M 0x20         // 65816 native mode: 8-bit accumulator and memory
+
+/* Apple 1 PIA registers */
+#define KBD   0xD010        // Keyboard data
+#define KBDCR 0xD011        // Keyboard control, bit 7 set when a key is waiting
+#define DSP   0xD012        // Display data, bit 7 set while busy
+#define DSPCR 0xD013        // Display control
+
+/* Woz Monitor entry points */
+#define MONITOR_RESET   0xFF00
+#define MONITOR_GETLINE 0xFF1F
+
+/* Page flags */
+#define PAGE_IO   0x01      // Accesses go to the PIA
+#define PAGE_ROM  0x02      // Writes are ignored
+#define PAGE_STOP 0x04      // Holds a stop address
+
+#define MAX_STOPS 8
+#define NO_CYCLE_LIMIT ~0ULL
+
+/*
+ * Polls of the keyboard after the input has run out before the
+ * program is taken to be waiting for input that will never come.
+ */
+#define IDLE_POLL_LIMIT 100000
+
+/* Why run6502() returned. */
+enum stopReason {
+    STOP_NONE,              // Still running
+    STOP_MONITOR,           // Reached a stop address
+    STOP_CYCLES,            // Ran for the cycle limit
+    STOP_INPUT,             // Waiting for a key after the end of the input
+    STOP_ILLEGAL,           // Illegal opcode at pc
+    STOP_HALT               // 65C02 or 65816 STP or WAI before pc
+};
+
+/*
+ * The processor. The 65C02 is the WDC W65C02S, with the Rockwell bit
+ * instructions, its own cycle counts and valid flags in decimal mode.
+ * Its STP and WAI end the run, as there are no interrupts. The 65816
+ * is the WDC W65C816S, which starts in emulation mode, as after a reset,
+ * and has its own interpreter whatever the engine: how long most of its
+ * instructions are depends on the M and X flags when they run, so they
+ * cannot be decoded ahead. Its stop addresses have a bank, which
+ * the program bank must match; the other processors only see those in
+ * bank 0.
+ */
+enum cpu {
+    CPU_6502,
+    CPU_65C02,
+    CPU_65816
+};
+
+/*
+ * The ways a program can be run. The interpreter decodes each
+ * instruction every time it runs it, and is the reference for the
+ * others. The threaded engine decodes each instruction once and jumps
+ * from one to the next through the decoded instructions. The block
+ * engine translates the instructions that run in turn from each place
+ * a branch or return goes to once, following calls and jumps, and runs
+ * them as a whole. They give the same results.
+ */
+enum engine {
+    ENGINE_INTERPRETER,
+    ENGINE_THREADED,
+    ENGINE_BLOCKS
+};
+
+struct decodedInstruction;
+struct block;
+
+/*
+ * Called with each character written to the display, with bit 7
+ * cleared and a return turned into a newline.
+ */
+typedef void (*displayFunction)(void *context, int c);
+
+/* Called for the next key, which returns it or -1 at the end of the input. */
+typedef int (*keyboardFunction)(void *context);
+
+struct machine {
+    /* Registers. Only the 65816 uses the high bytes of a, x, y and s. */
+    uint16_t pc;
+    uint16_t a;
+    uint16_t x;
+    uint16_t y;
+    uint16_t s;
+    uint8_t p;
+
+    /* 65816 registers */
+    uint16_t d;                         // Direct page
+    uint8_t dbr;                        // Data bank
+    uint8_t pbr;                        // Program bank
+    bool e;                             // Emulation mode
+
+    unsigned long long cycles;          // Clock cycles executed
+    unsigned long long instructions;    // Instructions executed
+    enum stopReason stop;
+
+    uint8_t memory[0x10000];            // Bank 0
+    uint8_t **banks[256];               // Pages written in the banks above, or NULL
+    unsigned long highPages;            // Pages allocated in them
+    uint8_t pageFlags[256];
+    uint32_t stops[MAX_STOPS];          // 24-bit, for the 65816
+    int numStops;
+
+    /* Apple 1 PIA */
+    uint8_t kbdcr;
+    uint8_t dspcr;
+    uint8_t kbd;                        // Last key read
+    uint8_t dspDirection;               // Display data direction register
+    bool keyWaiting;
+    bool inputEnded;
+    long idlePolls;                     // Keyboard polls since the input ended
+    displayFunction display;
+    keyboardFunction keyboard;
+    void *context;                      // Passed to display and keyboard
+
+    enum cpu cpu;                       // Set before the first run
+    enum engine engine;                 // Used by run6502()
+    struct decodedInstruction *decoded; // Threaded engine's instruction at each address
+    struct block **blocks;              // Block engine's block starting at each address
+    uint32_t pageGeneration[256];       // Counts writes to the code in each page
+    unsigned long long codeWrites;      // Counts writes to code in all pages
+    uint8_t *codeMap;                   // Nonzero for each byte of a decoded instruction
+    unsigned long long blockHits;       // Blocks run as translated before
+    unsigned long long blockMisses;     // Blocks translated, or translated again
+};
+
+struct machine *newMachine(void);
+void freeMachine(struct machine *m);
+void loadMemory(struct machine *m, uint16_t address, const uint8_t *data, size_t n);
+bool addStop(struct machine *m, uint32_t address);
+bool atStop(const struct machine *m, uint32_t pc);
+uint8_t readMemory(struct machine *m, uint32_t address);
+void writeMemory(struct machine *m, uint32_t address, uint8_t value);
+enum stopReason run6502(struct machine *m, unsigned long long cycleLimit);
+enum stopReason run65816(struct machine *m, unsigned long long cycleLimit);
+const char *stopReasonName(enum stopReason reason);
+const char *cpuName(enum cpu cpu);
+const char *engineName(enum engine engine);
+
+#endif /* LIB6502_H */
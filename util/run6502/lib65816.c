@@ -0,0 +1,976 @@
+/*
+ * lib6502: the 65816 interpreter. See lib6502.h.
+ *
+ * The registers are kept in the machine, as the widths of the
+ * accumulator and index registers change as the program runs. In
+ * emulation mode the M and X flags are always set, the high bytes of
+ * the index registers are zero and the stack is in page 1; in native
+ * mode a clear M flag makes the accumulator and memory accesses 16 bits
+ * wide, and a clear X flag the index registers. Setting the X flag
+ * clears the high bytes of the index registers. Direct page and the
+ * stack are in bank 0, absolute data addresses are in the data bank and
+ * code in the program bank. Indexing carries into the next bank.
+ *
+ * The cycles are those of the W65C816S: a cycle more for each extra
+ * byte of a 16-bit access (two for a read-modify-write), a cycle more
+ * for direct page addressing when the low byte of D is not zero, for an
+ * indexed read that crosses a page or has 16-bit index registers and for
+ * a branch taken, with another in emulation mode if it crosses a page.
+ * BRK, COP and RTI take a cycle more in native mode, and MVN and MVP 7
+ * cycles for each byte moved. Decimal mode gives valid flags, as on the
+ * 65C02, but takes no extra cycle.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lib6502.h"
+
+/*
+ * Clock cycles for each opcode, with an 8-bit accumulator and index
+ * registers, the low byte of D zero, no page crossed and no branch taken.
+ */
+static const uint8_t cycleTable[256] = {
+/*       0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
+/* 0 */  7, 6, 7, 4, 5, 3, 5, 6, 3, 2, 2, 4, 6, 4, 6, 5,
+/* 1 */  2, 5, 5, 7, 5, 4, 6, 6, 2, 4, 2, 2, 6, 4, 7, 5,
+/* 2 */  6, 6, 8, 4, 3, 3, 5, 6, 4, 2, 2, 5, 4, 4, 6, 5,
+/* 3 */  2, 5, 5, 7, 4, 4, 6, 6, 2, 4, 2, 2, 4, 4, 7, 5,
+/* 4 */  6, 6, 2, 4, 7, 3, 5, 6, 3, 2, 2, 3, 3, 4, 6, 5,
+/* 5 */  2, 5, 5, 7, 7, 4, 6, 6, 2, 4, 3, 2, 4, 4, 7, 5,
+/* 6 */  6, 6, 6, 4, 3, 3, 5, 6, 4, 2, 2, 6, 5, 4, 6, 5,
+/* 7 */  2, 5, 5, 7, 4, 4, 6, 6, 2, 4, 4, 2, 6, 4, 7, 5,
+/* 8 */  2, 6, 4, 4, 3, 3, 3, 6, 2, 2, 2, 3, 4, 4, 4, 5,
+/* 9 */  2, 6, 5, 7, 4, 4, 4, 6, 2, 5, 2, 2, 4, 5, 5, 5,
+/* A */  2, 6, 2, 4, 3, 3, 3, 6, 2, 2, 2, 4, 4, 4, 4, 5,
+/* B */  2, 5, 5, 7, 4, 4, 4, 6, 2, 4, 2, 2, 4, 4, 4, 5,
+/* C */  2, 6, 3, 4, 3, 3, 5, 6, 2, 2, 2, 3, 4, 4, 6, 5,
+/* D */  2, 5, 5, 7, 6, 4, 6, 6, 2, 4, 3, 3, 6, 4, 7, 5,
+/* E */  2, 6, 3, 4, 3, 3, 5, 6, 2, 2, 2, 3, 4, 4, 6, 5,
+/* F */  2, 5, 5, 7, 5, 4, 6, 6, 2, 4, 4, 2, 8, 4, 7, 5
+};
+
+#define WIDE_A(m) (!((m)->p & FLAG_M))
+#define WIDE_XY(m) (!((m)->p & FLAG_X))
+
+static uint8_t fetch(struct machine *m)
+{
+    return readMemory(m, ((uint32_t)m->pbr << 16) | m->pc++);
+}
+
+static uint16_t fetch16(struct machine *m)
+{
+    uint16_t value = fetch(m);
+
+    return value | (fetch(m) << 8);
+}
+
+static uint32_t fetch24(struct machine *m)
+{
+    uint32_t value = fetch16(m);
+
+    return value | ((uint32_t)fetch(m) << 16);
+}
+
+/* Read a byte, or two with wide set, from a 24-bit address. */
+static uint16_t readData(struct machine *m, uint32_t address, bool wide)
+{
+    uint16_t value = readMemory(m, address);
+
+    if (wide)
+        value |= readMemory(m, (address + 1) & 0xffffff) << 8;
+    return value;
+}
+
+static void writeData(struct machine *m, uint32_t address, uint16_t value, bool wide)
+{
+    writeMemory(m, address, value & 0xff);
+    if (wide)
+        writeMemory(m, (address + 1) & 0xffffff, value >> 8);
+}
+
+/* Read a 16-bit pointer in bank 0, wrapping around at $FFFF. */
+static uint16_t readPointer(struct machine *m, uint16_t address)
+{
+    return readMemory(m, address) | (readMemory(m, (uint16_t)(address + 1)) << 8);
+}
+
+static void push(struct machine *m, uint8_t value)
+{
+    writeMemory(m, m->s, value);
+    m->s = m->e ? 0x100 | ((m->s - 1) & 0xff) : m->s - 1;
+}
+
+static uint8_t pull(struct machine *m)
+{
+    m->s = m->e ? 0x100 | ((m->s + 1) & 0xff) : m->s + 1;
+    return readMemory(m, m->s);
+}
+
+static void push16(struct machine *m, uint16_t value)
+{
+    push(m, value >> 8);
+    push(m, value & 0xff);
+}
+
+static uint16_t pull16(struct machine *m)
+{
+    uint16_t value = pull(m);
+
+    return value | (pull(m) << 8);
+}
+
+static void setNZ(struct machine *m, uint16_t value, bool wide)
+{
+    if (!wide)
+        value = (value & 0xff) << 8;
+    m->p = (m->p & ~(FLAG_N | FLAG_Z)) | ((value & 0x8000) ? FLAG_N : 0) | (value ? 0 : FLAG_Z);
+}
+
+/* Set the accumulator, only its low byte if it is 8 bits wide, and N and Z. */
+static void setA(struct machine *m, uint16_t value)
+{
+    bool wide = WIDE_A(m);
+
+    m->a = wide ? value : (m->a & 0xff00) | (value & 0xff);
+    setNZ(m, value, wide);
+}
+
+/* Set an index register, with its high byte zero if it is 8 bits wide, and N and Z. */
+static void setIndex(struct machine *m, uint16_t *reg, uint16_t value)
+{
+    bool wide = WIDE_XY(m);
+
+    *reg = wide ? value : value & 0xff;
+    setNZ(m, value, wide);
+}
+
+/* Set P, keeping M and X set in emulation mode and clearing the index high bytes if X is set. */
+static void setP(struct machine *m, uint8_t p)
+{
+    m->p = m->e ? p | FLAG_M | FLAG_X : p;
+    if (m->p & FLAG_X) {
+        m->x &= 0xff;
+        m->y &= 0xff;
+    }
+}
+
+/*
+ * The address in bank 0 of a byte offset into direct page. In emulation
+ * mode with D on a page boundary it wraps around within the page, as on
+ * the 6502.
+ */
+static uint16_t direct(struct machine *m, unsigned offset)
+{
+    if (m->e && (m->d & 0xff) == 0)
+        return m->d | (offset & 0xff);
+    return m->d + offset;
+}
+
+/* Fetch a direct page offset. Unless D is on a page boundary this takes a cycle more. */
+static uint8_t fetchDirect(struct machine *m)
+{
+    if (m->d & 0xff)
+        m->cycles++;
+    return fetch(m);
+}
+
+/* The address in the data bank that a 16-bit pointer in direct page points to. */
+static uint32_t directPointer(struct machine *m, unsigned offset)
+{
+    return ((uint32_t)m->dbr << 16) | readMemory(m, direct(m, offset)) |
+        (readMemory(m, direct(m, offset + 1)) << 8);
+}
+
+/* The address that a 24-bit pointer in direct page points to, for long indirect addressing. */
+static uint32_t directLongPointer(struct machine *m, unsigned offset)
+{
+    return readMemory(m, direct(m, offset)) | (readMemory(m, direct(m, offset + 1)) << 8) |
+        ((uint32_t)readMemory(m, direct(m, offset + 2)) << 16);
+}
+
+static uint32_t absolute(struct machine *m)
+{
+    return ((uint32_t)m->dbr << 16) | fetch16(m);
+}
+
+/*
+ * Index a 24-bit address. A read takes a cycle more if it crosses a
+ * page or the index registers are 16 bits wide.
+ */
+static uint32_t indexed(struct machine *m, uint32_t base, uint16_t index, bool read)
+{
+    uint32_t address = (base + index) & 0xffffff;
+
+    if (read && (WIDE_XY(m) || ((base ^ address) & 0xffff00)))
+        m->cycles++;
+    return address;
+}
+
+/*
+ * The address of the operand of ORA, AND, EOR, ADC, STA, LDA, CMP or SBC,
+ * which have the same addressing modes in the same columns of the
+ * opcode table, other than immediate.
+ */
+static uint32_t groupOneAddress(struct machine *m, uint8_t opcode, bool read)
+{
+    uint8_t offset;
+
+    switch (opcode & 0x1f) {
+    case 0x01: // (dp,X)
+        offset = fetchDirect(m);
+        return directPointer(m, offset + m->x);
+    case 0x03: // sr,S
+        return (uint16_t)(m->s + fetch(m));
+    case 0x05: // dp
+        return direct(m, fetchDirect(m));
+    case 0x07: // [dp]
+        return directLongPointer(m, fetchDirect(m));
+    case 0x0d: // abs
+        return absolute(m);
+    case 0x0f: // long
+        return fetch24(m);
+    case 0x11: // (dp),Y
+        return indexed(m, directPointer(m, fetchDirect(m)), m->y, read);
+    case 0x12: // (dp)
+        return directPointer(m, fetchDirect(m));
+    case 0x13: // (sr,S),Y
+        offset = fetch(m);
+        return (((uint32_t)m->dbr << 16 | readPointer(m, m->s + offset)) + m->y) & 0xffffff;
+    case 0x15: // dp,X
+        offset = fetchDirect(m);
+        return direct(m, offset + m->x);
+    case 0x17: // [dp],Y
+        return (directLongPointer(m, fetchDirect(m)) + m->y) & 0xffffff;
+    case 0x19: // abs,Y
+        return indexed(m, absolute(m), m->y, read);
+    case 0x1d: // abs,X
+        return indexed(m, absolute(m), m->x, read);
+    default: // long,X
+        return (fetch24(m) + m->x) & 0xffffff;
+    }
+}
+
+/* Return if an opcode is one of ORA, AND, EOR, ADC, STA, LDA, CMP or SBC. */
+static bool isGroupOne(uint8_t opcode)
+{
+    return (opcode & 0x03) == 0x01 || ((opcode & 0x03) == 0x03 && (opcode & 0x0c) != 0x08) ||
+        (opcode & 0x1f) == 0x12;
+}
+
+static uint16_t immediate(struct machine *m, bool wide)
+{
+    return wide ? fetch16(m) : fetch(m);
+}
+
+/*
+ * Add with carry, in decimal mode a digit at a time. V is found from
+ * the sum before the top digit is adjusted, as on the 65C02.
+ */
+static void adc(struct machine *m, uint16_t value)
+{
+    bool wide = WIDE_A(m);
+    unsigned mask = wide ? 0xffff : 0xff;
+    unsigned sign = wide ? 0x8000 : 0x80;
+    unsigned a = m->a & mask;
+    unsigned carry = m->p & FLAG_C;
+    unsigned result;
+    bool overflow;
+
+    if (m->p & FLAG_D) {
+        int digits = wide ? 4 : 2;
+
+        result = 0;
+        overflow = false;
+        for (int i = 0; i < digits; i++) {
+            unsigned digit = ((a >> (4 * i)) & 0xf) + ((value >> (4 * i)) & 0xf) + carry;
+
+            if (i == digits - 1)
+                overflow = ~(a ^ value) & (a ^ (result | (digit << (4 * i)))) & sign;
+            if (digit > 9)
+                digit += 6;
+            carry = digit > 0xf;
+            result |= (digit & 0xf) << (4 * i);
+        }
+    } else {
+        result = a + value + carry;
+        overflow = ~(a ^ value) & (a ^ result) & sign;
+        carry = result > mask;
+    }
+    m->p = (m->p & ~(FLAG_C | FLAG_V)) | (carry ? FLAG_C : 0) | (overflow ? FLAG_V : 0);
+    setA(m, result);
+}
+
+/*
+ * Subtract with borrow. The carry and V are those of the binary
+ * subtraction; in decimal mode the result is adjusted a digit at a time.
+ */
+static void sbc(struct machine *m, uint16_t value)
+{
+    bool wide = WIDE_A(m);
+    unsigned mask = wide ? 0xffff : 0xff;
+    unsigned sign = wide ? 0x8000 : 0x80;
+    unsigned a = m->a & mask;
+    unsigned borrow = !(m->p & FLAG_C);
+    unsigned binary = a - value - borrow;
+    unsigned result = binary;
+
+    if (m->p & FLAG_D) {
+        int digits = wide ? 4 : 2;
+
+        result = 0;
+        for (int i = 0; i < digits; i++) {
+            int digit = ((a >> (4 * i)) & 0xf) - ((value >> (4 * i)) & 0xf) - borrow;
+
+            borrow = digit < 0;
+            if (borrow)
+                digit -= 6;
+            result |= (digit & 0xf) << (4 * i);
+        }
+    }
+    m->p = (m->p & ~(FLAG_C | FLAG_V)) | (binary > mask ? 0 : FLAG_C) |
+        (((a ^ value) & (a ^ binary) & sign) ? FLAG_V : 0);
+    setA(m, result);
+}
+
+static void compare(struct machine *m, uint16_t reg, uint16_t value, bool wide)
+{
+    if (!wide) {
+        reg &= 0xff;
+        value &= 0xff;
+    }
+    m->p = (m->p & ~FLAG_C) | (reg >= value ? FLAG_C : 0);
+    setNZ(m, reg - value, wide);
+}
+
+/* BIT. The immediate form only sets Z. */
+static void bit(struct machine *m, uint16_t value, bool immediate)
+{
+    bool wide = WIDE_A(m);
+    uint16_t sign = wide ? 0x8000 : 0x80;
+
+    m->p = (m->p & ~FLAG_Z) | ((m->a & value & (wide ? 0xffff : 0xff)) ? 0 : FLAG_Z);
+    if (!immediate)
+        m->p = (m->p & ~(FLAG_N | FLAG_V)) | ((value & sign) ? FLAG_N : 0) | ((value & (sign >> 1)) ? FLAG_V : 0);
+}
+
+/*
+ * The shifts, rotates, increments and decrements, numbered by the top
+ * three bits of their opcodes, and TSB and TRB.
+ */
+enum { ASL = 0, ROL = 1, LSR = 2, ROR = 3, DEC = 6, INC = 7, TSB, TRB };
+
+static uint16_t modify(struct machine *m, int operation, uint16_t value, bool wide)
+{
+    uint16_t sign = wide ? 0x8000 : 0x80;
+    uint16_t carry = m->p & FLAG_C;
+
+    if (!wide)
+        value &= 0xff;
+    switch (operation) {
+    case ASL:
+        carry = value & sign;
+        value <<= 1;
+        break;
+    case ROL:
+        carry = value & sign;
+        value = (value << 1) | (m->p & FLAG_C);
+        break;
+    case LSR:
+        carry = value & 1;
+        value >>= 1;
+        break;
+    case ROR:
+        carry = value & 1;
+        value = (value >> 1) | ((m->p & FLAG_C) ? sign : 0);
+        break;
+    case DEC:
+        value--;
+        break;
+    case INC:
+        value++;
+        break;
+    case TSB:
+    case TRB:
+        m->p = (m->p & ~FLAG_Z) | ((m->a & value & (wide ? 0xffff : 0xff)) ? 0 : FLAG_Z);
+        return operation == TSB ? value | m->a : value & ~m->a;
+    }
+    m->p = (m->p & ~FLAG_C) | (carry ? FLAG_C : 0);
+    setNZ(m, value, wide);
+    return value;
+}
+
+/* Read, modify and write memory, which takes two cycles more when it is 16 bits wide. */
+static void modifyMemory(struct machine *m, int operation, uint32_t address)
+{
+    bool wide = WIDE_A(m);
+
+    if (wide)
+        m->cycles += 2;
+    writeData(m, address, modify(m, operation, readData(m, address, wide), wide), wide);
+}
+
+static void branch(struct machine *m, uint16_t offset, bool condition)
+{
+    uint16_t target = m->pc + offset;
+
+    if (!condition)
+        return;
+    m->cycles++;
+    if (m->e && (target & 0xff00) != (m->pc & 0xff00))
+        m->cycles++;
+    m->pc = target;
+}
+
+/* BRK and COP, which push the program bank and use their own vectors in native mode. */
+static void interrupt(struct machine *m, uint16_t nativeVector, uint16_t emulationVector)
+{
+    m->pc++;
+    if (!m->e) {
+        m->cycles++;
+        push(m, m->pbr);
+    }
+    push16(m, m->pc);
+    push(m, m->p);
+    m->p = (m->p | FLAG_I) & ~FLAG_D;
+    m->pbr = 0;
+    m->pc = readPointer(m, m->e ? emulationVector : nativeVector);
+}
+
+/* MVN and MVP move a byte and run again until the count in C runs out. */
+static void blockMove(struct machine *m, int step)
+{
+    uint8_t destination = fetch(m);
+    uint8_t source = fetch(m);
+
+    m->dbr = destination;
+    writeMemory(m, ((uint32_t)destination << 16) | m->y, readMemory(m, ((uint32_t)source << 16) | m->x));
+    m->x += step;
+    m->y += step;
+    if (!WIDE_XY(m)) {
+        m->x &= 0xff;
+        m->y &= 0xff;
+    }
+    if (m->a-- != 0)
+        m->pc -= 3;
+}
+
+/* Run the instruction with an opcode, whose base cycles have been counted. */
+static void execute(struct machine *m, uint8_t opcode)
+{
+    bool wideA = WIDE_A(m);
+    bool wideXY = WIDE_XY(m);
+    uint32_t address;
+    uint16_t value;
+
+    if (isGroupOne(opcode) && opcode != 0x89) {
+        if (wideA)
+            m->cycles++;
+        if ((opcode & 0xe0) == 0x80) {
+            writeData(m, groupOneAddress(m, opcode, false), m->a, wideA);
+            return;
+        }
+        if ((opcode & 0x1f) == 0x09)
+            value = immediate(m, wideA);
+        else
+            value = readData(m, groupOneAddress(m, opcode, true), wideA);
+        switch (opcode >> 5) {
+        case 0:
+            setA(m, m->a | value);
+            break;
+        case 1:
+            setA(m, m->a & value);
+            break;
+        case 2:
+            setA(m, m->a ^ value);
+            break;
+        case 3:
+            adc(m, value);
+            break;
+        case 5:
+            setA(m, value);
+            break;
+        case 6:
+            compare(m, m->a, value, wideA);
+            break;
+        default:
+            sbc(m, value);
+            break;
+        }
+        return;
+    }
+
+    /* The 16-bit index register forms take a cycle more */
+    switch (opcode) {
+    case 0x84: case 0x86: case 0x8c: case 0x8e: case 0x94: case 0x96:
+    case 0xa0: case 0xa2: case 0xa4: case 0xa6: case 0xac: case 0xae:
+    case 0xb4: case 0xb6: case 0xbc: case 0xbe:
+    case 0xc0: case 0xc4: case 0xcc: case 0xe0: case 0xe4: case 0xec:
+    case 0x5a: case 0x7a: case 0xda: case 0xfa:
+        if (wideXY)
+            m->cycles++;
+        break;
+    case 0x24: case 0x2c: case 0x34: case 0x3c: case 0x89:
+    case 0x64: case 0x74: case 0x9c: case 0x9e:
+    case 0x48: case 0x68:
+        if (wideA)
+            m->cycles++;
+        break;
+    }
+
+    switch (opcode) {
+    /* Shifts, rotates, increments and decrements */
+    case 0x0a: case 0x2a: case 0x4a: case 0x6a:
+        setA(m, modify(m, opcode >> 5, m->a, wideA));
+        break;
+    case 0x1a:
+        setA(m, modify(m, INC, m->a, wideA));
+        break;
+    case 0x3a:
+        setA(m, modify(m, DEC, m->a, wideA));
+        break;
+    case 0x06: case 0x26: case 0x46: case 0x66: case 0xc6: case 0xe6:
+        modifyMemory(m, opcode >> 5, direct(m, fetchDirect(m)));
+        break;
+    case 0x16: case 0x36: case 0x56: case 0x76: case 0xd6: case 0xf6:
+        address = fetchDirect(m);
+        modifyMemory(m, opcode >> 5, direct(m, address + m->x));
+        break;
+    case 0x0e: case 0x2e: case 0x4e: case 0x6e: case 0xce: case 0xee:
+        modifyMemory(m, opcode >> 5, absolute(m));
+        break;
+    case 0x1e: case 0x3e: case 0x5e: case 0x7e: case 0xde: case 0xfe:
+        modifyMemory(m, opcode >> 5, indexed(m, absolute(m), m->x, false));
+        break;
+    case 0x04:
+        modifyMemory(m, TSB, direct(m, fetchDirect(m)));
+        break;
+    case 0x0c:
+        modifyMemory(m, TSB, absolute(m));
+        break;
+    case 0x14:
+        modifyMemory(m, TRB, direct(m, fetchDirect(m)));
+        break;
+    case 0x1c:
+        modifyMemory(m, TRB, absolute(m));
+        break;
+    case 0xc8:
+        setIndex(m, &m->y, m->y + 1);
+        break;
+    case 0x88:
+        setIndex(m, &m->y, m->y - 1);
+        break;
+    case 0xe8:
+        setIndex(m, &m->x, m->x + 1);
+        break;
+    case 0xca:
+        setIndex(m, &m->x, m->x - 1);
+        break;
+
+    /* Bit tests */
+    case 0x89:
+        bit(m, immediate(m, wideA), true);
+        break;
+    case 0x24:
+        bit(m, readData(m, direct(m, fetchDirect(m)), wideA), false);
+        break;
+    case 0x34:
+        address = fetchDirect(m);
+        bit(m, readData(m, direct(m, address + m->x), wideA), false);
+        break;
+    case 0x2c:
+        bit(m, readData(m, absolute(m), wideA), false);
+        break;
+    case 0x3c:
+        bit(m, readData(m, indexed(m, absolute(m), m->x, true), wideA), false);
+        break;
+
+    /* Index register loads, stores and compares */
+    case 0xa0:
+        setIndex(m, &m->y, immediate(m, wideXY));
+        break;
+    case 0xa4:
+        setIndex(m, &m->y, readData(m, direct(m, fetchDirect(m)), wideXY));
+        break;
+    case 0xb4:
+        address = fetchDirect(m);
+        setIndex(m, &m->y, readData(m, direct(m, address + m->x), wideXY));
+        break;
+    case 0xac:
+        setIndex(m, &m->y, readData(m, absolute(m), wideXY));
+        break;
+    case 0xbc:
+        setIndex(m, &m->y, readData(m, indexed(m, absolute(m), m->x, true), wideXY));
+        break;
+    case 0xa2:
+        setIndex(m, &m->x, immediate(m, wideXY));
+        break;
+    case 0xa6:
+        setIndex(m, &m->x, readData(m, direct(m, fetchDirect(m)), wideXY));
+        break;
+    case 0xb6:
+        address = fetchDirect(m);
+        setIndex(m, &m->x, readData(m, direct(m, address + m->y), wideXY));
+        break;
+    case 0xae:
+        setIndex(m, &m->x, readData(m, absolute(m), wideXY));
+        break;
+    case 0xbe:
+        setIndex(m, &m->x, readData(m, indexed(m, absolute(m), m->y, true), wideXY));
+        break;
+    case 0x84:
+        writeData(m, direct(m, fetchDirect(m)), m->y, wideXY);
+        break;
+    case 0x94:
+        address = fetchDirect(m);
+        writeData(m, direct(m, address + m->x), m->y, wideXY);
+        break;
+    case 0x8c:
+        writeData(m, absolute(m), m->y, wideXY);
+        break;
+    case 0x86:
+        writeData(m, direct(m, fetchDirect(m)), m->x, wideXY);
+        break;
+    case 0x96:
+        address = fetchDirect(m);
+        writeData(m, direct(m, address + m->y), m->x, wideXY);
+        break;
+    case 0x8e:
+        writeData(m, absolute(m), m->x, wideXY);
+        break;
+    case 0xc0:
+        compare(m, m->y, immediate(m, wideXY), wideXY);
+        break;
+    case 0xc4:
+        compare(m, m->y, readData(m, direct(m, fetchDirect(m)), wideXY), wideXY);
+        break;
+    case 0xcc:
+        compare(m, m->y, readData(m, absolute(m), wideXY), wideXY);
+        break;
+    case 0xe0:
+        compare(m, m->x, immediate(m, wideXY), wideXY);
+        break;
+    case 0xe4:
+        compare(m, m->x, readData(m, direct(m, fetchDirect(m)), wideXY), wideXY);
+        break;
+    case 0xec:
+        compare(m, m->x, readData(m, absolute(m), wideXY), wideXY);
+        break;
+
+    /* Stores of zero */
+    case 0x64:
+        writeData(m, direct(m, fetchDirect(m)), 0, wideA);
+        break;
+    case 0x74:
+        address = fetchDirect(m);
+        writeData(m, direct(m, address + m->x), 0, wideA);
+        break;
+    case 0x9c:
+        writeData(m, absolute(m), 0, wideA);
+        break;
+    case 0x9e:
+        writeData(m, indexed(m, absolute(m), m->x, false), 0, wideA);
+        break;
+
+    /* Transfers */
+    case 0xaa:
+        setIndex(m, &m->x, m->a);
+        break;
+    case 0xa8:
+        setIndex(m, &m->y, m->a);
+        break;
+    case 0x8a:
+        setA(m, m->x);
+        break;
+    case 0x98:
+        setA(m, m->y);
+        break;
+    case 0x9b:
+        setIndex(m, &m->y, m->x);
+        break;
+    case 0xbb:
+        setIndex(m, &m->x, m->y);
+        break;
+    case 0xba:
+        setIndex(m, &m->x, m->s);
+        break;
+    case 0x9a:
+        m->s = m->e ? 0x100 | (m->x & 0xff) : m->x;
+        break;
+    case 0x1b:
+        m->s = m->e ? 0x100 | (m->a & 0xff) : m->a;
+        break;
+    case 0x3b:
+        m->a = m->s;
+        setNZ(m, m->a, true);
+        break;
+    case 0x5b:
+        m->d = m->a;
+        setNZ(m, m->d, true);
+        break;
+    case 0x7b:
+        m->a = m->d;
+        setNZ(m, m->a, true);
+        break;
+    case 0xeb:
+        m->a = (m->a >> 8) | (m->a << 8);
+        setNZ(m, m->a, false);
+        break;
+
+    /* Stack */
+    case 0x48:
+        if (wideA)
+            push(m, m->a >> 8);
+        push(m, m->a & 0xff);
+        break;
+    case 0x68:
+        value = pull(m);
+        setA(m, wideA ? value | (pull(m) << 8) : value);
+        break;
+    case 0xda:
+        if (wideXY)
+            push(m, m->x >> 8);
+        push(m, m->x & 0xff);
+        break;
+    case 0xfa:
+        value = pull(m);
+        setIndex(m, &m->x, wideXY ? value | (pull(m) << 8) : value);
+        break;
+    case 0x5a:
+        if (wideXY)
+            push(m, m->y >> 8);
+        push(m, m->y & 0xff);
+        break;
+    case 0x7a:
+        value = pull(m);
+        setIndex(m, &m->y, wideXY ? value | (pull(m) << 8) : value);
+        break;
+    case 0x08:
+        push(m, m->p);
+        break;
+    case 0x28:
+        setP(m, pull(m));
+        break;
+    case 0x8b:
+        push(m, m->dbr);
+        break;
+    case 0xab:
+        m->dbr = pull(m);
+        setNZ(m, m->dbr, false);
+        break;
+    case 0x0b:
+        push16(m, m->d);
+        break;
+    case 0x2b:
+        m->d = pull16(m);
+        setNZ(m, m->d, true);
+        break;
+    case 0x4b:
+        push(m, m->pbr);
+        break;
+    case 0xf4:
+        push16(m, fetch16(m));
+        break;
+    case 0xd4:
+        push16(m, readPointer(m, direct(m, fetchDirect(m))));
+        break;
+    case 0x62:
+        value = fetch16(m);
+        push16(m, m->pc + value);
+        break;
+
+    /* Flags and modes */
+    case 0x18:
+        m->p &= ~FLAG_C;
+        break;
+    case 0x38:
+        m->p |= FLAG_C;
+        break;
+    case 0x58:
+        m->p &= ~FLAG_I;
+        break;
+    case 0x78:
+        m->p |= FLAG_I;
+        break;
+    case 0xb8:
+        m->p &= ~FLAG_V;
+        break;
+    case 0xd8:
+        m->p &= ~FLAG_D;
+        break;
+    case 0xf8:
+        m->p |= FLAG_D;
+        break;
+    case 0xc2:
+        setP(m, m->p & ~fetch(m));
+        break;
+    case 0xe2:
+        setP(m, m->p | fetch(m));
+        break;
+    case 0xfb: {
+        bool carry = m->p & FLAG_C;
+
+        // M and X are still set on leaving emulation mode
+        m->p = (m->p & ~FLAG_C) | (m->e ? FLAG_C : 0);
+        m->e = carry;
+        if (m->e)
+            m->s = 0x100 | (m->s & 0xff);
+        setP(m, m->p);
+        break;
+    }
+
+    /* Branches */
+    case 0x10:
+        branch(m, (int8_t)fetch(m), !(m->p & FLAG_N));
+        break;
+    case 0x30:
+        branch(m, (int8_t)fetch(m), m->p & FLAG_N);
+        break;
+    case 0x50:
+        branch(m, (int8_t)fetch(m), !(m->p & FLAG_V));
+        break;
+    case 0x70:
+        branch(m, (int8_t)fetch(m), m->p & FLAG_V);
+        break;
+    case 0x90:
+        branch(m, (int8_t)fetch(m), !(m->p & FLAG_C));
+        break;
+    case 0xb0:
+        branch(m, (int8_t)fetch(m), m->p & FLAG_C);
+        break;
+    case 0xd0:
+        branch(m, (int8_t)fetch(m), !(m->p & FLAG_Z));
+        break;
+    case 0xf0:
+        branch(m, (int8_t)fetch(m), m->p & FLAG_Z);
+        break;
+    case 0x80:
+        branch(m, (int8_t)fetch(m), true);
+        break;
+    case 0x82:
+        value = fetch16(m);
+        m->pc += value;
+        break;
+
+    /* Jumps, calls and returns */
+    case 0x4c:
+        m->pc = fetch16(m);
+        break;
+    case 0x5c:
+        address = fetch24(m);
+        m->pc = address & 0xffff;
+        m->pbr = address >> 16;
+        break;
+    case 0x6c:
+        m->pc = readPointer(m, fetch16(m));
+        break;
+    case 0x7c:
+        value = fetch16(m) + m->x;
+        m->pc = readMemory(m, ((uint32_t)m->pbr << 16) | value) |
+            (readMemory(m, ((uint32_t)m->pbr << 16) | (uint16_t)(value + 1)) << 8);
+        break;
+    case 0xdc:
+        value = fetch16(m);
+        m->pc = readPointer(m, value);
+        m->pbr = readMemory(m, (uint16_t)(value + 2));
+        break;
+    case 0x20:
+        value = fetch16(m);
+        push16(m, m->pc - 1);
+        m->pc = value;
+        break;
+    case 0xfc:
+        value = fetch16(m) + m->x;
+        push16(m, m->pc - 1);
+        m->pc = readMemory(m, ((uint32_t)m->pbr << 16) | value) |
+            (readMemory(m, ((uint32_t)m->pbr << 16) | (uint16_t)(value + 1)) << 8);
+        break;
+    case 0x22:
+        address = fetch24(m);
+        push(m, m->pbr);
+        push16(m, m->pc - 1);
+        m->pc = address & 0xffff;
+        m->pbr = address >> 16;
+        break;
+    case 0x60:
+        m->pc = pull16(m) + 1;
+        break;
+    case 0x6b:
+        m->pc = pull16(m) + 1;
+        m->pbr = pull(m);
+        break;
+    case 0x40:
+        setP(m, pull(m));
+        m->pc = pull16(m);
+        if (!m->e) {
+            m->cycles++;
+            m->pbr = pull(m);
+        }
+        break;
+    case 0x00:
+        interrupt(m, 0xffe6, 0xfffe);
+        break;
+    case 0x02:
+        interrupt(m, 0xffe4, 0xfff4);
+        break;
+
+    /* Block moves */
+    case 0x54:
+        blockMove(m, 1);
+        break;
+    case 0x44:
+        blockMove(m, -1);
+        break;
+
+    /* WDM, reserved for future use, skips its operand */
+    case 0x42:
+        (void)fetch(m);
+        break;
+
+    /* Wait for interrupt and stop end the run, as there are no interrupts */
+    case 0xcb:
+    case 0xdb:
+        m->stop = STOP_HALT;
+        break;
+
+    /* NOP */
+    default:
+        break;
+    }
+}
+
+enum stopReason run65816(struct machine *m, unsigned long long cycleLimit)
+{
+    m->stop = STOP_NONE;
+    setP(m, m->p);
+    if (m->e)
+        m->s = 0x100 | (m->s & 0xff);
+    while (m->stop == STOP_NONE) {
+        uint8_t opcode;
+
+        if ((m->pageFlags[m->pc >> 8] & PAGE_STOP) && atStop(m, ((uint32_t)m->pbr << 16) | m->pc)) {
+            m->stop = STOP_MONITOR;
+            break;
+        }
+        if (m->cycles >= cycleLimit) {
+            m->stop = STOP_CYCLES;
+            break;
+        }
+        opcode = fetch(m);
+        m->cycles += cycleTable[opcode];
+        m->instructions++;
+        execute(m, opcode);
+    }
+    return m->stop;
+}
@@ -0,0 +1,572 @@
+/*
+ * Run a 6502 program on the host, as on an Apple 1 or Replica 1, and
+ * report how long it took.
+ *
+ * Copyright (C) 2012-2018 by Jeff Tranter <tranter@pobox.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * usage: run6502 [-h] [-v] [-f] [-p <Processor>] [-e <Engine>] [-k] [-l <LoadAddress>] [-r <RunAddress>] [-x <StopAddress>] [-c <Cycles>] [-i <InputFile>] <Filename>
+ *
+ * The program in <Filename> is loaded into an emulated Apple 1 with
+ * the Woz Monitor in ROM and run until it returns to the monitor,
+ * normally by jumping to $FF00 as cc65 programs do when main()
+ * returns, or to GETLINE at $FF1F. The file can be a monitor file as
+ * written by bintomon (Woz Monitor format), or any other input that
+ * bintomon accepts: a flat binary, Intel HEX, S-records or a hex dump.
+ * A binary is loaded at <LoadAddress> (defaults to 0x280), or with
+ * -f at the address in its DOS 3.3 header. The program is started at
+ * <RunAddress>, which defaults to the run command at the end of a
+ * monitor file, or else the load address.
+ *
+ * The CPU is an NMOS 6502 with exact cycle counts, including the extra
+ * cycles for indexed reads that cross a page and for branches, or with
+ * -p 65c02 a WDC 65C02 with the Rockwell bit instructions, which also
+ * takes a cycle more for ADC and SBC in decimal mode. Its STP and WAI
+ * stop the program. With -p 65816 it is a WDC 65816, starting in
+ * emulation mode, with 16 MB of memory, which reads as zero above the
+ * first 64K until written. Only then can a file load above $FFFF, and
+ * the load, run and stop addresses be given with a bank, as 0x012000
+ * or as in bintomon, 01/2000. The program bank starts as that of the
+ * run address. It always runs with the interpreter. The PIA
+ * at $D010-$D013 connects the keyboard and display: characters written
+ * to the display go to standard output, and keys are read from
+ * standard input or <InputFile>, a newline being sent as a return. The
+ * display is always ready, so the cycles do not include waiting for
+ * the slow display of a real Apple 1. All memory other than the PIA and
+ * the monitor ROM is RAM.
+ *
+ * When the program stops, the cycles and instructions it executed and
+ * the wall time taken to emulate it are shown on standard error. It
+ * also stops after -c <Cycles> cycles, at an illegal opcode, at a
+ * -x <StopAddress> (up to 6 can be given), or if it keeps polling the
+ * keyboard after all of the input has been read. The exit status is 0
+ * only if it returned to the monitor.
+ *
+ * The threaded engine, which decodes each instruction only once, is
+ * used unless -e gives another: interpreter, the reference that decodes
+ * each instruction every time, or blocks, which translates the
+ * instructions that run in turn from each place a branch or return
+ * goes to once, through calls and jumps, and keeps the blocks in a
+ * cache (whose hit rate is shown). All give the same results, so
+ * running a program with each compares their speed. With -k, the
+ * program is also run with the interpreter alongside, and the two are
+ * compared every 100000 cycles, stopping with an error at the first
+ * difference. The keyboard input is then all read before starting.
+ *
+ * With the -v option the load and run addresses are shown first.
+ *
+ * Examples:
+ * run6502 nqueens.mon
+ * run6502 -c 100000000 sieve.mon >sieve.out
+ * echo A | run6502 hello2.mon
+ * run6502 -e interpreter nqueens.mon
+ * run6502 -p 65c02 -l 0x1000 test65c02.bin
+ * run6502 -p 65816 -l 0x6000 -x 0x6080 demo1.bin
+ * run6502 -e blocks -k -i test.bas basic.mon
+ * run6502 -l 0x300 -x 0x3f0 myprog.bin
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+#include "lib6502.h"
+#include "libbintomon.h"
+
+/* print command usage */
+void usage(char *name) {
+    fprintf(stderr, "usage: %s [-h] [-v] [-f] [-p <Processor>] [-e <Engine>] [-k] [-l <LoadAddress>] [-r <RunAddress>] [-x <StopAddress>] [-c <Cycles>] [-i <InputFile>] <Filename>\n", name);
+}
+
+/* Show help info */
+void showHelp(char *name)
+{
+    usage(name);
+    fprintf(stderr,
+            "\n-h  Show help info and exit.\n"
+            "-v  Show verbose output.\n"
+            "-f  Get load address and length from first 4 bytes of file.\n"
+            "-p <Processor>  Processor to emulate: 6502 (the default), 65c02 or 65816.\n"
+            "-e <Engine>  Engine to run the program: interpreter, threaded (the default) or blocks.\n"
+            "    The 65816 always uses the interpreter.\n"
+            "-k  Check the engine against the interpreter as the program runs.\n"
+            "-l <LoadAddress>  Load address of a binary file (defaults to 0x280).\n"
+            "    For the 65816 addresses can have a bank, as in 0x012000 or 01/2000.\n"
+            "-r <RunAddress>  Address to start running (defaults to the file's run command or load address).\n"
+            "-x <StopAddress>  Also stop when the program reaches this address.\n"
+            "-c <Cycles>  Stop after this many cycles.\n"
+            "-i <InputFile>  Read keyboard input from this file (defaults to standard input).\n\n"
+            "The program runs until it returns to the Woz Monitor at $FF00 or $FF1F.\n"
+            "Display output goes to standard output, and the cycles and time taken\n"
+            "to standard error.\n");
+}
+
+/*
+ * Parse an address, which can have a 65816 bank, either in the number
+ * or as a hex bank and address such as 01/2000. Returns -1 if not
+ * valid.
+ */
+long parseAddress(const char *s)
+{
+    char *end;
+    long address = strtol(s, &end, 0);
+
+    if (*end == '/' && end > s && end - s <= 2) {
+        const char *a = end + 1;
+
+        address = strtol(s, &end, 16);
+        if (*end != '/' || *a == '\0' || strlen(a) > 4)
+            return -1;
+        address = (address << 16) | strtol(a, &end, 16);
+    }
+    if (*s == '\0' || *end != '\0' || address < 0 || address > 0xffffff)
+        return -1;
+    return address;
+}
+
+/* Read the rest of a stream into a malloc()ed buffer. Returns NULL on error. */
+unsigned char *readStream(FILE *file, size_t *length)
+{
+    unsigned char *data = NULL;
+    size_t capacity = 0;
+
+    *length = 0;
+    for (;;) {
+        size_t n;
+
+        if (*length == capacity) {
+            capacity = capacity ? 2 * capacity : 65536;
+            data = realloc(data, capacity);
+            if (data == NULL) {
+                fprintf(stderr, "run6502: Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        n = fread(data + *length, 1, capacity - *length, file);
+        if (n == 0)
+            break;
+        *length += n;
+    }
+    if (ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+/* Read a whole file into a malloc()ed buffer. Returns NULL on error. */
+unsigned char *readFile(const char *filename, size_t *length)
+{
+    FILE *file = fopen(filename, "rb");
+    unsigned char *data;
+
+    if (file == NULL)
+        return NULL;
+    data = readStream(file, length);
+    fclose(file);
+    return data;
+}
+
+/*
+ * Load a program into memory. For the 65816 it can load anywhere in
+ * the 16 MB: what goes above bank 0 is written with writeMemory(),
+ * while bank 0 is loaded as for the other processors, over the ROM
+ * and without touching the PIA. Returns the address to run it from
+ * (the file's own run address, or the load address), or -1 after
+ * reporting an error.
+ */
+long loadProgram(struct machine *m, const char *name, const unsigned char *file, size_t fileLength,
+                 long loadAddress, bool fromFile, bool verbose, const char *prefix)
+{
+    enum bmInputFormat format;
+    struct bmLoader loader = { .runAddress = -1 };
+    size_t offset = 0;
+    long runAddress;
+
+    if (fromFile) {
+        size_t length;
+
+        if (fileLength < 4) {
+            fprintf(stderr, "%s: '%s' is too short to have a DOS 3.3 header\n", prefix, name);
+            return -1;
+        }
+        loadAddress = file[0] | (file[1] << 8);
+        length = file[2] | (file[3] << 8);
+        if (length > fileLength - 4) {
+            fprintf(stderr, "%s: '%s' is shorter than the length in its header\n", prefix, name);
+            return -1;
+        }
+        file += 4;
+        fileLength = length;
+        format = BM_BINARY_INPUT;
+    } else {
+        format = bmDetectInputFormat(file, fileLength);
+    }
+
+    if (!bmParseInput(format, file, fileLength, loadAddress, &loader, stderr, prefix))
+        return -1;
+    if (loader.numSegments == 0) {
+        fprintf(stderr, "%s: No data in '%s'\n", prefix, name);
+        return -1;
+    }
+    for (int i = 0; i < loader.numSegments; i++) {
+        long start = loader.segments[i].start;
+        long end = loader.segments[i].end;
+
+        if (end > 0x10000 && m->cpu != CPU_65816) {
+            fprintf(stderr, "%s: '%s' loads above $FFFF, which only the 65816 can address\n", prefix, name);
+            return -1;
+        }
+        if (start < 0x10000)
+            loadMemory(m, start, loader.bytes + offset, (end < 0x10000 ? end : 0x10000) - start);
+        for (long a = start < 0x10000 ? 0x10000 : start; a < end; a++) {
+            uint8_t value = loader.bytes[offset + (a - start)];
+
+            writeMemory(m, a, value);
+            /* A page that could not be allocated reads as zero */
+            if (readMemory(m, a) != value) {
+                fprintf(stderr, "%s: Out of memory\n", prefix);
+                return -1;
+            }
+        }
+        offset += end - start;
+        if (verbose)
+            fprintf(stderr, "Loaded: $%04lX-$%04lX (%ld bytes)\n", start, end - 1, end - start);
+    }
+    runAddress = loader.runAddress != -1 ? loader.runAddress : loader.segments[0].start;
+    free(loader.segments);
+    free(loader.bytes);
+    return runAddress;
+}
+
+
+/* Display callback: write the character to standard output. */
+void showCharacter(void *context, int c)
+{
+    putchar(c);
+}
+
+/* Keyboard callback: read the next character from the input file. */
+int readKey(void *context)
+{
+    return getc((FILE *)context);
+}
+
+/* Keyboard input read in advance, for two machines to read in turn. */
+struct bufferedInput {
+    const unsigned char *data;
+    size_t length;
+    size_t position;
+};
+
+/* Keyboard callback: read the next character from a buffer. */
+int readBufferedKey(void *context)
+{
+    struct bufferedInput *input = context;
+
+    if (input->position == input->length)
+        return -1;
+    return input->data[input->position++];
+}
+
+/* Return if two machines are in the same state. */
+bool sameState(const struct machine *m1, const struct machine *m2)
+{
+    return m1->pc == m2->pc && m1->a == m2->a && m1->x == m2->x && m1->y == m2->y &&
+        m1->s == m2->s && m1->p == m2->p && m1->d == m2->d && m1->dbr == m2->dbr &&
+        m1->pbr == m2->pbr && m1->e == m2->e && m1->cycles == m2->cycles &&
+        m1->instructions == m2->instructions && m1->kbdcr == m2->kbdcr &&
+        m1->dspcr == m2->dspcr && m1->kbd == m2->kbd && m1->dspDirection == m2->dspDirection &&
+        m1->keyWaiting == m2->keyWaiting && m1->idlePolls == m2->idlePolls &&
+        !memcmp(m1->memory, m2->memory, sizeof(m1->memory));
+}
+
+/* Show the registers of a machine, for a difference between engines. */
+void showState(const struct machine *m)
+{
+    fprintf(stderr, "%-11s PC=%04X A=%02X X=%02X Y=%02X S=%02X P=%02X cycles=%llu instructions=%llu\n",
+            engineName(m->engine), m->pc, m->a, m->x, m->y, m->s, m->p, m->cycles, m->instructions);
+}
+
+/*
+ * Run m, with a copy of it in ref that uses the interpreter, comparing
+ * them every CHECK_CYCLES cycles. Returns why m stopped, or STOP_NONE
+ * after showing how they differ.
+ */
+#define CHECK_CYCLES 100000
+
+enum stopReason runChecked(struct machine *m, struct machine *ref, unsigned long long cycleLimit, const char *prefix)
+{
+    enum stopReason reason, refReason;
+
+    do {
+        unsigned long long limit = cycleLimit - m->cycles > CHECK_CYCLES ? m->cycles + CHECK_CYCLES : cycleLimit;
+
+        reason = run6502(m, limit);
+        refReason = run6502(ref, limit);
+        if (reason != refReason || !sameState(m, ref)) {
+            fprintf(stderr, "%s: The %s engine differs from the interpreter within %d cycles of here:\n",
+                    prefix, engineName(m->engine), CHECK_CYCLES);
+            showState(m);
+            showState(ref);
+            for (int i = 0; i < 0x10000; i++) {
+                if (m->memory[i] != ref->memory[i]) {
+                    fprintf(stderr, "First difference in memory at $%04X: $%02X, not $%02X\n",
+                            i, m->memory[i], ref->memory[i]);
+                    break;
+                }
+            }
+            return STOP_NONE;
+        }
+    } while (reason == STOP_CYCLES && m->cycles < cycleLimit);
+    return reason;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool verbose = false;
+    bool fromFile = false;
+    bool check = false;
+    enum cpu cpu = CPU_6502;
+    enum engine engine = ENGINE_THREADED;
+    bool engineGiven = false;
+    long loadAddress = 0x280;
+    long runAddress = -1;
+    long fileRunAddress;
+    long stops[MAX_STOPS];
+    int numStops = 0;
+    unsigned long long cycleLimit = NO_CYCLE_LIMIT;
+    const char *inputName = NULL;
+    FILE *input = stdin;
+    struct bufferedInput bufferedInput[2];
+    unsigned char *file;
+    size_t fileLength;
+    struct machine *m[2] = { NULL, NULL };
+    struct timespec start, end;
+    double seconds;
+    enum stopReason reason;
+
+    while ((opt = getopt(argc, argv, "hvfkp:e:l:r:x:c:i:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'f':
+            fromFile = true;
+            break;
+        case 'k':
+            check = true;
+            break;
+        case 'p': {
+            int i;
+            for (i = 0; i <= CPU_65816; i++) {
+                if (!strcasecmp(optarg, cpuName(i)))
+                    break;
+            }
+            if (i > CPU_65816) {
+                fprintf(stderr, "%s: Invalid processor '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            cpu = i;
+            break;
+        }
+        case 'e': {
+            int i;
+            for (i = 0; i <= ENGINE_BLOCKS; i++) {
+                if (!strcmp(optarg, engineName(i)))
+                    break;
+            }
+            if (i > ENGINE_BLOCKS) {
+                fprintf(stderr, "%s: Invalid engine '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            engine = i;
+            engineGiven = true;
+            break;
+        }
+        case 'l':
+            loadAddress = parseAddress(optarg);
+            if (loadAddress == -1) {
+                fprintf(stderr, "%s: Invalid load address '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            runAddress = parseAddress(optarg);
+            if (runAddress == -1) {
+                fprintf(stderr, "%s: Invalid run address '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            /* Two stops are always there, at the monitor's entry points */
+            if (numStops == MAX_STOPS - 2) {
+                fprintf(stderr, "%s: Too many stop addresses\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            stops[numStops] = parseAddress(optarg);
+            if (stops[numStops] == -1) {
+                fprintf(stderr, "%s: Invalid stop address '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            numStops++;
+            break;
+        case 'c': {
+            char *end;
+            cycleLimit = strtoull(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "%s: Invalid cycle count '%s'\n", argv[0], optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'i':
+            inputName = optarg;
+            break;
+        case 'h':
+            showHelp(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc != optind + 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cpu == CPU_65816) {
+        if (engineGiven && engine != ENGINE_INTERPRETER) {
+            fprintf(stderr, "%s: The 65816 can only run with the interpreter\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        engine = ENGINE_INTERPRETER;
+    } else {
+        bool high = loadAddress > 0xffff || runAddress > 0xffff;
+
+        for (int i = 0; i < numStops; i++)
+            high = high || stops[i] > 0xffff;
+        if (high) {
+            fprintf(stderr, "%s: Addresses above $FFFF need -p 65816\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (inputName != NULL) {
+        input = fopen(inputName, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], inputName);
+            return 1;
+        }
+    }
+    if (check) {
+        bufferedInput[0].data = readStream(input, &bufferedInput[0].length);
+        if (bufferedInput[0].data == NULL) {
+            fprintf(stderr, "%s: Unable to read the keyboard input\n", argv[0]);
+            return 1;
+        }
+        bufferedInput[0].position = 0;
+        bufferedInput[1] = bufferedInput[0];
+    }
+
+    file = readFile(argv[optind], &fileLength);
+    if (file == NULL) {
+        fprintf(stderr, "%s: Unable to open '%s'\n", argv[0], argv[optind]);
+        return 1;
+    }
+
+    /* The machine to run, and with -k another using the interpreter to check it */
+    for (int i = 0; i < (check ? 2 : 1); i++) {
+        m[i] = newMachine();
+        if (m[i] == NULL) {
+            fprintf(stderr, "%s: Out of memory\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        m[i]->cpu = cpu;
+        m[i]->engine = i == 0 ? engine : ENGINE_INTERPRETER;
+        for (int j = 0; j < numStops; j++)
+            addStop(m[i], stops[j]);
+        fileRunAddress = loadProgram(m[i], argv[optind], file, fileLength, loadAddress, fromFile,
+                                     verbose && i == 0, argv[0]);
+        if (fileRunAddress == -1)
+            return 1;
+        if (runAddress == -1)
+            runAddress = fileRunAddress;
+        if (runAddress > 0xffff && cpu != CPU_65816) {
+            fprintf(stderr, "%s: Run address $%lX is above $FFFF\n", argv[0], runAddress);
+            return 1;
+        }
+        m[i]->pc = runAddress & 0xffff;
+        m[i]->pbr = runAddress >> 16;
+        if (check) {
+            m[i]->keyboard = readBufferedKey;
+            m[i]->context = &bufferedInput[i];
+        } else {
+            m[i]->keyboard = readKey;
+            m[i]->context = input;
+        }
+    }
+    free(file);
+    m[0]->display = showCharacter;
+    if (verbose && cpu == CPU_65816)
+        fprintf(stderr, "Run address: $%02X:%04X\n", m[0]->pbr, m[0]->pc);
+    else if (verbose)
+        fprintf(stderr, "Run address: $%04X\n", m[0]->pc);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (check)
+        reason = runChecked(m[0], m[1], cycleLimit, argv[0]);
+    else
+        reason = run6502(m[0], cycleLimit);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fflush(stdout);
+    if (reason == STOP_NONE)
+        return 1;
+
+    if (reason == STOP_ILLEGAL)
+        fprintf(stderr, "%s: Illegal opcode $%02X at $%04X\n", argv[0], m[0]->memory[m[0]->pc], m[0]->pc);
+    else if (cpu == CPU_65816)
+        fprintf(stderr, "%s at $%02X:%04X\n", stopReasonName(reason), m[0]->pbr, m[0]->pc);
+    else
+        fprintf(stderr, "%s at $%04X\n", stopReasonName(reason), m[0]->pc);
+    fprintf(stderr, "Cycles: %llu (%.3f seconds at 1 MHz)\n", m[0]->cycles, m[0]->cycles / 1e6);
+    fprintf(stderr, "Instructions: %llu\n", m[0]->instructions);
+    fprintf(stderr, "Wall time: %.3f seconds with the %s engine%s (%.1f million instructions per second)\n",
+            seconds, engineName(engine), check ? " and the interpreter" : "",
+            seconds > 0 ? m[0]->instructions / seconds / 1e6 : 0.0);
+    if (engine == ENGINE_BLOCKS) {
+        unsigned long long blocks = m[0]->blockHits + m[0]->blockMisses;
+
+        fprintf(stderr, "Block cache: %llu blocks run, %llu translated (%.2f%% hit rate)\n",
+                blocks, m[0]->blockMisses, blocks > 0 ? 100.0 * m[0]->blockHits / blocks : 0.0);
+    }
+    if (cpu == CPU_65816)
+        fprintf(stderr, "Memory above bank 0: %lu pages written (%lu bytes)\n",
+                m[0]->highPages, m[0]->highPages * 256);
+    if (check)
+        fprintf(stderr, "Same results as the interpreter\n");
+
+    freeMachine(m[0]);
+    if (m[1] != NULL)
+        freeMachine(m[1]);
+    return reason == STOP_MONITOR ? 0 : 1;
+}